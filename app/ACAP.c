@@ -10,14 +10,21 @@
 #include <string.h>
 #include <glib.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <math.h>
+#include <float.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <ctype.h>
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <glib-object.h>
 #include <glib.h>
+#include <glib-unix.h>
+#include <zlib.h>
 #include <axsdk/axparameter.h>
 #include <axsdk/axevent.h>
 #include "ACAP.h"
@@ -39,12 +46,13 @@ static ACAP_Config_Update ACAP_UpdateCallback = NULL;
 /*-----------------------------------------------------
  * Core Functions Implementation
  *-----------------------------------------------------*/
+// Attaches the FastCGI socket to the main loop once; requests are then
+// accepted when the socket is readable instead of polling from an idle source
 gboolean
 ACAP_Process(gpointer user_data) {
 	(void)user_data;
-    ACAP_HTTP_Process();
-//    ACAP_TIMER_Process();
-	return G_SOURCE_CONTINUE;
+    ACAP_HTTP_Listen();
+	return G_SOURCE_REMOVE;
 }
 
 static void
@@ -241,8 +249,10 @@ typedef struct {
 
 static int initialized = 0;
 static int fcgi_sock = -1;
+static guint fcgi_source = 0;
 static HTTPNode http_nodes[ACAP_MAX_HTTP_NODES];
 static int http_node_count = 0;
+static int http_request_detached = 0;
 
 
 static const char* get_path_without_query(const char* uri) {
@@ -273,8 +283,53 @@ ACAP_HTTP() {
 	return 1;
 }
 
+static gboolean ACAP_HTTP_Ready(gint fd, GIOCondition condition, gpointer user_data) {
+    (void)fd;
+    (void)condition;
+    (void)user_data;
+    ACAP_HTTP_Process();
+    return G_SOURCE_CONTINUE;
+}
+
+int ACAP_HTTP_Listen() {
+    if (!initialized)
+		return 0;
+    if (fcgi_source)
+        return 1;
+
+    const char* socket_path = getenv("FCGI_SOCKET_NAME");
+    if (!socket_path) {
+        LOG_WARN("Failed to get FCGI_SOCKET_NAME\n");
+        return 0;
+    }
+
+    if (fcgi_sock == -1) {
+        fcgi_sock = FCGX_OpenSocket(socket_path, 5);
+        if (fcgi_sock < 0) {
+            fcgi_sock = -1;
+            LOG_WARN("Failed to open FCGI socket\n");
+            return 0;
+        }
+        chmod(socket_path, 0777);
+    }
+
+    // Accept returns at once when the web server has nothing queued.
+    // Accepted connections do not inherit O_NONBLOCK and stay blocking.
+    int flags = fcntl(fcgi_sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(fcgi_sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        LOG_WARN("%s: Unable to make the FCGI socket non-blocking: %s\n", __func__, strerror(errno));
+        return 0;
+    }
+    fcgi_source = g_unix_fd_add(fcgi_sock, G_IO_IN, ACAP_HTTP_Ready, NULL);
+    return 1;
+}
+
 void ACAP_HTTP_Cleanup() {
 	LOG_TRACE("%s:",__func__);
+    if (fcgi_source) {
+        g_source_remove(fcgi_source);
+        fcgi_source = 0;
+    }
     if (fcgi_sock != -1) {
         close(fcgi_sock);
         fcgi_sock = -1;
@@ -338,46 +393,38 @@ int ACAP_HTTP_Node(const char *nodename, ACAP_HTTP_Callback callback) {
 
 
 void ACAP_HTTP_Process() {
-	FCGX_Request request;
+	FCGX_Request* request = NULL;
     ACAP_HTTP_Request_DATA requestData = {0};
-    char* socket_path = NULL;
 
-    if (!initialized)
+    if (!initialized || fcgi_sock == -1)
 		return;
 
-    // Get socket path
-    socket_path = getenv("FCGI_SOCKET_NAME");
-    if (!socket_path) {
-        LOG_WARN("Failed to get FCGI_SOCKET_NAME\n");
+    // The streams of the request point back at it, so it lives on the heap
+    // where a detached request can outlive this call
+    request = malloc(sizeof(FCGX_Request));
+    if (!request) {
+        LOG_WARN("%s: Memory allocation error\n", __func__);
         return;
     }
 
-    // Open socket if not already open
-    if (fcgi_sock == -1) {
-        fcgi_sock = FCGX_OpenSocket(socket_path, 5);
-        if (fcgi_sock < 0) {
-            LOG_WARN("Failed to open FCGI socket\n");
-            return;
-        }
-        chmod(socket_path, 0777);
-    }
-
     // Initialize request
-    if (FCGX_InitRequest(&request, fcgi_sock, 0) != 0) {
+    if (FCGX_InitRequest(request, fcgi_sock, 0) != 0) {
         LOG_WARN("FCGX_InitRequest failed\n");
+        free(request);
         return;
     }
 
-    // Accept the request
-    if (FCGX_Accept_r(&request) != 0) {
-        FCGX_Free(&request, 1);
+    // Accept the request, fails with EAGAIN when another wakeup took it
+    if (FCGX_Accept_r(request) != 0) {
+        FCGX_Free(request, 1);
+        free(request);
         return;
     }
 
     // Setup request data structure
-    requestData.request = &request;
-    requestData.method = FCGX_GetParam("REQUEST_METHOD", request.envp);
-    requestData.contentType = FCGX_GetParam("CONTENT_TYPE", request.envp);
+    requestData.request = request;
+    requestData.method = FCGX_GetParam("REQUEST_METHOD", request->envp);
+    requestData.contentType = FCGX_GetParam("CONTENT_TYPE", request->envp);
     
     // Handle POST data
     if (requestData.method && strcmp(requestData.method, "POST") == 0) {
@@ -385,7 +432,7 @@ void ACAP_HTTP_Process() {
         if (contentLength > 0 && contentLength < ACAP_MAX_BUFFER_SIZE) {
             char* postData = malloc(contentLength + 1);
 				if (postData) {
-					size_t bytesRead = FCGX_GetStr(postData, contentLength, request.in);
+					size_t bytesRead = FCGX_GetStr(postData, contentLength, request->in);
 					if (bytesRead < contentLength) {
 						free(postData);
 						goto cleanup;
@@ -398,9 +445,9 @@ void ACAP_HTTP_Process() {
     }
 
     // Process the request
-    const char* uriString = FCGX_GetParam("REQUEST_URI", request.envp);
+    const char* uriString = FCGX_GetParam("REQUEST_URI", request->envp);
     if (!uriString) {
-        ACAP_HTTP_Respond_Error(&request, 400, "Invalid URI");
+        ACAP_HTTP_Respond_Error(request, 400, "Invalid URI");
         goto cleanup;
     }
 
@@ -417,20 +464,43 @@ void ACAP_HTTP_Process() {
         }
     }
 
+    http_request_detached = 0;
     if (matching_callback) {
-        matching_callback(&request, &requestData);
+        matching_callback(request, &requestData);
     } else {
-        ACAP_HTTP_Respond_Error(&request, 404, "Not Found");
+        ACAP_HTTP_Respond_Error(request, 404, "Not Found");
     }
 
 cleanup:
     if (requestData.postData) {
         free((void*)requestData.postData);
     }
-    FCGX_Finish_r(&request);
+    if (!http_request_detached) {
+        FCGX_Finish_r(request);
+        free(request);
+    }
+    http_request_detached = 0;
     return;
 }
 
+ACAP_HTTP_Response ACAP_HTTP_Detach(ACAP_HTTP_Response response) {
+    if (!response || http_request_detached) {
+        LOG_WARN("%s: Invalid response\n", __func__);
+        return NULL;
+    }
+
+    // ACAP_HTTP_Process allocated the request, the new owner finishes and frees it
+    http_request_detached = 1;
+    return response;
+}
+
+void ACAP_HTTP_Release(ACAP_HTTP_Response response) {
+    if (!response)
+        return;
+    FCGX_Finish_r(response);
+    free(response);
+}
+
 /*------------------------------------------------------------------
  * HTTP Request Parameter Handling Implementation
  *------------------------------------------------------------------*/
@@ -501,6 +571,225 @@ const char* ACAP_HTTP_Request_Param(const ACAP_HTTP_Request request, const char*
 }
 
 
+/*------------------------------------------------------------------
+ * Streaming JSON Writer
+ *
+ * Serializes a cJSON tree as unformatted JSON straight into the
+ * FastCGI output stream.  Output is staged in a reusable chunk buffer
+ * and optionally gzip-compressed on the way out, so response size is
+ * not limited by any intermediate buffer.  When no output stream is
+ * set the bytes are appended to a growable memory buffer instead.
+ * HTTP callbacks are only dispatched from the main loop, so the static
+ * buffers are not shared between threads.
+ *------------------------------------------------------------------*/
+
+#define ACAP_JSON_CHUNK_SIZE 4096
+
+typedef struct {
+    FCGX_Stream* out;       // NULL to write into memory
+    char* memory;
+    size_t memoryLength;
+    size_t memorySize;
+    int gzip;
+    size_t length;
+    int error;
+} ACAP_JSON_Writer;
+
+static char ACAP_JSON_chunk[ACAP_JSON_CHUNK_SIZE];
+static unsigned char ACAP_JSON_deflated[ACAP_JSON_CHUNK_SIZE];
+static z_stream ACAP_JSON_zstream;
+static int ACAP_JSON_zstream_initialized = 0;
+
+static int ACAP_JSON_Gzip_Begin(void) {
+    if (!ACAP_JSON_zstream_initialized) {
+        memset(&ACAP_JSON_zstream, 0, sizeof(ACAP_JSON_zstream));
+        // windowBits 15 + 16 selects the gzip wrapper
+        if (deflateInit2(&ACAP_JSON_zstream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            LOG_WARN("%s: Unable to initialize gzip\n", __func__);
+            return 0;
+        }
+        ACAP_JSON_zstream_initialized = 1;
+        return 1;
+    }
+    return deflateReset(&ACAP_JSON_zstream) == Z_OK;
+}
+
+static void ACAP_JSON_Emit(ACAP_JSON_Writer* writer, const char* data, size_t length) {
+    if (writer->out) {
+        if (FCGX_PutStr(data, (int)length, writer->out) != (int)length)
+            writer->error = 1;
+        return;
+    }
+
+    if (writer->memoryLength + length > writer->memorySize) {
+        size_t size = writer->memorySize ? writer->memorySize : ACAP_JSON_CHUNK_SIZE;
+        while (size < writer->memoryLength + length)
+            size *= 2;
+        char* memory = realloc(writer->memory, size);
+        if (!memory) {
+            LOG_WARN("%s: Memory allocation error\n", __func__);
+            writer->error = 1;
+            return;
+        }
+        writer->memory = memory;
+        writer->memorySize = size;
+    }
+    memcpy(writer->memory + writer->memoryLength, data, length);
+    writer->memoryLength += length;
+}
+
+static void ACAP_JSON_Flush(ACAP_JSON_Writer* writer, int finish) {
+    if (writer->error)
+        return;
+
+    if (!writer->gzip) {
+        if (writer->length)
+            ACAP_JSON_Emit(writer, ACAP_JSON_chunk, writer->length);
+        writer->length = 0;
+        return;
+    }
+
+    ACAP_JSON_zstream.next_in = (Bytef*)ACAP_JSON_chunk;
+    ACAP_JSON_zstream.avail_in = (uInt)writer->length;
+    int result;
+    do {
+        ACAP_JSON_zstream.next_out = ACAP_JSON_deflated;
+        ACAP_JSON_zstream.avail_out = sizeof(ACAP_JSON_deflated);
+        result = deflate(&ACAP_JSON_zstream, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (result == Z_STREAM_ERROR) {
+            writer->error = 1;
+            break;
+        }
+        size_t produced = sizeof(ACAP_JSON_deflated) - ACAP_JSON_zstream.avail_out;
+        if (produced)
+            ACAP_JSON_Emit(writer, (const char*)ACAP_JSON_deflated, produced);
+        if (writer->error)
+            break;
+    } while (ACAP_JSON_zstream.avail_out == 0 || (finish && result != Z_STREAM_END));
+    writer->length = 0;
+}
+
+static void ACAP_JSON_Put(ACAP_JSON_Writer* writer, const char* data, size_t length) {
+    while (length && !writer->error) {
+        size_t space = ACAP_JSON_CHUNK_SIZE - writer->length;
+        size_t count = length < space ? length : space;
+        memcpy(ACAP_JSON_chunk + writer->length, data, count);
+        writer->length += count;
+        data += count;
+        length -= count;
+        if (writer->length == ACAP_JSON_CHUNK_SIZE)
+            ACAP_JSON_Flush(writer, 0);
+    }
+}
+
+static void ACAP_JSON_Put_Number(ACAP_JSON_Writer* writer, const cJSON* item) {
+    char number[32];
+    double d = item->valuedouble;
+    double test = 0;
+    int length;
+
+    // Same formatting rules as cJSON_PrintUnformatted
+    if (isnan(d) || isinf(d)) {
+        length = snprintf(number, sizeof(number), "null");
+    } else if (d == (double)item->valueint) {
+        length = snprintf(number, sizeof(number), "%d", item->valueint);
+    } else {
+        length = snprintf(number, sizeof(number), "%1.15g", d);
+        if (sscanf(number, "%lg", &test) != 1 ||
+            fabs(test - d) > fmax(fabs(test), fabs(d)) * DBL_EPSILON)
+            length = snprintf(number, sizeof(number), "%1.17g", d);
+    }
+    for (int i = 0; i < length; i++)
+        if (number[i] == ',')
+            number[i] = '.';
+    ACAP_JSON_Put(writer, number, (size_t)length);
+}
+
+static void ACAP_JSON_Put_String(ACAP_JSON_Writer* writer, const char* string) {
+    ACAP_JSON_Put(writer, "\"", 1);
+    if (string) {
+        const char* start = string;
+        const char* p = string;
+        for (; *p; p++) {
+            unsigned char c = (unsigned char)*p;
+            if (c >= 32 && c != '"' && c != '\\')
+                continue;
+            ACAP_JSON_Put(writer, start, (size_t)(p - start));
+            char escape[8];
+            switch (c) {
+                case '"':  ACAP_JSON_Put(writer, "\\\"", 2); break;
+                case '\\': ACAP_JSON_Put(writer, "\\\\", 2); break;
+                case '\b': ACAP_JSON_Put(writer, "\\b", 2); break;
+                case '\f': ACAP_JSON_Put(writer, "\\f", 2); break;
+                case '\n': ACAP_JSON_Put(writer, "\\n", 2); break;
+                case '\r': ACAP_JSON_Put(writer, "\\r", 2); break;
+                case '\t': ACAP_JSON_Put(writer, "\\t", 2); break;
+                default:
+                    snprintf(escape, sizeof(escape), "\\u%04x", c);
+                    ACAP_JSON_Put(writer, escape, 6);
+                    break;
+            }
+            start = p + 1;
+        }
+        ACAP_JSON_Put(writer, start, (size_t)(p - start));
+    }
+    ACAP_JSON_Put(writer, "\"", 1);
+}
+
+static void ACAP_JSON_Put_Item(ACAP_JSON_Writer* writer, const cJSON* item) {
+    const cJSON* child;
+
+    switch (item->type & 0xFF) {
+        case cJSON_False:
+            ACAP_JSON_Put(writer, "false", 5);
+            break;
+        case cJSON_True:
+            ACAP_JSON_Put(writer, "true", 4);
+            break;
+        case cJSON_NULL:
+            ACAP_JSON_Put(writer, "null", 4);
+            break;
+        case cJSON_Number:
+            ACAP_JSON_Put_Number(writer, item);
+            break;
+        case cJSON_String:
+            ACAP_JSON_Put_String(writer, item->valuestring);
+            break;
+        case cJSON_Raw:
+            if (item->valuestring)
+                ACAP_JSON_Put(writer, item->valuestring, strlen(item->valuestring));
+            break;
+        case cJSON_Array:
+            ACAP_JSON_Put(writer, "[", 1);
+            for (child = item->child; child && !writer->error; child = child->next) {
+                ACAP_JSON_Put_Item(writer, child);
+                if (child->next)
+                    ACAP_JSON_Put(writer, ",", 1);
+            }
+            ACAP_JSON_Put(writer, "]", 1);
+            break;
+        case cJSON_Object:
+            ACAP_JSON_Put(writer, "{", 1);
+            for (child = item->child; child && !writer->error; child = child->next) {
+                ACAP_JSON_Put_String(writer, child->string);
+                ACAP_JSON_Put(writer, ":", 1);
+                ACAP_JSON_Put_Item(writer, child);
+                if (child->next)
+                    ACAP_JSON_Put(writer, ",", 1);
+            }
+            ACAP_JSON_Put(writer, "}", 1);
+            break;
+        default:
+            writer->error = 1;
+            break;
+    }
+}
+
+static int ACAP_HTTP_Accepts_Gzip(ACAP_HTTP_Response response) {
+    const char* encoding = FCGX_GetParam("HTTP_ACCEPT_ENCODING", response->envp);
+    return encoding && strstr(encoding, "gzip") != NULL;
+}
+
 /*------------------------------------------------------------------
  * HTTP Response Implementation
  *------------------------------------------------------------------*/
@@ -543,17 +832,32 @@ int ACAP_HTTP_Respond_String(ACAP_HTTP_Response response, const char *fmt, ...)
         return 0;
     }
 
-    char buffer[4096];
+    char buffer[ACAP_MAX_BUFFER_SIZE];
     va_list args;
     va_start(args, fmt);
     int written = vsnprintf(buffer, sizeof(buffer), fmt, args);
     va_end(args);
     
-    if (written < 0 || written >= (int)sizeof(buffer)) {
+    if (written < 0) {
         return 0;
     }
-    
-    return FCGX_PutStr(buffer, written, response->out) == written;
+
+    if (written < (int)sizeof(buffer)) {
+        return FCGX_PutStr(buffer, written, response->out) == written;
+    }
+
+    // Larger than the stack buffer; format again into a heap buffer
+    char* large = malloc((size_t)written + 1);
+    if (!large) {
+        LOG_WARN("%s: Memory allocation error\n", __func__);
+        return 0;
+    }
+    va_start(args, fmt);
+    vsnprintf(large, (size_t)written + 1, fmt, args);
+    va_end(args);
+    int result = FCGX_PutStr(large, written, response->out) == written;
+    free(large);
+    return result;
 }
 
 int ACAP_HTTP_Respond_JSON(ACAP_HTTP_Response response, cJSON* object) {
@@ -562,17 +866,26 @@ int ACAP_HTTP_Respond_JSON(ACAP_HTTP_Response response, cJSON* object) {
         return 0;
     }
 
-    char* jsonString = cJSON_Print(object);
-    if (!jsonString) {
-        LOG_WARN("Failed to serialize JSON\n");
+    ACAP_JSON_Writer writer = {0};
+    writer.out = response->out;
+    writer.gzip = ACAP_HTTP_Accepts_Gzip(response) && ACAP_JSON_Gzip_Begin();
+
+    if (!ACAP_HTTP_Respond_String(response,
+            "Content-Type: application/json; charset=utf-8\r\n"
+            "Cache-Control: no-cache\r\n"
+            "%s\r\n",
+            writer.gzip ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : "")) {
         return 0;
     }
 
-    int result = ACAP_HTTP_Header_JSON(response) &&
-                 ACAP_HTTP_Respond_String(response, "%s", jsonString);
-    
-    free(jsonString);
-    return result;
+    ACAP_JSON_Put_Item(&writer, object);
+    ACAP_JSON_Flush(&writer, 1);
+
+    if (writer.error) {
+        LOG_WARN("Failed to serialize JSON\n");
+        return 0;
+    }
+    return 1;
 }
 
 int ACAP_HTTP_Respond_Data(ACAP_HTTP_Response response, size_t count, const void* data) {
@@ -616,6 +929,178 @@ int ACAP_HTTP_Respond_Text(ACAP_HTTP_Response response, const char* message) {
  * Status Management Implementation
  *------------------------------------------------------------------*/
 
+/*
+ * Every status mutation bumps a sequence number and records it on the
+ * group that changed.  Items registered with ACAP_STATUS_Live (counters
+ * and rates refreshed every second or every frame) do not move the
+ * generation, so the ETag of the full document only changes with state.
+ * GET /status serves bytes cached for the current sequence, answers
+ * If-None-Match with 304, supports ?since=<X-Status-Generation> to return
+ * only the groups changed after that and ?groups=a,b to return only those
+ * groups with an ETag that also follows their live items.
+ */
+
+typedef struct {
+    cJSON* group;
+    unsigned long generation;
+} ACAP_STATUS_Group_Generation;
+
+typedef struct {
+    char group[32];
+    char name[64];  // Empty for every item in the group
+} ACAP_STATUS_Live_Item;
+
+typedef struct {
+    unsigned long generation;
+    char* data;
+    size_t length;
+    size_t size;
+} ACAP_STATUS_Cache;
+
+static unsigned long status_sequence = 1;
+static unsigned long status_generation = 1;
+static unsigned long status_epoch = 0;
+static ACAP_STATUS_Group_Generation status_groups[ACAP_MAX_STATUS_GROUPS];
+static int status_group_count = 0;
+static ACAP_STATUS_Live_Item status_live[ACAP_MAX_STATUS_LIVE];
+static int status_live_count = 0;
+static ACAP_STATUS_Cache status_cache[2];  // [0] plain, [1] gzip
+
+static int ACAP_STATUS_Is_Live(const cJSON* group, const char* name) {
+    if (!group->string)
+        return 0;
+    for (int i = 0; i < status_live_count; i++) {
+        if (strcmp(status_live[i].group, group->string) != 0)
+            continue;
+        if (!status_live[i].name[0] || (name && strcmp(status_live[i].name, name) == 0))
+            return 1;
+    }
+    return 0;
+}
+
+void ACAP_STATUS_Live(const char* group, const char* name) {
+    if (!group)
+        return;
+    for (int i = 0; i < status_live_count; i++) {
+        if (strcmp(status_live[i].group, group) == 0 && strcmp(status_live[i].name, name ? name : "") == 0)
+            return;
+    }
+    if (status_live_count >= ACAP_MAX_STATUS_LIVE) {
+        LOG_WARN("%s: No room for %s.%s\n", __func__, group, name ? name : "*");
+        return;
+    }
+    snprintf(status_live[status_live_count].group, sizeof(status_live[0].group), "%s", group);
+    snprintf(status_live[status_live_count].name, sizeof(status_live[0].name), "%s", name ? name : "");
+    status_live_count++;
+}
+
+static void ACAP_STATUS_Touch(cJSON* group, const char* name) {
+    status_sequence++;
+    if (!ACAP_STATUS_Is_Live(group, name))
+        status_generation = status_sequence;
+    for (int i = 0; i < status_group_count; i++) {
+        if (status_groups[i].group == group) {
+            status_groups[i].generation = status_sequence;
+            return;
+        }
+    }
+    if (status_group_count < ACAP_MAX_STATUS_GROUPS) {
+        status_groups[status_group_count].group = group;
+        status_groups[status_group_count].generation = status_sequence;
+        status_group_count++;
+    }
+}
+
+static unsigned long ACAP_STATUS_Group_Changed(const cJSON* group) {
+    for (int i = 0; i < status_group_count; i++) {
+        if (status_groups[i].group == group)
+            return status_groups[i].generation;
+    }
+    return status_sequence;  // Untracked groups are always reported
+}
+
+// Exact match of name in a comma separated list
+static int ACAP_STATUS_Listed(const char* list, const char* name) {
+    size_t length = strlen(name);
+    while (list && *list) {
+        const char* end = strchr(list, ',');
+        size_t size = end ? (size_t)(end - list) : strlen(list);
+        if (size == length && strncmp(list, name, size) == 0)
+            return 1;
+        list = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+unsigned long ACAP_STATUS_Generation(void) {
+    return status_generation;
+}
+
+static int ACAP_STATUS_Respond_Headers(ACAP_HTTP_Response response, const char* etag, int gzip) {
+    return ACAP_HTTP_Respond_String(response,
+        "Content-Type: application/json; charset=utf-8\r\n"
+        "Cache-Control: no-cache\r\n"
+        "ETag: %s\r\n"
+        "X-Status-Generation: %lu\r\n"
+        "%s\r\n",
+        etag, status_sequence,
+        gzip ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : "");
+}
+
+static void ACAP_STATUS_Respond_Cached(ACAP_HTTP_Response response, const char* etag) {
+    int gzip = ACAP_HTTP_Accepts_Gzip(response);
+    ACAP_STATUS_Cache* cache = &status_cache[gzip ? 1 : 0];
+
+    if (!cache->data || cache->generation != status_sequence) {
+        ACAP_JSON_Writer writer = {0};
+        writer.memory = cache->data;
+        writer.memorySize = cache->size;
+        writer.gzip = gzip && ACAP_JSON_Gzip_Begin();
+        ACAP_JSON_Put_Item(&writer, status_container);
+        ACAP_JSON_Flush(&writer, 1);
+        cache->data = writer.memory;
+        cache->size = writer.memorySize;
+        if (writer.error || gzip != writer.gzip) {
+            cache->generation = 0;
+            ACAP_HTTP_Respond_Error(response, 500, "Status serialization failed");
+            return;
+        }
+        cache->length = writer.memoryLength;
+        cache->generation = status_sequence;
+    }
+
+    if (ACAP_STATUS_Respond_Headers(response, etag, gzip) && cache->length)
+        ACAP_HTTP_Respond_Data(response, cache->length, cache->data);
+}
+
+static void ACAP_STATUS_Respond_Delta(ACAP_HTTP_Response response, const char* etag, unsigned long since, const char* groups) {
+    ACAP_JSON_Writer writer = {0};
+    writer.out = response->out;
+    writer.gzip = ACAP_HTTP_Accepts_Gzip(response) && ACAP_JSON_Gzip_Begin();
+
+    if (!ACAP_STATUS_Respond_Headers(response, etag, writer.gzip))
+        return;
+
+    int first = 1;
+    ACAP_JSON_Put(&writer, "{", 1);
+    for (cJSON* group = status_container->child; group && !writer.error; group = group->next) {
+        if (ACAP_STATUS_Group_Changed(group) <= since)
+            continue;
+        if (groups && (!group->string || !ACAP_STATUS_Listed(groups, group->string)))
+            continue;
+        if (!first)
+            ACAP_JSON_Put(&writer, ",", 1);
+        ACAP_JSON_Put_String(&writer, group->string);
+        ACAP_JSON_Put(&writer, ":", 1);
+        ACAP_JSON_Put_Item(&writer, group);
+        first = 0;
+    }
+    ACAP_JSON_Put(&writer, "}", 1);
+    ACAP_JSON_Flush(&writer, 1);
+    if (writer.error)
+        LOG_WARN("%s: Failed to serialize status\n", __func__);
+}
+
 static void
 ACAP_ENDPOINT_status(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
     const char* method = ACAP_HTTP_Get_Method(request);
@@ -627,13 +1112,43 @@ ACAP_ENDPOINT_status(const ACAP_HTTP_Response response, const ACAP_HTTP_Request
 
 	if(!status_container)
 		status_container = cJSON_CreateObject();
-    
-    ACAP_HTTP_Respond_JSON(response, status_container);
+
+    const char* groups = ACAP_HTTP_Request_Param(request, "groups");
+    const char* since = ACAP_HTTP_Request_Param(request, "since");
+
+    // A group list is tagged by the last change to any of its groups, live items included
+    char etag[64];
+    if (groups) {
+        unsigned long changed = 0;
+        for (cJSON* group = status_container->child; group; group = group->next) {
+            if (group->string && ACAP_STATUS_Listed(groups, group->string) && ACAP_STATUS_Group_Changed(group) > changed)
+                changed = ACAP_STATUS_Group_Changed(group);
+        }
+        snprintf(etag, sizeof(etag), "\"%lx-%lu-g\"", status_epoch, changed);
+    } else {
+        snprintf(etag, sizeof(etag), "\"%lx-%lu\"", status_epoch, status_generation);
+    }
+
+    const char* match = FCGX_GetParam("HTTP_IF_NONE_MATCH", response->envp);
+    if (match && strstr(match, etag)) {
+        ACAP_HTTP_Respond_String(response,
+            "Status: 304 Not Modified\r\n"
+            "Cache-Control: no-cache\r\n"
+            "ETag: %s\r\n"
+            "\r\n", etag);
+    } else if (since || groups) {
+        ACAP_STATUS_Respond_Delta(response, etag, since ? strtoul(since, NULL, 10) : 0, groups);
+    } else {
+        ACAP_STATUS_Respond_Cached(response, etag);
+    }
+    free((void*)groups);
+    free((void*)since);
 }
 
 cJSON* ACAP_STATUS(void) {
     if (!status_container) {
         status_container = cJSON_CreateObject();
+        status_epoch = (unsigned long)time(NULL);
 		ACAP_HTTP_Node("status",ACAP_ENDPOINT_status);
 	}
     return status_container;
@@ -652,6 +1167,7 @@ cJSON* ACAP_STATUS_Group(const char* name) {
             return NULL;
         }
         cJSON_AddItemToObject(status_container, name, group);
+        ACAP_STATUS_Touch(group, NULL);
     }
     return group;
 }
@@ -670,11 +1186,16 @@ void ACAP_STATUS_SetBool(const char* group, const char* name, int state) {
     }
 
     cJSON* item = cJSON_GetObjectItem(groupObj, name);
-    if (item) {
+    if (item && cJSON_IsBool(item)) {
+        if ((item->type == cJSON_True) == (state != 0))
+            return;
+        item->type = (item->type & ~0xFF) | (state ? cJSON_True : cJSON_False);
+    } else if (item) {
         cJSON_ReplaceItemInObject(groupObj, name, cJSON_CreateBool(state));
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_CreateBool(state));
     }
+    ACAP_STATUS_Touch(groupObj, name);
 }
 
 void ACAP_STATUS_SetNumber(const char* group, const char* name, double value) {
@@ -689,11 +1210,16 @@ void ACAP_STATUS_SetNumber(const char* group, const char* name, double value) {
     }
 
     cJSON* item = cJSON_GetObjectItem(groupObj, name);
-    if (item) {
+    if (item && cJSON_IsNumber(item)) {
+        if (item->valuedouble == value)
+            return;
+        cJSON_SetNumberValue(item, value);
+    } else if (item) {
         cJSON_ReplaceItemInObject(groupObj, name, cJSON_CreateNumber(value));
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_CreateNumber(value));
     }
+    ACAP_STATUS_Touch(groupObj, name);
 }
 
 void ACAP_STATUS_SetString(const char* group, const char* name, const char* string) {
@@ -708,11 +1234,14 @@ void ACAP_STATUS_SetString(const char* group, const char* name, const char* stri
     }
 
     cJSON* item = cJSON_GetObjectItem(groupObj, name);
+    if (item && cJSON_IsString(item) && item->valuestring && strcmp(item->valuestring, string) == 0)
+        return;
     if (item) {
         cJSON_ReplaceItemInObject(groupObj, name, cJSON_CreateString(string));
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_CreateString(string));
     }
+    ACAP_STATUS_Touch(groupObj, name);
 }
 
 void ACAP_STATUS_SetObject(const char* group, const char* name, cJSON* data) {
@@ -727,11 +1256,14 @@ void ACAP_STATUS_SetObject(const char* group, const char* name, cJSON* data) {
     }
 
     cJSON* item = cJSON_GetObjectItem(groupObj, name);
+    if (item && cJSON_Compare(item, data, 1))
+        return;
     if (item) {
         cJSON_ReplaceItemInObject(groupObj, name, cJSON_Duplicate(data, 1));
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_Duplicate(data, 1));
     }
+    ACAP_STATUS_Touch(groupObj, name);
 }
 
 void ACAP_STATUS_SetNull(const char* group, const char* name) {
@@ -746,11 +1278,14 @@ void ACAP_STATUS_SetNull(const char* group, const char* name) {
     }
 
     cJSON* item = cJSON_GetObjectItem(groupObj, name);
+    if (item && cJSON_IsNull(item))
+        return;
     if (item) {
         cJSON_ReplaceItemInObject(groupObj, name, cJSON_CreateNull());
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_CreateNull());
     }
+    ACAP_STATUS_Touch(groupObj, name);
 }
 
 /*------------------------------------------------------------------
@@ -1324,9 +1859,11 @@ int ACAP_FILE_Write(const char* filepath, cJSON* object) {
  *------------------------------------------------------------------*/
 
 ACAP_EVENTS_Callback EVENT_USER_CALLBACK = 0;
+ACAP_EVENTS_State_Callback EVENT_STATE_CALLBACK = 0;
 static void ACAP_EVENTS_Main_Callback(guint subscription, AXEvent *axEvent, cJSON* event);
 cJSON* ACAP_EVENTS_SUBSCRIPTIONS = 0;
 cJSON* ACAP_EVENTS_DECLARATIONS = 0;
+static unsigned long ACAP_EVENTS_generation = 1;	//Bumped when declarations change
 AXEventHandler *ACAP_EVENTS_HANDLER = 0;
 
 
@@ -1407,6 +1944,13 @@ ACAP_EVENTS_SetCallback( ACAP_EVENTS_Callback callback ){
 	return 1;
 }
 
+int
+ACAP_EVENTS_SetStateCallback( ACAP_EVENTS_State_Callback callback ){
+	LOG_TRACE("%s: Entry\n",__func__);
+	EVENT_STATE_CALLBACK = callback;
+	return 1;
+}
+
 cJSON*
 ACAP_EVENTS_Parse( AXEvent *axEvent ) {
 	LOG_TRACE("%s: Entry\n",__func__);
@@ -1707,6 +2251,7 @@ ACAP_EVENTS_Add_Event( const char *id, const char* name, int state ) {
 	LOG_TRACE("%s: %s %s %s\n",__func__,id, name, state?"Stateful":"Stateless");
 
 	cJSON_AddNumberToObject(ACAP_EVENTS_DECLARATIONS,id,declarationID);
+	ACAP_EVENTS_generation++;
 	ax_event_key_value_set_free(set);
 	return declarationID;
 }	
@@ -1727,91 +2272,540 @@ ACAP_EVENTS_Remove_Event(const char *id ) {
 
 	ax_event_handler_undeclare( ACAP_EVENTS_HANDLER, event->valueint, NULL);
 	cJSON_Delete( event);
+	ACAP_EVENTS_generation++;
 	return 1;
 }
 
 
+/*
+ * Event handles
+ * A handle resolves an event id once to its declaration and keeps a key
+ * value set that is reused for every fire; only the value is updated.
+ * Stateful handles mirror their state into the "events" status group
+ * through a direct pointer to the status item.
+ *
+ * Fires are queued and sent to the event system by a dispatch thread so
+ * a slow event system never delays the caller.  State, status and the
+ * state callback are updated at once by the caller; the dispatcher sends
+ * the latest state of each queued handle, so flips that cancel out within
+ * one drain cycle are never sent.  A handle is queued at most once for
+ * state changes.
+ *
+ * An event may have a "policy" in events.json that limits how often it
+ * is emitted, enforced on the main loop with O(1) state per event:
+ *   "minInterval"  ms between emitted fires
+ *   "rate","burst" leaky bucket, fires per second and bucket size
+ *   "coalesce"     ms window; a state change is emitted at the end of the
+ *                  window with the final state, stateless fires in the
+ *                  window are merged into one with the latest payload
+ *                  ("value" holds the number of merged pulses)
+ * Held state changes are emitted when the policy allows; stateless fires
+ * that exceed the limits without a coalesce window are dropped.
+ */
+
+#define ACAP_EVENTS_QUEUE_SIZE 256
+
+enum {
+	ACAP_EVENTS_QUEUE_STATE,
+	ACAP_EVENTS_QUEUE_PULSE,
+	ACAP_EVENTS_QUEUE_STRING,
+	ACAP_EVENTS_QUEUE_EVENT			//A prepared AXEvent, sent and freed by the dispatcher
+};
+
+typedef struct {
+	unsigned int minInterval;
+	unsigned int coalesce;
+	double rate;
+	double burst;
+} ACAP_EVENTS_Policy;
+
+struct ACAP_EVENTS_Handle {
+	char* id;
+	guint declaration;
+	unsigned long generation;		//ACAP_EVENTS_generation when resolved
+	AXEventKeyValueSet* set;		//Dispatcher only
+	char* key;						//Data key held by the set
+	atomic_int state;				//Latest state set by the caller
+	int sentState;					//Dispatcher only
+	atomic_int queued;				//A state change is waiting in the queue
+	cJSON* statusGroup;
+	cJSON* statusItem;
+	//Policy state, main loop only
+	int limited;
+	ACAP_EVENTS_Policy policy;
+	double tokens;
+	guint64 tokenTime;
+	guint64 lastEmit;
+	int desired;					//Requested state while a change is held
+	ACAP_WHEEL_Timer deferred;
+	int heldKind;					//Stateless fire held for the coalesce window
+	unsigned int heldCount;
+	char* heldData;
+	AXEvent* heldEvent;
+	unsigned int suppressed;
+	struct ACAP_EVENTS_Handle* next;
+};
+
+typedef struct {
+	ACAP_EVENTS_Handle* handle;
+	guint declaration;
+	int kind;
+	int value;						//Pulse value
+	char* data;						//"key\0value" for strings
+	AXEvent* event;
+} ACAP_EVENTS_Queued;
+
+static ACAP_EVENTS_Handle* ACAP_EVENTS_HANDLES = 0;
+static void ACAP_EVENTS_Policy_Deferred( ACAP_WHEEL_Timer* timer, void* user_data );
+static ACAP_EVENTS_Queued ACAP_EVENTS_QUEUE[ACAP_EVENTS_QUEUE_SIZE];
+static unsigned int ACAP_EVENTS_QUEUE_HEAD = 0;
+static unsigned int ACAP_EVENTS_QUEUE_COUNT = 0;
+static pthread_mutex_t ACAP_EVENTS_QUEUE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ACAP_EVENTS_QUEUE_COND = PTHREAD_COND_INITIALIZER;
+static pthread_t ACAP_EVENTS_DISPATCHER;
+static int ACAP_EVENTS_DISPATCHING = 0;
+static int ACAP_EVENTS_SHUTDOWN = 0;
+static guint ACAP_EVENTS_QUEUE_TIMER = 0;
+static atomic_uint ACAP_EVENTS_QUEUE_MAX = 0;
+static atomic_uint ACAP_EVENTS_QUEUE_SENT = 0;
+static atomic_uint ACAP_EVENTS_QUEUE_COALESCED = 0;
+static atomic_uint ACAP_EVENTS_QUEUE_DROPPED = 0;
+static atomic_uint ACAP_EVENTS_QUEUE_FAILED = 0;
+
+static int
+ACAP_EVENTS_Handle_Resolve( ACAP_EVENTS_Handle* handle ) {
+	if( handle->generation == ACAP_EVENTS_generation )
+		return handle->declaration != 0;
+	cJSON* event = ACAP_EVENTS_DECLARATIONS ? cJSON_GetObjectItem(ACAP_EVENTS_DECLARATIONS, handle->id) : 0;
+	handle->declaration = event ? (guint)event->valueint : 0;
+	handle->generation = ACAP_EVENTS_generation;
+	return handle->declaration != 0;
+}
+
+ACAP_EVENTS_Handle*
+ACAP_EVENTS_Handle_Get( const char* id ) {
+	if( !id )
+		return 0;
+	for( ACAP_EVENTS_Handle* handle = ACAP_EVENTS_HANDLES; handle; handle = handle->next )
+		if( strcmp(handle->id, id) == 0 )
+			return handle;
+
+	ACAP_EVENTS_Handle* handle = calloc(1, sizeof(ACAP_EVENTS_Handle));
+	if( !handle )
+		return 0;
+	handle->id = strdup(id);
+	handle->set = ax_event_key_value_set_new();
+	atomic_init(&handle->state, ACAP_STATUS_Bool("events", id));
+	handle->sentState = atomic_load(&handle->state);
+	atomic_init(&handle->queued, 0);
+	ACAP_WHEEL_Timer_Init(&handle->deferred, ACAP_EVENTS_Policy_Deferred, handle);
+	handle->next = ACAP_EVENTS_HANDLES;
+	ACAP_EVENTS_HANDLES = handle;
+	return handle;
+}
+
 int
-ACAP_EVENTS_Fire( const char* id ) {
-	GError *error = NULL;
-	
-	LOG_TRACE("%s: %s\n", __func__, id );
-	
-	if( !ACAP_EVENTS_DECLARATIONS || !id ) {
-		LOG_WARN("EVENTs_Fire_State: Error send event\n");
+ACAP_EVENTS_Handle_State( const ACAP_EVENTS_Handle* handle ) {
+	return handle ? atomic_load(&handle->state) : 0;
+}
+
+//Dispatcher thread only
+static int
+ACAP_EVENTS_Handle_Send( ACAP_EVENTS_Handle* handle, guint declaration, const char* key, gconstpointer value, AXEventValueType type ) {
+	//Replacing a key's value in the set does not allocate a new entry
+	if( !handle->key || strcmp(handle->key, key) != 0 ) {
+		if( handle->key ) {
+			ax_event_key_value_set_free(handle->set);
+			handle->set = ax_event_key_value_set_new();
+			free(handle->key);
+		}
+		handle->key = strdup(key);
+	}
+	if( !ax_event_key_value_set_add_key_value(handle->set, key, NULL, value, type, NULL) ) {
+		LOG_WARN("%s: Could not set %s for %s\n",__func__, key, handle->id);
 		return 0;
 	}
+	AXEvent* axEvent = ax_event_new2(handle->set, NULL);
+	int success = ax_event_handler_send_event(ACAP_EVENTS_HANDLER, declaration, axEvent, NULL);
+	ax_event_free(axEvent);
+	if( !success )
+		LOG_WARN("%s: Could not send event %s\n",__func__, handle->id);
+	return success;
+}
+
+static void*
+ACAP_EVENTS_Dispatch_Thread( void* data ) {
+	(void)data;
+	ACAP_EVENTS_Queued batch[ACAP_EVENTS_QUEUE_SIZE];
+
+	pthread_mutex_lock(&ACAP_EVENTS_QUEUE_MUTEX);
+	while( 1 ) {
+		while( ACAP_EVENTS_QUEUE_COUNT == 0 && !ACAP_EVENTS_SHUTDOWN )
+			pthread_cond_wait(&ACAP_EVENTS_QUEUE_COND, &ACAP_EVENTS_QUEUE_MUTEX);
+		if( ACAP_EVENTS_QUEUE_COUNT == 0 && ACAP_EVENTS_SHUTDOWN )
+			break;
+		unsigned int count = ACAP_EVENTS_QUEUE_COUNT;
+		for( unsigned int i = 0; i < count; i++ )
+			batch[i] = ACAP_EVENTS_QUEUE[(ACAP_EVENTS_QUEUE_HEAD + i) % ACAP_EVENTS_QUEUE_SIZE];
+		ACAP_EVENTS_QUEUE_HEAD = (ACAP_EVENTS_QUEUE_HEAD + count) % ACAP_EVENTS_QUEUE_SIZE;
+		ACAP_EVENTS_QUEUE_COUNT = 0;
+		pthread_mutex_unlock(&ACAP_EVENTS_QUEUE_MUTEX);
+
+		for( unsigned int i = 0; i < count; i++ ) {
+			ACAP_EVENTS_Queued* queued = &batch[i];
+			ACAP_EVENTS_Handle* handle = queued->handle;
+			int success = 1;
+			if( queued->kind == ACAP_EVENTS_QUEUE_STATE ) {
+				//Cleared before reading so a later change queues the handle again
+				atomic_store(&handle->queued, 0);
+				int state = atomic_load(&handle->state);
+				if( state == handle->sentState ) {
+					atomic_fetch_add(&ACAP_EVENTS_QUEUE_COALESCED, 1);
+					continue;
+				}
+				success = ACAP_EVENTS_Handle_Send(handle, queued->declaration, "state", &state, AX_VALUE_TYPE_BOOL);
+				if( success )
+					handle->sentState = state;
+			} else if( queued->kind == ACAP_EVENTS_QUEUE_PULSE ) {
+				success = ACAP_EVENTS_Handle_Send(handle, queued->declaration, "value", &queued->value, AX_VALUE_TYPE_INT);
+			} else if( queued->kind == ACAP_EVENTS_QUEUE_EVENT ) {
+				success = ax_event_handler_send_event(ACAP_EVENTS_HANDLER, queued->declaration, queued->event, NULL);
+				if( !success )
+					LOG_WARN("%s: Could not send event %s\n",__func__, handle->id);
+				ax_event_free(queued->event);
+			} else {
+				const char* key = queued->data;
+				success = ACAP_EVENTS_Handle_Send(handle, queued->declaration, key, key + strlen(key) + 1, AX_VALUE_TYPE_STRING);
+				free(queued->data);
+			}
+			atomic_fetch_add(success ? &ACAP_EVENTS_QUEUE_SENT : &ACAP_EVENTS_QUEUE_FAILED, 1);
+		}
+		pthread_mutex_lock(&ACAP_EVENTS_QUEUE_MUTEX);
+	}
+	pthread_mutex_unlock(&ACAP_EVENTS_QUEUE_MUTEX);
+	return NULL;
+}
+
+static gboolean
+ACAP_EVENTS_Queue_Status( gpointer user_data ) {
+	(void)user_data;
+	pthread_mutex_lock(&ACAP_EVENTS_QUEUE_MUTEX);
+	unsigned int depth = ACAP_EVENTS_QUEUE_COUNT;
+	pthread_mutex_unlock(&ACAP_EVENTS_QUEUE_MUTEX);
+	ACAP_STATUS_SetNumber("eventQueue","depth",depth);
+	ACAP_STATUS_SetNumber("eventQueue","maxDepth",atomic_load(&ACAP_EVENTS_QUEUE_MAX));
+	ACAP_STATUS_SetNumber("eventQueue","sent",atomic_load(&ACAP_EVENTS_QUEUE_SENT));
+	ACAP_STATUS_SetNumber("eventQueue","coalesced",atomic_load(&ACAP_EVENTS_QUEUE_COALESCED));
+	ACAP_STATUS_SetNumber("eventQueue","dropped",atomic_load(&ACAP_EVENTS_QUEUE_DROPPED));
+	ACAP_STATUS_SetNumber("eventQueue","failed",atomic_load(&ACAP_EVENTS_QUEUE_FAILED));
+	for( ACAP_EVENTS_Handle* handle = ACAP_EVENTS_HANDLES; handle; handle = handle->next )
+		if( handle->limited )
+			ACAP_STATUS_SetNumber("eventSuppressed",handle->id,handle->suppressed);
+	return G_SOURCE_CONTINUE;
+}
 
-	cJSON *event = cJSON_GetObjectItem(ACAP_EVENTS_DECLARATIONS, id );
-	if(!event) {
-		LOG_WARN("%s: Event %s not found\n",__func__, id);
+static void
+ACAP_EVENTS_Dispatch_Start( void ) {
+	if( ACAP_EVENTS_DISPATCHING )
+		return;
+	ACAP_EVENTS_SHUTDOWN = 0;
+	if( pthread_create(&ACAP_EVENTS_DISPATCHER, NULL, ACAP_EVENTS_Dispatch_Thread, NULL) != 0 ) {
+		LOG_WARN("%s: Unable to start event dispatcher\n",__func__);
+		return;
+	}
+	ACAP_EVENTS_DISPATCHING = 1;
+	ACAP_STATUS_Live("eventQueue", NULL);
+	ACAP_STATUS_Live("eventSuppressed", NULL);
+	ACAP_EVENTS_QUEUE_TIMER = g_timeout_add_seconds(2, ACAP_EVENTS_Queue_Status, NULL);
+}
+
+//Sends the remaining queued events and stops the dispatcher
+static void
+ACAP_EVENTS_Dispatch_Stop( void ) {
+	if( !ACAP_EVENTS_DISPATCHING )
+		return;
+	pthread_mutex_lock(&ACAP_EVENTS_QUEUE_MUTEX);
+	ACAP_EVENTS_SHUTDOWN = 1;
+	pthread_cond_signal(&ACAP_EVENTS_QUEUE_COND);
+	pthread_mutex_unlock(&ACAP_EVENTS_QUEUE_MUTEX);
+	pthread_join(ACAP_EVENTS_DISPATCHER, NULL);
+	ACAP_EVENTS_DISPATCHING = 0;
+	if( ACAP_EVENTS_QUEUE_TIMER )
+		g_source_remove(ACAP_EVENTS_QUEUE_TIMER);
+	ACAP_EVENTS_QUEUE_TIMER = 0;
+}
+
+static int
+ACAP_EVENTS_Enqueue( ACAP_EVENTS_Handle* handle, int kind, const char* key, const char* value, AXEvent* event, int pulse ) {
+	if( !handle || !ACAP_EVENTS_HANDLER ) {
+		if( event )
+			ax_event_free(event);
 		return 0;
 	}
+	if( !ACAP_EVENTS_Handle_Resolve( handle ) ) {
+		LOG_WARN("%s: Event %s not found\n",__func__, handle->id);
+		if( event )
+			ax_event_free(event);
+		return 0;
+	}
+	if( !ACAP_EVENTS_DISPATCHING )
+		ACAP_EVENTS_Dispatch_Start();
+
+	char* data = 0;
+	if( kind == ACAP_EVENTS_QUEUE_STRING ) {
+		size_t keyLength = strlen(key) + 1;
+		size_t valueLength = strlen(value) + 1;
+		data = malloc(keyLength + valueLength);
+		if( !data ) {
+			atomic_fetch_add(&ACAP_EVENTS_QUEUE_DROPPED, 1);
+			return 0;
+		}
+		memcpy(data, key, keyLength);
+		memcpy(data + keyLength, value, valueLength);
+	}
 
-	AXEventKeyValueSet* set = ax_event_key_value_set_new();
+	pthread_mutex_lock(&ACAP_EVENTS_QUEUE_MUTEX);
+	if( ACAP_EVENTS_QUEUE_COUNT == ACAP_EVENTS_QUEUE_SIZE ) {
+		pthread_mutex_unlock(&ACAP_EVENTS_QUEUE_MUTEX);
+		atomic_fetch_add(&ACAP_EVENTS_QUEUE_DROPPED, 1);
+		free(data);
+		if( event )
+			ax_event_free(event);
+		return 0;
+	}
+	ACAP_EVENTS_Queued* queued = &ACAP_EVENTS_QUEUE[(ACAP_EVENTS_QUEUE_HEAD + ACAP_EVENTS_QUEUE_COUNT) % ACAP_EVENTS_QUEUE_SIZE];
+	queued->handle = handle;
+	queued->declaration = handle->declaration;
+	queued->kind = kind;
+	queued->value = pulse;
+	queued->data = data;
+	queued->event = event;
+	ACAP_EVENTS_QUEUE_COUNT++;
+	if( ACAP_EVENTS_QUEUE_COUNT > atomic_load(&ACAP_EVENTS_QUEUE_MAX) )
+		atomic_store(&ACAP_EVENTS_QUEUE_MAX, ACAP_EVENTS_QUEUE_COUNT);
+	pthread_cond_signal(&ACAP_EVENTS_QUEUE_COND);
+	pthread_mutex_unlock(&ACAP_EVENTS_QUEUE_MUTEX);
+	return 1;
+}
 
-	guint value = 1;
-	if( !ax_event_key_value_set_add_key_value(set,"value",NULL, &value,AX_VALUE_TYPE_INT,&error) ) {
-		ax_event_key_value_set_free(set);
-		LOG_WARN("%s: %s error %s\n", __func__,id,error->message);
-		g_error_free(error);
+static int
+ACAP_EVENTS_Emit_State( ACAP_EVENTS_Handle* handle, int value ) {
+	atomic_store(&handle->state, value);
+	if( !atomic_exchange(&handle->queued, 1) && !ACAP_EVENTS_Enqueue( handle, ACAP_EVENTS_QUEUE_STATE, 0, 0, 0, 0 ) ) {
+		atomic_store(&handle->queued, 0);
+		atomic_store(&handle->state, !value);
 		return 0;
 	}
 
-	AXEvent* axEvent = ax_event_new2(set,NULL);
-	ax_event_key_value_set_free(set);
+	if( !handle->statusItem || !cJSON_IsBool(handle->statusItem) ) {
+		ACAP_STATUS_SetBool("events", handle->id, value);
+		handle->statusGroup = ACAP_STATUS_Group("events");
+		handle->statusItem = handle->statusGroup ? cJSON_GetObjectItem(handle->statusGroup, handle->id) : 0;
+	} else {
+		handle->statusItem->type = (handle->statusItem->type & ~0xFF) | (value ? cJSON_True : cJSON_False);
+		ACAP_STATUS_Touch(handle->statusGroup, handle->id);
+	}
+	if( EVENT_STATE_CALLBACK )
+		EVENT_STATE_CALLBACK( handle->id, value );
+	LOG_TRACE("%s: %s %d queued\n",__func__, handle->id, value );
+	return 1;
+}
 
-	if( !ax_event_handler_send_event(ACAP_EVENTS_HANDLER, event->valueint, axEvent, &error) )  {
-		LOG_WARN("%s: Could not send event %s %s\n",__func__, id, error->message);
-		ax_event_free(axEvent);
-		g_error_free(error);
+//Earliest time the policy allows the next emit
+static guint64
+ACAP_EVENTS_Policy_Next( ACAP_EVENTS_Handle* handle, guint64 now ) {
+	guint64 next = now;
+	if( handle->policy.minInterval && handle->lastEmit && handle->lastEmit + handle->policy.minInterval > next )
+		next = handle->lastEmit + handle->policy.minInterval;
+	if( handle->policy.rate > 0 ) {
+		handle->tokens += (now - handle->tokenTime) * handle->policy.rate / 1000.0;
+		if( handle->tokens > handle->policy.burst )
+			handle->tokens = handle->policy.burst;
+		handle->tokenTime = now;
+		if( handle->tokens < 1 ) {
+			guint64 refill = now + (guint64)((1 - handle->tokens) * 1000.0 / handle->policy.rate) + 1;
+			if( refill > next )
+				next = refill;
+		}
+	}
+	return next;
+}
+
+static void
+ACAP_EVENTS_Policy_Consume( ACAP_EVENTS_Handle* handle, guint64 now ) {
+	handle->lastEmit = now;
+	if( handle->policy.rate > 0 )
+		handle->tokens -= 1;
+}
+
+static void
+ACAP_EVENTS_Policy_Deferred( ACAP_WHEEL_Timer* timer, void* user_data ) {
+	ACAP_EVENTS_Handle* handle = (ACAP_EVENTS_Handle*)user_data;
+	guint64 now = ACAP_WHEEL_Now();
+	int held = handle->heldKind ? 1 : handle->desired != atomic_load(&handle->state);
+	if( !held )
+		return;
+	guint64 next = ACAP_EVENTS_Policy_Next( handle, now );
+	if( next > now ) {
+		ACAP_WHEEL_Schedule( timer, next - now );
+		return;
+	}
+	ACAP_EVENTS_Policy_Consume( handle, now );
+
+	switch( handle->heldKind ) {
+		case 0:
+			ACAP_EVENTS_Emit_State( handle, handle->desired );
+			break;
+		case ACAP_EVENTS_QUEUE_PULSE:
+			ACAP_EVENTS_Enqueue( handle, ACAP_EVENTS_QUEUE_PULSE, 0, 0, 0, handle->heldCount );
+			break;
+		case ACAP_EVENTS_QUEUE_STRING: {
+			const char* key = handle->heldData;
+			ACAP_EVENTS_Enqueue( handle, ACAP_EVENTS_QUEUE_STRING, key, key + strlen(key) + 1, 0, 0 );
+			break;
+		}
+		case ACAP_EVENTS_QUEUE_EVENT:
+			ACAP_EVENTS_Enqueue( handle, ACAP_EVENTS_QUEUE_EVENT, 0, 0, handle->heldEvent, 0 );
+			handle->heldEvent = 0;
+			break;
+	}
+	free( handle->heldData );
+	handle->heldData = 0;
+	handle->heldKind = 0;
+	handle->heldCount = 0;
+}
+
+//Returns 1 if the stateless fire should be sent now, otherwise it is held or dropped
+static int
+ACAP_EVENTS_Policy_Stateless( ACAP_EVENTS_Handle* handle, int kind, const char* key, const char* value, AXEvent* event ) {
+	guint64 now = ACAP_WHEEL_Now();
+	if( handle->policy.coalesce ) {
+		//Keep only the latest payload for the end of the window
+		if( handle->heldCount )
+			handle->suppressed++;
+		free( handle->heldData );
+		handle->heldData = 0;
+		if( handle->heldEvent )
+			ax_event_free( handle->heldEvent );
+		handle->heldEvent = event;
+		if( kind == ACAP_EVENTS_QUEUE_STRING ) {
+			size_t keyLength = strlen(key) + 1;
+			handle->heldData = malloc(keyLength + strlen(value) + 1);
+			if( handle->heldData ) {
+				memcpy(handle->heldData, key, keyLength);
+				strcpy(handle->heldData + keyLength, value);
+			}
+		}
+		handle->heldKind = kind;
+		handle->heldCount++;
+		if( !ACAP_WHEEL_Pending( &handle->deferred ) )
+			ACAP_WHEEL_Schedule( &handle->deferred, handle->policy.coalesce );
 		return 0;
 	}
-	ax_event_free(axEvent);
-	LOG_TRACE("%s: %s fired %d\n",__func__,  id,value );
+	if( ACAP_EVENTS_Policy_Next( handle, now ) > now ) {
+		handle->suppressed++;
+		if( event )
+			ax_event_free( event );
+		return 0;
+	}
+	ACAP_EVENTS_Policy_Consume( handle, now );
 	return 1;
 }
 
 int
-ACAP_EVENTS_Fire_State( const char* id, int value ) {
-	if( value && ACAP_STATUS_Bool("events",id) )
-		return 1;  //The state is already high
-	if( !value && !ACAP_STATUS_Bool("events",id) )
-		return 1;  //The state is already low
+ACAP_EVENTS_Set_Policy( const char* id, cJSON* policy ) {
+	ACAP_EVENTS_Handle* handle = ACAP_EVENTS_Handle_Get( id );
+	if( !handle || !policy )
+		return 0;
+	cJSON* item;
+	handle->policy.minInterval = (item = cJSON_GetObjectItem(policy,"minInterval")) && item->valuedouble > 0 ? item->valuedouble : 0;
+	handle->policy.coalesce = (item = cJSON_GetObjectItem(policy,"coalesce")) && item->valuedouble > 0 ? item->valuedouble : 0;
+	handle->policy.rate = (item = cJSON_GetObjectItem(policy,"rate")) && item->valuedouble > 0 ? item->valuedouble : 0;
+	handle->policy.burst = (item = cJSON_GetObjectItem(policy,"burst")) && item->valuedouble >= 1 ? item->valuedouble : 1;
+	handle->limited = handle->policy.minInterval || handle->policy.coalesce || handle->policy.rate > 0;
+	handle->tokens = handle->policy.burst;
+	handle->tokenTime = ACAP_WHEEL_Now();
+	LOG_TRACE("%s: %s interval %u coalesce %u rate %f\n",__func__, id, handle->policy.minInterval, handle->policy.coalesce, handle->policy.rate);
+	return 1;
+}
 
-	LOG_TRACE("%s: %s %d\n", __func__, id, value );
-	
-	if( !ACAP_EVENTS_DECLARATIONS || !id ) {
-		LOG_WARN("EVENTs_Fire_State: Error send event\n");
+int
+ACAP_EVENTS_Copy_Policy( const char* id, const char* from ) {
+	ACAP_EVENTS_Handle* source = ACAP_EVENTS_Handle_Get( from );
+	ACAP_EVENTS_Handle* handle = ACAP_EVENTS_Handle_Get( id );
+	if( !source || !handle || !source->limited )
 		return 0;
-	}
+	cJSON* policy = cJSON_CreateObject();
+	cJSON_AddNumberToObject(policy,"minInterval",source->policy.minInterval);
+	cJSON_AddNumberToObject(policy,"coalesce",source->policy.coalesce);
+	cJSON_AddNumberToObject(policy,"rate",source->policy.rate);
+	cJSON_AddNumberToObject(policy,"burst",source->policy.burst);
+	int result = ACAP_EVENTS_Set_Policy( id, policy );
+	cJSON_Delete(policy);
+	return result;
+}
 
-	cJSON *event = cJSON_GetObjectItem(ACAP_EVENTS_DECLARATIONS, id );
-	if(!event) {
-		LOG_WARN("Error sending event %s.  Event not found\n", id);
+int
+ACAP_EVENTS_Handle_Fire_State( ACAP_EVENTS_Handle* handle, int value ) {
+	value = value ? 1 : 0;
+	if( !handle )
 		return 0;
+	if( !handle->limited ) {
+		if( atomic_load(&handle->state) == value )
+			return 1;  //Already in that state
+		return ACAP_EVENTS_Emit_State( handle, value );
 	}
 
-	AXEventKeyValueSet* set = ax_event_key_value_set_new();
+	handle->desired = value;
+	if( atomic_load(&handle->state) == value ) {
+		//A held change was reverted before it was emitted
+		if( ACAP_WHEEL_Pending( &handle->deferred ) ) {
+			ACAP_WHEEL_Cancel( &handle->deferred );
+			handle->suppressed++;
+		}
+		return 1;
+	}
+	if( ACAP_WHEEL_Pending( &handle->deferred ) )
+		return 1;
 
-	if( !ax_event_key_value_set_add_key_value(set,"state",NULL , &value,AX_VALUE_TYPE_BOOL,NULL) ) {
-		ax_event_key_value_set_free(set);
-		LOG_WARN("EVENT_Fire_State: Could not send event %s.  Internal error\n", id);
-		return 0;
+	guint64 now = ACAP_WHEEL_Now();
+	guint64 next = ACAP_EVENTS_Policy_Next( handle, now );
+	if( handle->policy.coalesce && now + handle->policy.coalesce > next )
+		next = now + handle->policy.coalesce;
+	if( next > now ) {
+		handle->suppressed++;
+		ACAP_WHEEL_Schedule( &handle->deferred, next - now );
+		return 1;
 	}
+	ACAP_EVENTS_Policy_Consume( handle, now );
+	return ACAP_EVENTS_Emit_State( handle, value );
+}
 
-	AXEvent* axEvent = ax_event_new2(set, NULL);
-	ax_event_key_value_set_free(set);
+int
+ACAP_EVENTS_Handle_Fire( ACAP_EVENTS_Handle* handle ) {
+	if( handle && handle->limited && !ACAP_EVENTS_Policy_Stateless( handle, ACAP_EVENTS_QUEUE_PULSE, 0, 0, 0 ) )
+		return 1;
+	return ACAP_EVENTS_Enqueue( handle, ACAP_EVENTS_QUEUE_PULSE, 0, 0, 0, 1 );
+}
 
-	if( !ax_event_handler_send_event(ACAP_EVENTS_HANDLER, event->valueint, axEvent, NULL) )  {
-		LOG_WARN("EVENT_Fire_State: Could not send event %s\n", id);
-		ax_event_free(axEvent);
+int
+ACAP_EVENTS_Handle_Fire_String( ACAP_EVENTS_Handle* handle, const char* key, const char* value ) {
+	if( !key || !value )
 		return 0;
-	}
-	ax_event_free(axEvent);
-	ACAP_STATUS_SetBool("events",id,value);
-	LOG_TRACE("EVENT_Fire_State: %s %d fired\n", id,value );
-	return 1;
+	if( handle && handle->limited && !ACAP_EVENTS_Policy_Stateless( handle, ACAP_EVENTS_QUEUE_STRING, key, value, 0 ) )
+		return 1;
+	return ACAP_EVENTS_Enqueue( handle, ACAP_EVENTS_QUEUE_STRING, key, value, 0, 0 );
+}
+
+int
+ACAP_EVENTS_Fire( const char* id ) {
+	LOG_TRACE("%s: %s\n", __func__, id );
+	return ACAP_EVENTS_Handle_Fire( ACAP_EVENTS_Handle_Get( id ) );
+}
+
+int
+ACAP_EVENTS_Fire_State( const char* id, int value ) {
+	return ACAP_EVENTS_Handle_Fire_State( ACAP_EVENTS_Handle_Get( id ), value );
 }
 
 
@@ -1819,18 +2813,15 @@ int
 ACAP_EVENTS_Fire_JSON( const char* Id, cJSON* data ) {
 	AXEventKeyValueSet *set = NULL;
 	int boolValue;
-	GError *error = NULL;
 	if(!data) {
 		LOG_WARN("%s: Invalid data",__func__);
 		return 0;
 	}
 
-	cJSON *event = cJSON_GetObjectItem(ACAP_EVENTS_DECLARATIONS, Id );
-	if(!event) {
-		LOG_WARN("%s: Error sending event %s.  Event not found\n",__func__,Id);
+	ACAP_EVENTS_Handle* handle = ACAP_EVENTS_Handle_Get( Id );
+	if( !handle )
 		return 0;
-	}
-	
+
 
 	set = ax_event_key_value_set_new();
 	int success = 0;
@@ -1860,15 +2851,10 @@ ACAP_EVENTS_Fire_JSON( const char* Id, cJSON* data ) {
 	}
 
 	AXEvent* axEvent = ax_event_new2(set, NULL);
-	success = ax_event_handler_send_event(ACAP_EVENTS_HANDLER, event->valueint, axEvent, &error);
 	ax_event_key_value_set_free(set);
-	ax_event_free(axEvent);
-	if(!success)  {
-		LOG_WARN("%s: Could not send event %s id = %d %s\n",__func__, Id, event->valueint, error->message);
-		g_error_free(error);
-		return 0;
-	}
-	return 1;
+	if( handle->limited && !ACAP_EVENTS_Policy_Stateless( handle, ACAP_EVENTS_QUEUE_EVENT, 0, 0, axEvent ) )
+		return 1;
+	return ACAP_EVENTS_Enqueue( handle, ACAP_EVENTS_QUEUE_EVENT, 0, 0, axEvent, 0 );
 }
 
 int
@@ -1961,10 +2947,214 @@ ACAP_EVENTS_Add_Event_JSON( cJSON* event ) {
 		return 0;
 	}
 	cJSON_AddNumberToObject(ACAP_EVENTS_DECLARATIONS,eventID,declarationID);
+	ACAP_EVENTS_generation++;
 	ax_event_key_value_set_free(set);
+	if( cJSON_GetObjectItem(event,"policy") )
+		ACAP_EVENTS_Set_Policy( eventID, cJSON_GetObjectItem(event,"policy") );
 	return declarationID;
 }
 
+/*------------------------------------------------------------------
+ * Timer wheel
+ *------------------------------------------------------------------
+ * Four levels of 64 slots.  Level 0 has 1 ms slots, each higher level
+ * 64 times coarser, covering about 4.6 hours.  Later deadlines park in
+ * the farthest level 3 slot and are re-inserted when it is reached.
+ * A timer sits in the level matching its distance from the wheel time
+ * and moves down one level at a time as the wheel passes the boundary
+ * of its slot.  The occupied bitmaps let the GLib source sleep until the
+ * next non-empty slot and let idle stretches be skipped in one step.
+ */
+
+#define ACAP_WHEEL_LEVELS 4
+#define ACAP_WHEEL_BITS 6
+#define ACAP_WHEEL_SLOTS (1 << ACAP_WHEEL_BITS)
+#define ACAP_WHEEL_MASK (ACAP_WHEEL_SLOTS - 1)
+
+typedef struct {
+    GSource source;
+} ACAP_WHEEL_Source;
+
+static ACAP_WHEEL_Timer* wheel_slots[ACAP_WHEEL_LEVELS][ACAP_WHEEL_SLOTS];
+static guint64 wheel_occupied[ACAP_WHEEL_LEVELS];
+static guint64 wheel_time = 0;      // Last processed ms
+static unsigned int wheel_count = 0;
+static GSource* wheel_source = NULL;
+
+guint64 ACAP_WHEEL_Now(void) {
+    return (guint64)(g_get_monotonic_time() / 1000);
+}
+
+static void ACAP_WHEEL_Link(ACAP_WHEEL_Timer* timer) {
+    guint64 expiry = timer->expiry > wheel_time ? timer->expiry : wheel_time + 1;
+    guint64 delta = expiry - wheel_time;
+    int level = 0;
+    while (level < ACAP_WHEEL_LEVELS - 1 && delta >= (1ULL << (ACAP_WHEEL_BITS * (level + 1))))
+        level++;
+    if (delta >= (1ULL << (ACAP_WHEEL_BITS * ACAP_WHEEL_LEVELS)))
+        expiry = wheel_time + (1ULL << (ACAP_WHEEL_BITS * ACAP_WHEEL_LEVELS)) - 1;
+    int slot = (expiry >> (ACAP_WHEEL_BITS * level)) & ACAP_WHEEL_MASK;
+
+    ACAP_WHEEL_Timer** head = &wheel_slots[level][slot];
+    timer->slot = level * ACAP_WHEEL_SLOTS + slot;
+    timer->prev = NULL;
+    timer->next = *head;
+    if (*head)
+        (*head)->prev = timer;
+    *head = timer;
+    wheel_occupied[level] |= 1ULL << slot;
+}
+
+static void ACAP_WHEEL_Unlink(ACAP_WHEEL_Timer* timer) {
+    int level = timer->slot / ACAP_WHEEL_SLOTS;
+    int slot = timer->slot % ACAP_WHEEL_SLOTS;
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel_slots[level][slot] = timer->next;
+        if (!timer->next)
+            wheel_occupied[level] &= ~(1ULL << slot);
+    }
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    timer->slot = -1;
+}
+
+static void ACAP_WHEEL_Cascade(int level, int slot) {
+    ACAP_WHEEL_Timer* timer = wheel_slots[level][slot];
+    wheel_slots[level][slot] = NULL;
+    wheel_occupied[level] &= ~(1ULL << slot);
+    while (timer) {
+        ACAP_WHEEL_Timer* next = timer->next;
+        ACAP_WHEEL_Link(timer);
+        timer = next;
+    }
+}
+
+static void ACAP_WHEEL_Advance(guint64 now) {
+    while (wheel_time < now) {
+        if (wheel_count == 0) {
+            wheel_time = now;
+            break;
+        }
+        // Skip to the end of the lowest level block that has empty levels below it
+        int empty = 0;
+        while (empty < ACAP_WHEEL_LEVELS && !wheel_occupied[empty])
+            empty++;
+        if (empty > 0) {
+            guint64 boundary = wheel_time | ((1ULL << (ACAP_WHEEL_BITS * empty)) - 1);
+            if (boundary >= now) {
+                wheel_time = now;
+                break;
+            }
+            wheel_time = boundary;
+        }
+
+        wheel_time++;
+        for (int level = ACAP_WHEEL_LEVELS - 1; level > 0; level--) {
+            guint64 below = (1ULL << (ACAP_WHEEL_BITS * level)) - 1;
+            if ((wheel_time & below) == 0)
+                ACAP_WHEEL_Cascade(level, (wheel_time >> (ACAP_WHEEL_BITS * level)) & ACAP_WHEEL_MASK);
+        }
+
+        int slot = wheel_time & ACAP_WHEEL_MASK;
+        ACAP_WHEEL_Timer* timer;
+        while ((timer = wheel_slots[0][slot])) {
+            ACAP_WHEEL_Unlink(timer);
+            wheel_count--;
+            if (timer->callback)
+                timer->callback(timer, timer->user_data);
+        }
+    }
+}
+
+// Next ms at which something is due or has to be cascaded.  A coarser
+// level may need cascading before the next level 0 slot is due.
+static guint64 ACAP_WHEEL_Next(void) {
+    guint64 next = G_MAXUINT64;
+    for (int level = 0; level < ACAP_WHEEL_LEVELS; level++) {
+        if (!wheel_occupied[level])
+            continue;
+        int shift = ACAP_WHEEL_BITS * level;
+        guint64 index = (wheel_time >> shift) + 1;
+        int start = index & ACAP_WHEEL_MASK;
+        guint64 occupied = wheel_occupied[level];
+        guint64 rotated = start ? (occupied >> start) | (occupied << (ACAP_WHEEL_SLOTS - start)) : occupied;
+        guint64 due = (index + __builtin_ctzll(rotated)) << shift;
+        if (due < next)
+            next = due;
+    }
+    return next;
+}
+
+static gboolean ACAP_WHEEL_Prepare(GSource* source, gint* timeout) {
+    (void)source;
+    if (wheel_count == 0) {
+        *timeout = -1;
+        return FALSE;
+    }
+    guint64 now = ACAP_WHEEL_Now();
+    guint64 next = ACAP_WHEEL_Next();
+    if (next <= now) {
+        *timeout = 0;
+        return TRUE;
+    }
+    *timeout = next - now > G_MAXINT ? G_MAXINT : (gint)(next - now);
+    return FALSE;
+}
+
+static gboolean ACAP_WHEEL_Check(GSource* source) {
+    (void)source;
+    return wheel_count > 0 && ACAP_WHEEL_Next() <= ACAP_WHEEL_Now();
+}
+
+static gboolean ACAP_WHEEL_Dispatch(GSource* source, GSourceFunc callback, gpointer user_data) {
+    (void)source; (void)callback; (void)user_data;
+    ACAP_WHEEL_Advance(ACAP_WHEEL_Now());
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs ACAP_WHEEL_Funcs = {
+    ACAP_WHEEL_Prepare,
+    ACAP_WHEEL_Check,
+    ACAP_WHEEL_Dispatch,
+    NULL, NULL, NULL
+};
+
+void ACAP_WHEEL_Timer_Init(ACAP_WHEEL_Timer* timer, ACAP_WHEEL_Callback callback, void* user_data) {
+    timer->next = timer->prev = NULL;
+    timer->slot = -1;
+    timer->expiry = 0;
+    timer->callback = callback;
+    timer->user_data = user_data;
+}
+
+int ACAP_WHEEL_Pending(const ACAP_WHEEL_Timer* timer) {
+    return timer && timer->slot >= 0;
+}
+
+void ACAP_WHEEL_Cancel(ACAP_WHEEL_Timer* timer) {
+    if (!ACAP_WHEEL_Pending(timer))
+        return;
+    ACAP_WHEEL_Unlink(timer);
+    wheel_count--;
+}
+
+void ACAP_WHEEL_Schedule(ACAP_WHEEL_Timer* timer, guint64 delay_ms) {
+    if (!timer)
+        return;
+    if (!wheel_source) {
+        wheel_time = ACAP_WHEEL_Now();
+        wheel_source = g_source_new(&ACAP_WHEEL_Funcs, sizeof(ACAP_WHEEL_Source));
+        g_source_attach(wheel_source, NULL);
+    }
+    ACAP_WHEEL_Cancel(timer);
+    timer->expiry = ACAP_WHEEL_Now() + delay_ms;
+    ACAP_WHEEL_Link(timer);
+    wheel_count++;
+}
+
 /*------------------------------------------------------------------
  * Timer functions
  *------------------------------------------------------------------*/
@@ -1973,23 +3163,40 @@ typedef struct ACAP_Timer {
     char* name;
     int active;
     int repeat_rate_seconds;
-    time_t next_trigger;
+    ACAP_WHEEL_Timer wheel;
     ACAP_TIMER_Callback callback;
     struct ACAP_Timer* next;
 } ACAP_Timer;
 
 static ACAP_Timer* timer_list = NULL;
 
+static void ACAP_TIMER_Free(ACAP_Timer* timer) {
+    ACAP_WHEEL_Cancel(&timer->wheel);
+    free(timer->name);
+    free(timer);
+}
+
+static void ACAP_TIMER_Expired(ACAP_WHEEL_Timer* wheel, void* user_data) {
+    ACAP_Timer* timer = (ACAP_Timer*)user_data;
+    (void)wheel;
+    // Rearm first so the callback may remove or reset its own timer
+    ACAP_WHEEL_Schedule(&timer->wheel, (guint64)timer->repeat_rate_seconds * 1000);
+    if (timer->callback(timer->name) == 0)
+        ACAP_TIMER_Remove(timer->name);
+}
+
 int ACAP_TIMER_Set(const char* name, int repeat_rate_seconds, ACAP_TIMER_Callback callback) {
     LOG_TRACE("%s: %s %d seconds", __func__, name, repeat_rate_seconds);
+    if (!name || !callback || repeat_rate_seconds <= 0)
+        return 0;
     ACAP_Timer* existing = timer_list;
     
     while (existing) {
         if (strcmp(existing->name, name) == 0) {
             existing->repeat_rate_seconds = repeat_rate_seconds;
             existing->callback = callback;
-            existing->next_trigger = time(NULL) + repeat_rate_seconds;
             existing->active = 1;
+            ACAP_WHEEL_Schedule(&existing->wheel, (guint64)repeat_rate_seconds * 1000);
             return 1;
         }
         existing = existing->next;
@@ -2002,9 +3209,10 @@ int ACAP_TIMER_Set(const char* name, int repeat_rate_seconds, ACAP_TIMER_Callbac
     new_timer->active = 1;
     new_timer->repeat_rate_seconds = repeat_rate_seconds;
     new_timer->callback = callback;
-    new_timer->next_trigger = time(NULL) + repeat_rate_seconds;
+    ACAP_WHEEL_Timer_Init(&new_timer->wheel, ACAP_TIMER_Expired, new_timer);
     new_timer->next = timer_list;
     timer_list = new_timer;
+    ACAP_WHEEL_Schedule(&new_timer->wheel, (guint64)repeat_rate_seconds * 1000);
 
     return 1;
 }
@@ -2021,8 +3229,7 @@ int ACAP_TIMER_Remove(const char* name) {
             } else {
                 timer_list = current->next;
             }
-            free(current->name);
-            free(current);
+            ACAP_TIMER_Free(current);
             return 1;
         }
         previous = current;
@@ -2037,42 +3244,18 @@ void ACAP_TIMER_Cleanup(void) {
     while (timer_list) {
         ACAP_Timer* temp = timer_list;
         timer_list = timer_list->next;
-        free(temp->name);
-        free(temp);
+        ACAP_TIMER_Free(temp);
     }
     timer_list = NULL;
+    if (wheel_source) {
+        g_source_destroy(wheel_source);
+        g_source_unref(wheel_source);
+        wheel_source = NULL;
+    }
 }
 
 void ACAP_TIMER_Process(void) {
-    ACAP_Timer* current = timer_list;
-    ACAP_Timer* prev = NULL;
-    time_t now = time(NULL);
-
-    while (current) {
-        if (current->active && now >= current->next_trigger) {
-            int result = current->callback(current->name);
-        
-            if (result == 0) {
-                ACAP_Timer* to_remove = current;
-                if (prev) {
-                    prev->next = current->next;
-                    current = current->next;
-                } else {
-                    timer_list = current->next;
-                    current = timer_list;
-                }
-                free(to_remove->name);
-                free(to_remove);
-            } else {
-                current->next_trigger = now + current->repeat_rate_seconds;
-                prev = current;
-                current = current->next;
-            }
-        } else {
-            prev = current;
-            current = current->next;
-        }
-    }
+    ACAP_WHEEL_Advance(ACAP_WHEEL_Now());
 }
 
 /*------------------------------------------------------------------
@@ -2080,6 +3263,9 @@ void ACAP_TIMER_Process(void) {
  *------------------------------------------------------------------*/
 
 void ACAP_Cleanup(void) {
+    // Send queued events before the handler goes away
+    ACAP_EVENTS_Dispatch_Stop();
+
     // Clean up other resources
     ACAP_HTTP_Cleanup();
     ACAP_TIMER_Cleanup();
@@ -2088,6 +3274,13 @@ void ACAP_Cleanup(void) {
         cJSON_Delete(status_container);
         status_container = NULL;
     }
+    for (int i = 0; i < 2; i++) {
+        free(status_cache[i].data);
+        status_cache[i].data = NULL;
+        status_cache[i].size = 0;
+        status_cache[i].generation = 0;
+    }
+    status_group_count = 0;
 
 	LOG_TRACE("%s:",__func__);
     if (app) {
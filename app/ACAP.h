@@ -19,6 +19,8 @@ extern "C" {
 #define ACAP_MAX_PATH_LENGTH 128
 #define ACAP_MAX_PACKAGE_NAME 30
 #define ACAP_MAX_BUFFER_SIZE 4096
+#define ACAP_MAX_STATUS_GROUPS 32
+#define ACAP_MAX_STATUS_LIVE 64
 
 struct ACAP_TIMER {
     char* label;
@@ -42,6 +44,7 @@ typedef enum {
  *-----------------------------------------------------*/
 typedef void (*ACAP_Config_Update)(const char* service, cJSON* data);
 typedef void (*ACAP_EVENTS_Callback)(cJSON* event);
+typedef void (*ACAP_EVENTS_State_Callback)(const char* id, int state);
 
 // HTTP Request/Response structures
 typedef struct {
@@ -72,10 +75,16 @@ void		ACAP_Cleanup(void);
  * HTTP Functions
  *-----------------------------------------------------*/
 int 		ACAP_HTTP(void);
-void		ACAP_HTTP_Process();
+int 		ACAP_HTTP_Listen(void);	// Serve requests from the main loop when the socket is readable
+void		ACAP_HTTP_Process();	// Accept and answer one request
 void 		ACAP_HTTP_Cleanup(void);
 int 		ACAP_HTTP_Node(const char* nodename, ACAP_HTTP_Callback callback);
 
+// Long-lived responses.  A detached response outlives its callback and
+// may be written from another thread until it is released.
+ACAP_HTTP_Response ACAP_HTTP_Detach(ACAP_HTTP_Response response);
+void		ACAP_HTTP_Release(ACAP_HTTP_Response response);
+
 // HTTP Request helpers
 const char* ACAP_HTTP_Get_Method(const ACAP_HTTP_Request request);
 const char* ACAP_HTTP_Get_Content_Type(const ACAP_HTTP_Request request);
@@ -109,8 +118,21 @@ int		ACAP_EVENTS_Fire_State( const char* Id, int value );
 int		ACAP_EVENTS_Fire( const char* Id );
 int		ACAP_EVENTS_Fire_JSON( const char* Id, cJSON* data );
 int		ACAP_EVENTS_SetCallback( ACAP_EVENTS_Callback callback );
+int		ACAP_EVENTS_SetStateCallback( ACAP_EVENTS_State_Callback callback );  //Called on every state transition
 int		ACAP_EVENTS_Subscribe( cJSON* eventDeclaration );
 
+//Event handles: resolve an event once and fire it without lookups.  Handles live until the app exits
+typedef struct ACAP_EVENTS_Handle ACAP_EVENTS_Handle;
+ACAP_EVENTS_Handle*	ACAP_EVENTS_Handle_Get( const char* Id );
+int		ACAP_EVENTS_Handle_Fire_State( ACAP_EVENTS_Handle* handle, int value );
+int		ACAP_EVENTS_Handle_Fire( ACAP_EVENTS_Handle* handle );
+int		ACAP_EVENTS_Handle_Fire_String( ACAP_EVENTS_Handle* handle, const char* key, const char* value );
+int		ACAP_EVENTS_Handle_State( const ACAP_EVENTS_Handle* handle );
+
+//Rate limiting policy, normally set by "policy" in events.json.  See ACAP.c
+int		ACAP_EVENTS_Set_Policy( const char* Id, cJSON* policy );
+int		ACAP_EVENTS_Copy_Policy( const char* Id, const char* fromId );
+
 /*-----------------------------------------------------
  * File Operations
  *-----------------------------------------------------*/
@@ -151,6 +173,8 @@ int 		ACAP_STATUS_Int(const char* group, const char* name);
 double 		ACAP_STATUS_Double(const char* group, const char* name);
 char* 		ACAP_STATUS_String(const char* group, const char* name);
 cJSON* 		ACAP_STATUS_Object(const char* group, const char* name);
+unsigned long ACAP_STATUS_Generation(void);  // Bumped on every status change except live items
+void 		ACAP_STATUS_Live(const char* group, const char* name);  // Counters and rates, NULL name for the whole group
 
 // Status setters
 void ACAP_STATUS_SetBool(const char* group, const char* name, int state);
@@ -159,6 +183,30 @@ void ACAP_STATUS_SetString(const char* group, const char* name, const char* stri
 void ACAP_STATUS_SetObject(const char* group, const char* name, cJSON* data);
 void ACAP_STATUS_SetNull(const char* group, const char* name);
 
+/*-----------------------------------------------------
+ * Timer wheel
+ * Millisecond deadlines driven by a GLib source on the default main
+ * context.  Timers are embedded in the caller's own structures; scheduling,
+ * rescheduling and cancelling are O(1) and never allocate.
+ *-----------------------------------------------------*/
+typedef struct ACAP_WHEEL_Timer ACAP_WHEEL_Timer;
+typedef void (*ACAP_WHEEL_Callback)(ACAP_WHEEL_Timer* timer, void* user_data);
+
+struct ACAP_WHEEL_Timer {
+    ACAP_WHEEL_Timer* next;
+    ACAP_WHEEL_Timer* prev;
+    guint64 expiry;                 // ACAP_WHEEL_Now() time in ms
+    ACAP_WHEEL_Callback callback;
+    void* user_data;
+    int slot;                       // -1 when not pending
+};
+
+void    ACAP_WHEEL_Timer_Init(ACAP_WHEEL_Timer* timer, ACAP_WHEEL_Callback callback, void* user_data);
+void    ACAP_WHEEL_Schedule(ACAP_WHEEL_Timer* timer, guint64 delay_ms);   // (Re)arm, replacing any pending deadline
+void    ACAP_WHEEL_Cancel(ACAP_WHEEL_Timer* timer);
+int     ACAP_WHEEL_Pending(const ACAP_WHEEL_Timer* timer);
+guint64 ACAP_WHEEL_Now(void);                                             // Monotonic ms
+
 /*-----------------------------------------------------
  * Timers
  *-----------------------------------------------------*/
@@ -169,7 +217,7 @@ typedef int (*ACAP_TIMER_Callback)(const char* name);
 int ACAP_TIMER_Set(const char* name, int repeat_rate_seconds, ACAP_TIMER_Callback callback);
 int ACAP_TIMER_Remove(const char* name);
 void ACAP_TIMER_Cleanup(void);
-void ACAP_TIMER_Process(void);
+void ACAP_TIMER_Process(void);  // Runs due timers.  Called by the main loop, no need to call it directly
 
 #ifdef __cplusplus
 }
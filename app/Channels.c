@@ -0,0 +1,256 @@
+/*
+ * Inference scheduling across several video channels with one model.
+ *
+ * The model is loaded once and every channel is inferred through the same
+ * larod connection, so adding a view area costs inference time but no
+ * extra model memory or load time.  ImageProcess asks Channels_Next which
+ * channel to run.  Stride scheduling keeps a "pass" per channel that
+ * advances by 1/weight each time the channel is served and always serves
+ * the lowest pass, so shares follow the weights with at most one frame of
+ * error and no channel starves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <glib.h>
+
+#include "ACAP.h"
+#include "Channels.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+typedef struct {
+	char name[32];
+	unsigned int vdoChannel;
+	double weight;
+	cJSON* settings;				//Per channel overrides, 0 for the primary channel
+	int running;
+	double pass;
+	gint64 lastServed;				//Monotonic ms
+	gint64 lastActive;
+	unsigned long long total;
+	unsigned int served;			//Since the last status update
+	gint64 waitSum;
+	gint64 waitMax;
+	unsigned int waitCount;
+} Channels_Channel;
+
+static Channels_Channel Channels_list[CHANNELS_MAX];
+static int Channels_count = 1;
+static char* Channels_config = 0;	//Applied settings, to detect changes
+static guint Channels_timer = 0;
+static gint64 Channels_statusTime = 0;
+
+static gint64
+Channels_Now() {
+	return g_get_monotonic_time() / 1000;
+}
+
+static int
+Channels_Active(const Channels_Channel* channel, gint64 now) {
+	return channel->lastActive && now - channel->lastActive < CHANNELS_ACTIVE_MS;
+}
+
+static gboolean
+Channels_Status(gpointer user_data) {
+	gint64 now = Channels_Now();
+	double seconds = Channels_statusTime ? (now - Channels_statusTime) / 1000.0 : 0;
+	Channels_statusTime = now;
+
+	unsigned int served = 0;
+	double sum = 0, squares = 0;
+	int running = 0;
+	for( int i = 0; i < Channels_count; i++ ) {
+		Channels_Channel* channel = &Channels_list[i];
+		served += channel->served;
+		if( !channel->running )
+			continue;
+		double normalized = channel->served / channel->weight;
+		sum += normalized;
+		squares += normalized * normalized;
+		running++;
+	}
+
+	cJSON* list = cJSON_CreateArray();
+	for( int i = 0; i < Channels_count; i++ ) {
+		Channels_Channel* channel = &Channels_list[i];
+		cJSON* item = cJSON_CreateObject();
+		cJSON_AddStringToObject(item, "name", i ? channel->name : "primary");
+		cJSON_AddNumberToObject(item, "channel", channel->vdoChannel);
+		cJSON_AddNumberToObject(item, "weight", channel->weight);
+		cJSON_AddBoolToObject(item, "running", channel->running);
+		cJSON_AddBoolToObject(item, "active", Channels_Active(channel, now));
+		cJSON_AddNumberToObject(item, "inferences", channel->total);
+		cJSON_AddNumberToObject(item, "rate", seconds > 0 ? (int)(channel->served * 10 / seconds) / 10.0 : 0);
+		cJSON_AddNumberToObject(item, "share", served ? (int)(channel->served * 1000 / served) / 10.0 : 0);
+		cJSON_AddNumberToObject(item, "waitMs", channel->waitCount ? channel->waitSum / channel->waitCount : 0);
+		cJSON_AddNumberToObject(item, "waitMaxMs", channel->waitMax);
+		cJSON_AddItemToArray(list, item);
+		channel->served = 0;
+		channel->waitSum = channel->waitMax = 0;
+		channel->waitCount = 0;
+	}
+	ACAP_STATUS_SetObject("channels", "list", list);
+	cJSON_Delete(list);
+	//Jain's index of inferences per unit of weight, 1 when every channel got exactly its share
+	ACAP_STATUS_SetNumber("channels", "fairness", squares > 0 ? (int)(sum * sum / (running * squares) * 1000) / 1000.0 : 1);
+	return G_SOURCE_CONTINUE;
+}
+
+int
+Channels_Count() {
+	return Channels_count;
+}
+
+const char*
+Channels_Name(int index) {
+	if( index <= 0 || index >= Channels_count )
+		return "";
+	return Channels_list[index].name;
+}
+
+cJSON*
+Channels_Setting(int index, const char* name) {
+	if( index > 0 && index < Channels_count && Channels_list[index].settings ) {
+		cJSON* item = cJSON_GetObjectItem(Channels_list[index].settings, name);
+		if( item )
+			return item;
+	}
+	cJSON* settings = ACAP_Get_Config("settings");
+	return settings ? cJSON_GetObjectItem(settings, name) : 0;
+}
+
+int
+Channels_Next() {
+	if( Channels_count == 1 )
+		return 0;
+	gint64 now = Channels_Now();
+	Channels_Channel* next = 0;
+	int index = 0;
+	for( int i = 0; i < Channels_count; i++ ) {
+		Channels_Channel* channel = &Channels_list[i];
+		if( channel->running && (!next || channel->pass < next->pass) ) {
+			next = channel;
+			index = i;
+		}
+	}
+	if( !next )
+		return 0;
+	next->pass += 1.0 / (next->weight * (Channels_Active(next, now) ? CHANNELS_ACTIVE_BOOST : 1.0));
+	return index;
+}
+
+void
+Channels_Done(int index, int detections) {
+	if( index < 0 || index >= Channels_count )
+		return;
+	Channels_Channel* channel = &Channels_list[index];
+	gint64 now = Channels_Now();
+	if( channel->lastServed ) {
+		gint64 wait = now - channel->lastServed;
+		channel->waitSum += wait;
+		channel->waitCount++;
+		if( wait > channel->waitMax )
+			channel->waitMax = wait;
+	}
+	channel->lastServed = now;
+	channel->served++;
+	channel->total++;
+	if( detections > 0 )
+		channel->lastActive = now;
+}
+
+static void
+Channels_Close() {
+	for( int i = 1; i < Channels_count; i++ ) {
+		Video_Stop_Channel(i);
+		cJSON_Delete(Channels_list[i].settings);
+		memset(&Channels_list[i], 0, sizeof(Channels_Channel));
+	}
+	Channels_count = 1;
+}
+
+int
+Channels_Init(cJSON* settings) {
+	char* config = settings ? cJSON_PrintUnformatted(settings) : 0;
+	if( config && Channels_config && strcmp(config, Channels_config) == 0 ) {
+		free(config);
+		return 0;
+	}
+	free(Channels_config);
+	Channels_config = config;
+
+	Channels_Close();
+	Channels_Channel* primary = &Channels_list[0];
+	snprintf(primary->name, sizeof(primary->name), "%s", "");
+	primary->vdoChannel = 1;
+	primary->weight = 1;
+	primary->running = 1;
+
+	cJSON* model = ACAP_Get_Config("model");
+	unsigned int width = model && cJSON_GetObjectItem(model,"videoWidth") ? cJSON_GetObjectItem(model,"videoWidth")->valueint : 800;
+	unsigned int height = model && cJSON_GetObjectItem(model,"videoHeight") ? cJSON_GetObjectItem(model,"videoHeight")->valueint : 600;
+
+	cJSON* entry = cJSON_IsArray(settings) ? settings->child : 0;
+	while( entry ) {
+		cJSON* item = cJSON_GetObjectItem(entry, "channel");
+		unsigned int vdoChannel = cJSON_IsNumber(item) && item->valueint > 0 ? item->valueint : 0;
+		int duplicate = vdoChannel == 1;
+		for( int i = 1; i < Channels_count; i++ )
+			if( Channels_list[i].vdoChannel == vdoChannel )
+				duplicate = 1;
+		if( !vdoChannel || duplicate ) {
+			LOG_WARN("%s: Invalid or duplicate channel %u\n",__func__, vdoChannel);
+		} else if( Channels_count >= CHANNELS_MAX ) {
+			LOG_WARN("%s: Channel %u ignored, max %d channels\n",__func__, vdoChannel, CHANNELS_MAX);
+		} else {
+			Channels_Channel* channel = &Channels_list[Channels_count];
+			item = cJSON_GetObjectItem(entry, "name");
+			if( cJSON_IsString(item) && item->valuestring[0] )
+				snprintf(channel->name, sizeof(channel->name), "%s", item->valuestring);
+			else
+				snprintf(channel->name, sizeof(channel->name), "Channel%u", vdoChannel);
+			for( char* c = channel->name; *c; c++ )
+				if( *c == ' ' )
+					*c = '_';		//Part of event ids
+			item = cJSON_GetObjectItem(entry, "weight");
+			channel->weight = cJSON_IsNumber(item) && item->valuedouble > 0 ? item->valuedouble : 1;
+			channel->vdoChannel = vdoChannel;
+			channel->settings = cJSON_Duplicate(entry, 1);
+			channel->pass = primary->pass;		//Start level with the others, no catching up
+			channel->running = Video_Start_Channel(Channels_count, vdoChannel, width, height);
+			if( channel->running ) {
+				LOG("Inference channel %s on video channel %u, weight %.1f\n", channel->name, vdoChannel, channel->weight);
+			} else {
+				LOG_WARN("%s: Unable to start video channel %u\n",__func__, vdoChannel);
+			}
+			Channels_count++;
+		}
+		entry = entry->next;
+	}
+
+	if( !Channels_timer ) {
+		ACAP_STATUS_Live("channels", "list");
+		ACAP_STATUS_Live("channels", "fairness");
+		Channels_timer = g_timeout_add_seconds(2, Channels_Status, NULL);
+	}
+	ACAP_STATUS_SetNumber("channels", "count", Channels_count);
+	Channels_Status(0);
+	return 1;
+}
+
+void
+Channels_Cleanup() {
+	Channels_Close();
+	if( Channels_timer ) {
+		g_source_remove(Channels_timer);
+		Channels_timer = 0;
+	}
+	free(Channels_config);
+	Channels_config = 0;
+}
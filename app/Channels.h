@@ -0,0 +1,35 @@
+/*
+ * Inference scheduling across several video channels with one model.
+ *
+ * settings.json "channels": [
+ *		{"name":"North","channel":2,"weight":1,"aoi":{...},"size":{...},"confidence":60,"ignore":[]}
+ * ]
+ * Index 0 is always the primary stream (VDO channel 1, weight 1) that
+ * drives zones, counting and the other per-frame consumers.  Each
+ * entry adds a stream on another sensor or view area.  All channels share
+ * the loaded model.  Channels are served by stride scheduling: a channel
+ * with weight 2 gets twice the inferences of one with weight 1, and a
+ * channel with recent detections counts double.  "aoi", "size",
+ * "confidence" and "ignore" override the top level settings per channel.
+ * Label and rule events of additional channels are named <name>_<label>
+ * and <name>_<event>.
+ */
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include "cJSON.h"
+#include "Video.h"
+
+#define CHANNELS_MAX			VIDEO_MAX_CHANNELS
+#define CHANNELS_ACTIVE_MS		5000	//A channel is active this long after a detection
+#define CHANNELS_ACTIVE_BOOST	2.0		//Weight multiplier for active channels
+
+int			Channels_Init(cJSON* settings);		//Returns 1 when the set of channels changed
+int			Channels_Count();
+const char*	Channels_Name(int index);			//Event prefix, "" for the primary channel
+cJSON*		Channels_Setting(int index, const char* name);
+int			Channels_Next();
+void		Channels_Done(int index, int detections);
+void		Channels_Cleanup();
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ * Pre-event clips.
+ *
+ * A capture thread pulls JPEG frames from a second image provider at a
+ * low rate and appends them to a ring.  Frames are allocated once and
+ * reference counted; extracting a clip or serving a frame over HTTP
+ * takes references instead of copying.  Every allocated frame is
+ * accounted against the byte budget, including frames only kept alive
+ * by an ongoing extraction.  When a new frame does not fit, the oldest
+ * frames are evicted and if it still does not fit it is dropped.
+ *
+ * A clip covers preSeconds before and postSeconds after the event and
+ * is written by the capture thread once the post period has passed, so
+ * no file I/O happens on the inference thread.  Clips are stored as
+ * concatenated JPEGs (Motion JPEG).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "ACAP.h"
+#include "Video.h"
+#include "Clip.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define CLIP_DIRECTORY	"localdata/clips"
+#define CLIP_DIRECTORY_LENGTH	(ACAP_MAX_PATH_LENGTH + sizeof(CLIP_DIRECTORY))
+
+typedef struct {
+	char id[32];
+	uint64_t trigger;
+} Clip_Pending;
+
+static pthread_t Clip_thread;
+static pthread_mutex_t Clip_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Clip_cond = PTHREAD_COND_INITIALIZER;
+static int Clip_running = 0;
+static int Clip_shutdown = 0;
+
+static Clip_Frame* Clip_oldest = 0;
+static Clip_Frame* Clip_newest = 0;
+static unsigned int Clip_frames = 0;
+static atomic_size_t Clip_allocated = 0;
+static atomic_uint Clip_dropped = 0;
+static atomic_uint Clip_written = 0;
+
+static Clip_Pending Clip_pending[CLIP_MAX_PENDING];
+static int Clip_pendingCount = 0;
+
+static cJSON* Clip_events = 0;
+static size_t Clip_budget = 8 * 1024 * 1024;
+static unsigned int Clip_width = 640;
+static unsigned int Clip_height = 360;
+static unsigned int Clip_interval = 500;	//ms between frames
+static uint64_t Clip_pre = 10000;
+static uint64_t Clip_post = 5000;
+static int Clip_maxClips = 10;
+static guint Clip_timer = 0;
+
+static uint64_t
+Clip_Now() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+void
+Clip_Release(Clip_Frame* frame) {
+	if( frame && atomic_fetch_sub(&frame->references, 1) == 1 ) {
+		atomic_fetch_sub(&Clip_allocated, sizeof(Clip_Frame) + frame->size);
+		free(frame);
+	}
+}
+
+//Remove the oldest frame from the ring.  Called with Clip_mutex held
+static void
+Clip_Evict() {
+	Clip_Frame* frame = Clip_oldest;
+	if( !frame )
+		return;
+	Clip_oldest = frame->next;
+	if( !Clip_oldest )
+		Clip_newest = 0;
+	Clip_frames--;
+	Clip_Release(frame);
+}
+
+static void
+Clip_Append(const void* data, size_t size, uint64_t timestamp) {
+	size_t need = sizeof(Clip_Frame) + size;
+
+	pthread_mutex_lock(&Clip_mutex);
+	while( Clip_oldest && Clip_oldest->timestamp + Clip_pre + Clip_post < timestamp )
+		Clip_Evict();
+	while( Clip_oldest && atomic_load(&Clip_allocated) + need > Clip_budget )
+		Clip_Evict();
+	if( atomic_load(&Clip_allocated) + need > Clip_budget ) {
+		pthread_mutex_unlock(&Clip_mutex);
+		atomic_fetch_add(&Clip_dropped, 1);
+		return;
+	}
+	Clip_Frame* frame = malloc(need);
+	if( !frame ) {
+		pthread_mutex_unlock(&Clip_mutex);
+		atomic_fetch_add(&Clip_dropped, 1);
+		return;
+	}
+	atomic_fetch_add(&Clip_allocated, need);
+	atomic_init(&frame->references, 1);
+	frame->next = 0;
+	frame->timestamp = timestamp;
+	frame->size = size;
+	memcpy(frame->data, data, size);
+	if( Clip_newest )
+		Clip_newest->next = frame;
+	else
+		Clip_oldest = frame;
+	Clip_newest = frame;
+	Clip_frames++;
+	pthread_mutex_unlock(&Clip_mutex);
+}
+
+static int
+Clip_Filter(const struct dirent* entry) {
+	return strstr(entry->d_name, ".mjpg") != NULL;
+}
+
+//Keep at most Clip_maxClips files.  Names start with the timestamp so they sort by age
+static void
+Clip_Rotate(const char* directory) {
+	struct dirent** entries = 0;
+	int count = scandir(directory, &entries, Clip_Filter, alphasort);
+	if( count < 0 )
+		return;
+	for( int i = 0; i < count; i++ ) {
+		if( i < count - Clip_maxClips ) {
+			char path[CLIP_DIRECTORY_LENGTH + 1 + NAME_MAX + 1];
+			snprintf(path, sizeof(path), "%s/%s", directory, entries[i]->d_name);
+			unlink(path);
+		}
+		free(entries[i]);
+	}
+	free(entries);
+}
+
+static void
+Clip_Extract(const Clip_Pending* pending) {
+	Clip_Frame* frames[1024];
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&Clip_mutex);
+	uint64_t from = pending->trigger > Clip_pre ? pending->trigger - Clip_pre : 0;
+	uint64_t to = pending->trigger + Clip_post;
+	for( Clip_Frame* frame = Clip_oldest; frame && count < 1024; frame = frame->next ) {
+		if( frame->timestamp < from || frame->timestamp > to )
+			continue;
+		atomic_fetch_add(&frame->references, 1);
+		frames[count++] = frame;
+	}
+	pthread_mutex_unlock(&Clip_mutex);
+
+	if( count == 0 )
+		return;
+
+	char directory[CLIP_DIRECTORY_LENGTH];
+	snprintf(directory, sizeof(directory), "%s%s", ACAP_FILE_AppPath(), CLIP_DIRECTORY);
+	mkdir(directory, 0755);
+
+	char filename[128];
+	snprintf(filename, sizeof(filename), "%s/%llu_%s.mjpg", CLIP_DIRECTORY, (unsigned long long)pending->trigger, pending->id);
+	FILE* file = ACAP_FILE_Open(filename, "wb");
+	int failed = !file;
+	for( unsigned int i = 0; i < count; i++ ) {
+		if( !failed && fwrite(frames[i]->data, 1, frames[i]->size, file) != frames[i]->size )
+			failed = 1;
+		Clip_Release(frames[i]);
+	}
+	if( file && fclose(file) != 0 )
+		failed = 1;
+	if( failed ) {
+		LOG_WARN("%s: Unable to write %s\n",__func__, filename);
+		return;
+	}
+	atomic_fetch_add(&Clip_written, 1);
+	Clip_Rotate(directory);
+	LOG_TRACE("%s: %s %u frames\n",__func__, filename, count);
+}
+
+static void*
+Clip_Capture_Thread(void* data) {
+	pthread_mutex_lock(&Clip_mutex);
+	while( !Clip_shutdown ) {
+		pthread_mutex_unlock(&Clip_mutex);
+
+		VdoBuffer* buffer = Video_Capture_RGB();
+		uint64_t now = Clip_Now();
+		if( buffer ) {
+			VdoFrame* vdoFrame = vdo_buffer_get_frame(buffer);
+			size_t size = vdoFrame ? vdo_frame_get_size(vdoFrame) : 0;
+			void* jpeg = vdo_buffer_get_data(buffer);
+			//Same clock as the detection frames, so Clip_Nearest pairs a snapshot with its image
+			uint64_t captured = Video_Capture_Time(buffer);
+			if( jpeg && size )
+				Clip_Append(jpeg, size, captured ? captured : now);
+		}
+
+		pthread_mutex_lock(&Clip_mutex);
+		int i = 0;
+		while( i < Clip_pendingCount ) {
+			if( Clip_pending[i].trigger + Clip_post > now ) {
+				i++;
+				continue;
+			}
+			Clip_Pending pending = Clip_pending[i];
+			Clip_pending[i] = Clip_pending[--Clip_pendingCount];
+			pthread_mutex_unlock(&Clip_mutex);
+			Clip_Extract(&pending);
+			pthread_mutex_lock(&Clip_mutex);
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long)(Clip_interval % 1000) * 1000000L;
+		deadline.tv_sec += Clip_interval / 1000 + deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		if( !Clip_shutdown )
+			pthread_cond_timedwait(&Clip_cond, &Clip_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&Clip_mutex);
+	return NULL;
+}
+
+static gboolean
+Clip_Status(gpointer user_data) {
+	pthread_mutex_lock(&Clip_mutex);
+	unsigned int frames = Clip_frames;
+	uint64_t depth = Clip_oldest ? Clip_newest->timestamp - Clip_oldest->timestamp : 0;
+	pthread_mutex_unlock(&Clip_mutex);
+	ACAP_STATUS_SetNumber("clips","frames",frames);
+	ACAP_STATUS_SetNumber("clips","depth",(double)depth);
+	ACAP_STATUS_SetNumber("clips","bytes",atomic_load(&Clip_allocated));
+	ACAP_STATUS_SetNumber("clips","budget",Clip_budget);
+	ACAP_STATUS_SetNumber("clips","dropped",atomic_load(&Clip_dropped));
+	ACAP_STATUS_SetNumber("clips","written",atomic_load(&Clip_written));
+	return G_SOURCE_CONTINUE;
+}
+
+void
+Clip_Event(const char* id, int state) {
+	if( !id || !state || !Clip_running || !Clip_events )
+		return;
+	cJSON* event = Clip_events->child;
+	while( event && !(cJSON_IsString(event) && strcmp(event->valuestring, id) == 0) )
+		event = event->next;
+	if( !event )
+		return;
+
+	pthread_mutex_lock(&Clip_mutex);
+	if( Clip_pendingCount < CLIP_MAX_PENDING ) {
+		snprintf(Clip_pending[Clip_pendingCount].id, sizeof(Clip_pending[0].id), "%s", id);
+		Clip_pending[Clip_pendingCount].trigger = Clip_Now();
+		Clip_pendingCount++;
+	} else {
+		LOG_WARN("%s: Too many pending clips, %s ignored\n",__func__, id);
+	}
+	pthread_mutex_unlock(&Clip_mutex);
+}
+
+Clip_Frame*
+Clip_Nearest(uint64_t timestamp, uint64_t maxDistance) {
+	Clip_Frame* nearest = 0;
+	uint64_t best = maxDistance;
+	pthread_mutex_lock(&Clip_mutex);
+	for( Clip_Frame* frame = Clip_oldest; frame; frame = frame->next ) {
+		uint64_t distance = frame->timestamp > timestamp ? frame->timestamp - timestamp : timestamp - frame->timestamp;
+		if( distance <= best ) {
+			nearest = frame;
+			best = distance;
+		}
+	}
+	if( nearest )
+		atomic_fetch_add(&nearest->references, 1);
+	pthread_mutex_unlock(&Clip_mutex);
+	return nearest;
+}
+
+static int
+Clip_Valid_Name(const char* name) {
+	if( !name || !name[0] || strchr(name, '/') || strstr(name, "..") )
+		return 0;
+	return strstr(name, ".mjpg") != NULL;
+}
+
+static void
+Clip_HTTP(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	const char* name = ACAP_HTTP_Request_Param(request, "name");
+	const char* frame = ACAP_HTTP_Request_Param(request, "frame");
+
+	if( frame ) {
+		free((void*)frame);
+		//Latest frame in the ring
+		pthread_mutex_lock(&Clip_mutex);
+		Clip_Frame* latest = Clip_newest;
+		if( latest )
+			atomic_fetch_add(&latest->references, 1);
+		pthread_mutex_unlock(&Clip_mutex);
+		if( name )
+			free((void*)name);
+		if( !latest ) {
+			ACAP_HTTP_Respond_Error(response, 404, "No frames");
+			return;
+		}
+		ACAP_HTTP_Respond_String(response, "Content-Type: image/jpeg\r\nContent-Length: %zu\r\nCache-Control: no-cache\r\n\r\n", latest->size);
+		ACAP_HTTP_Respond_Data(response, latest->size, latest->data);
+		Clip_Release(latest);
+		return;
+	}
+
+	if( name ) {
+		if( !Clip_Valid_Name(name) ) {
+			free((void*)name);
+			ACAP_HTTP_Respond_Error(response, 400, "Invalid clip name");
+			return;
+		}
+		char filename[128];
+		snprintf(filename, sizeof(filename), "%s/%s", CLIP_DIRECTORY, name);
+		free((void*)name);
+		FILE* file = ACAP_FILE_Open(filename, "rb");
+		if( !file ) {
+			ACAP_HTTP_Respond_Error(response, 404, "Clip not found");
+			return;
+		}
+		ACAP_HTTP_Respond_String(response, "Content-Type: video/x-motion-jpeg\r\n\r\n");
+		char chunk[ACAP_MAX_BUFFER_SIZE];
+		size_t length;
+		while( (length = fread(chunk, 1, sizeof(chunk), file)) > 0 )
+			if( !ACAP_HTTP_Respond_Data(response, length, chunk) )
+				break;
+		fclose(file);
+		return;
+	}
+
+	char directory[CLIP_DIRECTORY_LENGTH];
+	snprintf(directory, sizeof(directory), "%s%s", ACAP_FILE_AppPath(), CLIP_DIRECTORY);
+	cJSON* list = cJSON_CreateArray();
+	struct dirent** entries = 0;
+	int count = scandir(directory, &entries, Clip_Filter, alphasort);
+	for( int i = count - 1; i >= 0; i-- ) {
+		cJSON_AddItemToArray(list, cJSON_CreateString(entries[i]->d_name));
+		free(entries[i]);
+	}
+	if( count >= 0 )
+		free(entries);
+	ACAP_HTTP_Respond_JSON(response, list);
+	cJSON_Delete(list);
+}
+
+static void
+Clip_Stop() {
+	if( !Clip_running )
+		return;
+	pthread_mutex_lock(&Clip_mutex);
+	Clip_shutdown = 1;
+	pthread_cond_signal(&Clip_cond);
+	pthread_mutex_unlock(&Clip_mutex);
+	pthread_join(Clip_thread, NULL);
+	Video_Stop_RGB();
+
+	pthread_mutex_lock(&Clip_mutex);
+	while( Clip_oldest )
+		Clip_Evict();
+	Clip_pendingCount = 0;
+	Clip_running = 0;
+	pthread_mutex_unlock(&Clip_mutex);
+	if( Clip_timer ) {
+		g_source_remove(Clip_timer);
+		Clip_timer = 0;
+	}
+	ACAP_STATUS_SetBool("clips","active",0);
+}
+
+int
+Clip_Init(cJSON* settings) {
+	static int registered = 0;
+	if( !registered ) {
+		ACAP_HTTP_Node("clip", Clip_HTTP);
+		ACAP_STATUS_Live("clips", "frames");
+		ACAP_STATUS_Live("clips", "depth");
+		ACAP_STATUS_Live("clips", "bytes");
+		ACAP_STATUS_Live("clips", "dropped");
+		ACAP_STATUS_Live("clips", "written");
+		registered = 1;
+	}
+
+	int enabled = settings && cJSON_IsTrue(cJSON_GetObjectItem(settings,"enabled"));
+	if( !enabled ) {
+		Clip_Stop();
+		if( Clip_events ) {
+			cJSON_Delete(Clip_events);
+			Clip_events = 0;
+		}
+		return 1;
+	}
+
+	unsigned int width = Clip_width, height = Clip_height, interval = Clip_interval;
+	uint64_t pre = Clip_pre, post = Clip_post;
+	size_t budget = Clip_budget;
+	cJSON* item;
+	if( (item = cJSON_GetObjectItem(settings,"width")) && item->valueint > 0 )
+		width = item->valueint;
+	if( (item = cJSON_GetObjectItem(settings,"height")) && item->valueint > 0 )
+		height = item->valueint;
+	if( (item = cJSON_GetObjectItem(settings,"fps")) && item->valuedouble > 0 )
+		interval = 1000.0 / item->valuedouble;
+	if( interval < 100 )
+		interval = 100;
+	if( (item = cJSON_GetObjectItem(settings,"preSeconds")) && item->valuedouble >= 0 )
+		pre = item->valuedouble * 1000;
+	if( (item = cJSON_GetObjectItem(settings,"postSeconds")) && item->valuedouble >= 0 )
+		post = item->valuedouble * 1000;
+	if( (item = cJSON_GetObjectItem(settings,"budgetKB")) && item->valuedouble > 0 )
+		budget = item->valuedouble * 1024;
+	if( budget < CLIP_MIN_BUDGET )
+		budget = CLIP_MIN_BUDGET;
+	if( budget > CLIP_MAX_BUDGET )
+		budget = CLIP_MAX_BUDGET;
+	if( (item = cJSON_GetObjectItem(settings,"maxClips")) && item->valueint > 0 )
+		Clip_maxClips = item->valueint;
+	if( Clip_events )
+		cJSON_Delete(Clip_events);
+	item = cJSON_GetObjectItem(settings,"events");
+	Clip_events = cJSON_IsArray(item) ? cJSON_Duplicate(item, 1) : cJSON_CreateArray();
+
+	//Only a new stream geometry or rate restarts capture, anything else keeps the pre-event ring
+	if( Clip_running && width == Clip_width && height == Clip_height && interval == Clip_interval ) {
+		pthread_mutex_lock(&Clip_mutex);
+		Clip_pre = pre;
+		Clip_post = post;
+		Clip_budget = budget;
+		pthread_mutex_unlock(&Clip_mutex);
+		return 1;
+	}
+	Clip_Stop();
+	Clip_width = width;
+	Clip_height = height;
+	Clip_interval = interval;
+	Clip_pre = pre;
+	Clip_post = post;
+	Clip_budget = budget;
+
+	//Encode no more frames than the ring takes
+	if( !Video_Start_RGB(Clip_width, Clip_height, 1000.0 / Clip_interval) ) {
+		LOG_WARN("%s: Clip stream failed\n",__func__);
+		return 0;
+	}
+	Clip_shutdown = 0;
+	if( pthread_create(&Clip_thread, NULL, Clip_Capture_Thread, NULL) != 0 ) {
+		LOG_WARN("%s: Unable to start capture thread: %s\n",__func__, strerror(errno));
+		Video_Stop_RGB();
+		return 0;
+	}
+	Clip_running = 1;
+	Clip_timer = g_timeout_add_seconds(2, Clip_Status, NULL);
+	ACAP_STATUS_SetBool("clips","active",1);
+	LOG("Pre-event clips %ux%u, %u ms interval, %zu KB budget\n", Clip_width, Clip_height, Clip_interval, Clip_budget / 1024);
+	return 1;
+}
+
+void
+Clip_Cleanup() {
+	Clip_Stop();
+	if( Clip_events ) {
+		cJSON_Delete(Clip_events);
+		Clip_events = 0;
+	}
+}
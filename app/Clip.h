@@ -0,0 +1,34 @@
+/*
+ * Pre-event clips.
+ * A low resolution JPEG stream is kept in a memory bounded ring.  When
+ * one of the configured events goes high the frames around it are
+ * written to localdata/clips/ and can be fetched from /local/detectx/clip.
+ */
+#ifndef CLIP_H
+#define CLIP_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cJSON.h"
+
+#define CLIP_MAX_PENDING		4
+#define CLIP_MIN_BUDGET			(256 * 1024)
+#define CLIP_MAX_BUDGET			(32 * 1024 * 1024)
+
+typedef struct Clip_Frame {
+	atomic_int references;
+	struct Clip_Frame* next;
+	uint64_t timestamp;		//EPOCH ms
+	size_t size;
+	unsigned char data[];	//JPEG
+} Clip_Frame;
+
+int		Clip_Init(cJSON* settings);
+void	Clip_Event(const char* id, int state);
+//Ring frame closest to timestamp, at most maxDistance ms away.  The caller owns a reference
+Clip_Frame* Clip_Nearest(uint64_t timestamp, uint64_t maxDistance);
+void	Clip_Release(Clip_Frame* frame);
+void	Clip_Cleanup();
+
+#endif
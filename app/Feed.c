@@ -0,0 +1,205 @@
+/*
+ * Binary detection feed over a local Unix socket.
+ *
+ * Subscribers connect to a SOCK_SEQPACKET socket and receive one
+ * message per processed frame.  The message is encoded once per frame
+ * and written to each subscriber with a single non-blocking send.  A
+ * subscriber that is not keeping up loses that frame and its drop
+ * counter is incremented; it is never allowed to stall inference.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "ACAP.h"
+#include "Feed.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+typedef struct {
+	int fd;
+	unsigned int sent;
+	unsigned int dropped;
+} Feed_Subscriber;
+
+static int Feed_fd = -1;
+static guint Feed_source = 0;
+static guint Feed_timer = 0;
+static char Feed_path[sizeof(((struct sockaddr_un*)0)->sun_path)] = "";
+static Feed_Subscriber Feed_subscribers[FEED_MAX_SUBSCRIBERS];
+static int Feed_count = 0;
+static Feed_Record_t Feed_buffer[FRAME_MAX_DETECTIONS];
+
+static void
+Feed_Remove(int index) {
+	close(Feed_subscribers[index].fd);
+	Feed_count--;
+	Feed_subscribers[index] = Feed_subscribers[Feed_count];
+	LOG_TRACE("%s: Subscriber removed\n",__func__);
+}
+
+static gboolean
+Feed_Accept(gint fd, GIOCondition condition, gpointer user_data) {
+	int client;
+	while( (client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 ) {
+		if( Feed_count >= FEED_MAX_SUBSCRIBERS ) {
+			LOG_WARN("%s: Too many subscribers\n",__func__);
+			close(client);
+			continue;
+		}
+		Feed_subscribers[Feed_count].fd = client;
+		Feed_subscribers[Feed_count].sent = 0;
+		Feed_subscribers[Feed_count].dropped = 0;
+		Feed_count++;
+		LOG_TRACE("%s: Subscriber added\n",__func__);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+Feed_Status(gpointer user_data) {
+	cJSON* subscribers = cJSON_CreateArray();
+	for( int i = 0; i < Feed_count; i++ ) {
+		cJSON* subscriber = cJSON_CreateObject();
+		cJSON_AddNumberToObject(subscriber,"sent",Feed_subscribers[i].sent);
+		cJSON_AddNumberToObject(subscriber,"dropped",Feed_subscribers[i].dropped);
+		cJSON_AddItemToArray(subscribers, subscriber);
+	}
+	ACAP_STATUS_SetObject("feed","subscribers",subscribers);
+	cJSON_Delete(subscribers);
+	return G_SOURCE_CONTINUE;
+}
+
+void
+Feed_Publish(const Frame_t* frame) {
+	if( Feed_count == 0 || !frame )
+		return;
+
+	unsigned int count = frame->count;
+	if( count > FRAME_MAX_DETECTIONS )
+		count = FRAME_MAX_DETECTIONS;
+	unsigned int records = count ? count : 1;
+
+	for( unsigned int i = 0; i < records; i++ ) {
+		Feed_Record_t* record = &Feed_buffer[i];
+		record->sequence = htole32(frame->sequence);
+		record->index = htole16((uint16_t)i);
+		record->count = htole16((uint16_t)count);
+		record->timestamp = htole64(frame->timestamp);
+		if( count ) {
+			const Detection_t* detection = &frame->detections[i];
+			record->label = htole16(detection->label);
+			record->confidence = htole16(detection->confidence);
+			record->x = htole16(detection->x);
+			record->y = htole16(detection->y);
+			record->w = htole16(detection->w);
+			record->h = htole16(detection->h);
+			record->zones = htole32(detection->zones);
+		} else {
+			record->label = record->confidence = 0;
+			record->x = record->y = record->w = record->h = 0;
+			record->zones = 0;
+		}
+	}
+
+	size_t length = records * sizeof(Feed_Record_t);
+	int i = 0;
+	while( i < Feed_count ) {
+		ssize_t sent = send(Feed_subscribers[i].fd, Feed_buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if( sent == (ssize_t)length ) {
+			Feed_subscribers[i].sent++;
+		} else if( sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) ) {
+			Feed_subscribers[i].dropped++;
+		} else {
+			Feed_Remove(i);
+			continue;
+		}
+		i++;
+	}
+}
+
+static void
+Feed_Close() {
+	if( Feed_source ) {
+		g_source_remove(Feed_source);
+		Feed_source = 0;
+	}
+	if( Feed_timer ) {
+		g_source_remove(Feed_timer);
+		Feed_timer = 0;
+	}
+	while( Feed_count )
+		Feed_Remove(Feed_count - 1);
+	if( Feed_fd >= 0 ) {
+		close(Feed_fd);
+		unlink(Feed_path);
+		Feed_fd = -1;
+	}
+	ACAP_STATUS_SetBool("feed","active",0);
+}
+
+int
+Feed_Init(cJSON* settings) {
+	int enabled = settings && cJSON_IsTrue(cJSON_GetObjectItem(settings,"enabled"));
+	const char* path = cJSON_GetObjectItem(settings,"path") && cJSON_IsString(cJSON_GetObjectItem(settings,"path")) ?
+		cJSON_GetObjectItem(settings,"path")->valuestring : FEED_DEFAULT_PATH;
+
+	if( Feed_fd >= 0 && (!enabled || strcmp(path, Feed_path) != 0) )
+		Feed_Close();
+	if( !enabled || Feed_fd >= 0 )
+		return 1;
+
+	if( strlen(path) >= sizeof(Feed_path) ) {
+		LOG_WARN("%s: Socket path too long\n",__func__);
+		return 0;
+	}
+	snprintf(Feed_path, sizeof(Feed_path), "%s", path);
+
+	Feed_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if( Feed_fd < 0 ) {
+		LOG_WARN("%s: Unable to create socket: %s\n",__func__, strerror(errno));
+		return 0;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", Feed_path);
+	unlink(Feed_path);
+	if( bind(Feed_fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(Feed_fd, FEED_MAX_SUBSCRIBERS) < 0 ) {
+		LOG_WARN("%s: Unable to listen on %s: %s\n",__func__, Feed_path, strerror(errno));
+		close(Feed_fd);
+		Feed_fd = -1;
+		return 0;
+	}
+	chmod(Feed_path, 0666);
+
+	Feed_source = g_unix_fd_add(Feed_fd, G_IO_IN, Feed_Accept, NULL);
+	Feed_timer = g_timeout_add_seconds(2, Feed_Status, NULL);
+	ACAP_STATUS_Live("feed","subscribers");
+	ACAP_STATUS_SetBool("feed","active",1);
+	ACAP_STATUS_SetString("feed","path",Feed_path);
+	ACAP_STATUS_SetNumber("feed","recordSize",sizeof(Feed_Record_t));
+	LOG("Detection feed listening on %s\n", Feed_path);
+	return 1;
+}
+
+void
+Feed_Cleanup() {
+	Feed_Close();
+}
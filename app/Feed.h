@@ -0,0 +1,38 @@
+/*
+ * Binary detection feed for co-located consumers over a local
+ * SOCK_SEQPACKET Unix socket.  Every processed frame is sent as one
+ * message of fixed-size little-endian Feed_Record_t entries.
+ */
+#ifndef FEED_H
+#define FEED_H
+
+#include <stdint.h>
+#include "cJSON.h"
+#include "Frame.h"
+
+#define FEED_MAX_SUBSCRIBERS	8
+#define FEED_DEFAULT_PATH		"/tmp/detectx.feed"
+
+/*
+ * Wire format, 32 bytes, little-endian.
+ * A frame without detections is sent as a single record with count 0.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t sequence;		//Frame sequence number
+	uint16_t index;			//Detection index within the frame
+	uint16_t count;			//Detections in the frame
+	uint64_t timestamp;		//VDO capture time of the image, EPOCH ms
+	uint16_t label;			//Class index in the model label list
+	uint16_t confidence;	//0-100
+	uint16_t x;				//Box in 0-1000 units
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+	uint32_t zones;			//Zone bitmask
+} Feed_Record_t;
+
+int		Feed_Init(cJSON* settings);
+void	Feed_Publish(const Frame_t* frame);
+void	Feed_Cleanup();
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Compact per-frame detection record.
+ * ImageProcess fills one Frame_t per processed image alongside the JSON
+ * detection list so binary consumers do not need to walk cJSON.
+ * Coordinates use the same 0-1000 space as the JSON detections.
+ */
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+#define FRAME_MAX_DETECTIONS 128
+
+typedef struct {
+	uint16_t label;			//Class index in the model label list
+	uint16_t confidence;	//0-100
+	uint16_t x;				//Top left corner [0-1000]
+	uint16_t y;
+	uint16_t w;				//Size [0-1000]
+	uint16_t h;
+	uint32_t zones;			//Bit n set when the detection is in zone n
+} Detection_t;
+
+typedef struct {
+	uint32_t sequence;		//Increments for every processed image
+	uint64_t timestamp;		//EPOCH ms the image was captured, decision time when VDO has no timestamp
+	uint32_t count;
+	Detection_t detections[FRAME_MAX_DETECTIONS];
+} Frame_t;
+
+#endif
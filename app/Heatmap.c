@@ -0,0 +1,401 @@
+/*
+ * Heatmaps of detection centres.
+ *
+ * One 64x48 grid of uint32 counters per label and one per violation
+ * event.  A detection increments the cell of its centre in its label
+ * layer.  While a violation event is high, detections of presenceLabel
+ * are also added to that event's layer, showing where people walk
+ * without a helmet.  Updates are O(1) with no allocation.
+ *
+ * Old activity fades by exponential decay with halfLifeHours.  Decay is
+ * applied in whole hours of wall-clock time since the last decay, which
+ * is kept in the file header, so restarts and downtime are accounted
+ * for.  The grids are saved to localdata/heatmap.bin every
+ * HEATMAP_SAVE_SECONDS and loaded at startup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <syslog.h>
+#include <math.h>
+#include <endian.h>
+#include <zlib.h>
+
+#include "ACAP.h"
+#include "Heatmap.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define HEATMAP_FILE		"localdata/heatmap.bin"
+#define HEATMAP_MAGIC		0x4D485844	//"DXHM"
+#define HEATMAP_VERSION		2
+#define HEATMAP_SAVE_SECONDS	900
+#define HEATMAP_HOUR		3600000ULL
+#define HEATMAP_CELLS		(HEATMAP_WIDTH * HEATMAP_HEIGHT)
+#define HEATMAP_LAYERS		(HEATMAP_LABELS + HEATMAP_EVENTS)
+#define HEATMAP_MAX_SCALE	16
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t layers;
+	char eventIds[HEATMAP_EVENTS][32];
+	uint64_t decayed;		//EPOCH ms the grids were last decayed, not part of the identity
+} Heatmap_Header;
+
+static uint32_t Heatmap_grid[HEATMAP_LAYERS][HEATMAP_CELLS];
+static Heatmap_Header Heatmap_header;
+static int Heatmap_eventState[HEATMAP_EVENTS];
+static int Heatmap_presence = -1;
+static char Heatmap_presenceLabel[32] = "Person";
+static double Heatmap_halfLife = 168;
+static int Heatmap_running = 0;
+static guint Heatmap_timer = 0;
+static char* Heatmap_config = 0;
+
+void
+Heatmap_Frame(const Frame_t* frame) {
+	if( !Heatmap_running || !frame )
+		return;
+	int violation = 0;
+	for( unsigned int e = 0; e < HEATMAP_EVENTS; e++ )
+		violation |= Heatmap_eventState[e];
+
+	for( uint32_t i = 0; i < frame->count && i < FRAME_MAX_DETECTIONS; i++ ) {
+		const Detection_t* detection = &frame->detections[i];
+		unsigned int cx = detection->x + detection->w / 2;
+		unsigned int cy = detection->y + detection->h / 2;
+		unsigned int column = cx * HEATMAP_WIDTH / 1000;
+		unsigned int row = cy * HEATMAP_HEIGHT / 1000;
+		if( column >= HEATMAP_WIDTH ) column = HEATMAP_WIDTH - 1;
+		if( row >= HEATMAP_HEIGHT ) row = HEATMAP_HEIGHT - 1;
+		unsigned int cell = row * HEATMAP_WIDTH + column;
+
+		if( detection->label < HEATMAP_LABELS && Heatmap_grid[detection->label][cell] < UINT32_MAX )
+			Heatmap_grid[detection->label][cell]++;
+		if( violation && detection->label == Heatmap_presence ) {
+			for( unsigned int e = 0; e < HEATMAP_EVENTS; e++ )
+				if( Heatmap_eventState[e] && Heatmap_grid[HEATMAP_LABELS + e][cell] < UINT32_MAX )
+					Heatmap_grid[HEATMAP_LABELS + e][cell]++;
+		}
+	}
+}
+
+void
+Heatmap_Event(const char* id, int state) {
+	if( !Heatmap_running || !id )
+		return;
+	for( unsigned int e = 0; e < HEATMAP_EVENTS; e++ )
+		if( Heatmap_header.eventIds[e][0] && strncmp(Heatmap_header.eventIds[e], id, sizeof(Heatmap_header.eventIds[e])) == 0 )
+			Heatmap_eventState[e] = state;
+}
+
+/*
+ * Decay and persistence
+ */
+
+static void
+Heatmap_Save() {
+	FILE* file = ACAP_FILE_Open(HEATMAP_FILE, "wb");
+	if( !file ) {
+		LOG_WARN("%s: Unable to open %s\n",__func__, HEATMAP_FILE);
+		return;
+	}
+	if( fwrite(&Heatmap_header, sizeof(Heatmap_header), 1, file) != 1 ||
+		fwrite(Heatmap_grid, sizeof(Heatmap_grid), 1, file) != 1 )
+		LOG_WARN("%s: Write failed\n",__func__);
+	fclose(file);
+}
+
+static void
+Heatmap_Load() {
+	FILE* file = ACAP_FILE_Open(HEATMAP_FILE, "rb");
+	if( !file )
+		return;
+	Heatmap_Header stored;
+	if( fread(&stored, sizeof(stored), 1, file) == 1 &&
+		memcmp(&stored, &Heatmap_header, offsetof(Heatmap_Header, decayed)) == 0 ) {
+		if( fread(Heatmap_grid, sizeof(Heatmap_grid), 1, file) == 1 )
+			Heatmap_header.decayed = stored.decayed;
+		else
+			memset(Heatmap_grid, 0, sizeof(Heatmap_grid));
+	}
+	fclose(file);
+}
+
+//Whole hours only; decaying small counts in short steps would truncate them to zero
+static void
+Heatmap_Decay() {
+	uint64_t now = (uint64_t)ACAP_DEVICE_Timestamp();
+	if( !Heatmap_header.decayed || now < Heatmap_header.decayed ) {
+		Heatmap_header.decayed = now;
+		return;
+	}
+	uint64_t hours = (now - Heatmap_header.decayed) / HEATMAP_HOUR;
+	if( hours == 0 )
+		return;
+	Heatmap_header.decayed += hours * HEATMAP_HOUR;
+	if( Heatmap_halfLife <= 0 )
+		return;
+	//Fixed point 16.16 factor for the elapsed hours
+	uint64_t factor = (uint64_t)(pow(0.5, hours / Heatmap_halfLife) * 65536.0);
+	for( unsigned int layer = 0; layer < HEATMAP_LAYERS; layer++ )
+		for( unsigned int cell = 0; cell < HEATMAP_CELLS; cell++ )
+			Heatmap_grid[layer][cell] = (uint32_t)((Heatmap_grid[layer][cell] * factor) >> 16);
+}
+
+static gboolean
+Heatmap_Periodic(gpointer user_data) {
+	Heatmap_Decay();
+	Heatmap_Save();
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Export
+ */
+
+static void
+Heatmap_PNG_Chunk(ACAP_HTTP_Response response, const char* type, const uint8_t* data, uint32_t length) {
+	uint8_t header[8];
+	uint32_t size = htobe32(length);
+	memcpy(header, &size, 4);
+	memcpy(header + 4, type, 4);
+	uLong crc = crc32(0L, header + 4, 4);
+	if( length )
+		crc = crc32(crc, data, length);
+	uint32_t trailer = htobe32((uint32_t)crc);
+	ACAP_HTTP_Respond_Data(response, 8, header);
+	if( length )
+		ACAP_HTTP_Respond_Data(response, length, data);
+	ACAP_HTTP_Respond_Data(response, 4, &trailer);
+}
+
+//Palette PNG, black through red and yellow to white, normalized to the hottest cell
+static void
+Heatmap_PNG(ACAP_HTTP_Response response, const uint32_t* grid, unsigned int scale) {
+	unsigned int width = HEATMAP_WIDTH * scale;
+	unsigned int height = HEATMAP_HEIGHT * scale;
+	size_t rawSize = (size_t)(width + 1) * height;
+	uint8_t* raw = malloc(rawSize);
+	uLongf packedSize = compressBound(rawSize);
+	uint8_t* packed = malloc(packedSize);
+	if( !raw || !packed ) {
+		free(raw);
+		free(packed);
+		ACAP_HTTP_Respond_Error(response, 500, "Memory allocation error");
+		return;
+	}
+
+	uint32_t max = 1;
+	for( unsigned int cell = 0; cell < HEATMAP_CELLS; cell++ )
+		if( grid[cell] > max )
+			max = grid[cell];
+	for( unsigned int y = 0; y < height; y++ ) {
+		uint8_t* line = raw + (size_t)y * (width + 1);
+		line[0] = 0;	//No filter
+		for( unsigned int x = 0; x < width; x++ ) {
+			uint32_t value = grid[(y / scale) * HEATMAP_WIDTH + x / scale];
+			//Square root keeps sparse paths visible next to hot spots
+			line[1 + x] = (uint8_t)(sqrt((double)value / max) * 255.0);
+		}
+	}
+	if( compress2(packed, &packedSize, raw, rawSize, Z_BEST_SPEED) != Z_OK ) {
+		free(raw);
+		free(packed);
+		ACAP_HTTP_Respond_Error(response, 500, "Compression failed");
+		return;
+	}
+
+	uint8_t palette[256 * 3];
+	for( int i = 0; i < 256; i++ ) {
+		palette[i * 3] = i < 85 ? i * 3 : 255;
+		palette[i * 3 + 1] = i < 85 ? 0 : i < 170 ? (i - 85) * 3 : 255;
+		palette[i * 3 + 2] = i < 170 ? 0 : (i - 170) * 3;
+	}
+	uint8_t ihdr[13];
+	uint32_t value = htobe32(width);
+	memcpy(ihdr, &value, 4);
+	value = htobe32(height);
+	memcpy(ihdr + 4, &value, 4);
+	ihdr[8] = 8;	//Bit depth
+	ihdr[9] = 3;	//Palette
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+	static const uint8_t signature[8] = {0x89,'P','N','G','\r','\n',0x1A,'\n'};
+	ACAP_HTTP_Respond_String(response, "Content-Type: image/png\r\nCache-Control: no-cache\r\n\r\n");
+	ACAP_HTTP_Respond_Data(response, sizeof(signature), signature);
+	Heatmap_PNG_Chunk(response, "IHDR", ihdr, sizeof(ihdr));
+	Heatmap_PNG_Chunk(response, "PLTE", palette, sizeof(palette));
+	Heatmap_PNG_Chunk(response, "IDAT", packed, packedSize);
+	Heatmap_PNG_Chunk(response, "IEND", NULL, 0);
+	free(raw);
+	free(packed);
+}
+
+static void
+Heatmap_HTTP(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	if( !Heatmap_running ) {
+		ACAP_HTTP_Respond_Error(response, 503, "Heatmap not enabled");
+		return;
+	}
+
+	int layer = -1;
+	const char* param;
+	if( (param = ACAP_HTTP_Request_Param(request, "label")) ) {
+		char* end = 0;
+		long index = strtol(param, &end, 10);
+		if( end != param && *end == 0 ) {
+			layer = index;
+		} else {
+			cJSON* model = ACAP_Get_Config("model");
+			cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+			for( int i = 0; labels && i < cJSON_GetArraySize(labels); i++ )
+				if( cJSON_IsString(cJSON_GetArrayItem(labels, i)) && strcmp(cJSON_GetArrayItem(labels, i)->valuestring, param) == 0 )
+					layer = i;
+		}
+		free((void*)param);
+		if( layer >= HEATMAP_LABELS )
+			layer = -1;
+	}
+	if( (param = ACAP_HTTP_Request_Param(request, "event")) ) {
+		for( unsigned int e = 0; e < HEATMAP_EVENTS; e++ )
+			if( Heatmap_header.eventIds[e][0] && strncmp(Heatmap_header.eventIds[e], param, sizeof(Heatmap_header.eventIds[e])) == 0 )
+				layer = HEATMAP_LABELS + e;
+		free((void*)param);
+	}
+	if( layer < 0 ) {
+		ACAP_HTTP_Respond_Error(response, 400, "Unknown label or event");
+		return;
+	}
+
+	char format[8] = "png";
+	if( (param = ACAP_HTTP_Request_Param(request, "format")) ) {
+		snprintf(format, sizeof(format), "%s", param);
+		free((void*)param);
+	}
+	unsigned int scale = 1;
+	if( (param = ACAP_HTTP_Request_Param(request, "scale")) ) {
+		scale = atoi(param);
+		free((void*)param);
+		if( scale < 1 ) scale = 1;
+		if( scale > HEATMAP_MAX_SCALE ) scale = HEATMAP_MAX_SCALE;
+	}
+
+	const uint32_t* grid = Heatmap_grid[layer];
+	if( strcmp(format, "raw") == 0 ) {
+		uint32_t cells[HEATMAP_CELLS];
+		for( unsigned int cell = 0; cell < HEATMAP_CELLS; cell++ )
+			cells[cell] = htole32(grid[cell]);
+		ACAP_HTTP_Respond_String(response,
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Length: %zu\r\n"
+			"X-Heatmap-Width: %u\r\n"
+			"X-Heatmap-Height: %u\r\n"
+			"Cache-Control: no-cache\r\n\r\n", sizeof(cells), HEATMAP_WIDTH, HEATMAP_HEIGHT);
+		ACAP_HTTP_Respond_Data(response, sizeof(cells), cells);
+		return;
+	}
+	if( strcmp(format, "json") == 0 ) {
+		cJSON* result = cJSON_CreateObject();
+		cJSON_AddNumberToObject(result, "width", HEATMAP_WIDTH);
+		cJSON_AddNumberToObject(result, "height", HEATMAP_HEIGHT);
+		cJSON* cells = cJSON_AddArrayToObject(result, "cells");
+		for( unsigned int cell = 0; cell < HEATMAP_CELLS; cell++ )
+			cJSON_AddItemToArray(cells, cJSON_CreateNumber(grid[cell]));
+		ACAP_HTTP_Respond_JSON(response, result);
+		cJSON_Delete(result);
+		return;
+	}
+	Heatmap_PNG(response, grid, scale);
+}
+
+/*
+ * Setup
+ */
+
+int
+Heatmap_Init(cJSON* settings) {
+	static int registered = 0;
+	if( !registered ) {
+		ACAP_HTTP_Node("heatmap", Heatmap_HTTP);
+		registered = 1;
+	}
+
+	char* config = settings ? cJSON_PrintUnformatted(settings) : 0;
+	if( config && Heatmap_config && strcmp(config, Heatmap_config) == 0 ) {
+		free(config);
+		return 1;
+	}
+	free(Heatmap_config);
+	Heatmap_config = config;
+
+	if( Heatmap_running ) {
+		Heatmap_Decay();
+		Heatmap_Save();
+		if( Heatmap_timer )
+			g_source_remove(Heatmap_timer);
+		Heatmap_timer = 0;
+		Heatmap_running = 0;
+	}
+	if( !settings || !cJSON_IsTrue(cJSON_GetObjectItem(settings,"enabled")) )
+		return 1;
+
+	memset(&Heatmap_header, 0, sizeof(Heatmap_header));
+	Heatmap_header.magic = HEATMAP_MAGIC;
+	Heatmap_header.version = HEATMAP_VERSION;
+	Heatmap_header.width = HEATMAP_WIDTH;
+	Heatmap_header.height = HEATMAP_HEIGHT;
+	Heatmap_header.layers = HEATMAP_LAYERS;
+	cJSON* event = cJSON_GetObjectItem(settings,"events") ? cJSON_GetObjectItem(settings,"events")->child : 0;
+	for( unsigned int e = 0; event && e < HEATMAP_EVENTS; event = event->next )
+		if( cJSON_IsString(event) )
+			strncpy(Heatmap_header.eventIds[e++], event->valuestring, sizeof(Heatmap_header.eventIds[0]));
+
+	cJSON* item = cJSON_GetObjectItem(settings,"presenceLabel");
+	if( item && cJSON_IsString(item) )
+		snprintf(Heatmap_presenceLabel, sizeof(Heatmap_presenceLabel), "%s", item->valuestring);
+	item = cJSON_GetObjectItem(settings,"halfLifeHours");
+	if( item && cJSON_IsNumber(item) )
+		Heatmap_halfLife = item->valuedouble;
+
+	Heatmap_presence = -1;
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	for( int i = 0; labels && i < cJSON_GetArraySize(labels); i++ )
+		if( cJSON_IsString(cJSON_GetArrayItem(labels, i)) && strcmp(cJSON_GetArrayItem(labels, i)->valuestring, Heatmap_presenceLabel) == 0 )
+			Heatmap_presence = i;
+
+	memset(Heatmap_grid, 0, sizeof(Heatmap_grid));
+	Heatmap_Load();
+	Heatmap_Decay();
+	for( unsigned int e = 0; e < HEATMAP_EVENTS; e++ ) {
+		char id[sizeof(Heatmap_header.eventIds[0]) + 1];
+		snprintf(id, sizeof(id), "%.32s", Heatmap_header.eventIds[e]);
+		Heatmap_eventState[e] = id[0] ? ACAP_STATUS_Bool("events", id) : 0;
+	}
+	Heatmap_running = 1;
+	Heatmap_timer = g_timeout_add_seconds(HEATMAP_SAVE_SECONDS, Heatmap_Periodic, NULL);
+	return 1;
+}
+
+void
+Heatmap_Cleanup() {
+	if( Heatmap_running ) {
+		Heatmap_Decay();
+		Heatmap_Save();
+	}
+	free(Heatmap_config);
+	Heatmap_config = 0;
+	if( Heatmap_timer )
+		g_source_remove(Heatmap_timer);
+	Heatmap_timer = 0;
+	Heatmap_running = 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * Heatmaps of detection centres.
+ * GET /local/detectx/heatmap?label=<name|index>|event=<id>[&format=png|raw|json][&scale=<1-16>]
+ */
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "cJSON.h"
+#include "Frame.h"
+
+#define HEATMAP_WIDTH		64
+#define HEATMAP_HEIGHT		48
+#define HEATMAP_LABELS		16
+#define HEATMAP_EVENTS		4
+
+int		Heatmap_Init(cJSON* settings);
+void	Heatmap_Frame(const Frame_t* frame);
+void	Heatmap_Event(const char* id, int state);
+void	Heatmap_Cleanup();
+
+#endif
@@ -0,0 +1,779 @@
+/*
+ * Append-only detection history.
+ *
+ * The inference thread only copies records into a bounded memory buffer.
+ * A writer thread swaps the buffer every flushSeconds, appends it to the
+ * current segment and index and syncs once per batch.  Segments rotate at
+ * segmentKB and the oldest are deleted when the history exceeds maxMB.
+ *
+ * Flash wear is bounded by budgetKB per day.  Detections stop being
+ * written when 90% of the daily budget is used; the rest is reserved
+ * for event transitions.  Detections are recorded at most once per
+ * detectionInterval ms.  Records that do not fit are counted as dropped.
+ *
+ * Queries are detached from the main loop and answered one at a time by
+ * a query thread, so a long range never delays inference or timers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ACAP.h"
+#include "History.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define HISTORY_DIRECTORY	"localdata/history"
+#define HISTORY_EVENTS		"events.txt"
+#define HISTORY_DAY			86400000ULL
+#define HISTORY_PATH_LENGTH	(sizeof(History_path) + 1 + NAME_MAX + 1)	//Directory and a file name
+
+static pthread_t History_thread;
+static pthread_mutex_t History_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t History_cond = PTHREAD_COND_INITIALIZER;
+static int History_running = 0;
+static int History_shutdown = 0;
+
+static History_Record_t History_buffers[2][HISTORY_BUFFER_RECORDS];
+static unsigned int History_active = 0;
+static unsigned int History_count = 0;
+
+//Event ids by index.  Added on the main loop under History_mutex and never changed after
+static char History_events[HISTORY_MAX_EVENTS][HISTORY_EVENT_LENGTH];
+static unsigned int History_eventCount = 0;
+static unsigned int History_eventsSaved = 0;	//Writer thread
+
+static char History_path[ACAP_MAX_PATH_LENGTH + 32] = "";
+static int History_segment = -1;
+static int History_index = -1;
+static size_t History_segmentSize = 0;
+
+static unsigned int History_flushSeconds = 10;
+static unsigned int History_detectionInterval = 1000;
+static size_t History_segmentBytes = 1024 * 1024;
+static size_t History_maxBytes = 64 * 1024 * 1024;
+static size_t History_budget = 8 * 1024 * 1024;
+
+static uint64_t History_lastDetections = 0;
+static uint64_t History_day = 0;
+static atomic_size_t History_written = 0;		//Bytes written the current day
+static atomic_uint History_dropped = 0;
+static atomic_uint History_records = 0;
+static guint History_timer = 0;
+static char* History_config = 0;		//history setting the writer runs with
+
+static int
+History_Filter(const struct dirent* entry) {
+	size_t length = strlen(entry->d_name);
+	return length > 4 && strcmp(entry->d_name + length - 4, ".seg") == 0;
+}
+
+static void
+History_Close_Segment() {
+	if( History_segment >= 0 )
+		close(History_segment);
+	if( History_index >= 0 )
+		close(History_index);
+	History_segment = History_index = -1;
+	History_segmentSize = 0;
+}
+
+//Delete the oldest segments until the history fits in maxMB
+static void
+History_Trim() {
+	struct dirent** entries = 0;
+	int count = scandir(History_path, &entries, History_Filter, alphasort);
+	if( count < 0 )
+		return;
+	size_t total = 0;
+	size_t sizes[count];
+	for( int i = 0; i < count; i++ ) {
+		char path[HISTORY_PATH_LENGTH];
+		struct stat info;
+		snprintf(path, sizeof(path), "%s/%s", History_path, entries[i]->d_name);
+		sizes[i] = stat(path, &info) == 0 ? (size_t)info.st_size : 0;
+		total += sizes[i];
+	}
+	//Never delete the segment being written (the newest)
+	for( int i = 0; i < count - 1 && total > History_maxBytes; i++ ) {
+		char path[HISTORY_PATH_LENGTH];
+		snprintf(path, sizeof(path), "%s/%s", History_path, entries[i]->d_name);
+		unlink(path);
+		path[strlen(path) - 3] = 0;
+		strcat(path, "idx");
+		unlink(path);
+		total -= sizes[i];
+	}
+	for( int i = 0; i < count; i++ )
+		free(entries[i]);
+	free(entries);
+}
+
+static int
+History_Open_Segment(uint64_t timestamp) {
+	History_Close_Segment();
+	char path[HISTORY_PATH_LENGTH];
+	snprintf(path, sizeof(path), "%s/%013llu.seg", History_path, (unsigned long long)timestamp);
+	History_segment = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	path[strlen(path) - 3] = 0;
+	strcat(path, "idx");
+	History_index = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if( History_segment < 0 || History_index < 0 ) {
+		LOG_WARN("%s: Unable to open segment: %s\n",__func__, strerror(errno));
+		History_Close_Segment();
+		return 0;
+	}
+	History_Trim();
+	return 1;
+}
+
+static void
+History_Flush(const History_Record_t* records, unsigned int count, const History_Index_t* index, unsigned int indexed) {
+	if( History_segment < 0 || count == 0 )
+		return;
+	ssize_t length = count * sizeof(History_Record_t);
+	if( write(History_segment, records, length) != length ||
+		(indexed && write(History_index, index, indexed * sizeof(History_Index_t)) != (ssize_t)(indexed * sizeof(History_Index_t))) )
+		LOG_WARN("%s: Write failed: %s\n",__func__, strerror(errno));
+	//One sync per batch
+	fdatasync(History_segment);
+	if( indexed )
+		fdatasync(History_index);
+}
+
+static void
+History_Write(History_Record_t* records, unsigned int count) {
+	History_Index_t index[HISTORY_BUFFER_RECORDS / HISTORY_INDEX_STRIDE + 1];
+	unsigned int kept = 0;		//Accepted records are compacted to the front of the buffer
+	unsigned int flushed = 0;
+	unsigned int indexed = 0;
+	size_t detectionBudget = History_budget / 10 * 9;
+
+	for( unsigned int i = 0; i < count; i++ ) {
+		History_Record_t record = records[i];
+		uint64_t timestamp = le64toh(record.timestamp);
+		uint64_t day = timestamp / HISTORY_DAY;
+		if( day > History_day ) {
+			History_day = day;
+			atomic_store(&History_written, 0);
+		}
+
+		int rotate = History_segment < 0 || History_segmentSize >= History_segmentBytes;
+		int indexEntry = rotate || (History_segmentSize / sizeof(History_Record_t)) % HISTORY_INDEX_STRIDE == 0;
+		size_t cost = sizeof(History_Record_t) + (indexEntry ? sizeof(History_Index_t) : 0);
+		size_t limit = record.type == HISTORY_EVENT ? History_budget : detectionBudget;
+		if( atomic_load(&History_written) + cost > limit ) {
+			atomic_fetch_add(&History_dropped, 1);
+			continue;
+		}
+
+		if( rotate ) {
+			History_Flush(records + flushed, kept - flushed, index, indexed);
+			flushed = kept;
+			indexed = 0;
+			if( !History_Open_Segment(timestamp) ) {
+				atomic_fetch_add(&History_dropped, count - i);
+				return;
+			}
+		}
+		if( indexEntry ) {
+			index[indexed].timestamp = record.timestamp;
+			index[indexed].offset = htole32((uint32_t)History_segmentSize);
+			index[indexed].reserved = 0;
+			indexed++;
+		}
+		records[kept++] = record;
+		History_segmentSize += sizeof(History_Record_t);
+		atomic_fetch_add(&History_written, cost);
+		atomic_fetch_add(&History_records, 1);
+	}
+	History_Flush(records + flushed, kept - flushed, index, indexed);
+}
+
+//Append the ids added since the last batch, before any record that refers to them
+static void
+History_Save_Events(unsigned int count) {
+	if( count <= History_eventsSaved )
+		return;
+	char path[HISTORY_PATH_LENGTH];
+	snprintf(path, sizeof(path), "%s/%s", History_path, HISTORY_EVENTS);
+	FILE* file = fopen(path, "a");
+	if( !file ) {
+		LOG_WARN("%s: Unable to open %s: %s\n",__func__, path, strerror(errno));
+		return;
+	}
+	size_t bytes = 0;
+	for( unsigned int i = History_eventsSaved; i < count; i++ ) {
+		int length = fprintf(file, "%s\n", History_events[i]);
+		bytes += length > 0 ? length : 0;
+	}
+	if( fflush(file) != 0 || fdatasync(fileno(file)) != 0 ) {
+		LOG_WARN("%s: Write failed: %s\n",__func__, strerror(errno));
+		fclose(file);
+		return;
+	}
+	fclose(file);
+	History_eventsSaved = count;
+	atomic_fetch_add(&History_written, bytes);
+}
+
+static void
+History_Load_Events() {
+	char path[HISTORY_PATH_LENGTH];
+	snprintf(path, sizeof(path), "%s/%s", History_path, HISTORY_EVENTS);
+	FILE* file = fopen(path, "r");
+	char line[HISTORY_EVENT_LENGTH + 1];		//Id and newline
+	pthread_mutex_lock(&History_mutex);
+	History_eventCount = 0;
+	while( file && History_eventCount < HISTORY_MAX_EVENTS && fgets(line, sizeof(line), file) ) {
+		size_t length = strcspn(line, "\r\n");
+		if( length >= HISTORY_EVENT_LENGTH )
+			length = HISTORY_EVENT_LENGTH - 1;
+		memcpy(History_events[History_eventCount], line, length);
+		History_events[History_eventCount++][length] = 0;
+	}
+	History_eventsSaved = History_eventCount;
+	pthread_mutex_unlock(&History_mutex);
+	if( file )
+		fclose(file);
+}
+
+static void*
+History_Writer_Thread(void* data) {
+	pthread_mutex_lock(&History_mutex);
+	while( 1 ) {
+		if( !History_shutdown ) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += History_flushSeconds;
+			pthread_cond_timedwait(&History_cond, &History_mutex, &deadline);
+		}
+		unsigned int buffer = History_active;
+		unsigned int count = History_count;
+		unsigned int events = History_eventCount;
+		History_active = !History_active;
+		History_count = 0;
+		int shutdown = History_shutdown;
+		pthread_mutex_unlock(&History_mutex);
+
+		History_Save_Events(events);
+		if( count )
+			History_Write(History_buffers[buffer], count);
+		if( shutdown )
+			break;
+		pthread_mutex_lock(&History_mutex);
+	}
+	History_Close_Segment();
+	return NULL;
+}
+
+static void
+History_Append(const History_Record_t* records, unsigned int count) {
+	pthread_mutex_lock(&History_mutex);
+	unsigned int space = HISTORY_BUFFER_RECORDS - History_count;
+	if( count > space ) {
+		atomic_fetch_add(&History_dropped, count - space);
+		count = space;
+	}
+	memcpy(&History_buffers[History_active][History_count], records, count * sizeof(History_Record_t));
+	History_count += count;
+	pthread_mutex_unlock(&History_mutex);
+}
+
+void
+History_Frame(const Frame_t* frame) {
+	static History_Record_t records[FRAME_MAX_DETECTIONS];
+	if( !History_running || !frame || frame->count == 0 )
+		return;
+	if( frame->timestamp < History_lastDetections + History_detectionInterval && frame->timestamp >= History_lastDetections )
+		return;
+	History_lastDetections = frame->timestamp;
+
+	unsigned int count = frame->count < FRAME_MAX_DETECTIONS ? frame->count : FRAME_MAX_DETECTIONS;
+	for( unsigned int i = 0; i < count; i++ ) {
+		const Detection_t* detection = &frame->detections[i];
+		History_Record_t* record = &records[i];
+		memset(record, 0, sizeof(History_Record_t));
+		record->timestamp = htole64(frame->timestamp);
+		record->sequence = htole32(frame->sequence);
+		record->type = HISTORY_DETECTION;
+		record->label = htole16(detection->label);
+		record->detection.confidence = htole16(detection->confidence);
+		record->detection.x = htole16(detection->x);
+		record->detection.y = htole16(detection->y);
+		record->detection.w = htole16(detection->w);
+		record->detection.h = htole16(detection->h);
+		record->detection.zones = htole32(detection->zones);
+	}
+	History_Append(records, count);
+}
+
+void
+History_Event(const char* id, int state) {
+	if( !History_running || !id )
+		return;
+	char name[HISTORY_EVENT_LENGTH];
+	snprintf(name, sizeof(name), "%s", id);
+	pthread_mutex_lock(&History_mutex);
+	unsigned int index = 0;
+	while( index < History_eventCount && strcmp(History_events[index], name) != 0 )
+		index++;
+	if( index == History_eventCount && index < HISTORY_MAX_EVENTS ) {
+		memcpy(History_events[index], name, sizeof(name));
+		History_eventCount++;
+	}
+	pthread_mutex_unlock(&History_mutex);
+	if( index >= HISTORY_MAX_EVENTS ) {
+		atomic_fetch_add(&History_dropped, 1);
+		return;
+	}
+
+	History_Record_t record;
+	memset(&record, 0, sizeof(record));
+	record.timestamp = htole64((uint64_t)ACAP_DEVICE_Timestamp());
+	record.type = HISTORY_EVENT_ID;
+	record.state = state ? 1 : 0;
+	record.eventIndex = htole32(index);
+	History_Append(&record, 1);
+}
+
+static gboolean
+History_Status(gpointer user_data) {
+	ACAP_STATUS_SetNumber("history","records",atomic_load(&History_records));
+	ACAP_STATUS_SetNumber("history","dropped",atomic_load(&History_dropped));
+	ACAP_STATUS_SetNumber("history","writtenToday",atomic_load(&History_written));
+	ACAP_STATUS_SetNumber("history","budget",History_budget);
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Query
+ */
+
+static const char*
+History_Label_Name(cJSON* labels, unsigned int index) {
+	cJSON* label = labels ? cJSON_GetArrayItem(labels, index) : 0;
+	return label && cJSON_IsString(label) ? label->valuestring : "Undefined";
+}
+
+typedef struct {
+	ACAP_HTTP_Response response;	//Detached
+	int binary;
+	int first;
+	int label;			//-1 for any
+	const char* event;	//0 for any
+	char eventName[HISTORY_EVENT_LENGTH];
+	uint32_t eventIndex;	//Index of event, UINT32_MAX when it has never been recorded
+	unsigned int events;	//Known event ids
+	cJSON* labels;		//Copy owned by the query
+	uint64_t from;
+	uint64_t to;
+	unsigned int count;
+} History_Query;
+
+static pthread_t History_queryThread;
+static pthread_mutex_t History_queryMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t History_queryCond = PTHREAD_COND_INITIALIZER;
+static History_Query* History_queries[HISTORY_MAX_QUERIES];
+static int History_queryCount = 0;
+static int History_queryRunning = 0;
+static atomic_int History_queryShutdown = 0;
+
+//Returns 0 when the end of the range has been passed
+static int
+History_Query_Record(History_Query* query, const History_Record_t* record) {
+	uint64_t timestamp = le64toh(record->timestamp);
+	if( timestamp < query->from )
+		return 1;
+	if( timestamp > query->to || atomic_load(&History_queryShutdown) )
+		return 0;
+	if( record->type == HISTORY_DETECTION ) {
+		if( query->event || (query->label >= 0 && le16toh(record->label) != query->label) )
+			return 1;
+	} else if( record->type == HISTORY_EVENT_ID ) {
+		if( query->label >= 0 || (query->event && le32toh(record->eventIndex) != query->eventIndex) )
+			return 1;
+	} else {
+		if( query->label >= 0 || (query->event && strncmp(record->event, query->event, sizeof(record->event)) != 0) )
+			return 1;
+	}
+	query->count++;
+	if( query->binary )
+		return ACAP_HTTP_Respond_Data(query->response, sizeof(History_Record_t), record) ? 1 : 0;
+
+	const char* separator = query->first ? "" : ",";
+	query->first = 0;
+	if( record->type == HISTORY_DETECTION )
+		return ACAP_HTTP_Respond_String(query->response,
+			"%s{\"timestamp\":%llu,\"sequence\":%u,\"label\":\"%s\",\"id\":%u,\"c\":%u,\"x\":%u,\"y\":%u,\"w\":%u,\"h\":%u,\"zones\":%u}",
+			separator, (unsigned long long)timestamp, le32toh(record->sequence),
+			History_Label_Name(query->labels, le16toh(record->label)), le16toh(record->label),
+			le16toh(record->detection.confidence), le16toh(record->detection.x), le16toh(record->detection.y),
+			le16toh(record->detection.w), le16toh(record->detection.h), le32toh(record->detection.zones)) ? 1 : 0;
+	char legacy[sizeof(record->event) + 1];
+	const char* event = legacy;
+	if( record->type == HISTORY_EVENT_ID ) {
+		uint32_t index = le32toh(record->eventIndex);
+		event = index < query->events ? History_events[index] : "";
+	} else {
+		memcpy(legacy, record->event, sizeof(record->event));
+		legacy[sizeof(record->event)] = 0;
+	}
+	return ACAP_HTTP_Respond_String(query->response,
+		"%s{\"timestamp\":%llu,\"event\":\"%s\",\"state\":%s}",
+		separator, (unsigned long long)timestamp, event, record->state ? "true" : "false") ? 1 : 0;
+}
+
+//Byte offset of the last index entry at or before the start of the range
+static size_t
+History_Query_Offset(const char* segmentPath, uint64_t from) {
+	char path[HISTORY_PATH_LENGTH];
+	snprintf(path, sizeof(path), "%s", segmentPath);
+	path[strlen(path) - 3] = 0;
+	strcat(path, "idx");
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if( fd < 0 )
+		return 0;
+	struct stat info;
+	size_t offset = 0;
+	if( fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(History_Index_t) ) {
+		size_t entries = info.st_size / sizeof(History_Index_t);
+		const History_Index_t* index = mmap(NULL, entries * sizeof(History_Index_t), PROT_READ, MAP_SHARED, fd, 0);
+		if( index != MAP_FAILED ) {
+			size_t low = 0, high = entries;
+			while( low < high ) {
+				size_t middle = (low + high) / 2;
+				if( le64toh(index[middle].timestamp) <= from )
+					low = middle + 1;
+				else
+					high = middle;
+			}
+			if( low > 0 )
+				offset = le32toh(index[low - 1].offset);
+			munmap((void*)index, entries * sizeof(History_Index_t));
+		}
+	}
+	close(fd);
+	return offset;
+}
+
+//Returns 0 when the end of the range has been passed
+static int
+History_Query_Segment(History_Query* query, const char* path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if( fd < 0 )
+		return 1;
+	struct stat info;
+	int more = 1;
+	if( fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(History_Record_t) ) {
+		//A record may be in the middle of being appended; only map complete records
+		size_t size = (info.st_size / sizeof(History_Record_t)) * sizeof(History_Record_t);
+		const History_Record_t* records = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if( records != MAP_FAILED ) {
+			madvise((void*)records, size, MADV_SEQUENTIAL);
+			size_t offset = History_Query_Offset(path, query->from);
+			for( size_t i = offset / sizeof(History_Record_t); more && i < size / sizeof(History_Record_t); i++ )
+				more = History_Query_Record(query, &records[i]);
+			munmap((void*)records, size);
+		}
+	}
+	close(fd);
+	return more;
+}
+
+static void
+History_Run(History_Query* query) {
+	struct dirent** entries = 0;
+	int count = scandir(History_path, &entries, History_Filter, alphasort);
+
+	if( query->binary )
+		ACAP_HTTP_Respond_String(query->response, "Content-Type: application/octet-stream\r\nCache-Control: no-cache\r\n\r\n");
+	else
+		ACAP_HTTP_Respond_String(query->response, "Content-Type: application/json\r\nCache-Control: no-cache\r\n\r\n[");
+
+	int more = 1;
+	for( int i = 0; i < count; i++ ) {
+		//A segment holds the records from its own start until the next segment starts
+		uint64_t next = i + 1 < count ? strtoull(entries[i + 1]->d_name, NULL, 10) : UINT64_MAX;
+		uint64_t start = strtoull(entries[i]->d_name, NULL, 10);
+		if( more && next > query->from && start <= query->to ) {
+			char path[HISTORY_PATH_LENGTH];
+			snprintf(path, sizeof(path), "%s/%s", History_path, entries[i]->d_name);
+			more = History_Query_Segment(query, path);
+		}
+		free(entries[i]);
+	}
+	if( count >= 0 )
+		free(entries);
+
+	if( !query->binary )
+		ACAP_HTTP_Respond_String(query->response, "]");
+	LOG_TRACE("%s: %u records\n",__func__, query->count);
+}
+
+static void
+History_Query_Free(History_Query* query) {
+	ACAP_HTTP_Release(query->response);
+	cJSON_Delete(query->labels);
+	free(query);
+}
+
+static void*
+History_Query_Thread(void* data) {
+	pthread_mutex_lock(&History_queryMutex);
+	while( !atomic_load(&History_queryShutdown) ) {
+		if( !History_queryCount ) {
+			pthread_cond_wait(&History_queryCond, &History_queryMutex);
+			continue;
+		}
+		History_Query* query = History_queries[0];
+		History_queryCount--;
+		memmove(History_queries, History_queries + 1, History_queryCount * sizeof(History_Query*));
+		pthread_mutex_unlock(&History_queryMutex);
+		History_Run(query);
+		History_Query_Free(query);
+		pthread_mutex_lock(&History_queryMutex);
+	}
+	pthread_mutex_unlock(&History_queryMutex);
+	return NULL;
+}
+
+static void
+History_HTTP(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	if( !History_path[0] ) {
+		ACAP_HTTP_Respond_Error(response, 503, "History not enabled");
+		return;
+	}
+
+	unsigned int events;
+	pthread_mutex_lock(&History_mutex);
+	events = History_eventCount;
+	pthread_mutex_unlock(&History_mutex);
+
+	const char* param;
+	if( (param = ACAP_HTTP_Request_Param(request, "events")) ) {
+		free((void*)param);
+		cJSON* list = cJSON_CreateArray();
+		for( unsigned int i = 0; i < events; i++ )
+			cJSON_AddItemToArray(list, cJSON_CreateString(History_events[i]));
+		ACAP_HTTP_Respond_JSON(response, list);
+		cJSON_Delete(list);
+		return;
+	}
+
+	History_Query* query = calloc(1, sizeof(History_Query));
+	if( !query ) {
+		ACAP_HTTP_Respond_Error(response, 500, "Out of memory");
+		return;
+	}
+	query->first = 1;
+	query->label = -1;
+	query->to = UINT64_MAX;
+	query->events = events;
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	query->labels = labels ? cJSON_Duplicate(labels, 1) : 0;
+
+	if( (param = ACAP_HTTP_Request_Param(request, "from")) ) {
+		query->from = strtoull(param, NULL, 10);
+		free((void*)param);
+	}
+	if( (param = ACAP_HTTP_Request_Param(request, "to")) ) {
+		query->to = strtoull(param, NULL, 10);
+		free((void*)param);
+	}
+	if( (param = ACAP_HTTP_Request_Param(request, "format")) ) {
+		query->binary = strcmp(param, "binary") == 0;
+		free((void*)param);
+	}
+	if( (param = ACAP_HTTP_Request_Param(request, "label")) ) {
+		char* end = 0;
+		long index = strtol(param, &end, 10);
+		if( end && *end == 0 && end != param ) {
+			query->label = index;
+		} else {
+			for( int i = 0; query->labels && i < cJSON_GetArraySize(query->labels); i++ )
+				if( strcmp(History_Label_Name(query->labels, i), param) == 0 )
+					query->label = i;
+		}
+		free((void*)param);
+		if( query->label < 0 ) {
+			cJSON_Delete(query->labels);
+			free(query);
+			ACAP_HTTP_Respond_Error(response, 400, "Unknown label");
+			return;
+		}
+	}
+	query->eventIndex = UINT32_MAX;
+	if( (param = ACAP_HTTP_Request_Param(request, "event")) ) {
+		snprintf(query->eventName, sizeof(query->eventName), "%s", param);
+		query->event = query->eventName;
+		free((void*)param);
+		for( unsigned int i = 0; i < query->events; i++ )
+			if( strcmp(History_events[i], query->eventName) == 0 )
+				query->eventIndex = i;
+	}
+
+	pthread_mutex_lock(&History_queryMutex);
+	if( !History_queryRunning && !atomic_load(&History_queryShutdown) ) {
+		if( pthread_create(&History_queryThread, NULL, History_Query_Thread, NULL) == 0 )
+			History_queryRunning = 1;
+		else
+			LOG_WARN("%s: Unable to start query thread: %s\n",__func__, strerror(errno));
+	}
+	ACAP_HTTP_Response detached = 0;
+	if( History_queryRunning && History_queryCount < HISTORY_MAX_QUERIES )
+		detached = ACAP_HTTP_Detach(response);
+	if( detached ) {
+		query->response = detached;
+		History_queries[History_queryCount++] = query;
+		pthread_cond_signal(&History_queryCond);
+	}
+	pthread_mutex_unlock(&History_queryMutex);
+	if( !detached ) {
+		cJSON_Delete(query->labels);
+		free(query);
+		ACAP_HTTP_Respond_Error(response, 503, "Too many history queries");
+	}
+}
+
+/*
+ * Setup
+ */
+
+static void
+History_Stop() {
+	if( !History_running )
+		return;
+	pthread_mutex_lock(&History_mutex);
+	History_shutdown = 1;
+	pthread_cond_signal(&History_cond);
+	pthread_mutex_unlock(&History_mutex);
+	pthread_join(History_thread, NULL);
+	History_running = 0;
+	if( History_timer ) {
+		g_source_remove(History_timer);
+		History_timer = 0;
+	}
+	ACAP_STATUS_SetBool("history","active",0);
+}
+
+//Bytes already written today by earlier runs, so restarts do not reset the budget
+static size_t
+History_Written_Today(uint64_t now) {
+	struct dirent** entries = 0;
+	int count = scandir(History_path, &entries, History_Filter, alphasort);
+	size_t total = 0;
+	time_t midnight = (time_t)(now / HISTORY_DAY * HISTORY_DAY / 1000);
+	for( int i = 0; i < count; i++ ) {
+		char path[HISTORY_PATH_LENGTH];
+		struct stat info;
+		snprintf(path, sizeof(path), "%s/%s", History_path, entries[i]->d_name);
+		if( stat(path, &info) == 0 && info.st_mtime >= midnight ) {
+			//Count from the index entry before midnight; errs on the high side by at most one stride
+			size_t offset = History_Query_Offset(path, (uint64_t)midnight * 1000);
+			if( (off_t)offset < info.st_size )
+				total += info.st_size - offset;
+		}
+		free(entries[i]);
+	}
+	if( count >= 0 )
+		free(entries);
+	return total;
+}
+
+int
+History_Init(cJSON* settings) {
+	static int registered = 0;
+	if( !registered ) {
+		ACAP_HTTP_Node("history", History_HTTP);
+		ACAP_STATUS_Live("history", "records");
+		ACAP_STATUS_Live("history", "dropped");
+		ACAP_STATUS_Live("history", "writtenToday");
+		registered = 1;
+	}
+
+	char* config = settings ? cJSON_PrintUnformatted(settings) : 0;
+	if( config && History_config && strcmp(config, History_config) == 0 ) {
+		free(config);
+		return 1;
+	}
+	free(History_config);
+	History_config = config;
+
+	History_Stop();
+	if( !settings || !cJSON_IsTrue(cJSON_GetObjectItem(settings,"enabled")) )
+		return 1;
+
+	cJSON* item;
+	if( (item = cJSON_GetObjectItem(settings,"flushSeconds")) && item->valueint > 0 )
+		History_flushSeconds = item->valueint;
+	if( (item = cJSON_GetObjectItem(settings,"detectionInterval")) && item->valueint >= 0 )
+		History_detectionInterval = item->valueint;
+	if( (item = cJSON_GetObjectItem(settings,"segmentKB")) && item->valueint >= 64 )
+		History_segmentBytes = (size_t)item->valueint * 1024;
+	if( (item = cJSON_GetObjectItem(settings,"maxMB")) && item->valueint > 0 )
+		History_maxBytes = (size_t)item->valueint * 1024 * 1024;
+	if( (item = cJSON_GetObjectItem(settings,"budgetKB")) && item->valueint > 0 )
+		History_budget = (size_t)item->valueint * 1024;
+
+	//The event list and the daily budget are kept in memory once read, so restarts skip the scan
+	if( !History_path[0] ) {
+		snprintf(History_path, sizeof(History_path), "%s%s", ACAP_FILE_AppPath(), HISTORY_DIRECTORY);
+		mkdir(History_path, 0755);
+		History_Load_Events();
+		uint64_t now = (uint64_t)ACAP_DEVICE_Timestamp();
+		History_day = now / HISTORY_DAY;
+		atomic_store(&History_written, History_Written_Today(now));
+	}
+
+	pthread_mutex_lock(&History_mutex);
+	History_count = 0;
+	History_shutdown = 0;
+	pthread_mutex_unlock(&History_mutex);
+	if( pthread_create(&History_thread, NULL, History_Writer_Thread, NULL) != 0 ) {
+		LOG_WARN("%s: Unable to start writer thread: %s\n",__func__, strerror(errno));
+		return 0;
+	}
+	History_running = 1;
+	History_timer = g_timeout_add_seconds(10, History_Status, NULL);
+	ACAP_STATUS_SetBool("history","active",1);
+	History_Status(NULL);
+	return 1;
+}
+
+void
+History_Cleanup() {
+	History_Stop();
+	pthread_mutex_lock(&History_queryMutex);
+	atomic_store(&History_queryShutdown, 1);
+	pthread_cond_signal(&History_queryCond);
+	int running = History_queryRunning;
+	pthread_mutex_unlock(&History_queryMutex);
+	if( running )
+		pthread_join(History_queryThread, NULL);
+	for( int i = 0; i < History_queryCount; i++ ) {
+		ACAP_HTTP_Respond_Error(History_queries[i]->response, 503, "Shutting down");
+		History_Query_Free(History_queries[i]);
+	}
+	History_queryCount = 0;
+	History_queryRunning = 0;
+	free(History_config);
+	History_config = 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Append-only detection history under localdata/history/.
+ *
+ * Each segment file <first timestamp>.seg holds fixed size 32-byte
+ * little-endian History_Record_t in time order.  A sidecar
+ * <first timestamp>.idx holds one History_Index_t for every
+ * HISTORY_INDEX_STRIDE records so a time range can be located without
+ * scanning the segment.  Event records refer to a line in events.txt,
+ * the append-only list of event ids seen so far, so ids of any length
+ * fit the fixed record.
+ *
+ * GET /local/detectx/history?from=<ms>&to=<ms>[&label=<name|index>][&event=<id>][&format=binary]
+ * GET /local/detectx/history?events=1		The event id list, index order
+ */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include "cJSON.h"
+#include "Frame.h"
+
+#define HISTORY_INDEX_STRIDE	256
+#define HISTORY_BUFFER_RECORDS	4096	//Records held in memory between flushes
+#define HISTORY_MAX_QUERIES		4		//Queries waiting for the query thread
+
+#define HISTORY_MAX_EVENTS		256		//Distinct event ids
+#define HISTORY_EVENT_LENGTH	64
+
+#define HISTORY_DETECTION	0
+#define HISTORY_EVENT		1		//Id in the record, only written by earlier versions
+#define HISTORY_EVENT_ID	2		//Index in the event id list
+
+typedef struct __attribute__((packed)) {
+	uint64_t timestamp;		//EPOCH ms
+	uint32_t sequence;		//Frame sequence
+	uint8_t type;			//HISTORY_DETECTION or HISTORY_EVENT
+	uint8_t state;			//Event state
+	uint16_t label;			//Label index for detections
+	union {
+		struct __attribute__((packed)) {
+			uint16_t confidence;
+			uint16_t x;
+			uint16_t y;
+			uint16_t w;
+			uint16_t h;
+			uint32_t zones;		//Zone bitmask
+			uint16_t reserved;
+		} detection;
+		char event[16];		//HISTORY_EVENT id, not terminated when 16 characters
+		uint32_t eventIndex;	//HISTORY_EVENT_ID line in events.txt, from 0
+	};
+} History_Record_t;
+
+typedef struct __attribute__((packed)) {
+	uint64_t timestamp;
+	uint32_t offset;		//Byte offset in the segment
+	uint32_t reserved;
+} History_Index_t;
+
+int		History_Init(cJSON* settings);
+void	History_Frame(const Frame_t* frame);
+void	History_Event(const char* id, int state);
+void	History_Cleanup();
+
+#endif
@@ -0,0 +1,349 @@
+/*
+ * Minimal baseline JPEG encoder for NV12 frames.
+ * 4:2:0 sampling, standard quantization and Huffman tables, float AAN DCT.
+ * Intended for occasional snapshots, not for continuous encoding.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "Jpeg.h"
+
+typedef struct {
+	uint8_t* data;
+	size_t length;
+	size_t size;
+	uint32_t bitBuffer;
+	int bitCount;
+	int error;
+} Jpeg_Writer;
+
+typedef struct {
+	uint16_t code;
+	uint8_t length;
+} Jpeg_Code;
+
+static const uint8_t Jpeg_zigzag[64] = {
+	 0, 1, 5, 6,14,15,27,28, 2, 4, 7,13,16,26,29,42,
+	 3, 8,12,17,25,30,41,43, 9,11,18,24,31,40,44,53,
+	10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,
+	21,34,37,47,50,56,59,61,35,36,48,49,57,58,62,63
+};
+
+static const uint8_t Jpeg_lumaQuant[64] = {
+	16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,
+	14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,
+	18,22,37,56,68,109,103,77,24,35,55,64,81,104,113,92,
+	49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99
+};
+
+static const uint8_t Jpeg_chromaQuant[64] = {
+	17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,
+	24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
+	99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,
+	99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99
+};
+
+static const uint8_t Jpeg_dcLumaBits[16] = {0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static const uint8_t Jpeg_dcChromaBits[16] = {0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
+static const uint8_t Jpeg_dcValues[12] = {0,1,2,3,4,5,6,7,8,9,10,11};
+
+static const uint8_t Jpeg_acLumaBits[16] = {0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
+static const uint8_t Jpeg_acLumaValues[162] = {
+	0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,
+	0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
+	0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+	0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+	0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,
+	0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+	0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,
+	0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,
+	0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+	0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+	0xf9,0xfa
+};
+
+static const uint8_t Jpeg_acChromaBits[16] = {0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
+static const uint8_t Jpeg_acChromaValues[162] = {
+	0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,
+	0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
+	0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+	0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
+	0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,
+	0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+	0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,
+	0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,
+	0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+	0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+	0xf9,0xfa
+};
+
+//AAN scale factors, including the factor 8 of the 2D DCT
+static const float Jpeg_aan[8] = {
+	1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+	1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f
+};
+
+static Jpeg_Code Jpeg_dcLuma[256], Jpeg_dcChroma[256], Jpeg_acLuma[256], Jpeg_acChroma[256];
+static int Jpeg_tablesReady = 0;
+
+static void
+Jpeg_Build_Codes(const uint8_t* bits, const uint8_t* values, Jpeg_Code* table) {
+	int code = 0;
+	int k = 0;
+	for( int length = 1; length <= 16; length++ ) {
+		for( int i = 0; i < bits[length - 1]; i++ ) {
+			table[values[k]].code = code++;
+			table[values[k]].length = length;
+			k++;
+		}
+		code <<= 1;
+	}
+}
+
+static void
+Jpeg_Put(Jpeg_Writer* writer, const void* data, size_t count) {
+	if( writer->error )
+		return;
+	if( writer->length + count > writer->size ) {
+		size_t size = writer->size * 2;
+		while( size < writer->length + count )
+			size *= 2;
+		uint8_t* grown = realloc(writer->data, size);
+		if( !grown ) {
+			writer->error = 1;
+			return;
+		}
+		writer->data = grown;
+		writer->size = size;
+	}
+	memcpy(writer->data + writer->length, data, count);
+	writer->length += count;
+}
+
+static void
+Jpeg_Put_Byte(Jpeg_Writer* writer, uint8_t byte) {
+	Jpeg_Put(writer, &byte, 1);
+}
+
+static void
+Jpeg_Put_Word(Jpeg_Writer* writer, unsigned int word) {
+	uint8_t bytes[2] = { word >> 8, word & 0xff };
+	Jpeg_Put(writer, bytes, 2);
+}
+
+static void
+Jpeg_Put_Bits(Jpeg_Writer* writer, unsigned int code, int length) {
+	writer->bitCount += length;
+	writer->bitBuffer |= code << (24 - writer->bitCount);
+	while( writer->bitCount >= 8 ) {
+		uint8_t byte = (writer->bitBuffer >> 16) & 0xff;
+		Jpeg_Put_Byte(writer, byte);
+		if( byte == 0xff )
+			Jpeg_Put_Byte(writer, 0);	//Byte stuffing
+		writer->bitBuffer <<= 8;
+		writer->bitCount -= 8;
+	}
+}
+
+static void
+Jpeg_Put_Code(Jpeg_Writer* writer, const Jpeg_Code* code) {
+	Jpeg_Put_Bits(writer, code->code, code->length);
+}
+
+static void
+Jpeg_Put_Table(Jpeg_Writer* writer, int class, const uint8_t* bits, const uint8_t* values, int count) {
+	Jpeg_Put_Byte(writer, class);
+	Jpeg_Put(writer, bits, 16);
+	Jpeg_Put(writer, values, count);
+}
+
+static void
+Jpeg_DCT(float* d0, float* d1, float* d2, float* d3, float* d4, float* d5, float* d6, float* d7) {
+	float tmp0 = *d0 + *d7, tmp7 = *d0 - *d7;
+	float tmp1 = *d1 + *d6, tmp6 = *d1 - *d6;
+	float tmp2 = *d2 + *d5, tmp5 = *d2 - *d5;
+	float tmp3 = *d3 + *d4, tmp4 = *d3 - *d4;
+
+	float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+	float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+	*d0 = tmp10 + tmp11;
+	*d4 = tmp10 - tmp11;
+	float z1 = (tmp12 + tmp13) * 0.707106781f;
+	*d2 = tmp13 + z1;
+	*d6 = tmp13 - z1;
+
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+	float z5 = (tmp10 - tmp12) * 0.382683433f;
+	float z2 = tmp10 * 0.541196100f + z5;
+	float z4 = tmp12 * 1.306562965f + z5;
+	float z3 = tmp11 * 0.707106781f;
+	float z11 = tmp7 + z3, z13 = tmp7 - z3;
+	*d5 = z13 + z2;
+	*d3 = z13 - z2;
+	*d1 = z11 + z4;
+	*d7 = z11 - z4;
+}
+
+static void
+Jpeg_Put_Value(Jpeg_Writer* writer, const Jpeg_Code* table, int symbolBase, int value) {
+	int magnitude = value < 0 ? -value : value;
+	int bits = 0;
+	while( magnitude ) {
+		bits++;
+		magnitude >>= 1;
+	}
+	Jpeg_Put_Code(writer, &table[symbolBase + bits]);
+	if( bits )
+		Jpeg_Put_Bits(writer, (value < 0 ? value - 1 : value) & ((1 << bits) - 1), bits);
+}
+
+static int
+Jpeg_Block(Jpeg_Writer* writer, float* block, const float* scale, int dc, const Jpeg_Code* dcTable, const Jpeg_Code* acTable) {
+	int coefficients[64];
+
+	for( int i = 0; i < 64; i += 8 )
+		Jpeg_DCT(&block[i], &block[i+1], &block[i+2], &block[i+3], &block[i+4], &block[i+5], &block[i+6], &block[i+7]);
+	for( int i = 0; i < 8; i++ )
+		Jpeg_DCT(&block[i], &block[i+8], &block[i+16], &block[i+24], &block[i+32], &block[i+40], &block[i+48], &block[i+56]);
+	for( int i = 0; i < 64; i++ ) {
+		float v = block[i] * scale[i];
+		coefficients[Jpeg_zigzag[i]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+	}
+
+	Jpeg_Put_Value(writer, dcTable, 0, coefficients[0] - dc);
+
+	int last = 63;
+	while( last > 0 && coefficients[last] == 0 )
+		last--;
+	for( int i = 1; i <= last; i++ ) {
+		int zeros = 0;
+		while( coefficients[i] == 0 ) {
+			zeros++;
+			i++;
+		}
+		while( zeros >= 16 ) {
+			Jpeg_Put_Code(writer, &acTable[0xF0]);
+			zeros -= 16;
+		}
+		Jpeg_Put_Value(writer, acTable, zeros << 4, coefficients[i]);
+	}
+	if( last != 63 )
+		Jpeg_Put_Code(writer, &acTable[0x00]);
+	return coefficients[0];
+}
+
+int
+Jpeg_Encode_NV12(const uint8_t* nv12, unsigned int width, unsigned int height, int quality, uint8_t** jpeg, size_t* length) {
+	if( !nv12 || !jpeg || !length || width < 2 || height < 2 || width > 0xffff || height > 0xffff )
+		return 0;
+
+	if( !Jpeg_tablesReady ) {
+		Jpeg_Build_Codes(Jpeg_dcLumaBits, Jpeg_dcValues, Jpeg_dcLuma);
+		Jpeg_Build_Codes(Jpeg_dcChromaBits, Jpeg_dcValues, Jpeg_dcChroma);
+		Jpeg_Build_Codes(Jpeg_acLumaBits, Jpeg_acLumaValues, Jpeg_acLuma);
+		Jpeg_Build_Codes(Jpeg_acChromaBits, Jpeg_acChromaValues, Jpeg_acChroma);
+		Jpeg_tablesReady = 1;
+	}
+
+	if( quality < 1 ) quality = 1;
+	if( quality > 100 ) quality = 100;
+	quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+	uint8_t lumaTable[64], chromaTable[64];
+	for( int i = 0; i < 64; i++ ) {
+		int luma = (Jpeg_lumaQuant[i] * quality + 50) / 100;
+		int chroma = (Jpeg_chromaQuant[i] * quality + 50) / 100;
+		lumaTable[Jpeg_zigzag[i]] = luma < 1 ? 1 : luma > 255 ? 255 : luma;
+		chromaTable[Jpeg_zigzag[i]] = chroma < 1 ? 1 : chroma > 255 ? 255 : chroma;
+	}
+	float lumaScale[64], chromaScale[64];
+	for( int row = 0, k = 0; row < 8; row++ ) {
+		for( int column = 0; column < 8; column++, k++ ) {
+			lumaScale[k] = 1.0f / (lumaTable[Jpeg_zigzag[k]] * Jpeg_aan[row] * Jpeg_aan[column]);
+			chromaScale[k] = 1.0f / (chromaTable[Jpeg_zigzag[k]] * Jpeg_aan[row] * Jpeg_aan[column]);
+		}
+	}
+
+	Jpeg_Writer writer = {0};
+	writer.size = width * height / 4 + 1024;
+	writer.data = malloc(writer.size);
+	if( !writer.data )
+		return 0;
+
+	static const uint8_t header[] = {
+		0xFF,0xD8,										//SOI
+		0xFF,0xE0,0,16,'J','F','I','F',0,1,1,0,0,1,0,1,0,0	//APP0 JFIF
+	};
+	Jpeg_Put(&writer, header, sizeof(header));
+
+	Jpeg_Put_Word(&writer, 0xFFDB);						//DQT
+	Jpeg_Put_Word(&writer, 2 + 2 * 65);
+	Jpeg_Put_Byte(&writer, 0);
+	Jpeg_Put(&writer, lumaTable, 64);
+	Jpeg_Put_Byte(&writer, 1);
+	Jpeg_Put(&writer, chromaTable, 64);
+
+	Jpeg_Put_Word(&writer, 0xFFC0);						//SOF0
+	Jpeg_Put_Word(&writer, 17);
+	Jpeg_Put_Byte(&writer, 8);
+	Jpeg_Put_Word(&writer, height);
+	Jpeg_Put_Word(&writer, width);
+	static const uint8_t components[] = { 3, 1,0x22,0, 2,0x11,1, 3,0x11,1 };
+	Jpeg_Put(&writer, components, sizeof(components));
+
+	Jpeg_Put_Word(&writer, 0xFFC4);						//DHT
+	Jpeg_Put_Word(&writer, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+	Jpeg_Put_Table(&writer, 0x00, Jpeg_dcLumaBits, Jpeg_dcValues, 12);
+	Jpeg_Put_Table(&writer, 0x10, Jpeg_acLumaBits, Jpeg_acLumaValues, 162);
+	Jpeg_Put_Table(&writer, 0x01, Jpeg_dcChromaBits, Jpeg_dcValues, 12);
+	Jpeg_Put_Table(&writer, 0x11, Jpeg_acChromaBits, Jpeg_acChromaValues, 162);
+
+	static const uint8_t scan[] = { 0xFF,0xDA,0,12,3, 1,0x00, 2,0x11, 3,0x11, 0,63,0 };
+	Jpeg_Put(&writer, scan, sizeof(scan));
+
+	const uint8_t* luma = nv12;
+	const uint8_t* chroma = nv12 + width * height;
+	unsigned int chromaWidth = width / 2, chromaHeight = height / 2;
+	int dcY = 0, dcU = 0, dcV = 0;
+	float block[64], blockU[64], blockV[64];
+
+	for( unsigned int my = 0; my < height && !writer.error; my += 16 ) {
+		for( unsigned int mx = 0; mx < width; mx += 16 ) {
+			for( int by = 0; by < 16; by += 8 ) {
+				for( int bx = 0; bx < 16; bx += 8 ) {
+					for( int y = 0, k = 0; y < 8; y++ ) {
+						unsigned int py = my + by + y < height ? my + by + y : height - 1;
+						for( int x = 0; x < 8; x++, k++ ) {
+							unsigned int px = mx + bx + x < width ? mx + bx + x : width - 1;
+							block[k] = luma[py * width + px] - 128.0f;
+						}
+					}
+					dcY = Jpeg_Block(&writer, block, lumaScale, dcY, Jpeg_dcLuma, Jpeg_acLuma);
+				}
+			}
+			for( int y = 0, k = 0; y < 8; y++ ) {
+				unsigned int py = my / 2 + y < chromaHeight ? my / 2 + y : chromaHeight - 1;
+				for( int x = 0; x < 8; x++, k++ ) {
+					unsigned int px = mx / 2 + x < chromaWidth ? mx / 2 + x : chromaWidth - 1;
+					blockU[k] = chroma[py * width + px * 2] - 128.0f;
+					blockV[k] = chroma[py * width + px * 2 + 1] - 128.0f;
+				}
+			}
+			dcU = Jpeg_Block(&writer, blockU, chromaScale, dcU, Jpeg_dcChroma, Jpeg_acChroma);
+			dcV = Jpeg_Block(&writer, blockV, chromaScale, dcV, Jpeg_dcChroma, Jpeg_acChroma);
+		}
+	}
+
+	Jpeg_Put_Bits(&writer, 0x7F, 7);					//Pad last byte with ones
+	Jpeg_Put_Word(&writer, 0xFFD9);						//EOI
+
+	if( writer.error ) {
+		free(writer.data);
+		return 0;
+	}
+	*jpeg = writer.data;
+	*length = writer.length;
+	return 1;
+}
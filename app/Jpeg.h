@@ -0,0 +1,16 @@
+/*
+ * Minimal baseline JPEG encoder for NV12 frames (4:2:0, standard tables).
+ */
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Encodes an NV12 image with tightly packed planes.  Width and height must be even.
+ * On success *jpeg is a malloc'ed buffer the caller must free.
+ */
+int Jpeg_Encode_NV12(const uint8_t* nv12, unsigned int width, unsigned int height, int quality, uint8_t** jpeg, size_t* length);
+
+#endif
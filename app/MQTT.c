@@ -0,0 +1,1253 @@
+/*
+ * MQTT 3.1.1 publisher for detections and event state transitions.
+ *
+ * The main thread copies each frame into a single-producer ring and
+ * returns; it never blocks on the network.  A publisher thread drains
+ * the ring, encodes JSON, batches frames per topic and owns the broker
+ * connection: CONNECT/CONNACK, PUBLISH at QoS 0 or 1, PINGREQ keep-alive
+ * and reconnects with exponential backoff.  At QoS 1 unacknowledged
+ * PUBLISH packets are kept in a bounded in-flight window and resent with
+ * the DUP flag after a reconnect.  While the window is full the ring is
+ * left to fill up and new frames are dropped and counted.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <glib.h>
+
+#include "ACAP.h"
+#include "MQTT.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define MQTT_ITEM_FRAME		0
+#define MQTT_ITEM_EVENT		1
+#define MQTT_CONNECT_TIMEOUT	10000	//ms for TCP connect and CONNACK
+#define MQTT_MAX_BATCH		65536	//Batch payload size that forces a flush
+#define MQTT_INFLIGHT_SLOTS	(MQTT_MAX_INFLIGHT + MQTT_MAX_TOPICS + 1)
+#define MQTT_PASSWORD_MASK	"********"	//Returned instead of the password
+
+typedef struct {
+	int type;
+	gint64 enqueued;		//Monotonic us
+	union {
+		Frame_t frame;
+		struct {
+			char id[64];
+			int state;
+			double timestamp;
+		} event;
+	};
+} MQTT_Item;
+
+typedef struct {
+	char host[128];
+	int port;
+	int stub;
+	char user[64];
+	char password[64];
+	char clientId[64];
+	char preTopic[64];
+	int keepAlive;			//Seconds, 0 disables PINGREQ
+	int qos;
+	int batchFrames;
+	int batchMs;
+	int maxInflight;
+} MQTT_Config_t;
+
+typedef struct {
+	char topic[192];
+	char* data;
+	size_t length;
+	size_t size;
+	int frames;
+	gint64 opened;			//Monotonic ms of the first frame in the batch
+	gint64 enqueuedSum;		//Sum of the queue timestamps of the frames, us
+	gint64 oldest;
+} MQTT_Batch;
+
+typedef struct {
+	uint16_t id;
+	uint8_t* packet;
+	size_t length;
+} MQTT_Inflight;
+
+//Configuration built by MQTT_Start and adopted by the publisher thread
+typedef struct {
+	MQTT_Config_t config;
+	char topics[MQTT_MAX_TOPICS][192];
+	int topicCount;
+	int labelBatch[MQTT_MAX_LABELS];
+	char labelNames[MQTT_MAX_LABELS][32];
+	int labelCount;
+} MQTT_Setup;
+
+//Ring shared by the main thread (producer) and the publisher thread (consumer)
+static MQTT_Item MQTT_queue[MQTT_QUEUE_SIZE];
+static atomic_uint MQTT_head = 0;		//Next item to publish, written by the publisher
+static atomic_uint MQTT_tail = 0;		//Next free slot, written by the main thread
+static int MQTT_wake = -1;				//eventfd signalled for every queued item
+static int MQTT_lastFrameEmpty = 0;
+
+//Written on the main thread, copied by the publisher thread when MQTT_generation changes
+static cJSON* MQTT_settings = 0;
+static cJSON* MQTT_public = 0;				//Settings in the app config, password masked
+static pthread_mutex_t MQTT_setupMutex = PTHREAD_MUTEX_INITIALIZER;
+static MQTT_Setup MQTT_setup;
+static atomic_uint MQTT_generation = 0;
+static atomic_int MQTT_enabled = 0;			//A broker is configured, gates the producers
+
+//Owned by the publisher thread
+static unsigned int MQTT_applied = 0;		//Generation of MQTT_config
+static MQTT_Config_t MQTT_config;
+static MQTT_Batch MQTT_batches[MQTT_MAX_TOPICS];
+static int MQTT_batchCount = 0;
+static int MQTT_labelBatch[MQTT_MAX_LABELS];	//Batch index per label, -1 = not published
+static char MQTT_labelNames[MQTT_MAX_LABELS][32];
+static int MQTT_labelCount = 0;
+
+//Publisher thread state
+static pthread_t MQTT_thread;
+static atomic_int MQTT_running = 0;			//Cleared by MQTT_Cleanup only
+static int MQTT_fd = -1;
+static uint8_t MQTT_rx[1024];
+static size_t MQTT_rxLength = 0;
+static int MQTT_connack = -1;
+static gint64 MQTT_lastSend = 0;
+static gint64 MQTT_pingSent = 0;
+static uint16_t MQTT_packetId = 0;
+static MQTT_Inflight MQTT_inflight[MQTT_INFLIGHT_SLOTS];
+static int MQTT_inflightCount = 0;
+
+//Metrics, read by the status timer on the main thread
+static atomic_int MQTT_connected = 0;
+static atomic_int MQTT_connecting = 0;
+static atomic_uint MQTT_reconnects = 0;		//Connections lost after CONNACK
+static atomic_ullong MQTT_published = 0;
+static atomic_ullong MQTT_publishedFrames = 0;
+static atomic_ullong MQTT_bytes = 0;
+static atomic_uint MQTT_dropped = 0;
+static atomic_uint MQTT_inflightNow = 0;
+static atomic_ullong MQTT_latencySum = 0;		//us since the last status update
+static atomic_ullong MQTT_latencyCount = 0;
+static atomic_ullong MQTT_latencyMax = 0;
+static atomic_ullong MQTT_stubReceived = 0;
+static pthread_mutex_t MQTT_textMutex = PTHREAD_MUTEX_INITIALIZER;
+static char MQTT_text[160] = "Not configured";
+static guint MQTT_statusTimer = 0;
+static gint64 MQTT_statusTime = 0;
+static unsigned long long MQTT_statusPublished = 0;
+static unsigned long long MQTT_statusFrames = 0;
+
+static gint64
+MQTT_Now() {
+	return g_get_monotonic_time() / 1000;
+}
+
+static void
+MQTT_Text(const char* fmt, ...) {
+	va_list args;
+	pthread_mutex_lock(&MQTT_textMutex);
+	va_start(args, fmt);
+	vsnprintf(MQTT_text, sizeof(MQTT_text), fmt, args);
+	va_end(args);
+	pthread_mutex_unlock(&MQTT_textMutex);
+}
+
+/*------------------------------------------------------------------
+ * Packet encoding
+ *------------------------------------------------------------------*/
+
+static uint8_t*
+MQTT_Put_Header(uint8_t* p, uint8_t type, size_t remaining) {
+	*p++ = type;
+	do {
+		uint8_t byte = remaining % 128;
+		remaining /= 128;
+		if( remaining )
+			byte |= 0x80;
+		*p++ = byte;
+	} while( remaining );
+	return p;
+}
+
+static uint8_t*
+MQTT_Put_String(uint8_t* p, const char* string) {
+	size_t length = strlen(string);
+	*p++ = (length >> 8) & 0xff;
+	*p++ = length & 0xff;
+	memcpy(p, string, length);
+	return p + length;
+}
+
+/*------------------------------------------------------------------
+ * In-process stub broker
+ *------------------------------------------------------------------*/
+
+static int
+MQTT_Stub_Read(int fd, uint8_t* data, size_t length) {
+	while( length ) {
+		ssize_t got = read(fd, data, length);
+		if( got < 0 && errno == EINTR )
+			continue;
+		if( got <= 0 )
+			return 0;
+		data += got;
+		length -= got;
+	}
+	return 1;
+}
+
+//Accepts any CONNECT and acknowledges every PUBLISH and PINGREQ
+static void*
+MQTT_Stub_Thread(void* data) {
+	int fd = (int)(intptr_t)data;
+	uint8_t* body = 0;
+	size_t size = 0;
+	uint8_t type;
+
+	while( MQTT_Stub_Read(fd, &type, 1) ) {
+		size_t remaining = 0, multiplier = 1;
+		uint8_t byte;
+		do {
+			if( !MQTT_Stub_Read(fd, &byte, 1) )
+				goto done;
+			remaining += (byte & 0x7f) * multiplier;
+			multiplier *= 128;
+		} while( (byte & 0x80) && multiplier <= 128 * 128 * 128 );
+		if( remaining > size ) {
+			uint8_t* grown = realloc(body, remaining);
+			if( !grown )
+				break;
+			body = grown;
+			size = remaining;
+		}
+		if( remaining && !MQTT_Stub_Read(fd, body, remaining) )
+			break;
+
+		uint8_t reply[4];
+		size_t replyLength = 0;
+		switch( type >> 4 ) {
+			case 1:		//CONNECT
+				reply[0] = 0x20; reply[1] = 2; reply[2] = 0; reply[3] = 0;
+				replyLength = 4;
+				break;
+			case 3:		//PUBLISH
+				atomic_fetch_add(&MQTT_stubReceived, 1);
+				if( ((type >> 1) & 3) == 1 && remaining >= 2 ) {
+					size_t topicLength = (body[0] << 8) | body[1];
+					if( remaining >= topicLength + 4 ) {
+						reply[0] = 0x40; reply[1] = 2;
+						reply[2] = body[2 + topicLength];
+						reply[3] = body[3 + topicLength];
+						replyLength = 4;
+					}
+				}
+				break;
+			case 12:	//PINGREQ
+				reply[0] = 0xD0; reply[1] = 0;
+				replyLength = 2;
+				break;
+			case 14:	//DISCONNECT
+				goto done;
+		}
+		if( replyLength && send(fd, reply, replyLength, MSG_NOSIGNAL) != (ssize_t)replyLength )
+			break;
+	}
+done:
+	free(body);
+	close(fd);
+	return NULL;
+}
+
+/*------------------------------------------------------------------
+ * Connection, runs on the publisher thread
+ *------------------------------------------------------------------*/
+
+//True when the publisher is stopping or MQTT_Start published a new configuration
+static int
+MQTT_Interrupted() {
+	return !atomic_load(&MQTT_running) || atomic_load(&MQTT_generation) != MQTT_applied;
+}
+
+/*
+ * Waits for events on fd (ignored when fd < 0) for at most timeout ms.
+ * Returns 1 when fd is ready, 0 on timeout or, with wake set, when an
+ * item was queued and -1 when the publisher is stopping or reconfigured.
+ */
+static int
+MQTT_Wait(int fd, short events, int timeout, int wake) {
+	gint64 deadline = MQTT_Now() + timeout;
+	while( !MQTT_Interrupted() ) {
+		struct pollfd fds[2];
+		fds[0].fd = MQTT_wake;
+		fds[0].events = POLLIN;
+		fds[1].fd = fd;
+		fds[1].events = events;
+		fds[0].revents = fds[1].revents = 0;
+		gint64 remaining = deadline - MQTT_Now();
+		if( remaining < 0 )
+			remaining = 0;
+		int result = poll(fds, fd >= 0 ? 2 : 1, (int)remaining);
+		if( result < 0 && errno != EINTR )
+			return 0;
+		if( fds[0].revents & POLLIN ) {
+			uint64_t count;
+			if( read(MQTT_wake, &count, sizeof(count)) < 0 ) {
+				LOG_TRACE("%s: Wake read failed\n",__func__);
+			}
+		}
+		if( fd >= 0 && fds[1].revents )
+			return 1;
+		if( (wake && (fds[0].revents & POLLIN)) || remaining == 0 )
+			return MQTT_Interrupted() ? -1 : 0;
+	}
+	return -1;
+}
+
+static int
+MQTT_Send(const uint8_t* data, size_t length) {
+	if( MQTT_fd < 0 )
+		return 0;
+	while( length ) {
+		ssize_t sent = send(MQTT_fd, data, length, MSG_NOSIGNAL);
+		if( sent < 0 ) {
+			if( errno == EINTR )
+				continue;
+			return 0;
+		}
+		data += sent;
+		length -= sent;
+	}
+	MQTT_lastSend = MQTT_Now();
+	return 1;
+}
+
+static void
+MQTT_Disconnect(const char* reason) {
+	if( MQTT_fd < 0 )
+		return;
+	close(MQTT_fd);
+	MQTT_fd = -1;
+	MQTT_rxLength = 0;
+	MQTT_pingSent = 0;
+	atomic_store(&MQTT_connected, 0);
+	if( reason ) {
+		atomic_fetch_add(&MQTT_reconnects, 1);
+		MQTT_Text("Disconnected: %s", reason);
+		LOG_WARN("MQTT: Disconnected from %s: %s\n", MQTT_config.host, reason);
+	}
+}
+
+static void
+MQTT_Acknowledged(uint16_t id) {
+	for( int i = 0; i < MQTT_inflightCount; i++ ) {
+		if( MQTT_inflight[i].id != id )
+			continue;
+		free(MQTT_inflight[i].packet);
+		memmove(&MQTT_inflight[i], &MQTT_inflight[i + 1], (MQTT_inflightCount - i - 1) * sizeof(MQTT_Inflight));
+		MQTT_inflightCount--;
+		atomic_store(&MQTT_inflightNow, MQTT_inflightCount);
+		return;
+	}
+}
+
+static void
+MQTT_Packet(uint8_t type, const uint8_t* body, size_t length) {
+	switch( type >> 4 ) {
+		case 2:		//CONNACK
+			if( length >= 2 )
+				MQTT_connack = body[1];
+			break;
+		case 4:		//PUBACK
+			if( length >= 2 )
+				MQTT_Acknowledged((body[0] << 8) | body[1]);
+			break;
+		case 13:	//PINGRESP
+			MQTT_pingSent = 0;
+			break;
+		default:
+			LOG_TRACE("%s: Ignored packet type %u\n",__func__, type >> 4);
+			break;
+	}
+}
+
+//Reads what is available and handles complete packets.  Returns 0 when the connection is lost
+static int
+MQTT_Receive() {
+	ssize_t got = recv(MQTT_fd, MQTT_rx + MQTT_rxLength, sizeof(MQTT_rx) - MQTT_rxLength, MSG_DONTWAIT);
+	if( got == 0 )
+		return 0;
+	if( got < 0 )
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	MQTT_rxLength += got;
+
+	size_t offset = 0;
+	while( MQTT_rxLength - offset >= 2 ) {
+		size_t remaining = 0, multiplier = 1, header = 1;
+		int complete = 0;
+		while( header < 5 && offset + header < MQTT_rxLength ) {
+			uint8_t byte = MQTT_rx[offset + header++];
+			remaining += (byte & 0x7f) * multiplier;
+			multiplier *= 128;
+			if( !(byte & 0x80) ) {
+				complete = 1;
+				break;
+			}
+		}
+		if( !complete ) {
+			if( header >= 5 )
+				return 0;		//Malformed length
+			break;
+		}
+		if( header + remaining > sizeof(MQTT_rx) )
+			return 0;			//A publisher is never sent packets this large
+		if( offset + header + remaining > MQTT_rxLength )
+			break;
+		MQTT_Packet(MQTT_rx[offset], MQTT_rx + offset + header, remaining);
+		offset += header + remaining;
+	}
+	memmove(MQTT_rx, MQTT_rx + offset, MQTT_rxLength - offset);
+	MQTT_rxLength -= offset;
+	return 1;
+}
+
+static int
+MQTT_Open(const char** reason) {
+	if( MQTT_config.stub ) {
+		int pair[2];
+		pthread_t stub;
+		if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0 ) {
+			*reason = strerror(errno);
+			return -1;
+		}
+		if( pthread_create(&stub, NULL, MQTT_Stub_Thread, (void*)(intptr_t)pair[1]) != 0 ) {
+			*reason = "Unable to start stub broker";
+			close(pair[0]);
+			close(pair[1]);
+			return -1;
+		}
+		pthread_detach(stub);
+		return pair[0];
+	}
+
+	char port[16];
+	snprintf(port, sizeof(port), "%d", MQTT_config.port);
+	struct addrinfo hints, *addresses = 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int result = getaddrinfo(MQTT_config.host, port, &hints, &addresses);
+	if( result != 0 ) {
+		*reason = gai_strerror(result);
+		return -1;
+	}
+
+	int fd = -1;
+	*reason = "Connection refused";
+	for( struct addrinfo* address = addresses; address && fd < 0; address = address->ai_next ) {
+		fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+		if( fd < 0 )
+			continue;
+		if( connect(fd, address->ai_addr, address->ai_addrlen) < 0 ) {
+			int error = errno;
+			if( error == EINPROGRESS ) {
+				socklen_t length = sizeof(error);
+				int ready = MQTT_Wait(fd, POLLOUT, MQTT_CONNECT_TIMEOUT, 0);
+				if( ready <= 0 )
+					error = ETIMEDOUT;
+				else if( getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 )
+					error = errno;
+			}
+			if( error ) {
+				*reason = strerror(error);
+				close(fd);
+				fd = -1;
+				if( MQTT_Interrupted() )
+					break;
+			}
+		}
+	}
+	freeaddrinfo(addresses);
+	if( fd < 0 )
+		return -1;
+
+	//Writes block with a timeout so a stalled broker cannot hang the publisher forever
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	struct timeval timeout = { 5, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static int
+MQTT_Connect() {
+	const char* reason = 0;
+	atomic_store(&MQTT_connecting, 1);
+	MQTT_Text("Connecting to %s:%d", MQTT_config.host, MQTT_config.port);
+
+	MQTT_fd = MQTT_Open(&reason);
+	if( MQTT_fd < 0 ) {
+		MQTT_Text("Connection failed: %s", reason ? reason : "Unknown error");
+		atomic_store(&MQTT_connecting, 0);
+		return 0;
+	}
+
+	int user = MQTT_config.user[0] != 0;
+	int password = user && MQTT_config.password[0] != 0;
+	size_t remaining = 10 + 2 + strlen(MQTT_config.clientId);
+	if( user )
+		remaining += 2 + strlen(MQTT_config.user);
+	if( password )
+		remaining += 2 + strlen(MQTT_config.password);
+	uint8_t packet[512];
+	uint8_t* p = MQTT_Put_Header(packet, 0x10, remaining);
+	p = MQTT_Put_String(p, "MQTT");
+	*p++ = 4;												//Protocol level 3.1.1
+	*p++ = 0x02 | (user ? 0x80 : 0) | (password ? 0x40 : 0);	//Clean session
+	*p++ = (MQTT_config.keepAlive >> 8) & 0xff;
+	*p++ = MQTT_config.keepAlive & 0xff;
+	p = MQTT_Put_String(p, MQTT_config.clientId);
+	if( user )
+		p = MQTT_Put_String(p, MQTT_config.user);
+	if( password )
+		p = MQTT_Put_String(p, MQTT_config.password);
+
+	MQTT_connack = -1;
+	MQTT_rxLength = 0;
+	if( !MQTT_Send(packet, p - packet) ) {
+		MQTT_Disconnect(0);
+		MQTT_Text("Connection failed: %s", strerror(errno));
+		atomic_store(&MQTT_connecting, 0);
+		return 0;
+	}
+
+	gint64 deadline = MQTT_Now() + MQTT_CONNECT_TIMEOUT;
+	while( MQTT_connack < 0 && MQTT_Now() < deadline ) {
+		int ready = MQTT_Wait(MQTT_fd, POLLIN, (int)(deadline - MQTT_Now()), 0);
+		if( ready < 0 || (ready > 0 && !MQTT_Receive()) )
+			break;
+	}
+	if( MQTT_connack != 0 ) {
+		static const char* refused[] = { "", "Unacceptable protocol version", "Identifier rejected",
+			"Server unavailable", "Bad user name or password", "Not authorized" };
+		MQTT_Disconnect(0);
+		MQTT_Text("Connection failed: %s", MQTT_connack < 0 ? "No response from broker" :
+			MQTT_connack < 6 ? refused[MQTT_connack] : "Refused");
+		atomic_store(&MQTT_connecting, 0);
+		return 0;
+	}
+
+	//Resend unacknowledged messages from the previous connection
+	for( int i = 0; i < MQTT_inflightCount; i++ ) {
+		MQTT_inflight[i].packet[0] |= 0x08;
+		if( !MQTT_Send(MQTT_inflight[i].packet, MQTT_inflight[i].length) ) {
+			MQTT_Disconnect(strerror(errno));
+			atomic_store(&MQTT_connecting, 0);
+			return 0;
+		}
+	}
+
+	atomic_store(&MQTT_connecting, 0);
+	atomic_store(&MQTT_connected, 1);
+	MQTT_Text("Connected to %s:%d", MQTT_config.host, MQTT_config.port);
+	LOG("MQTT: Connected to %s:%d\n", MQTT_config.host, MQTT_config.port);
+	return 1;
+}
+
+/*------------------------------------------------------------------
+ * Publishing, runs on the publisher thread
+ *------------------------------------------------------------------*/
+
+static int
+MQTT_Publish_Message(const char* topic, const char* payload, size_t length) {
+	int qos = MQTT_config.qos;
+	if( qos && MQTT_inflightCount >= MQTT_INFLIGHT_SLOTS ) {
+		atomic_fetch_add(&MQTT_dropped, 1);
+		return 1;
+	}
+	size_t remaining = 2 + strlen(topic) + (qos ? 2 : 0) + length;
+	uint8_t* packet = malloc(remaining + 5);
+	if( !packet ) {
+		LOG_WARN("%s: Memory allocation error\n",__func__);
+		atomic_fetch_add(&MQTT_dropped, 1);
+		return 1;
+	}
+	uint8_t* p = MQTT_Put_Header(packet, 0x30 | (qos << 1), remaining);
+	p = MQTT_Put_String(p, topic);
+	if( qos ) {
+		if( ++MQTT_packetId == 0 )
+			MQTT_packetId = 1;
+		*p++ = MQTT_packetId >> 8;
+		*p++ = MQTT_packetId & 0xff;
+	}
+	memcpy(p, payload, length);
+	p += length;
+	size_t total = p - packet;
+
+	if( qos ) {
+		//Kept until PUBACK, also across reconnects
+		MQTT_inflight[MQTT_inflightCount].id = MQTT_packetId;
+		MQTT_inflight[MQTT_inflightCount].packet = packet;
+		MQTT_inflight[MQTT_inflightCount].length = total;
+		MQTT_inflightCount++;
+		atomic_store(&MQTT_inflightNow, MQTT_inflightCount);
+	}
+	int sent = MQTT_Send(packet, total);
+	if( !qos )
+		free(packet);
+	if( !sent )
+		return 0;
+	atomic_fetch_add(&MQTT_published, 1);
+	atomic_fetch_add(&MQTT_bytes, total);
+	return 1;
+}
+
+static int
+MQTT_Append(MQTT_Batch* batch, const char* fmt, ...) {
+	va_list args;
+	for(;;) {
+		size_t available = batch->size - batch->length;
+		va_start(args, fmt);
+		int length = vsnprintf(batch->data ? batch->data + batch->length : 0, available, fmt, args);
+		va_end(args);
+		if( length < 0 )
+			return 0;
+		if( (size_t)length < available ) {
+			batch->length += length;
+			return 1;
+		}
+		size_t size = batch->size ? batch->size * 2 : 4096;
+		while( size < batch->length + length + 1 )
+			size *= 2;
+		char* data = realloc(batch->data, size);
+		if( !data ) {
+			LOG_WARN("%s: Memory allocation error\n",__func__);
+			return 0;
+		}
+		batch->data = data;
+		batch->size = size;
+	}
+}
+
+static int
+MQTT_Flush(MQTT_Batch* batch) {
+	if( batch->frames == 0 )
+		return 1;
+	int batched = MQTT_config.batchFrames != 1 || MQTT_config.batchMs > 0;
+	if( batched )
+		MQTT_Append(batch, "]");
+	int result = MQTT_Publish_Message(batch->topic, batch->data, batch->length);
+
+	gint64 now = g_get_monotonic_time();
+	unsigned long long latency = now - batch->oldest;
+	atomic_fetch_add(&MQTT_latencySum, (unsigned long long)(batch->frames * now - batch->enqueuedSum));
+	atomic_fetch_add(&MQTT_latencyCount, batch->frames);
+	if( latency > atomic_load(&MQTT_latencyMax) )
+		atomic_store(&MQTT_latencyMax, latency);
+	atomic_fetch_add(&MQTT_publishedFrames, batch->frames);
+
+	batch->length = 0;
+	batch->frames = 0;
+	batch->enqueuedSum = 0;
+	return result;
+}
+
+static int
+MQTT_Frame_Item(const MQTT_Item* item) {
+	const Frame_t* frame = &item->frame;
+	int batched = MQTT_config.batchFrames != 1 || MQTT_config.batchMs > 0;
+	int result = 1;
+
+	for( int b = 0; b < MQTT_batchCount && result; b++ ) {
+		MQTT_Batch* batch = &MQTT_batches[b];
+		int matches = 0;
+		for( unsigned int i = 0; i < frame->count; i++ ) {
+			int label = frame->detections[i].label;
+			if( (label < MQTT_MAX_LABELS ? MQTT_labelBatch[label] : 0) == b )
+				matches++;
+		}
+		//Label topics only get frames with that label, the default topic also gets empty frames
+		if( !matches && (b != 0 || frame->count) )
+			continue;
+
+		if( batch->frames == 0 ) {
+			batch->opened = MQTT_Now();
+			batch->oldest = item->enqueued;
+			if( batched )
+				MQTT_Append(batch, "[");
+		} else {
+			MQTT_Append(batch, ",");
+		}
+		MQTT_Append(batch, "{\"sequence\":%u,\"timestamp\":%llu,\"detections\":[",
+			frame->sequence, (unsigned long long)frame->timestamp);
+		int first = 1;
+		for( unsigned int i = 0; i < frame->count; i++ ) {
+			const Detection_t* detection = &frame->detections[i];
+			int label = detection->label;
+			if( (label < MQTT_MAX_LABELS ? MQTT_labelBatch[label] : 0) != b )
+				continue;
+			MQTT_Append(batch, "%s{\"label\":\"%s\",\"c\":%u,\"x\":%u,\"y\":%u,\"w\":%u,\"h\":%u,\"zones\":%u}",
+				first ? "" : ",", label < MQTT_labelCount ? MQTT_labelNames[label] : "Undefined",
+				detection->confidence, detection->x, detection->y, detection->w, detection->h, detection->zones);
+			first = 0;
+		}
+		MQTT_Append(batch, "]}");
+		batch->frames++;
+		batch->enqueuedSum += item->enqueued;
+
+		if( (MQTT_config.batchFrames > 0 && batch->frames >= MQTT_config.batchFrames) || batch->length >= MQTT_MAX_BATCH )
+			result = MQTT_Flush(batch);
+	}
+	return result;
+}
+
+static int
+MQTT_Event_Item(const MQTT_Item* item) {
+	char topic[192];
+	char payload[160];
+	snprintf(topic, sizeof(topic), "%s/event/%s", MQTT_config.preTopic, item->event.id);
+	int length = snprintf(payload, sizeof(payload), "{\"event\":\"%s\",\"state\":%s,\"timestamp\":%.0f}",
+		item->event.id, item->event.state ? "true" : "false", item->event.timestamp);
+	if( length < 0 || (size_t)length >= sizeof(payload) )
+		return 1;
+	return MQTT_Publish_Message(topic, payload, length);
+}
+
+//Publishes queued items while the in-flight window has room and flushes batches that are due
+static int
+MQTT_Drain() {
+	unsigned int head = atomic_load_explicit(&MQTT_head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&MQTT_tail, memory_order_acquire);
+	while( head != tail && (MQTT_config.qos == 0 || MQTT_inflightCount < MQTT_config.maxInflight) ) {
+		const MQTT_Item* item = &MQTT_queue[head % MQTT_QUEUE_SIZE];
+		int result = item->type == MQTT_ITEM_EVENT ? MQTT_Event_Item(item) : MQTT_Frame_Item(item);
+		head++;
+		atomic_store_explicit(&MQTT_head, head, memory_order_release);
+		if( !result )
+			return 0;
+	}
+
+	if( MQTT_config.batchMs > 0 ) {
+		gint64 now = MQTT_Now();
+		for( int b = 0; b < MQTT_batchCount; b++ )
+			if( MQTT_batches[b].frames && now - MQTT_batches[b].opened >= MQTT_config.batchMs )
+				if( !MQTT_Flush(&MQTT_batches[b]) )
+					return 0;
+	}
+	return 1;
+}
+
+//Disconnects and drops the in-flight messages and open batches
+static void
+MQTT_Close() {
+	if( MQTT_fd >= 0 ) {
+		static const uint8_t disconnect[2] = { 0xE0, 0 };
+		MQTT_Send(disconnect, sizeof(disconnect));
+		MQTT_Disconnect(0);
+	}
+	for( int i = 0; i < MQTT_inflightCount; i++ )
+		free(MQTT_inflight[i].packet);
+	MQTT_inflightCount = 0;
+	for( int b = 0; b < MQTT_batchCount; b++ ) {
+		free(MQTT_batches[b].data);
+		memset(&MQTT_batches[b], 0, sizeof(MQTT_Batch));
+	}
+	MQTT_batchCount = 0;
+	atomic_store(&MQTT_connecting, 0);
+	atomic_store(&MQTT_inflightNow, 0);
+}
+
+//Adopts the configuration published by MQTT_Start, items queued before are dropped
+static void
+MQTT_Apply() {
+	MQTT_Close();
+	pthread_mutex_lock(&MQTT_setupMutex);
+	MQTT_applied = atomic_load(&MQTT_generation);
+	MQTT_config = MQTT_setup.config;
+	MQTT_batchCount = MQTT_setup.topicCount;
+	for( int b = 0; b < MQTT_batchCount; b++ )
+		memcpy(MQTT_batches[b].topic, MQTT_setup.topics[b], sizeof(MQTT_batches[b].topic));
+	memcpy(MQTT_labelBatch, MQTT_setup.labelBatch, sizeof(MQTT_labelBatch));
+	memcpy(MQTT_labelNames, MQTT_setup.labelNames, sizeof(MQTT_labelNames));
+	MQTT_labelCount = MQTT_setup.labelCount;
+	pthread_mutex_unlock(&MQTT_setupMutex);
+	atomic_store(&MQTT_head, atomic_load(&MQTT_tail));
+}
+
+/*
+ * Runs from MQTT_Init to MQTT_Cleanup.  MQTT_Start never waits for it:
+ * a new configuration interrupts any wait and is adopted at the top of
+ * the loop, once a blocking name lookup or send has returned.
+ */
+static void*
+MQTT_Thread(void* data) {
+	int backoff = 1;
+
+	while( atomic_load(&MQTT_running) ) {
+		if( atomic_load(&MQTT_generation) != MQTT_applied ) {
+			MQTT_Apply();
+			backoff = 1;
+		}
+		if( !MQTT_config.host[0] ) {
+			MQTT_Wait(-1, 0, 60000, 0);
+			continue;
+		}
+		if( MQTT_fd < 0 ) {
+			if( !MQTT_Connect() ) {
+				if( MQTT_Interrupted() )
+					continue;
+				char reason[160];
+				pthread_mutex_lock(&MQTT_textMutex);
+				snprintf(reason, sizeof(reason), "%s", MQTT_text);
+				pthread_mutex_unlock(&MQTT_textMutex);
+				MQTT_Text("%s. Retry in %d s", reason, backoff);
+				if( MQTT_Wait(-1, 0, backoff * 1000, 0) < 0 )
+					continue;
+				backoff = backoff * 2 > MQTT_MAX_BACKOFF ? MQTT_MAX_BACKOFF : backoff * 2;
+				continue;
+			}
+			backoff = 1;
+		}
+
+		gint64 now = MQTT_Now();
+		gint64 timeout = 1000;
+		if( MQTT_config.keepAlive > 0 ) {
+			gint64 interval = (gint64)MQTT_config.keepAlive * 1000;
+			if( MQTT_pingSent && now - MQTT_pingSent >= interval ) {
+				MQTT_Disconnect("Broker not responding");
+				continue;
+			}
+			if( !MQTT_pingSent && now - MQTT_lastSend >= interval ) {
+				static const uint8_t ping[2] = { 0xC0, 0 };
+				if( !MQTT_Send(ping, sizeof(ping)) ) {
+					MQTT_Disconnect(strerror(errno));
+					continue;
+				}
+				MQTT_pingSent = now;
+			}
+			gint64 due = (MQTT_pingSent ? MQTT_pingSent : MQTT_lastSend) + interval - now;
+			if( due < timeout )
+				timeout = due;
+		}
+		if( MQTT_config.batchMs > 0 ) {
+			for( int b = 0; b < MQTT_batchCount; b++ ) {
+				if( !MQTT_batches[b].frames )
+					continue;
+				gint64 due = MQTT_batches[b].opened + MQTT_config.batchMs - now;
+				if( due < timeout )
+					timeout = due;
+			}
+		}
+
+		int ready = MQTT_Wait(MQTT_fd, POLLIN, timeout > 0 ? (int)timeout : 0, 1);
+		if( ready < 0 )
+			continue;
+		if( ready > 0 && !MQTT_Receive() ) {
+			MQTT_Disconnect("Connection closed by broker");
+			continue;
+		}
+		if( !MQTT_Drain() )
+			MQTT_Disconnect(strerror(errno));
+	}
+
+	MQTT_Close();
+	return NULL;
+}
+
+/*------------------------------------------------------------------
+ * Main thread
+ *------------------------------------------------------------------*/
+
+static MQTT_Item*
+MQTT_Reserve() {
+	unsigned int tail = atomic_load_explicit(&MQTT_tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&MQTT_head, memory_order_acquire);
+	if( tail - head >= MQTT_QUEUE_SIZE ) {
+		atomic_fetch_add(&MQTT_dropped, 1);
+		return 0;
+	}
+	MQTT_Item* item = &MQTT_queue[tail % MQTT_QUEUE_SIZE];
+	item->enqueued = g_get_monotonic_time();
+	return item;
+}
+
+static void
+MQTT_Commit() {
+	unsigned int tail = atomic_load_explicit(&MQTT_tail, memory_order_relaxed);
+	atomic_store_explicit(&MQTT_tail, tail + 1, memory_order_release);
+	uint64_t one = 1;
+	if( write(MQTT_wake, &one, sizeof(one)) < 0 ) {
+		LOG_TRACE("%s: Wake failed\n",__func__);
+	}
+}
+
+void
+MQTT_Publish(const Frame_t* frame) {
+	if( !frame || !atomic_load_explicit(&MQTT_enabled, memory_order_relaxed) )
+		return;
+
+	//Only the first of consecutive empty frames is published
+	int empty = frame->count == 0;
+	if( empty && MQTT_lastFrameEmpty )
+		return;
+	MQTT_lastFrameEmpty = empty;
+
+	MQTT_Item* item = MQTT_Reserve();
+	if( !item )
+		return;
+	unsigned int count = frame->count < FRAME_MAX_DETECTIONS ? frame->count : FRAME_MAX_DETECTIONS;
+	item->type = MQTT_ITEM_FRAME;
+	item->frame.sequence = frame->sequence;
+	item->frame.timestamp = frame->timestamp;
+	item->frame.count = count;
+	memcpy(item->frame.detections, frame->detections, count * sizeof(Detection_t));
+	MQTT_Commit();
+}
+
+void
+MQTT_Event(const char* id, int state) {
+	if( !id || !atomic_load_explicit(&MQTT_enabled, memory_order_relaxed) )
+		return;
+	MQTT_Item* item = MQTT_Reserve();
+	if( !item )
+		return;
+	item->type = MQTT_ITEM_EVENT;
+	snprintf(item->event.id, sizeof(item->event.id), "%s", id);
+	item->event.state = state;
+	item->event.timestamp = ACAP_DEVICE_Timestamp();
+	MQTT_Commit();
+}
+
+static gboolean
+MQTT_Status(gpointer user_data) {
+	gint64 now = g_get_monotonic_time();
+	double seconds = MQTT_statusTime ? (now - MQTT_statusTime) / 1000000.0 : 0;
+	MQTT_statusTime = now;
+	unsigned long long published = atomic_load(&MQTT_published);
+	unsigned long long frames = atomic_load(&MQTT_publishedFrames);
+	unsigned long long latencySum = atomic_exchange(&MQTT_latencySum, 0);
+	unsigned long long latencyCount = atomic_exchange(&MQTT_latencyCount, 0);
+	unsigned long long latencyMax = atomic_exchange(&MQTT_latencyMax, 0);
+	char text[sizeof(MQTT_text)];
+	pthread_mutex_lock(&MQTT_textMutex);
+	snprintf(text, sizeof(text), "%s", MQTT_text);
+	pthread_mutex_unlock(&MQTT_textMutex);
+
+	ACAP_STATUS_SetBool("mqtt","connected", atomic_load(&MQTT_connected));
+	ACAP_STATUS_SetBool("mqtt","connecting", atomic_load(&MQTT_connecting));
+	ACAP_STATUS_SetString("mqtt","status", text);
+	ACAP_STATUS_SetNumber("mqtt","published", published);
+	ACAP_STATUS_SetNumber("mqtt","publishedFrames", frames);
+	ACAP_STATUS_SetNumber("mqtt","bytes", atomic_load(&MQTT_bytes));
+	ACAP_STATUS_SetNumber("mqtt","dropped", atomic_load(&MQTT_dropped));
+	ACAP_STATUS_SetNumber("mqtt","reconnects", atomic_load(&MQTT_reconnects));
+	ACAP_STATUS_SetNumber("mqtt","inflight", atomic_load(&MQTT_inflightNow));
+	ACAP_STATUS_SetNumber("mqtt","queue", atomic_load(&MQTT_tail) - atomic_load(&MQTT_head));
+	if( seconds > 0 ) {
+		ACAP_STATUS_SetNumber("mqtt","messagesPerSecond", (published - MQTT_statusPublished) / seconds);
+		ACAP_STATUS_SetNumber("mqtt","framesPerSecond", (frames - MQTT_statusFrames) / seconds);
+	}
+	ACAP_STATUS_SetNumber("mqtt","latencyMs", latencyCount ? latencySum / 1000.0 / latencyCount : 0);
+	ACAP_STATUS_SetNumber("mqtt","latencyMaxMs", latencyMax / 1000.0);
+	if( MQTT_setup.config.stub )
+		ACAP_STATUS_SetNumber("mqtt","stubReceived", atomic_load(&MQTT_stubReceived));
+	MQTT_statusPublished = published;
+	MQTT_statusFrames = frames;
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+MQTT_Signal() {
+	uint64_t one = 1;
+	if( write(MQTT_wake, &one, sizeof(one)) < 0 ) {
+		LOG_TRACE("%s: Wake failed\n",__func__);
+	}
+}
+
+static void
+MQTT_Copy_String(char* target, size_t size, cJSON* settings, const char* name, const char* fallback) {
+	cJSON* item = cJSON_GetObjectItem(settings, name);
+	snprintf(target, size, "%s", cJSON_IsString(item) ? item->valuestring : fallback);
+}
+
+static int
+MQTT_Int(cJSON* settings, const char* name, int fallback) {
+	cJSON* item = cJSON_GetObjectItem(settings, name);
+	if( cJSON_IsNumber(item) )
+		return item->valueint;
+	if( cJSON_IsString(item) && item->valuestring[0] )
+		return atoi(item->valuestring);		//The MQTT page posts the port as text
+	return fallback;
+}
+
+static int
+MQTT_Topic_Batch(MQTT_Setup* setup, const char* topic) {
+	for( int b = 0; b < setup->topicCount; b++ )
+		if( strcmp(setup->topics[b], topic) == 0 )
+			return b;
+	if( setup->topicCount >= MQTT_MAX_TOPICS ) {
+		LOG_WARN("%s: Too many topics, %s uses the default topic\n",__func__, topic);
+		return 0;
+	}
+	snprintf(setup->topics[setup->topicCount], sizeof(setup->topics[0]), "%s", topic);
+	return setup->topicCount++;
+}
+
+//Fills MQTT_setup from the settings, returns 0 when they cannot be used
+static int
+MQTT_Build(MQTT_Setup* setup) {
+	cJSON* settings = MQTT_settings;
+	MQTT_Config_t* config = &setup->config;
+	memset(setup, 0, sizeof(MQTT_Setup));
+	MQTT_Copy_String(config->host, sizeof(config->host), settings, "address", "");
+	MQTT_Copy_String(config->user, sizeof(config->user), settings, "user", "");
+	MQTT_Copy_String(config->password, sizeof(config->password), settings, "password", "");
+	MQTT_Copy_String(config->preTopic, sizeof(config->preTopic), settings, "preTopic", "detectx");
+	MQTT_Copy_String(config->clientId, sizeof(config->clientId), settings, "clientId", "");
+	if( !config->clientId[0] ) {
+		const char* serial = ACAP_DEVICE_Prop("serial");
+		snprintf(config->clientId, sizeof(config->clientId), "%s-%s", ACAP_Name(), serial ? serial : "camera");
+	}
+	config->stub = strcmp(config->host, "stub") == 0;
+	config->port = MQTT_Int(settings, "port", 1883);
+	config->keepAlive = MQTT_Int(settings, "keepAlive", 60);
+	config->qos = MQTT_Int(settings, "qos", 0) ? 1 : 0;
+	config->batchFrames = MQTT_Int(settings, "batchFrames", 1);
+	config->batchMs = MQTT_Int(settings, "batchMs", 0);
+	config->maxInflight = MQTT_Int(settings, "maxInflight", 16);
+	if( config->batchFrames < 0 )
+		config->batchFrames = 0;
+	if( config->batchMs < 0 )
+		config->batchMs = 0;
+	if( config->batchFrames == 0 && config->batchMs == 0 )
+		config->batchFrames = 1;
+	if( config->maxInflight < 1 )
+		config->maxInflight = 1;
+	if( config->maxInflight > MQTT_MAX_INFLIGHT )
+		config->maxInflight = MQTT_MAX_INFLIGHT;
+	if( config->keepAlive < 0 || config->keepAlive > 65535 )
+		config->keepAlive = 60;
+
+	if( !config->host[0] )
+		return 1;
+	if( cJSON_IsTrue(cJSON_GetObjectItem(settings,"tls")) ) {
+		config->host[0] = 0;
+		return 0;
+	}
+
+	//Label names and per-label topics
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	cJSON* label = labels ? labels->child : 0;
+	while( label && setup->labelCount < MQTT_MAX_LABELS ) {
+		char* name = setup->labelNames[setup->labelCount];
+		snprintf(name, sizeof(setup->labelNames[0]), "%s", cJSON_IsString(label) ? label->valuestring : "Undefined");
+		for( char* c = name; *c; c++ )
+			if( *c == '"' || *c == '\\' || (unsigned char)*c < 0x20 )
+				*c = '_';
+		setup->labelCount++;
+		label = label->next;
+	}
+	char topic[192];
+	snprintf(topic, sizeof(topic), "%s/detections", config->preTopic);
+	MQTT_Topic_Batch(setup, topic);
+	cJSON* topics = cJSON_GetObjectItem(settings,"topics");
+	cJSON* labelTopic = cJSON_IsObject(topics) ? topics->child : 0;
+	while( labelTopic ) {
+		int index = -1;
+		for( int i = 0; i < setup->labelCount && index < 0; i++ )
+			if( strcmp(setup->labelNames[i], labelTopic->string) == 0 )
+				index = i;
+		if( index < 0 ) {
+			LOG_WARN("MQTT: Unknown label %s in topics\n", labelTopic->string);
+		} else if( cJSON_IsString(labelTopic) ) {
+			setup->labelBatch[index] = labelTopic->valuestring[0] ? MQTT_Topic_Batch(setup, labelTopic->valuestring) : -1;
+		}
+		labelTopic = labelTopic->next;
+	}
+	return 1;
+}
+
+/*
+ * Hands a new configuration to the publisher thread and returns without
+ * waiting for it; the thread drops its connection at the next wakeup.
+ */
+static int
+MQTT_Start() {
+	pthread_mutex_lock(&MQTT_setupMutex);
+	int valid = MQTT_Build(&MQTT_setup);
+	pthread_mutex_unlock(&MQTT_setupMutex);
+	const MQTT_Config_t* config = &MQTT_setup.config;
+
+	atomic_store(&MQTT_enabled, config->host[0] != 0);
+	atomic_fetch_add(&MQTT_generation, 1);
+	MQTT_lastFrameEmpty = 0;
+	MQTT_Signal();
+
+	if( !atomic_load(&MQTT_running) ) {
+		MQTT_Text("Unable to start publisher");
+		valid = 0;
+	} else if( !valid ) {
+		MQTT_Text("TLS is not supported");
+		LOG_WARN("MQTT: TLS is not supported\n");
+	} else if( !config->host[0] ) {
+		MQTT_Text("Not configured");
+	} else {
+		MQTT_Text("Connecting to %s:%d", config->host, config->port);
+		atomic_store(&MQTT_connecting, 1);
+	}
+	atomic_store(&MQTT_connected, 0);
+	MQTT_Status(0);
+	return valid;
+}
+
+//Replaces the values of known keys
+static void
+MQTT_Merge(cJSON* settings, cJSON* update) {
+	cJSON* item = update ? update->child : 0;
+	while( item ) {
+		if( item->string && cJSON_GetObjectItem(settings, item->string) )
+			cJSON_ReplaceItemInObject(settings, item->string, cJSON_Duplicate(item, 1));
+		item = item->next;
+	}
+}
+
+//Copy of the settings safe to return to clients
+static cJSON*
+MQTT_Masked() {
+	cJSON* masked = cJSON_Duplicate(MQTT_settings, 1);
+	cJSON* password = cJSON_GetObjectItem(masked, "password");
+	if( cJSON_IsString(password) && password->valuestring[0] )
+		cJSON_ReplaceItemInObject(masked, "password", cJSON_CreateString(MQTT_PASSWORD_MASK));
+	return masked;
+}
+
+static void
+MQTT_Unescape(char* string) {
+	char* out = string;
+	for( char* in = string; *in; in++ ) {
+		if( *in == '%' && g_ascii_isxdigit(in[1]) && g_ascii_isxdigit(in[2]) ) {
+			*out++ = (g_ascii_xdigit_value(in[1]) << 4) | g_ascii_xdigit_value(in[2]);
+			in += 2;
+		} else {
+			*out++ = *in == '+' ? ' ' : *in;
+		}
+	}
+	*out = 0;
+}
+
+static void
+MQTT_HTTP(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	const char* method = ACAP_HTTP_Get_Method(request);
+	cJSON* update = 0;
+
+	if( method && strcmp(method, "POST") == 0 && request->postData ) {
+		update = cJSON_Parse(request->postData);
+	} else {
+		char* set = (char*)ACAP_HTTP_Request_Param(request, "set");
+		if( !set ) {
+			cJSON* masked = MQTT_Masked();
+			ACAP_HTTP_Respond_JSON(response, masked);
+			cJSON_Delete(masked);
+			return;
+		}
+		MQTT_Unescape(set);
+		update = cJSON_Parse(set);
+		free(set);
+	}
+	if( !cJSON_IsObject(update) ) {
+		cJSON_Delete(update);
+		ACAP_HTTP_Respond_Error(response, 400, "Invalid JSON data");
+		return;
+	}
+	//A client posting back the settings it read keeps the stored password
+	cJSON* password = cJSON_GetObjectItem(update, "password");
+	if( cJSON_IsString(password) && strcmp(password->valuestring, MQTT_PASSWORD_MASK) == 0 )
+		cJSON_DeleteItemFromObject(update, "password");
+	MQTT_Merge(MQTT_settings, update);
+	cJSON_Delete(update);
+	ACAP_FILE_Write("localdata/mqtt.json", MQTT_settings);
+	cJSON* masked = MQTT_Masked();
+	MQTT_Merge(MQTT_public, masked);
+	cJSON_Delete(masked);
+
+	if( !MQTT_Start() ) {
+		ACAP_HTTP_Respond_Error(response, 400, MQTT_text);
+		return;
+	}
+	ACAP_HTTP_Respond_Text(response, MQTT_setup.config.host[0] ? "Connecting" : "Not configured");
+}
+
+int
+MQTT_Init() {
+	if( !MQTT_settings ) {
+		MQTT_settings = ACAP_FILE_Read("html/config/mqtt.json");
+		if( !MQTT_settings )
+			MQTT_settings = cJSON_CreateObject();
+		cJSON* saved = ACAP_FILE_Read("localdata/mqtt.json");
+		MQTT_Merge(MQTT_settings, saved);
+		cJSON_Delete(saved);
+		MQTT_public = MQTT_Masked();
+		ACAP_Set_Config("mqtt", MQTT_public);
+
+		MQTT_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if( MQTT_wake < 0 ) {
+			LOG_WARN("%s: Unable to create eventfd: %s\n",__func__, strerror(errno));
+			return 0;
+		}
+		atomic_store(&MQTT_running, 1);
+		if( pthread_create(&MQTT_thread, NULL, MQTT_Thread, NULL) != 0 ) {
+			atomic_store(&MQTT_running, 0);
+			LOG_WARN("%s: Unable to start publisher thread: %s\n",__func__, strerror(errno));
+		}
+		ACAP_HTTP_Node("mqtt", MQTT_HTTP);
+		//Everything but the connection state changes every second
+		const char* live[] = {"published","publishedFrames","bytes","dropped","reconnects","inflight","queue",
+			"messagesPerSecond","framesPerSecond","latencyMs","latencyMaxMs","stubReceived"};
+		for( size_t i = 0; i < sizeof(live) / sizeof(live[0]); i++ )
+			ACAP_STATUS_Live("mqtt", live[i]);
+		MQTT_statusTimer = g_timeout_add_seconds(1, MQTT_Status, NULL);
+	}
+	return MQTT_Start();
+}
+
+//Called after the main loop has quit, so waiting for a lookup in progress is harmless
+void
+MQTT_Cleanup() {
+	atomic_store(&MQTT_enabled, 0);
+	if( atomic_load(&MQTT_running) ) {
+		atomic_store(&MQTT_running, 0);
+		MQTT_Signal();
+		pthread_join(MQTT_thread, NULL);
+	}
+	if( MQTT_statusTimer ) {
+		g_source_remove(MQTT_statusTimer);
+		MQTT_statusTimer = 0;
+	}
+	if( MQTT_wake >= 0 ) {
+		close(MQTT_wake);
+		MQTT_wake = -1;
+	}
+}
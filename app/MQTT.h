@@ -0,0 +1,35 @@
+/*
+ * MQTT 3.1.1 publisher for detections and event state transitions.
+ *
+ * html/config/mqtt.json (saved in localdata/mqtt.json by GET mqtt?set=):
+ *	{
+ *		"address": "broker.local", "port": 1883, "user": "", "password": "",
+ *		"clientId": "", "preTopic": "detectx", "keepAlive": 60, "qos": 0,
+ *		"batchFrames": 1, "batchMs": 0, "maxInflight": 16,
+ *		"topics": {"Person": "site/gate/person", "Helmet": ""}
+ *	}
+ * Detections are published to <preTopic>/detections.  A label listed in
+ * "topics" is published to its own topic instead, or not at all when the
+ * topic is empty.  Event states are published to <preTopic>/event/<id>.
+ * With batchFrames > 1 or batchMs > 0 each PUBLISH carries a JSON array
+ * of frames.  The address "stub" connects to an in-process broker that
+ * acknowledges everything, for throughput testing without a network.
+ */
+#ifndef MQTT_H
+#define MQTT_H
+
+#include "cJSON.h"
+#include "Frame.h"
+
+#define MQTT_QUEUE_SIZE		64		//Frames and events waiting for the publisher thread
+#define MQTT_MAX_INFLIGHT	64		//Upper limit for maxInflight (QoS 1)
+#define MQTT_MAX_TOPICS		16		//Default topic and per-label topics
+#define MQTT_MAX_LABELS		256
+#define MQTT_MAX_BACKOFF	60		//Seconds between reconnect attempts
+
+int		MQTT_Init();
+void	MQTT_Publish(const Frame_t* frame);
+void	MQTT_Event(const char* id, int state);
+void	MQTT_Cleanup();
+
+#endif
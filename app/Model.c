@@ -9,6 +9,7 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <glib.h>
 
 #include "larod.h"
 #include "ACAP.h"
@@ -24,46 +25,455 @@ float iou(float x1, float y1, float w1, float h1, float x2, float y2, float w2,
 void Model_Cleanup();
 cJSON* non_maximum_suppression(cJSON* list);
 
-static unsigned int modelWidth = 640;
-static unsigned int modelHeight = 640;
-static size_t inputs = 1;
-static size_t outputs = 1;
-static size_t ppInputs = 1;
-static size_t ppOutputs = 1;
-static unsigned int videoWidth = 1280;
-static unsigned int videoHeight = 720;
 static unsigned int channels = 3;
-static unsigned int boxes = 0;
-static unsigned int classes = 0;
-static float quant = 1.0;
-static float quant_zero = 0;
-static float objectnessThreshold = 0.25;
 static float confidenceThreshold = 0.30;
 static float nms = 0.05;
-static int larodModelFd = -1;
-static larodConnection* conn = NULL;
-static larodModel* InfModel = NULL;
-static larodModel* ppModel = NULL;
-static larodJobRequest* ppReq = NULL;
-static larodMap* ppMap;
-static larodJobRequest* infReq;
-static void* ppInputAddr = MAP_FAILED;
-static void* larodInputAddr = MAP_FAILED;
-static void* larodOutput1Addr = MAP_FAILED;
-static int ppInputFd = -1;
-static int larodInputFd = -1;
-static int larodOutput1Fd = -1;
-static larodTensor** inputTensors = NULL;
-static larodTensor** outputTensors = NULL;
-static larodTensor** ppInputTensors = NULL;
-static larodTensor** ppOutputTensors = 0;
-static size_t yuyvBufferSize = 0;
-
-static  cJSON* modelConfig = 0;
-
-static char PP_SD_INPUT_FILE_PATTERN[] = "/tmp/larod.pp.test-XXXXXX";
-static char OBJECT_DETECTOR_INPUT_FILE_PATTERN[] = "/tmp/larod.in.test-XXXXXX";
-static char OBJECT_DETECTOR_OUT1_FILE_PATTERN[]  = "/tmp/larod.out1.test-XXXXXX";
+
+static  cJSON* modelConfig = 0;		//The "model" config, follows the active model
+
+/*
+ * Preprocessing (NV12 scale and convert to RGB) is shared by every model
+ * with the same input and output geometry.  The cpu-proc job runs once per
+ * frame and its output file is bound as the input tensor of each inference
+ * job request, so a frame that is inferred again, or by another model,
+ * skips both the frame copy and the resize.
+ */
+#define MODEL_MAX_PP	2
+
+typedef struct {
+	larodConnection* conn;
+	larodMap* map;
+	larodModel* model;
+	larodJobRequest* req;
+	larodTensor** inputTensors;
+	larodTensor** outputTensors;
+	size_t inputs;
+	size_t outputs;
+	void* inputAddr;
+	void* outputAddr;
+	int inputFd;
+	int outputFd;
+	size_t inputSize;			//NV12 frame
+	size_t outputSize;			//RGB tensor
+	unsigned int videoWidth;
+	unsigned int videoHeight;
+	unsigned int width;
+	unsigned int height;
+	VdoBuffer* frame;			//Cache key, buffer and sequence of the preprocessed frame
+	unsigned int sequence;
+	int cached;
+	int users;
+	unsigned long long jobs;
+	unsigned long long reused;
+} Model_PP;
+
+static Model_PP Model_pp[MODEL_MAX_PP];
+static GMutex Model_ppMutex;		//Slots are taken by the loader thread
+
+static void
+Model_PP_Destroy( Model_PP* pp ) {
+    larodError* error = NULL;
+    if( pp->req ) larodDestroyJobRequest(&pp->req);
+    if( pp->inputTensors ) larodDestroyTensors(pp->conn, &pp->inputTensors, pp->inputs, &error);
+    if( pp->outputTensors ) larodDestroyTensors(pp->conn, &pp->outputTensors, pp->outputs, &error);
+    larodClearError(&error);
+    if( pp->model ) larodDestroyModel(&pp->model);
+    if( pp->map ) larodDestroyMap(&pp->map);
+    if( pp->conn ) larodDisconnect(&pp->conn, NULL);
+    if( pp->inputAddr != MAP_FAILED && pp->inputAddr ) munmap(pp->inputAddr, pp->inputSize);
+    if( pp->inputFd >= 0 ) close(pp->inputFd);
+    if( pp->outputAddr != MAP_FAILED && pp->outputAddr ) munmap(pp->outputAddr, pp->outputSize);
+    if( pp->outputFd >= 0 ) close(pp->outputFd);
+    memset(pp, 0, sizeof(Model_PP));
+    pp->inputFd = pp->outputFd = -1;
+}
+
+static Model_PP*
+Model_PP_Create( Model_PP* pp, unsigned int inWidth, unsigned int inHeight, unsigned int width, unsigned int height ) {
+    larodError* error = NULL;
+    memset(pp, 0, sizeof(Model_PP));
+    pp->inputFd = pp->outputFd = -1;
+    pp->inputAddr = pp->outputAddr = MAP_FAILED;
+    pp->videoWidth = inWidth;
+    pp->videoHeight = inHeight;
+    pp->width = width;
+    pp->height = height;
+    pp->inputs = pp->outputs = 1;
+    pp->users = 1;		//Reserved while it is created outside the lock
+
+    //Each slot has its own connection, it outlives the model sets that use it
+    if (!larodConnect(&pp->conn, &error)) {
+        LOG_WARN("%s: Could not connect to larod: %s\n", __func__, error->msg);
+        goto failed;
+    }
+
+    pp->map = larodCreateMap(&error);
+    if (!pp->map) {
+        LOG_WARN("%s: Could not create preprocessing larodMap %s\n",__func__, error->msg);
+        goto failed;
+    }
+    if (!larodMapSetStr(pp->map, "image.input.format", "nv12", &error) ||
+        !larodMapSetIntArr2(pp->map, "image.input.size", inWidth, inHeight, &error) ||
+        !larodMapSetStr(pp->map, "image.output.format", "rgb-interleaved", &error) ||
+        !larodMapSetIntArr2(pp->map, "image.output.size", width, height, &error)) {
+        LOG_WARN("%s: Failed setting preprocessing parameters: %s\n", __func__, error->msg);
+        goto failed;
+    }
+
+    // Use libyuv as image preprocessing backend
+    const char* larodLibyuvPP = "cpu-proc";
+    const larodDevice* device = larodGetDevice(pp->conn, larodLibyuvPP, 0, &error);
+    if (!device) {
+        LOG_WARN("%s: Could not get device %s: %s\n", __func__, larodLibyuvPP, error->msg);
+        goto failed;
+    }
+    pp->model = larodLoadModel(pp->conn, -1, device, LAROD_ACCESS_PRIVATE, "", pp->map, &error);
+    if (!pp->model) {
+        LOG_WARN("%s: Unable to load preprocessing model with chip %s: %s",__func__,larodLibyuvPP, error->msg);
+        goto failed;
+    }
+
+    pp->inputTensors = larodCreateModelInputs(pp->model, &pp->inputs, &error);
+    if (!pp->inputTensors) {
+        LOG_WARN("%s: Failed retrieving input tensors: %s\n",__func__,error->msg);
+        goto failed;
+    }
+    pp->outputTensors = larodCreateModelOutputs(pp->model, &pp->outputs, &error);
+    if (!pp->outputTensors) {
+        LOG_WARN("%s: Failed retrieving output tensors: %s\n",__func__, error->msg);
+        goto failed;
+    }
+
+    const larodTensorPitches* inputPitches = larodGetTensorPitches(pp->inputTensors[0], &error);
+    const larodTensorPitches* outputPitches = inputPitches ? larodGetTensorPitches(pp->outputTensors[0], &error) : NULL;
+    if (!outputPitches) {
+        LOG_WARN("%s: Could not get pitches of tensor: %s\n",__func__, error->msg);
+        goto failed;
+    }
+    pp->inputSize = inputPitches->pitches[0];
+    pp->outputSize = outputPitches->pitches[0];
+	LOG_TRACE("Buffer size: %zu\n",pp->inputSize);
+
+    //mkstemp replaces the X:s, so each file needs a fresh pattern
+    char inputFile[] = "/tmp/larod.pp.test-XXXXXX";
+    char outputFile[] = "/tmp/larod.in.test-XXXXXX";
+    if (!createAndMapTmpFile(inputFile, pp->inputSize, &pp->inputAddr, &pp->inputFd) ||
+        !createAndMapTmpFile(outputFile, pp->outputSize, &pp->outputAddr, &pp->outputFd)) {
+        LOG_WARN("%s: Could not allocate pre-processor tensor\n",__func__);
+        goto failed;
+    }
+
+    if (!larodSetTensorFd(pp->inputTensors[0], pp->inputFd, &error) ||
+        !larodSetTensorFd(pp->outputTensors[0], pp->outputFd, &error)) {
+        LOG_WARN("%s: Failed setting preprocessing tensor fd: %s\n",__func__, error->msg);
+        goto failed;
+    }
+
+    pp->req = larodCreateJobRequest(pp->model, pp->inputTensors, pp->inputs, pp->outputTensors, pp->outputs, NULL, &error);
+    if (!pp->req) {
+        LOG_WARN("%s: Failed creating preprocessing job request: %s\n", __func__,error->msg);
+        goto failed;
+    }
+    return pp;
+
+failed:
+    larodClearError(&error);
+    g_mutex_lock(&Model_ppMutex);
+    Model_PP_Destroy(pp);
+    g_mutex_unlock(&Model_ppMutex);
+    return 0;
+}
+
+static Model_PP*
+Model_PP_Get( unsigned int inWidth, unsigned int inHeight, unsigned int width, unsigned int height ) {
+	Model_PP* slot = 0;
+	g_mutex_lock(&Model_ppMutex);
+	for( int i = 0; i < MODEL_MAX_PP; i++ ) {
+		Model_PP* pp = &Model_pp[i];
+		if( pp->users && pp->req && pp->videoWidth == inWidth && pp->videoHeight == inHeight && pp->width == width && pp->height == height ) {
+			pp->users++;
+			g_mutex_unlock(&Model_ppMutex);
+			return pp;
+		}
+	}
+	for( int i = 0; i < MODEL_MAX_PP && !slot; i++ )
+		if( !Model_pp[i].users ) {
+			slot = &Model_pp[i];
+			slot->users = 1;
+		}
+	g_mutex_unlock(&Model_ppMutex);
+	if( !slot ) {
+		LOG_WARN("%s: No free preprocessing slot for %ux%u\n",__func__, width, height);
+		return 0;
+	}
+	return Model_PP_Create( slot, inWidth, inHeight, width, height );
+}
+
+static void
+Model_PP_Release( Model_PP* pp ) {
+	if( !pp )
+		return;
+	g_mutex_lock(&Model_ppMutex);
+	if( pp->users > 0 && --pp->users == 0 )
+		Model_PP_Destroy( pp );
+	g_mutex_unlock(&Model_ppMutex);
+}
+
+static int
+Model_PP_Run( Model_PP* pp, VdoBuffer* image ) {
+    larodError* error = NULL;
+	unsigned int sequence = 0;
+	//Without a sequence number a recycled buffer cannot be told apart, so nothing is cached
+	int known = getFrameInfo( image, NULL, &sequence );
+	if( known && pp->cached && pp->frame == image && pp->sequence == sequence ) {
+		pp->reused++;
+		return 1;
+	}
+	pp->cached = 0;
+	uint8_t* nv12Data = (uint8_t*)vdo_buffer_get_data(image);
+	memcpy(pp->inputAddr, nv12Data, pp->inputSize);
+    if (!larodRunJob(pp->conn, pp->req, &error)) {
+		LOG_WARN("%s: Unable to run job to preprocess model: %s (%d)\n", __func__, error->msg, error->code);
+        larodClearError(&error);
+		return 0;
+	}
+	pp->frame = image;
+	pp->sequence = sequence;
+	pp->cached = known;
+	pp->jobs++;
+	if( pp->jobs % 10 == 0 ) {
+		ACAP_STATUS_SetNumber("model","preprocessJobs", pp->jobs);
+		ACAP_STATUS_SetNumber("model","preprocessReused", pp->reused);
+	}
+	return 1;
+}
+
+/*
+ * A model set is everything needed to run one model: the larod connection,
+ * the loaded model, its tensors and job request, and the decode parameters
+ * from model.json.  Model_Setup loads the first set.  A swap loads a
+ * complete second set on a loader thread while the active set keeps
+ * running; the main loop then switches sets between two frames and frees
+ * the old one.
+ */
+typedef struct {
+	cJSON* config;
+	larodConnection* conn;
+	int modelFd;
+	larodModel* model;
+	larodJobRequest* req;
+	larodTensor** inputTensors;
+	larodTensor** outputTensors;
+	size_t inputs;
+	size_t outputs;
+	void* outputAddr;
+	int outputFd;
+	size_t outputSize;
+	Model_PP* preprocess;
+	unsigned int modelWidth;
+	unsigned int modelHeight;
+	unsigned int videoWidth;
+	unsigned int videoHeight;
+	unsigned int boxes;
+	unsigned int classes;
+	float quant;
+	float quant_zero;
+	float objectness;
+	float nms;
+	int initial;				//Loaded at startup, not a swap
+	unsigned int loadMs;
+	unsigned int warmupMs;
+	char error[128];
+} Model_Set;
+
+static Model_Set* Model_active = 0;
+static Model_Ready_Callback Model_ready = 0;
+static int Model_loading = 0;		//A loader thread is running
+static const char* Model_swapState = "idle";
+static char Model_swapError[128] = "";
+static unsigned int Model_swapLoadMs = 0;
+static unsigned int Model_swapWarmupMs = 0;
+static double Model_swapTime = 0;
+
+static void
+Model_Set_Destroy( Model_Set* set ) {
+    larodError* error = NULL;
+	if( !set )
+		return;
+    if( set->req ) larodDestroyJobRequest(&set->req);
+    if( set->inputTensors ) larodDestroyTensors(set->conn, &set->inputTensors, set->inputs, &error);
+    if( set->outputTensors ) larodDestroyTensors(set->conn, &set->outputTensors, set->outputs, &error);
+    larodClearError(&error);
+    // Only the model handle is released here. We count on larod service to
+    // release the privately loaded model when the session is disconnected in
+    // larodDisconnect().
+    if( set->model ) larodDestroyModel(&set->model);
+    if( set->conn ) larodDisconnect(&set->conn, NULL);
+    if( set->modelFd >= 0 ) close(set->modelFd);
+    if( set->outputAddr != MAP_FAILED ) munmap(set->outputAddr, set->outputSize);
+    if( set->outputFd >= 0 ) close(set->outputFd);
+	Model_PP_Release( set->preprocess );
+	cJSON_Delete( set->config );
+	free( set );
+}
+
+static int
+Model_Number( Model_Set* set, const char* name, double* value ) {
+	cJSON* item = cJSON_GetObjectItem(set->config, name);
+	if( !cJSON_IsNumber(item) ) {
+		snprintf(set->error, sizeof(set->error), "model.json has no %s", name);
+		return 0;
+	}
+	*value = item->valuedouble;
+	return 1;
+}
+
+static int
+Model_Set_Load( Model_Set* set ) {
+    larodError* error = NULL;
+	double modelWidth, modelHeight, videoWidth, videoHeight, boxes, classes, quant, zeroPoint, objectness, nms;
+	if( !Model_Number(set,"modelWidth",&modelWidth) || !Model_Number(set,"modelHeight",&modelHeight) ||
+	    !Model_Number(set,"videoWidth",&videoWidth) || !Model_Number(set,"videoHeight",&videoHeight) ||
+	    !Model_Number(set,"boxes",&boxes) || !Model_Number(set,"classes",&classes) ||
+	    !Model_Number(set,"quant",&quant) || !Model_Number(set,"zeroPoint",&zeroPoint) ||
+	    !Model_Number(set,"objectness",&objectness) || !Model_Number(set,"nms",&nms) )
+		return 0;
+	set->modelWidth = modelWidth;
+	set->modelHeight = modelHeight;
+	set->videoWidth = videoWidth;
+	set->videoHeight = videoHeight;
+	set->boxes = boxes;
+	set->classes = classes;
+	set->quant = quant;
+	set->quant_zero = zeroPoint;
+	set->objectness = objectness;
+	set->nms = nms;
+
+	LOG_TRACE("Boxes: %d Classes: %d Objectness: %f Confidence:%f",set->boxes,set->classes,set->objectness,confidenceThreshold);
+
+    // Model file
+    const char* modelPath = cJSON_GetObjectItem(set->config,"path")?cJSON_GetObjectItem(set->config,"path")->valuestring:0;
+	if(!modelPath) {
+		snprintf(set->error, sizeof(set->error), "Could not find model path");
+		return 0;
+	}
+
+	set->modelFd = open(modelPath, O_RDONLY);
+	if(set->modelFd < 0) {
+		snprintf(set->error, sizeof(set->error), "Could not open model %s", modelPath);
+		return 0;
+	}
+
+	//Connect to larod
+    if (!larodConnect(&set->conn, &error)) {
+		snprintf(set->error, sizeof(set->error), "Could not connect to larod: %s", error->msg);
+        larodClearError(&error);
+		return 0;
+    }
+
+	const char* chipString = "cpu-tflite";
+	cJSON* chip = cJSON_GetObjectItem(set->config,"chip");
+	if( chip && chip->type == cJSON_String ) 
+		chipString = chip->valuestring;
+	LOG_TRACE("Loading model for %s\n",chipString);
+	
+    const larodDevice* device = larodGetDevice(set->conn, chipString, 0, &error);
+    if (!device) {
+		snprintf(set->error, sizeof(set->error), "Could not get device %s: %s", chipString, error->msg);
+        larodClearError(&error);
+        return 0;
+    }
+
+    set->model = larodLoadModel(set->conn, set->modelFd, device, LAROD_ACCESS_PRIVATE, "object_detection", NULL, &error);
+    if (!set->model) {
+		snprintf(set->error, sizeof(set->error), "Unable to load model: %s", error->msg);
+        larodClearError(&error);
+        return 0;
+    }
+
+    set->preprocess = Model_PP_Get(set->videoWidth, set->videoHeight, set->modelWidth, set->modelHeight);
+    if (!set->preprocess) {
+		snprintf(set->error, sizeof(set->error), "Unable to set up preprocessing");
+        return 0;
+    }
+
+    // Create input/output tensors
+    set->inputTensors = larodCreateModelInputs(set->model, &set->inputs, &error);
+    if (!set->inputTensors) {
+		snprintf(set->error, sizeof(set->error), "Failed retrieving input tensors: %s", error->msg);
+        larodClearError(&error);
+        return 0;
+    }
+
+    set->outputTensors = larodCreateModelOutputs(set->model, &set->outputs, &error);
+    if (!set->outputTensors) {
+		snprintf(set->error, sizeof(set->error), "Failed retrieving output tensors: %s", error->msg);
+        larodClearError(&error);
+        return 0;
+    }
+
+    size_t expectedSize  = set->modelWidth * set->modelHeight * channels;
+    if (expectedSize != set->preprocess->outputSize) {
+		snprintf(set->error, sizeof(set->error), "Expected video output size %zu, actual %zu", expectedSize, set->preprocess->outputSize);
+        return 0;
+    }
+    const larodTensorPitches* outputPitches = larodGetTensorPitches(set->outputTensors[0], &error);
+    if (!outputPitches) {
+		snprintf(set->error, sizeof(set->error), "Could not get pitches of tensor: %s", error->msg);
+        larodClearError(&error);
+        return 0;
+    }
+	
+    // Allocate space for output tensor
+    char outputFile[] = "/tmp/larod.out1.test-XXXXXX";
+    set->outputSize = set->boxes * (set->classes + 5);
+    if (!createAndMapTmpFile(outputFile, set->outputSize, &set->outputAddr, &set->outputFd)) {
+		snprintf(set->error, sizeof(set->error), "Could not allocate output tensor");
+        return 0;
+    }
+
+    // Connect tensors to file descriptors, the model reads the shared preprocessing output
+    if (!larodSetTensorFd(set->inputTensors[0], set->preprocess->outputFd, &error)) {
+		snprintf(set->error, sizeof(set->error), "Failed setting input tensor fd: %s", error->msg);
+        larodClearError(&error);
+        return 0;
+    }
+
+    if (!larodSetTensorFd(set->outputTensors[0], set->outputFd, &error)) {
+		snprintf(set->error, sizeof(set->error), "Failed setting output tensor fd: %s", error->msg);
+        larodClearError(&error);
+        return 0;
+    }
+
+    // Create job request
+    set->req = larodCreateJobRequest(set->model,
+                                   set->inputTensors,
+                                   set->inputs,
+                                   set->outputTensors,
+                                   set->outputs,
+                                   NULL,
+                                   &error);
+    if (!set->req) {
+		snprintf(set->error, sizeof(set->error), "Failed creating inference request: %s", error->msg);
+        larodClearError(&error);
+        return 0;
+    }
+	return 1;
+}
+
+static Model_Set*
+Model_Set_Create( cJSON* config ) {
+	Model_Set* set = calloc(1, sizeof(Model_Set));
+	if( !set ) {
+		cJSON_Delete( config );
+		return 0;
+	}
+	set->config = config;
+	set->modelFd = -1;
+	set->outputFd = -1;
+	set->outputAddr = MAP_FAILED;
+	return set;
+}
 
 int inferenceErrors = 5;
 
@@ -75,7 +485,7 @@ Model_Inference(VdoBuffer* image) {
 		return 0;
 	}
 
-	if( ACAP_STATUS_Bool( "model", "state" ) == 0 ) {  //The Model Was not Loaded
+	if( !Model_active || ACAP_STATUS_Bool( "model", "state" ) == 0 ) {  //The Model Was not Loaded
 		LOG_TRACE("%s: Model not running\n",__func__);
 		return 0;
 	}
@@ -86,23 +496,26 @@ Model_Inference(VdoBuffer* image) {
 		return 0;
 	}
 
+	Model_Set* set = Model_active;
+	unsigned int boxes = set->boxes;
+	unsigned int classes = set->classes;
+	float quant = set->quant;
+	float quant_zero = set->quant_zero;
+	float objectnessThreshold = set->objectness;
+	void* larodOutput1Addr = set->outputAddr;
 
-	uint8_t* nv12Data = (uint8_t*)vdo_buffer_get_data(image);
-	memcpy(ppInputAddr, nv12Data, yuyvBufferSize);
-    if (!larodRunJob(conn, ppReq, &error)) {
-		LOG_WARN("%s: Unable to run job to preprocess model: %s (%d)\n", __func__, error->msg, error->code);
-        larodClearError(&error);
+	if( !Model_PP_Run( set->preprocess, image ) ) {
 		inferenceErrors--;
 		return 0;
 	}
 
-    if (lseek(larodOutput1Fd, 0, SEEK_SET) == -1) {
+    if (lseek(set->outputFd, 0, SEEK_SET) == -1) {
         LOG_WARN("%s: Unable to rewind output file position: %s\n", __func__, strerror(errno));
 		inferenceErrors--;
         return 0;
     }
 
-    if (!larodRunJob(conn, infReq, &error)) {
+    if (!larodRunJob(set->conn, set->req, &error)) {
 		LOG_WARN("%s: Unable to run inference on model: %s (%d)\n", __func__, error->msg, error->code);
         larodClearError(&error);
 		inferenceErrors--;
@@ -139,6 +552,7 @@ Model_Inference(VdoBuffer* image) {
 					label = cJSON_GetArrayItem(labels, classId)->valuestring;
 				cJSON* detection = cJSON_CreateObject();
 				cJSON_AddStringToObject( detection,"label",label);
+				cJSON_AddNumberToObject( detection,"id",classId);
 				cJSON_AddNumberToObject( detection,"c",maxConfidence);
 				cJSON_AddNumberToObject( detection,"x",x - (w/2));
 				cJSON_AddNumberToObject( detection,"y",y - (h/2));
@@ -156,6 +570,7 @@ Model_Inference(VdoBuffer* image) {
 	return non_maximum_suppression( list );
 }
 
+
 float iou(float x1, float y1, float w1, float h1, float x2, float y2, float w2, float h2) {
     float xx1 = fmax(x1 - (w1 / 2), x2 - (w2 / 2));
     float yy1 = fmax(y1 - (h1 / 2), y2 - (h2 / 2));
@@ -262,41 +677,269 @@ createAndMapTmpFile(char* fileName, size_t fileSize, void** mappedAddr, int* con
 
 void
 Model_Cleanup() {
-    // Only the model handle is released here. We count on larod service to
-    // release the privately loaded model when the session is disconnected in
-    // larodDisconnect().
-    larodError* error = NULL;
-	
-	if( ppMap ) larodDestroyMap(&ppMap);
-    if( ppModel ) larodDestroyModel(&ppModel);
-    larodDestroyModel(&InfModel);
-    if (conn) larodDisconnect(&conn, NULL);
-    if (larodModelFd >= 0) close(larodModelFd);
-    if (larodInputAddr != MAP_FAILED) munmap(larodInputAddr, modelWidth * modelHeight * channels);
-    if (larodInputFd >= 0) close(larodInputFd);
-    if (ppInputAddr != MAP_FAILED) munmap(ppInputAddr, modelWidth * modelHeight * channels);
-    if (ppInputFd >= 0) close(ppInputFd);
-    if (larodOutput1Addr != MAP_FAILED) munmap(larodOutput1Addr, boxes * (classes + 5));
-    larodDestroyJobRequest(&ppReq);
-    larodDestroyJobRequest(&infReq);
-    larodDestroyTensors(conn, &inputTensors, inputs, &error);
-    larodDestroyTensors(conn, &outputTensors, outputs, &error);
-    larodClearError(&error);
+	Model_Set_Destroy( Model_active );
+	Model_active = 0;
 	ACAP_STATUS_SetString("model","status","Model stopped");
 	ACAP_STATUS_SetBool("model","state", 0);	
 }
 
+static int
+Model_Same_Labels( cJSON* active, cJSON* labels ) {
+	if( cJSON_GetArraySize(active) != cJSON_GetArraySize(labels) )
+		return 0;
+	cJSON* a = active ? active->child : 0;
+	cJSON* b = labels ? labels->child : 0;
+	for( ; a && b; a = a->next, b = b->next ) {
+		if( !cJSON_IsString(a) || !cJSON_IsString(b) )
+			return 0;
+		//Active labels have spaces replaced by the event declarations
+		const char* x = a->valuestring;
+		const char* y = b->valuestring;
+		for( ; *x && *y; x++, y++ )
+			if( *x != *y && !(*x == '_' && *y == ' ') )
+				return 0;
+		if( *x || *y )
+			return 0;
+	}
+	return 1;
+}
 
+static cJSON*
+Model_State() {
+	cJSON* state = cJSON_CreateObject();
+	cJSON_AddStringToObject(state, "state", Model_swapState);
+	cJSON_AddNumberToObject(state, "loadMs", Model_swapLoadMs);
+	cJSON_AddNumberToObject(state, "warmupMs", Model_swapWarmupMs);
+	cJSON_AddNumberToObject(state, "time", Model_swapTime);
+	cJSON_AddStringToObject(state, "error", Model_swapError);
+	return state;
+}
 
-cJSON*
-Model_Setup() {
+static void
+Model_Swap_Status() {
+	cJSON* state = Model_State();
+	ACAP_STATUS_SetObject("model", "swap", state);
+	cJSON_Delete(state);
+}
 
-	LOG_TRACE("%s: Entry\n", __func__);
+static void
+Model_Started( Model_Set* set ) {
+	if( set->error[0] ) {
+		LOG_WARN("Model setup failed: %s\n", set->error);
+		ACAP_STATUS_SetString("model","status","Model initialization failed.  Check log file");
+		Model_Set_Destroy( set );
+		if( Model_ready )
+			Model_ready( 0 );
+		return;
+	}
+	Model_active = set;
+	nms = set->nms;
+	LOG("Model loaded in %u ms, warm-up %u ms\n", set->loadMs, set->warmupMs);
+	ACAP_STATUS_SetNumber("model","loadTime", set->loadMs);
+	ACAP_STATUS_SetNumber("model","warmupTime", set->warmupMs);
+	ACAP_STATUS_SetString("model","status","Model OK.");
+	ACAP_STATUS_SetBool("model","state", 1);
+	if( Model_ready )
+		Model_ready( 1 );
+}
+
+static gboolean
+Model_Loaded( gpointer data ) {
+	Model_Set* set = (Model_Set*)data;
+	Model_loading = 0;
+	if( set->initial ) {
+		Model_Started( set );
+		return G_SOURCE_REMOVE;
+	}
+	Model_swapLoadMs = set->loadMs;
+	Model_swapWarmupMs = set->warmupMs;
+
+	//Labels and the stream size are used by events, zones, rules and the video stream
+	if( !set->error[0] && !Model_active )
+		snprintf(set->error, sizeof(set->error), "No model running, restart the application");
+	if( !set->error[0] && (set->videoWidth != Model_active->videoWidth || set->videoHeight != Model_active->videoHeight) )
+		snprintf(set->error, sizeof(set->error), "videoWidth and videoHeight must match the running model");
+	if( !set->error[0] && !Model_Same_Labels( cJSON_GetObjectItem(modelConfig,"labels"), cJSON_GetObjectItem(set->config,"labels") ) )
+		snprintf(set->error, sizeof(set->error), "Labels must match the running model");
+
+	if( set->error[0] ) {
+		LOG_WARN("Model swap failed: %s\n", set->error);
+		Model_swapState = "failed";
+		snprintf(Model_swapError, sizeof(Model_swapError), "%s", set->error);
+		Model_Set_Destroy( set );
+		Model_Swap_Status();
+		return G_SOURCE_REMOVE;
+	}
+
+	//Runs from the main loop, between two calls to Model_Inference
+	Model_Set* old = Model_active;
+	Model_active = set;
+	nms = set->nms;
+	inferenceErrors = 5;
+	for( cJSON* item = set->config->child; item; item = item->next ) {
+		if( strcmp(item->string, "labels") == 0 )
+			continue;
+		if( cJSON_GetObjectItem(modelConfig, item->string) )
+			cJSON_ReplaceItemInObject(modelConfig, item->string, cJSON_Duplicate(item, 1));
+		else
+			cJSON_AddItemToObject(modelConfig, item->string, cJSON_Duplicate(item, 1));
+	}
+	Model_Set_Destroy( old );
+
+	LOG("Model swapped after %u ms load and %u ms warm-up\n", set->loadMs, Model_swapWarmupMs);
+	Model_swapState = "swapped";
+	Model_swapError[0] = 0;
+	Model_swapTime = ACAP_DEVICE_Timestamp();
+	ACAP_STATUS_SetNumber("model","loadTime", set->loadMs);
+	ACAP_STATUS_SetString("model","status","Model OK.");
+	ACAP_STATUS_SetBool("model","state", 1);
+	Model_Swap_Status();
+	return G_SOURCE_REMOVE;
+}
 
+/*
+ * Larod and the DLPU allocate and compile lazily on the first job, so the
+ * first live frame would otherwise take several times the normal inference
+ * time.  The loader thread runs that job on a mid-grey input tensor of its
+ * own; the shared preprocessing output may be in use by the active model
+ * during a swap, so it is not touched.  At startup nothing else uses the
+ * preprocessing slot yet and its job is warmed up too.
+ */
+static void
+Model_Warmup( Model_Set* set ) {
     larodError* error = NULL;
+	larodTensor** inputs = NULL;
+	larodJobRequest* req = NULL;
+	size_t count = 0;
+	size_t size = set->preprocess->outputSize;
+	void* addr = MAP_FAILED;
+	int fd = -1;
+	char inputFile[] = "/tmp/larod.warmup-XXXXXX";
+	gint64 start = g_get_monotonic_time();
+
+	if( set->initial ) {
+		memset(set->preprocess->inputAddr, 0x80, set->preprocess->inputSize);
+		set->preprocess->cached = 0;
+		if( !larodRunJob(set->preprocess->conn, set->preprocess->req, &error) ) {
+			snprintf(set->error, sizeof(set->error), "Warm-up preprocessing failed: %s", error->msg);
+			goto done;
+		}
+	}
+	if( !createAndMapTmpFile(inputFile, size, &addr, &fd) ) {
+		snprintf(set->error, sizeof(set->error), "Could not allocate warm-up tensor");
+		goto done;
+	}
+	memset(addr, 0x80, size);
+	inputs = larodCreateModelInputs(set->model, &count, &error);
+	if( !inputs || !larodSetTensorFd(inputs[0], fd, &error) ) {
+		snprintf(set->error, sizeof(set->error), "Failed setting up warm-up tensor: %s", error ? error->msg : "");
+		goto done;
+	}
+	req = larodCreateJobRequest(set->model, inputs, count, set->outputTensors, set->outputs, NULL, &error);
+	if( !req || !larodRunJob(set->conn, req, &error) )
+		snprintf(set->error, sizeof(set->error), "Warm-up inference failed: %s", error ? error->msg : "");
+
+done:
+	larodClearError(&error);
+	if( req ) larodDestroyJobRequest(&req);
+	if( inputs ) larodDestroyTensors(set->conn, &inputs, count, &error);
+	larodClearError(&error);
+	if( addr != MAP_FAILED ) munmap(addr, size);
+	if( fd >= 0 ) close(fd);
+	set->warmupMs = (g_get_monotonic_time() - start) / 1000;
+}
+
+static gpointer
+Model_Loader( gpointer data ) {
+	Model_Set* set = (Model_Set*)data;
+	gint64 start = g_get_monotonic_time();
+	if( Model_Set_Load( set ) )
+		Model_Warmup( set );
+	set->loadMs = (g_get_monotonic_time() - start) / 1000 - set->warmupMs;
+	g_idle_add( Model_Loaded, set );
+	return NULL;
+}
+
+static void
+Model_HTTP(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	const char* method = ACAP_HTTP_Get_Method(request);
+	cJSON* config = 0;
+
+	if( method && strcmp(method, "POST") == 0 && request->postData ) {
+		//Properties not posted are taken from the running model
+		cJSON* update = cJSON_Parse(request->postData);
+		if( !cJSON_IsObject(update) ) {
+			cJSON_Delete(update);
+			ACAP_HTTP_Respond_Error(response, 400, "Invalid JSON data");
+			return;
+		}
+		config = modelConfig ? cJSON_Duplicate(modelConfig, 1) : cJSON_CreateObject();
+		for( cJSON* item = update->child; item; item = item->next ) {
+			if( cJSON_GetObjectItem(config, item->string) )
+				cJSON_ReplaceItemInObject(config, item->string, cJSON_Duplicate(item, 1));
+			else
+				cJSON_AddItemToObject(config, item->string, cJSON_Duplicate(item, 1));
+		}
+		cJSON_Delete(update);
+	} else {
+		const char* swap = ACAP_HTTP_Request_Param(request, "swap");
+		if( !swap ) {
+			cJSON* state = Model_State();
+			ACAP_HTTP_Respond_JSON(response, state);
+			cJSON_Delete(state);
+			return;
+		}
+		free((void*)swap);
+		config = ACAP_FILE_Read("html/config/model.json");
+		if( !config ) {
+			ACAP_HTTP_Respond_Error(response, 500, "Unable to read model.json");
+			return;
+		}
+	}
+
+	if( Model_loading || !Model_active ) {
+		cJSON_Delete(config);
+		ACAP_HTTP_Respond_Error(response, 400, Model_loading ? "A model is already loading" : "No model running");
+		return;
+	}
+
+	Model_Set* set = Model_Set_Create( config );
+	if( !set ) {
+		ACAP_HTTP_Respond_Error(response, 500, "Out of memory");
+		return;
+	}
+	GError* error = NULL;
+	GThread* thread = g_thread_try_new("model-loader", Model_Loader, set, &error);
+	if( !thread ) {
+		LOG_WARN("%s: Unable to start loader: %s\n",__func__, error->message);
+		g_error_free(error);
+		Model_Set_Destroy(set);
+		ACAP_HTTP_Respond_Error(response, 500, "Unable to start model loader");
+		return;
+	}
+	g_thread_unref(thread);
+	Model_loading = 1;
+	Model_swapState = "loading";
+	Model_swapError[0] = 0;
+	Model_Swap_Status();
+	LOG("Loading model %s in the background\n", cJSON_GetObjectItem(set->config,"path") && cJSON_IsString(cJSON_GetObjectItem(set->config,"path")) ? cJSON_GetObjectItem(set->config,"path")->valuestring : "");
+
+	cJSON* state = Model_State();
+	ACAP_HTTP_Respond_JSON(response, state);
+	cJSON_Delete(state);
+}
+
+cJSON*
+Model_Setup( Model_Ready_Callback ready ) {
+
+	LOG_TRACE("%s: Entry\n", __func__);
 
 	ACAP_STATUS_SetString("model","status","Model initialization failed.  Check log file");
 	ACAP_STATUS_SetBool("model","state", 0);	
+	ACAP_HTTP_Node("model", Model_HTTP);
+	ACAP_STATUS_Live("model", "preprocessJobs");
+	ACAP_STATUS_Live("model", "preprocessReused");
+	Model_ready = ready;
 	
 	modelConfig = ACAP_FILE_Read( "html/config/model.json" );
 	if( !modelConfig ) {
@@ -306,256 +949,31 @@ Model_Setup() {
 
 	LOG_TRACE("%s: Initializing\n", __func__);
 
-	modelWidth = cJSON_GetObjectItem(modelConfig,"modelWidth")->valueint;
-	modelHeight = cJSON_GetObjectItem(modelConfig,"modelHeight")->valueint;
-	videoWidth = cJSON_GetObjectItem(modelConfig,"videoWidth")->valueint;
-	videoHeight = cJSON_GetObjectItem(modelConfig,"videoHeight")->valueint;
-	boxes = cJSON_GetObjectItem(modelConfig,"boxes")->valueint;
-	classes = cJSON_GetObjectItem(modelConfig,"classes")->valueint;
-	quant = cJSON_GetObjectItem(modelConfig,"quant")->valuedouble;
-	quant_zero = cJSON_GetObjectItem(modelConfig,"zeroPoint")->valuedouble;
-	objectnessThreshold = cJSON_GetObjectItem(modelConfig,"objectness")->valuedouble;
-	nms = cJSON_GetObjectItem(modelConfig,"nms")->valuedouble;
-
-	LOG_TRACE("Boxes: %d Classes: %d Objectness: %f Confidence:%f",boxes,classes,objectnessThreshold,confidenceThreshold);
-
 	char* json = cJSON_PrintUnformatted(modelConfig);
 	if(json) {
 		LOG_TRACE("%s\n", json);
 		free(json);
 	}
 
-    ppMap = larodCreateMap(&error);
-    if (!ppMap) {
-        LOG_WARN("%s: Could not create preprocessing larodMap %s\n",__func__, error->msg);
-		Model_Cleanup();
-		return 0;
-    }
-    if (!larodMapSetStr(ppMap, "image.input.format", "nv12", &error)) {
-        LOG_WARN("%s: Failed setting preprocessing parameters: %s\n", __func__, error->msg);
-		Model_Cleanup();
-		return 0;
-    }
-    if (!larodMapSetIntArr2(ppMap, "image.input.size", videoWidth, videoHeight, &error)) {
-        LOG_WARN("%s: Failed setting preprocessing parameters: %s\n", __func__, error->msg);
-		Model_Cleanup();
-		return 0;
-    }
-    if (!larodMapSetStr(ppMap, "image.output.format", "rgb-interleaved", &error)) {
-        LOG_WARN("%s: Failed setting preprocessing parameters: %s\n", __func__,error->msg);
-		Model_Cleanup();
-		return 0;
-    }
-
-    if (!larodMapSetIntArr2(ppMap, "image.output.size", modelWidth, modelHeight, &error)) {
-        LOG_WARN("%s: Failed setting preprocessing parameters: %s\n", __func__,error->msg);
-		Model_Cleanup();
-		return 0;
-    }
-
-    // Model file
-    const char* modelPath = cJSON_GetObjectItem(modelConfig,"path")?cJSON_GetObjectItem(modelConfig,"path")->valuestring:0;
-	if(!modelPath) {
-        LOG_WARN("%s: Could not find model path\n", __func__);
-		Model_Cleanup();
-		return 0;
-	}
-
-	larodModelFd = open(modelPath, O_RDONLY,modelPath);
-	if(larodModelFd < 0) {
-        LOG_WARN("%s: Could not open model %s\n", __func__,modelPath);
-		Model_Cleanup();
+	//Load and compile on a thread so the caller can start the video stream meanwhile
+	Model_Set* set = Model_Set_Create( cJSON_Duplicate(modelConfig, 1) );
+	if( !set ) {
+        LOG_WARN("%s: Out of memory\n", __func__);
 		return 0;
 	}
-
-	//Connect to larod
-    if (!larodConnect(&conn, &error)) {
-        LOG_WARN("%s: Could not connect to larod: %s\n", __func__, error->msg);
-		Model_Cleanup();
+	set->initial = 1;
+	GError* error = NULL;
+	GThread* thread = g_thread_try_new("model-loader", Model_Loader, set, &error);
+	if( !thread ) {
+        LOG_WARN("%s: Unable to start loader: %s\n", __func__, error->message);
+		g_error_free(error);
+		Model_Set_Destroy( set );
 		return 0;
-    }
-
-	const char* chipString = "cpu-tflite";
-	cJSON* chip = cJSON_GetObjectItem(modelConfig,"chip");
-	if( chip && chip->type == cJSON_String ) 
-		chipString = chip->valuestring;
-	LOG_TRACE("Loading model for %s\n",chipString);
-	
-    const larodDevice* device = larodGetDevice(conn, chipString, 0, &error);
-    if (!device) {
-        LOG_WARN("%s: Could not get device %s: %s\n", __func__, chipString, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-
-    InfModel = larodLoadModel(conn, larodModelFd, device, LAROD_ACCESS_PRIVATE, "object_detection", NULL, &error);
-    if (!InfModel) {
-        LOG_WARN("%s: Unable to load model: %s\n", __func__, error->msg);
-        larodClearError(&error);
-        Model_Cleanup();
-        return 0;
-    }
-
-    // Use libyuv as image preprocessing backend
-    const char* larodLibyuvPP = "cpu-proc";
-    const larodDevice* device_prePros  = larodGetDevice(conn, larodLibyuvPP, 0, &error);
-	if(!device_prePros) {
-        LOG_WARN("%s: Could not get device %s: %s\n", __func__, larodLibyuvPP, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-	}
-    ppModel = larodLoadModel(conn, -1, device_prePros, LAROD_ACCESS_PRIVATE, "", ppMap, &error);
-    if (!ppModel) {
-        LOG_WARN("%s: Unable to load preprocessing model with chip %s: %s",__func__,larodLibyuvPP, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    } else {
-//		LOG("Loading preprocessing model with chip %s\n", larodLibyuvPP);
 	}
-
-    // Create input/output tensors
-    ppInputTensors = larodCreateModelInputs(ppModel, &ppInputs, &error);
-    if (!ppInputTensors) {
-        LOG_WARN("%s: Failed retrieving input tensors: %s\n",__func__,error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-    ppOutputTensors = larodCreateModelOutputs(ppModel, &ppOutputs, &error);
-    if (!ppOutputTensors) {
-        LOG_WARN("%s: Failed retrieving output tensors: %s\n",__func__, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-
-    inputTensors = larodCreateModelInputs(InfModel, &inputs, &error);
-    if (!inputTensors) {
-        LOG_WARN("%s: Failed retrieving input tensors: %s\n",__func__, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-
-    outputTensors = larodCreateModelOutputs(InfModel, &outputs, &error);
-    if (!outputTensors) {
-        LOG_WARN("%s: Failed retrieving output tensors: %s\n", __func__, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-
-    // Determine tensor buffer sizes
-    const larodTensorPitches* ppInputPitches = larodGetTensorPitches(ppInputTensors[0], &error);
-    if (!ppInputPitches) {
-        LOG_WARN("%s: Could not get pitches of tensor: %s\n",__func__, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-
-    yuyvBufferSize = ppInputPitches->pitches[0];
-	LOG_TRACE("Buffer size: %zu\n",yuyvBufferSize);
-    const larodTensorPitches* ppOutputPitches = larodGetTensorPitches(ppOutputTensors[0], &error);
-    if (!ppOutputPitches) {
-        LOG_WARN("%s: Could not get pitches of tensor: %s\n",__func__, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-
-    size_t rgbBufferSize = ppOutputPitches->pitches[0];
-    size_t expectedSize  = modelWidth * modelHeight * channels;
-    if (expectedSize != rgbBufferSize) {
-        LOG_WARN("%s: Expected video output size %zu, actual %zu\n", __func__, expectedSize, rgbBufferSize);
-		Model_Cleanup();
-        return 0;
-    }
-    const larodTensorPitches* outputPitches = larodGetTensorPitches(outputTensors[0], &error);
-    if (!outputPitches) {
-        LOG_WARN("%s: Could not get pitches of tensor: %s\n",__func__, error->msg);
-		Model_Cleanup();
-        return 0;
-    }
-	
-    // Allocate space for input tensor
-    if (!createAndMapTmpFile(PP_SD_INPUT_FILE_PATTERN, yuyvBufferSize, &ppInputAddr, &ppInputFd)) {
-        LOG_WARN("%s: Could not allocate pre-processor tensor\n",__func__);
-		Model_Cleanup();
-        return 0;
-    }
-    if (!createAndMapTmpFile(OBJECT_DETECTOR_INPUT_FILE_PATTERN, modelWidth * modelHeight * channels, &larodInputAddr, &larodInputFd)) {
-        LOG_WARN("%s: Could not allocate input tensor\n",__func__);
-		Model_Cleanup();
-        return 0;
-    }
-
-    if (!createAndMapTmpFile(OBJECT_DETECTOR_OUT1_FILE_PATTERN, boxes * (classes + 5), &larodOutput1Addr, &larodOutput1Fd)) {
-        LOG_WARN("%s: Could not allocate output tenso\n",__func__);
-		Model_Cleanup();
-        return 0;
-    }
-
-    // Connect tensors to file descriptors
-    if (!larodSetTensorFd(ppInputTensors[0], ppInputFd, &error)) {
-        LOG_WARN("%s: Failed setting input tensor fd: %s\n",__func__, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-    if (!larodSetTensorFd(ppOutputTensors[0], larodInputFd, &error)) {
-        LOG_WARN("%s: Failed setting input tensor fd: %s\n", __func__, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-
-    if (!larodSetTensorFd(inputTensors[0], larodInputFd, &error)) {
-        LOG_WARN("%s: Failed setting input tensor fd: %s\n", __func__, error->msg);
-        larodClearError(&error);
-		Model_Cleanup();
-        return 0;
-    }
-
-    if (!larodSetTensorFd(outputTensors[0], larodOutput1Fd, &error)) {
-        LOG_WARN("%s: Failed setting output tensor fd: %s\n", __func__, error->msg);
-		Model_Cleanup();
-        return 0;
-    }
-
-    // Create job requests
-    ppReq = larodCreateJobRequest(ppModel,
-                                  ppInputTensors,
-                                  ppInputs,
-                                  ppOutputTensors,
-                                  ppOutputs,
-                                  NULL,
-                                  &error);
-    if (!ppReq) {
-        LOG_WARN("%s: Failed creating preprocessing job request: %s\n", __func__,error->msg);
-		Model_Cleanup();
-        return 0;
-    }
-
-    infReq = larodCreateJobRequest(InfModel,
-                                   inputTensors,
-                                   inputs,
-                                   outputTensors,
-                                   outputs,
-                                   NULL,
-                                   &error);
-    if (!infReq) {
-        LOG_WARN("%s: Failed creating inference request: %s\n", __func__,error->msg);
-		Model_Cleanup();
-        return 0;
-    }
-	
-	ACAP_STATUS_SetString("model","status","Model OK.");
-	ACAP_STATUS_SetBool("model","state", 1);
+	g_thread_unref(thread);
+	Model_loading = 1;
+	ACAP_STATUS_SetString("model","status","Loading model");
+	Model_Swap_Status();
 	
     return modelConfig;
 }
-
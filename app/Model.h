@@ -8,7 +8,9 @@
 #include "vdo-types.h"
 #include "cJSON.h"
 
-cJSON*	Model_Setup();
+typedef void (*Model_Ready_Callback)(int ok);
+
+cJSON*	Model_Setup(Model_Ready_Callback ready);	//Returns model.json, calls ready from the main loop when loaded
 cJSON*	Model_Inference(VdoBuffer* image);
 void 	Model_Cleanup();
 
@@ -8,11 +8,13 @@
  * [
  *		{
  *			"label":"some label",		The label od the detected object
+ *			"id":0,						The label index in the model label list
  *			"c":82,						The confidence value between 0-100  
  *			"x":100,					The top left corner [0-1000]
  *			"y":100,					The top left corner [0-1000]
  *			"w":100,					The object width [0-1000] 
  *			"h":100,					The object height [0-1000]
+ *			"zones":["Gate"],			Zones the object is in, only when zones are configured
  *			"timestamp":1731531483123	//EPOCH timestam since Jan 1 1970. millisecond resolution
  *		},
  *		....
@@ -22,10 +24,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <syslog.h>
 
 #include "ACAP.h"
+#include "Channels.h"
 
 #define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
 #define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
@@ -33,61 +37,89 @@
 #define LOG_TRACE(fmt, args...)    {}
 
 
-cJSON* lastTriggerTime = 0;
-cJSON* firstTriggerTime = 0;
+#define OUTPUT_MAX_LABELS	256
 
-void
-Output( cJSON* detections ) {
-	ACAP_STATUS_SetObject("labels","detections",detections);
+typedef struct {
+	char* event;				//Event id, the label with spaces replaced
+	ACAP_EVENTS_Handle* handle;
+	int channel;				//Index in Channels, 0 for the primary channel
+	int index;
+	ACAP_WHEEL_Timer low;		//Label not seen for minEventDuration
+	ACAP_WHEEL_Timer stable;	//Label seen for stabelizeTransition
+} Output_Label;
+
+static Output_Label Output_labels[CHANNELS_MAX][OUTPUT_MAX_LABELS];
+static int Output_labelCount[CHANNELS_MAX];
+static uint64_t Output_high[CHANNELS_MAX][OUTPUT_MAX_LABELS / 64];	//Label events currently high
+
+static void
+Output_High( Output_Label* label ) {
+	uint64_t bit = 1ULL << (label->index & 63);
+	uint64_t* high = Output_high[label->channel];
+	if( high[label->index >> 6] & bit )
+		return;
+	LOG_TRACE("%s: Label %s set to high",__func__,label->event);
+	if( ACAP_EVENTS_Handle_Fire_State( label->handle, 1 ) )
+		high[label->index >> 6] |= bit;
+}
+
+static void
+Output_Stable( ACAP_WHEEL_Timer* timer, void* user_data ) {
+	Output_High( (Output_Label*)user_data );
+}
+
+static void
+Output_Low( ACAP_WHEEL_Timer* timer, void* user_data ) {
+	Output_Label* label = (Output_Label*)user_data;
+	uint64_t bit = 1ULL << (label->index & 63);
+	uint64_t* high = Output_high[label->channel];
+	ACAP_WHEEL_Cancel( &label->stable );
+	if( !(high[label->index >> 6] & bit) )
+		return;
+	ACAP_EVENTS_Handle_Fire_State( label->handle, 0 );
+	high[label->index >> 6] &= ~bit;
+	LOG_TRACE("%s: Label %s set to Low",__func__,label->event);
+}
 
-	double now = ACAP_DEVICE_Timestamp();
+static void
+Output_Labels( int channel, cJSON* detections ) {
 	cJSON* settings = ACAP_Get_Config("settings");
 	if(!settings)
 		return;
-	if( !lastTriggerTime )
-		lastTriggerTime = cJSON_CreateObject();
-	if( !firstTriggerTime )
-		firstTriggerTime = cJSON_CreateObject();	
-	
+
 	double minEventDuration = cJSON_GetObjectItem(settings,"minEventDuration")?cJSON_GetObjectItem(settings,"minEventDuration")->valuedouble:3000;
 	double stabelizeTransition = cJSON_GetObjectItem(settings,"stabelizeTransition")?cJSON_GetObjectItem(settings,"stabelizeTransition")->valuedouble:0;
 
+	//Deadlines run from the main loop timer wheel, so labels go low even if no more frames are processed
 	cJSON* detection = detections->child;
 	while( detection ) {
-		const char* label = cJSON_GetObjectItem(detection,"label")?cJSON_GetObjectItem(detection,"label")->valuestring:"Undefined";
-
-		if( !ACAP_STATUS_Bool("events", label) ) {
-			cJSON* transitionStateTime = cJSON_GetObjectItem(firstTriggerTime,label);
-			double timestamp = now;
-			if( !transitionStateTime)
-				cJSON_AddNumberToObject(firstTriggerTime,label, now);
-			else
-				timestamp = transitionStateTime->valuedouble;
-			if( (now - timestamp) >= stabelizeTransition ) {
-				LOG_TRACE("%s: Label %s set to high",__func__,label);
-				ACAP_EVENTS_Fire_State( label, 1 );
-				cJSON_DeleteItemFromObject( firstTriggerTime,label);
+		cJSON* id = cJSON_GetObjectItem(detection,"id");
+		int index = id ? id->valueint : -1;
+		if( index >= 0 && index < Output_labelCount[channel] ) {
+			Output_Label* label = &Output_labels[channel][index];
+			if( !(Output_high[channel][index >> 6] & (1ULL << (index & 63))) ) {
+				if( stabelizeTransition <= 0 )
+					Output_High( label );
+				else if( !ACAP_WHEEL_Pending( &label->stable ) )
+					ACAP_WHEEL_Schedule( &label->stable, stabelizeTransition );
 			}
- 		}
-
-		if( !cJSON_GetObjectItem(lastTriggerTime,label) ) {
-			cJSON_AddNumberToObject(lastTriggerTime,label, now);
-		} else {
-			cJSON_ReplaceItemInObject(lastTriggerTime,label,cJSON_CreateNumber(now));
+			ACAP_WHEEL_Schedule( &label->low, minEventDuration );
 		}
 		detection = detection->next;
 	}
+}
 
-	cJSON* lastTrigger = lastTriggerTime->child;
-	while( lastTrigger ) {
-		if( ACAP_STATUS_Bool("events", lastTrigger->string) ) {
-			if( (now - lastTrigger->valuedouble) > minEventDuration ) {
-				ACAP_EVENTS_Fire_State( lastTrigger->string , 0 );
-				LOG_TRACE("%s: Label %s set to Low",__func__,label);
-			}
-		}
-		lastTrigger = lastTrigger->next;
-	}
+void
+Output( cJSON* detections ) {
+	ACAP_STATUS_SetObject("labels","detections",detections);
+	Output_Labels( 0, detections );
+}
+
+void
+Output_Channel( int channel, cJSON* detections ) {
+	if( channel <= 0 || channel >= CHANNELS_MAX )
+		return;
+	Output_Labels( channel, detections );
 }
 
 void replace_spaces(char *str) {
@@ -99,6 +131,60 @@ void replace_spaces(char *str) {
     }
 }
 
+static void
+Output_Clear( int channel ) {
+	for( int i = 0; i < Output_labelCount[channel]; i++ ) {
+		Output_Label* label = &Output_labels[channel][i];
+		ACAP_WHEEL_Cancel( &label->low );
+		ACAP_WHEEL_Cancel( &label->stable );
+		if( channel > 0 && label->event )
+			ACAP_EVENTS_Remove_Event( label->event );
+		free( label->event );
+	}
+	memset( Output_labels[channel], 0, sizeof(Output_labels[channel]) );
+	memset( Output_high[channel], 0, sizeof(Output_high[channel]) );
+	Output_labelCount[channel] = 0;
+}
+
+static void
+Output_Declare( int channel, cJSON* labels ) {
+	const char* prefix = Channels_Name( channel );
+	cJSON* label = labels->child;
+	while( label && Output_labelCount[channel] < OUTPUT_MAX_LABELS ) {
+		char niceName[64];
+		char id[96];
+		replace_spaces( label->valuestring );
+		if( channel > 0 ) {
+			snprintf(niceName, sizeof(niceName), "DetectX %s: %s", prefix, label->valuestring);
+			snprintf(id, sizeof(id), "%s_%s", prefix, label->valuestring);
+		} else {
+			snprintf(niceName, sizeof(niceName), "DetectX: %s", label->valuestring);
+			snprintf(id, sizeof(id), "%s", label->valuestring);
+		}
+		ACAP_EVENTS_Add_Event( id, niceName, 1);
+		Output_Label* entry = &Output_labels[channel][Output_labelCount[channel]];
+		entry->event = strdup( id );
+		entry->handle = ACAP_EVENTS_Handle_Get( entry->event );
+		ACAP_EVENTS_Copy_Policy( entry->event, "label" );	//The "label" policy in events.json applies to every label
+		entry->channel = channel;
+		entry->index = Output_labelCount[channel]++;
+		ACAP_WHEEL_Timer_Init( &entry->low, Output_Low, entry );
+		ACAP_WHEEL_Timer_Init( &entry->stable, Output_Stable, entry );
+		label = label->next;
+	}
+}
+
+void Output_Channels() {
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	for( int channel = 1; channel < CHANNELS_MAX; channel++ )
+		Output_Clear( channel );
+	if(!labels)
+		return;
+	for( int channel = 1; channel < Channels_Count(); channel++ )
+		Output_Declare( channel, labels );
+}
+
 void Output_reset() {
 	LOG_TRACE("%s:",__func__);
 	cJSON* model = ACAP_Get_Config("model");
@@ -111,15 +197,8 @@ void Output_reset() {
 		LOG_WARN("%s: Model has no labels",__func__);
 		return;
 	}
-	cJSON* label = labels->child;
-	while( label ) {
-		char niceName[32];
-		sprintf(niceName,"DetectX: %s", label->valuestring);
-		replace_spaces( label->valuestring );
-		ACAP_EVENTS_Add_Event( label->valuestring, niceName, 1);
-		label = label->next;
-	}
-	lastTriggerTime = cJSON_CreateObject();
-	firstTriggerTime = cJSON_CreateObject();
+	Output_Clear( 0 );
+	Output_Declare( 0, labels );
+	Output_Channels();
 	LOG_TRACE("%s: Exit",__func__);	
 }
@@ -8,6 +8,8 @@
 #include "cJSON.h"
 
 void Output(cJSON* detectionList);
+void Output_Channel(int channel, cJSON* detectionList);	//Label events of an additional channel
 void Output_reset();
+void Output_Channels();		//Re-declare the label events of the additional channels
 
 #endif
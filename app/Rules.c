@@ -0,0 +1,531 @@
+/*
+ * Declarative event rules.
+ *
+ * Rules are parsed once into a shared array of register instructions.
+ * Per frame the detections are counted into a label x zone table, then
+ * each rule's instructions are run over a fixed register file.  Nothing
+ * is allocated and no strings are compared while evaluating, so a frame
+ * costs one pass over the detections plus a few instructions per rule.
+ * Label and zone names are resolved when the rules are compiled; the
+ * rules are recompiled when the rules, zone names, labels or channels
+ * change.  Rules keeping their event carry their state over, so a
+ * recompile does not toggle events that are high.
+ * Every rule is evaluated per inference channel with its own state, and
+ * fires <name>_<event> for the additional channels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+
+#include "ACAP.h"
+#include "Zones.h"
+#include "Channels.h"
+#include "Rules.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define RULES_ANY_LABEL		RULES_MAX_LABELS	//Count row for all labels
+#define RULES_ANY_ZONE		ZONES_MAX			//Count column for the whole image
+
+enum {
+	RULES_OP_CONST,		//dst = value
+	RULES_OP_COUNT,		//dst = counts[value]
+	RULES_OP_ADD,
+	RULES_OP_SUB,
+	RULES_OP_MUL,
+	RULES_OP_DIV,
+	RULES_OP_LT,
+	RULES_OP_LE,
+	RULES_OP_GT,
+	RULES_OP_GE,
+	RULES_OP_EQ,
+	RULES_OP_NE,
+	RULES_OP_AND,
+	RULES_OP_OR,
+	RULES_OP_NOT		//dst = !a
+};
+
+typedef struct {
+	uint8_t op;
+	uint8_t dst;
+	uint8_t a;
+	uint8_t b;
+	int32_t value;
+} Rules_Instruction;
+
+typedef struct {
+	char event[64];			//Declared by Rules for additional channels
+	ACAP_EVENTS_Handle* handle;
+	int state;
+	uint64_t since;			//When the condition last changed
+	int condition;
+} Rules_State;
+
+typedef struct {
+	char event[32];
+	uint16_t start;
+	uint16_t length;
+	uint8_t result;
+	uint64_t forMs;
+	uint64_t clearMs;
+	Rules_State channels[CHANNELS_MAX];
+} Rules_Rule;
+
+typedef struct {
+	const char* text;
+	const char* position;
+	int registers;
+	const char* error;
+} Rules_Parser;
+
+static Rules_Instruction Rules_code[RULES_MAX_CODE];
+static int Rules_codeLength = 0;
+static Rules_Rule Rules_rules[RULES_MAX];
+static int Rules_count = 0;
+static int32_t Rules_counts[(RULES_MAX_LABELS + 1) * (ZONES_MAX + 1)];
+static int32_t Rules_registers[RULES_MAX_REGISTERS];
+static cJSON* Rules_declared = 0;
+static char* Rules_config = 0;			//Everything the compiled rules depend on
+static Rules_Rule Rules_previous[RULES_MAX];
+static int Rules_previousCount = 0;
+
+#define RULES_SLOT(label, zone)	((label) * (ZONES_MAX + 1) + (zone))
+
+static int Rules_Expression(Rules_Parser* parser);
+
+static void
+Rules_Space(Rules_Parser* parser) {
+	while( isspace((unsigned char)*parser->position) )
+		parser->position++;
+}
+
+static int
+Rules_Accept(Rules_Parser* parser, const char* token) {
+	Rules_Space(parser);
+	size_t length = strlen(token);
+	if( strncmp(parser->position, token, length) != 0 )
+		return 0;
+	//Keywords must not run into a following name
+	if( isalpha((unsigned char)token[0]) && (isalnum((unsigned char)parser->position[length]) || parser->position[length] == '_') )
+		return 0;
+	parser->position += length;
+	return 1;
+}
+
+static int
+Rules_Name(Rules_Parser* parser, char* name, size_t size) {
+	Rules_Space(parser);
+	size_t length = 0;
+	if( *parser->position == '\'' ) {
+		parser->position++;
+		while( *parser->position && *parser->position != '\'' && length + 1 < size )
+			name[length++] = *parser->position++;
+		if( *parser->position != '\'' ) {
+			parser->error = "Unterminated name";
+			return 0;
+		}
+		parser->position++;
+	} else {
+		while( (isalnum((unsigned char)*parser->position) || strchr("_-.*", *parser->position)) && *parser->position && length + 1 < size )
+			name[length++] = *parser->position++;
+	}
+	name[length] = 0;
+	if( length == 0 ) {
+		parser->error = "Name expected";
+		return 0;
+	}
+	return 1;
+}
+
+static int
+Rules_Emit(Rules_Parser* parser, uint8_t op, int a, int b, int32_t value) {
+	if( Rules_codeLength >= RULES_MAX_CODE ) {
+		parser->error = "Too many instructions";
+		return -1;
+	}
+	int dst;
+	if( op == RULES_OP_CONST || op == RULES_OP_COUNT ) {
+		if( parser->registers >= RULES_MAX_REGISTERS ) {
+			parser->error = "Expression too deep";
+			return -1;
+		}
+		dst = parser->registers++;
+	} else {
+		//Operands are always the topmost registers, the result replaces them
+		dst = a;
+		parser->registers = a + 1;
+	}
+	Rules_Instruction* instruction = &Rules_code[Rules_codeLength++];
+	instruction->op = op;
+	instruction->dst = dst;
+	instruction->a = a < 0 ? 0 : a;
+	instruction->b = b < 0 ? 0 : b;
+	instruction->value = value;
+	return dst;
+}
+
+static int
+Rules_Label(const char* name) {
+	if( strcmp(name, "*") == 0 )
+		return RULES_ANY_LABEL;
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	int index = 0;
+	for( cJSON* label = labels ? labels->child : 0; label && index < RULES_MAX_LABELS; label = label->next, index++ )
+		if( cJSON_IsString(label) && strcmp(label->valuestring, name) == 0 )
+			return index;
+	return -1;
+}
+
+static int
+Rules_Primary(Rules_Parser* parser) {
+	Rules_Space(parser);
+	if( Rules_Accept(parser, "(") ) {
+		int result = Rules_Expression(parser);
+		if( result < 0 )
+			return -1;
+		if( !Rules_Accept(parser, ")") ) {
+			parser->error = "Missing )";
+			return -1;
+		}
+		return result;
+	}
+	if( Rules_Accept(parser, "!") ) {
+		int operand = Rules_Primary(parser);
+		return operand < 0 ? -1 : Rules_Emit(parser, RULES_OP_NOT, operand, operand, 0);
+	}
+	if( isdigit((unsigned char)*parser->position) ) {
+		char* end;
+		long value = strtol(parser->position, &end, 10);
+		parser->position = end;
+		return Rules_Emit(parser, RULES_OP_CONST, -1, -1, (int32_t)value);
+	}
+	if( Rules_Accept(parser, "count") ) {
+		char name[64];
+		if( !Rules_Accept(parser, "(") ) {
+			parser->error = "Missing ( after count";
+			return -1;
+		}
+		if( !Rules_Name(parser, name, sizeof(name)) )
+			return -1;
+		int label = Rules_Label(name);
+		if( label < 0 ) {
+			parser->error = "Unknown label";
+			return -1;
+		}
+		int zone = RULES_ANY_ZONE;
+		if( Rules_Accept(parser, "in") ) {
+			if( !Rules_Name(parser, name, sizeof(name)) )
+				return -1;
+			zone = -1;
+			for( int z = 0; z < Zones_Count(); z++ )
+				if( strcmp(Zones_Name(z), name) == 0 )
+					zone = z;
+			if( zone < 0 ) {
+				parser->error = "Unknown zone";
+				return -1;
+			}
+		}
+		if( !Rules_Accept(parser, ")") ) {
+			parser->error = "Missing )";
+			return -1;
+		}
+		return Rules_Emit(parser, RULES_OP_COUNT, -1, -1, RULES_SLOT(label, zone));
+	}
+	parser->error = "Unexpected token";
+	return -1;
+}
+
+static int
+Rules_Product(Rules_Parser* parser) {
+	int left = Rules_Primary(parser);
+	while( left >= 0 ) {
+		uint8_t op;
+		if( Rules_Accept(parser, "*") ) op = RULES_OP_MUL;
+		else if( Rules_Accept(parser, "/") ) op = RULES_OP_DIV;
+		else break;
+		int right = Rules_Primary(parser);
+		left = right < 0 ? -1 : Rules_Emit(parser, op, left, right, 0);
+	}
+	return left;
+}
+
+static int
+Rules_Sum(Rules_Parser* parser) {
+	int left = Rules_Product(parser);
+	while( left >= 0 ) {
+		uint8_t op;
+		if( Rules_Accept(parser, "+") ) op = RULES_OP_ADD;
+		else if( Rules_Accept(parser, "-") ) op = RULES_OP_SUB;
+		else break;
+		int right = Rules_Product(parser);
+		left = right < 0 ? -1 : Rules_Emit(parser, op, left, right, 0);
+	}
+	return left;
+}
+
+static int
+Rules_Compare(Rules_Parser* parser) {
+	int left = Rules_Sum(parser);
+	if( left < 0 )
+		return -1;
+	uint8_t op;
+	if( Rules_Accept(parser, "<=") ) op = RULES_OP_LE;
+	else if( Rules_Accept(parser, ">=") ) op = RULES_OP_GE;
+	else if( Rules_Accept(parser, "==") ) op = RULES_OP_EQ;
+	else if( Rules_Accept(parser, "!=") ) op = RULES_OP_NE;
+	else if( Rules_Accept(parser, "<") ) op = RULES_OP_LT;
+	else if( Rules_Accept(parser, ">") ) op = RULES_OP_GT;
+	else return left;
+	int right = Rules_Sum(parser);
+	return right < 0 ? -1 : Rules_Emit(parser, op, left, right, 0);
+}
+
+static int
+Rules_And(Rules_Parser* parser) {
+	int left = Rules_Compare(parser);
+	while( left >= 0 && Rules_Accept(parser, "&&") ) {
+		int right = Rules_Compare(parser);
+		left = right < 0 ? -1 : Rules_Emit(parser, RULES_OP_AND, left, right, 0);
+	}
+	return left;
+}
+
+static int
+Rules_Expression(Rules_Parser* parser) {
+	int left = Rules_And(parser);
+	while( left >= 0 && Rules_Accept(parser, "||") ) {
+		int right = Rules_And(parser);
+		left = right < 0 ? -1 : Rules_Emit(parser, RULES_OP_OR, left, right, 0);
+	}
+	return left;
+}
+
+static int32_t
+Rules_Run(const Rules_Rule* rule) {
+	int32_t* r = Rules_registers;
+	const Rules_Instruction* instruction = &Rules_code[rule->start];
+	const Rules_Instruction* end = instruction + rule->length;
+	for( ; instruction < end; instruction++ ) {
+		int32_t a = r[instruction->a];
+		int32_t b = r[instruction->b];
+		switch( instruction->op ) {
+			case RULES_OP_CONST: r[instruction->dst] = instruction->value; break;
+			case RULES_OP_COUNT: r[instruction->dst] = Rules_counts[instruction->value]; break;
+			case RULES_OP_ADD: r[instruction->dst] = a + b; break;
+			case RULES_OP_SUB: r[instruction->dst] = a - b; break;
+			case RULES_OP_MUL: r[instruction->dst] = a * b; break;
+			case RULES_OP_DIV: r[instruction->dst] = b ? a / b : 0; break;
+			case RULES_OP_LT: r[instruction->dst] = a < b; break;
+			case RULES_OP_LE: r[instruction->dst] = a <= b; break;
+			case RULES_OP_GT: r[instruction->dst] = a > b; break;
+			case RULES_OP_GE: r[instruction->dst] = a >= b; break;
+			case RULES_OP_EQ: r[instruction->dst] = a == b; break;
+			case RULES_OP_NE: r[instruction->dst] = a != b; break;
+			case RULES_OP_AND: r[instruction->dst] = a && b; break;
+			case RULES_OP_OR: r[instruction->dst] = a || b; break;
+			case RULES_OP_NOT: r[instruction->dst] = !a; break;
+		}
+	}
+	return r[rule->result];
+}
+
+void
+Rules_Frame(int channel, const Frame_t* frame) {
+	if( Rules_count == 0 || !frame || channel < 0 || channel >= CHANNELS_MAX )
+		return;
+
+	memset(Rules_counts, 0, sizeof(Rules_counts));
+	for( uint32_t i = 0; i < frame->count && i < FRAME_MAX_DETECTIONS; i++ ) {
+		const Detection_t* detection = &frame->detections[i];
+		int label = detection->label < RULES_MAX_LABELS ? detection->label : -1;
+		if( label >= 0 )
+			Rules_counts[RULES_SLOT(label, RULES_ANY_ZONE)]++;
+		Rules_counts[RULES_SLOT(RULES_ANY_LABEL, RULES_ANY_ZONE)]++;
+		for( uint32_t zones = detection->zones; zones; zones &= zones - 1 ) {
+			int zone = __builtin_ctz(zones);
+			if( label >= 0 )
+				Rules_counts[RULES_SLOT(label, zone)]++;
+			Rules_counts[RULES_SLOT(RULES_ANY_LABEL, zone)]++;
+		}
+	}
+
+	for( int i = 0; i < Rules_count; i++ ) {
+		Rules_Rule* rule = &Rules_rules[i];
+		Rules_State* state = &rule->channels[channel];
+		if( !state->handle )
+			continue;
+		int condition = Rules_Run(rule) != 0;
+		if( condition != state->condition ) {
+			state->condition = condition;
+			state->since = frame->timestamp;
+		}
+		if( condition == state->state )
+			continue;
+		uint64_t hold = condition ? rule->forMs : rule->clearMs;
+		if( frame->timestamp - state->since >= hold ) {
+			state->state = condition;
+			ACAP_EVENTS_Handle_Fire_State(state->handle, condition);
+		}
+	}
+}
+
+//Sets low and removes the events of rules that were not carried over
+static void
+Rules_Clear(Rules_Rule* rules, int count) {
+	for( int i = 0; i < count; i++ ) {
+		for( int channel = 0; channel < CHANNELS_MAX; channel++ ) {
+			Rules_State* state = &rules[i].channels[channel];
+			if( state->state )
+				ACAP_EVENTS_Handle_Fire_State(state->handle, 0);
+			if( state->event[0] )
+				ACAP_EVENTS_Remove_Event(state->event);
+		}
+	}
+}
+
+//Takes over the state of the previous rule with the same event on the channel
+static int
+Rules_Carry(Rules_State* state, const char* event, int channel) {
+	for( int i = 0; i < Rules_previousCount; i++ ) {
+		Rules_Rule* previous = &Rules_previous[i];
+		Rules_State* old = &previous->channels[channel];
+		if( channel == 0 ? strcmp(previous->event, event) != 0 : strcmp(old->event, event) != 0 )
+			continue;
+		if( channel == 0 && !old->handle )
+			continue;
+		state->state = old->state;
+		state->condition = old->condition;
+		state->since = old->since;
+		memset(old, 0, sizeof(Rules_State));
+		return 1;
+	}
+	return 0;
+}
+
+//Each additional channel gets its own copy of the rule event with the same policy
+static void
+Rules_Declare(Rules_Rule* rule, cJSON* name) {
+	for( int channel = 1; channel < Channels_Count(); channel++ ) {
+		Rules_State* state = &rule->channels[channel];
+		char niceName[96];
+		snprintf(state->event, sizeof(state->event), "%s_%s", Channels_Name(channel), rule->event);
+		if( !Rules_Carry(state, state->event, channel) ) {
+			snprintf(niceName, sizeof(niceName), "%s: %s", Channels_Name(channel), cJSON_IsString(name) ? name->valuestring : rule->event);
+			ACAP_EVENTS_Add_Event(state->event, niceName, 1);
+			ACAP_EVENTS_Copy_Policy(state->event, rule->event);
+		}
+		state->handle = ACAP_EVENTS_Handle_Get(state->event);
+	}
+}
+
+static char*
+Rules_Config(cJSON* rules) {
+	cJSON* config = cJSON_CreateArray();
+	cJSON_AddItemToArray(config, rules ? cJSON_Duplicate(rules, 1) : cJSON_CreateNull());
+	cJSON_AddItemToArray(config, Zones_Names(Zones_Count() ? (uint32_t)((1ull << Zones_Count()) - 1) : 0));
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	cJSON_AddItemToArray(config, labels ? cJSON_Duplicate(labels, 1) : cJSON_CreateNull());
+	cJSON* channels = cJSON_CreateArray();
+	for( int channel = 0; channel < Channels_Count(); channel++ )
+		cJSON_AddItemToArray(channels, cJSON_CreateString(Channels_Name(channel)));
+	cJSON_AddItemToArray(config, channels);
+	char* text = cJSON_PrintUnformatted(config);
+	cJSON_Delete(config);
+	return text;
+}
+
+int
+Rules_Init(cJSON* rules) {
+	char* config = Rules_Config(rules);
+	if( config && Rules_config && strcmp(config, Rules_config) == 0 ) {
+		free(config);
+		return Rules_count;
+	}
+	free(Rules_config);
+	Rules_config = config;
+
+	memcpy(Rules_previous, Rules_rules, sizeof(Rules_Rule) * Rules_count);
+	Rules_previousCount = Rules_count;
+	Rules_count = 0;
+	Rules_codeLength = 0;
+	if( !Rules_declared )
+		Rules_declared = cJSON_CreateObject();
+
+	cJSON* errors = cJSON_CreateArray();
+	cJSON* item = rules && cJSON_IsArray(rules) ? rules->child : 0;
+	for( ; item; item = item->next ) {
+		cJSON* event = cJSON_GetObjectItem(item,"event");
+		cJSON* when = cJSON_GetObjectItem(item,"when");
+		if( !cJSON_IsString(event) || !cJSON_IsString(when) ) {
+			cJSON_AddItemToArray(errors, cJSON_CreateString("Rule needs event and when"));
+			continue;
+		}
+		if( Rules_count >= RULES_MAX ) {
+			cJSON_AddItemToArray(errors, cJSON_CreateString("Too many rules"));
+			break;
+		}
+
+		Rules_Parser parser = { when->valuestring, when->valuestring, 0, 0 };
+		int start = Rules_codeLength;
+		int result = Rules_Expression(&parser);
+		Rules_Space(&parser);
+		if( result >= 0 && *parser.position )
+			parser.error = "Unexpected text after expression";
+		if( result < 0 || parser.error ) {
+			char message[160];
+			snprintf(message, sizeof(message), "%s: %s at '%.32s'", event->valuestring, parser.error ? parser.error : "Error", parser.position);
+			LOG_WARN("%s: %s\n",__func__, message);
+			cJSON_AddItemToArray(errors, cJSON_CreateString(message));
+			Rules_codeLength = start;
+			continue;
+		}
+
+		Rules_Rule* rule = &Rules_rules[Rules_count++];
+		memset(rule, 0, sizeof(Rules_Rule));
+		snprintf(rule->event, sizeof(rule->event), "%s", event->valuestring);
+		rule->start = start;
+		rule->length = Rules_codeLength - start;
+		rule->result = result;
+		rule->forMs = cJSON_GetObjectItem(item,"for") ? cJSON_GetObjectItem(item,"for")->valuedouble * 1000 : 0;
+		rule->clearMs = cJSON_GetObjectItem(item,"clear") ? cJSON_GetObjectItem(item,"clear")->valuedouble * 1000 : 0;
+
+		//Events not in events.json are declared once with the optional name
+		cJSON* name = cJSON_GetObjectItem(item,"name");
+		if( cJSON_IsString(name) && !cJSON_GetObjectItem(Rules_declared, rule->event) ) {
+			ACAP_EVENTS_Add_Event(rule->event, name->valuestring, 1);
+			cJSON_AddTrueToObject(Rules_declared, rule->event);
+		}
+		Rules_Carry(&rule->channels[0], rule->event, 0);
+		rule->channels[0].handle = ACAP_EVENTS_Handle_Get(rule->event);
+		Rules_Declare(rule, name);
+	}
+	Rules_Clear(Rules_previous, Rules_previousCount);
+	Rules_previousCount = 0;
+
+	ACAP_STATUS_SetNumber("rules","count",Rules_count);
+	ACAP_STATUS_SetNumber("rules","instructions",Rules_codeLength);
+	ACAP_STATUS_SetObject("rules","errors",errors);
+	cJSON_Delete(errors);
+	LOG("%d rules compiled into %d instructions\n", Rules_count, Rules_codeLength);
+	return Rules_count;
+}
+
+void
+Rules_Cleanup() {
+	Rules_Clear(Rules_rules, Rules_count);
+	Rules_count = 0;
+	Rules_codeLength = 0;
+	free(Rules_config);
+	Rules_config = 0;
+	if( Rules_declared )
+		cJSON_Delete(Rules_declared);
+	Rules_declared = 0;
+}
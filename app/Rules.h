@@ -0,0 +1,33 @@
+/*
+ * Declarative event rules.
+ * Each rule is compiled on load into register bytecode that is evaluated
+ * every frame over the label/zone counts of that frame.
+ *
+ * settings.json "rules": [
+ *		{"event":"NoHelmet","when":"count(Person in 'Zone A') > count(Helmet in 'Zone A')","for":3,"clear":1},
+ *		...
+ * ]
+ * "for" is the number of seconds the condition must hold before the event
+ * goes high, "clear" the seconds it must be false before it goes low.
+ * Expressions support numbers, count(Label), count(Label in Zone),
+ * count(* in Zone), + - * / < <= > >= == != && || ! and parentheses.
+ * Rules run on every inference channel.  Additional channels fire
+ * <name>_<event>; zones belong to the primary view, so zone terms count
+ * zero on the other channels.
+ */
+#ifndef RULES_H
+#define RULES_H
+
+#include "cJSON.h"
+#include "Frame.h"
+
+#define RULES_MAX			32
+#define RULES_MAX_CODE		1024	//Instructions for all rules
+#define RULES_MAX_REGISTERS	16
+#define RULES_MAX_LABELS	64
+
+int		Rules_Init(cJSON* rules);
+void	Rules_Frame(int channel, const Frame_t* frame);		//Channel index in Channels, 0 for the primary
+void	Rules_Cleanup();
+
+#endif
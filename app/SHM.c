@@ -0,0 +1,121 @@
+/*
+ * Shared memory ring of per-frame detections.
+ * The detector is the only writer.  See SHM.h for the reader protocol.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ACAP.h"
+#include "SHM.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+static SHM_Header_t* SHM_header = MAP_FAILED;
+static char SHM_name[64] = "";
+
+void
+SHM_Publish(const Frame_t* frame) {
+	if( SHM_header == MAP_FAILED || !frame )
+		return;
+
+	uint64_t written = atomic_load_explicit(&SHM_header->writeSequence, memory_order_relaxed);
+	SHM_Slot_t* slot = &SHM_header->ring[written % SHM_SLOTS];
+	uint32_t count = frame->count < FRAME_MAX_DETECTIONS ? frame->count : FRAME_MAX_DETECTIONS;
+
+	uint32_t lock = atomic_load_explicit(&slot->lock, memory_order_relaxed);
+	atomic_store_explicit(&slot->lock, lock + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot->sequence = frame->sequence;
+	slot->timestamp = frame->timestamp;
+	slot->count = count;
+	memcpy(slot->detections, frame->detections, count * sizeof(Detection_t));
+
+	atomic_store_explicit(&slot->lock, lock + 2, memory_order_release);
+	atomic_store_explicit(&SHM_header->writeSequence, written + 1, memory_order_release);
+}
+
+static void
+SHM_Close() {
+	if( SHM_header != MAP_FAILED ) {
+		munmap(SHM_header, sizeof(SHM_Header_t));
+		SHM_header = MAP_FAILED;
+		shm_unlink(SHM_name);
+	}
+	ACAP_STATUS_SetBool("shm","active",0);
+}
+
+int
+SHM_Init(cJSON* settings) {
+	int enabled = settings && cJSON_IsTrue(cJSON_GetObjectItem(settings,"enabled"));
+	cJSON* nameItem = settings ? cJSON_GetObjectItem(settings,"name") : 0;
+	const char* name = nameItem && cJSON_IsString(nameItem) && nameItem->valuestring[0] == '/' ?
+		nameItem->valuestring : SHM_DEFAULT_NAME;
+
+	if( SHM_header != MAP_FAILED && (!enabled || strcmp(name, SHM_name) != 0) )
+		SHM_Close();
+	if( !enabled || SHM_header != MAP_FAILED )
+		return 1;
+
+	snprintf(SHM_name, sizeof(SHM_name), "%s", name);
+	int fd = shm_open(SHM_name, O_CREAT | O_RDWR, 0644);
+	if( fd < 0 ) {
+		LOG_WARN("%s: Unable to open %s: %s\n",__func__, SHM_name, strerror(errno));
+		return 0;
+	}
+	fchmod(fd, 0644);
+	if( ftruncate(fd, sizeof(SHM_Header_t)) < 0 ) {
+		LOG_WARN("%s: Unable to size %s: %s\n",__func__, SHM_name, strerror(errno));
+		close(fd);
+		shm_unlink(SHM_name);
+		return 0;
+	}
+	SHM_header = mmap(NULL, sizeof(SHM_Header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if( SHM_header == MAP_FAILED ) {
+		LOG_WARN("%s: Unable to map %s: %s\n",__func__, SHM_name, strerror(errno));
+		shm_unlink(SHM_name);
+		return 0;
+	}
+
+	//Readers check magic last; clear it while the geometry is written
+	SHM_header->magic = 0;
+	atomic_thread_fence(memory_order_release);
+	SHM_header->version = SHM_VERSION;
+	SHM_header->slots = SHM_SLOTS;
+	SHM_header->slotSize = sizeof(SHM_Slot_t);
+	SHM_header->maxDetections = FRAME_MAX_DETECTIONS;
+	SHM_header->detectionSize = sizeof(Detection_t);
+	atomic_store_explicit(&SHM_header->writeSequence, 0, memory_order_relaxed);
+	for( int i = 0; i < SHM_SLOTS; i++ )
+		atomic_store_explicit(&SHM_header->ring[i].lock, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	SHM_header->magic = SHM_MAGIC;
+
+	ACAP_STATUS_SetBool("shm","active",1);
+	ACAP_STATUS_SetString("shm","name",SHM_name);
+	ACAP_STATUS_SetNumber("shm","size",sizeof(SHM_Header_t));
+	ACAP_STATUS_SetNumber("shm","headerSize",offsetof(SHM_Header_t, ring));
+	ACAP_STATUS_SetNumber("shm","slots",SHM_SLOTS);
+	ACAP_STATUS_SetNumber("shm","slotSize",sizeof(SHM_Slot_t));
+	ACAP_STATUS_SetNumber("shm","maxDetections",FRAME_MAX_DETECTIONS);
+	LOG("Detections published in shared memory %s\n", SHM_name);
+	return 1;
+}
+
+void
+SHM_Cleanup() {
+	SHM_Close();
+}
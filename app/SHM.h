@@ -0,0 +1,59 @@
+/*
+ * Per-frame detections published in a POSIX shared memory ring.
+ *
+ * Local readers shm_open(SHM_DEFAULT_NAME, O_RDONLY), mmap the segment
+ * read-only and poll without any system calls.  Each slot is protected
+ * by a sequence lock:
+ *
+ *	uint64_t written = atomic_load_explicit(&header->writeSequence, memory_order_acquire);
+ *	const SHM_Slot_t* slot = &header->ring[(written - 1) % header->slots];
+ *	do {
+ *		s1 = atomic_load_explicit(&slot->lock, memory_order_acquire);
+ *		if( s1 & 1 ) continue;				//Writer active, retry
+ *		memcpy(&copy, slot, sizeof(copy));
+ *		atomic_thread_fence(memory_order_acquire);
+ *		s2 = atomic_load_explicit(&slot->lock, memory_order_relaxed);
+ *	} while( s1 != s2 || (s1 & 1) );
+ *
+ * Frame n (1-based writeSequence) is stored in slot (n - 1) % slots.
+ * A reader that falls more than "slots" frames behind has lost frames
+ * and can detect it from the frame sequence numbers.
+ */
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "cJSON.h"
+#include "Frame.h"
+
+#define SHM_DEFAULT_NAME	"/detectx.detections"
+#define SHM_MAGIC			0x48535844	//"DXSH"
+#define SHM_VERSION			2
+#define SHM_SLOTS			64
+
+typedef struct {
+	_Atomic uint32_t lock;		//Odd while the writer updates the slot
+	uint32_t sequence;			//Frame sequence number
+	uint64_t timestamp;			//VDO capture time of the image, EPOCH ms
+	uint32_t count;
+	uint32_t reserved;
+	Detection_t detections[FRAME_MAX_DETECTIONS];
+} SHM_Slot_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slotSize;
+	uint32_t maxDetections;
+	uint32_t detectionSize;
+	_Atomic uint64_t writeSequence;	//Frames written so far
+	SHM_Slot_t ring[SHM_SLOTS];
+} SHM_Header_t;
+
+int		SHM_Init(cJSON* settings);
+void	SHM_Publish(const Frame_t* frame);
+void	SHM_Cleanup();
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * Server-Sent Events stream of detections and event state transitions.
+ *
+ * Each connected client gets its own writer thread and a bounded queue
+ * of pending messages.  The inference thread copies the compact frame
+ * once, hands a reference to every client queue and returns; the first
+ * client thread that sends a frame formats it, and all socket I/O
+ * happens on the client threads.  A slow client only loses its own
+ * oldest messages and never delays inference or other clients.
+ * Messages queued while a client is writing are sent as one batch with
+ * a single flush.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+
+#include "ACAP.h"
+#include "SSE.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define SSE_KEEPALIVE_SECONDS 15
+#define SSE_MAX_LABELS 128
+
+typedef struct {
+	atomic_int references;
+	char* data;				//Event text, frames are formatted by the first client that sends them
+	size_t length;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint32_t count;
+	Detection_t detections[];
+} SSE_Message;
+
+typedef struct {
+	int active;
+	int joinable;			//Thread not joined yet, also after it ended on a closed connection
+	int shutdown;
+	ACAP_HTTP_Response response;
+	pthread_t thread;
+	pthread_cond_t cond;
+	SSE_Message* queue[SSE_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int count;
+} SSE_Client;
+
+static SSE_Client SSE_clients[SSE_MAX_CLIENTS];
+static pthread_mutex_t SSE_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int SSE_activeClients = 0;
+static atomic_uint SSE_dropped = 0;
+static unsigned int SSE_sequence = 0;
+static pthread_mutex_t SSE_formatMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Model labels are fixed for the lifetime of the application, copied once on the main thread
+static char SSE_labelNames[SSE_MAX_LABELS][32];
+static int SSE_labelCount = -1;
+
+static void
+SSE_Release(SSE_Message* message) {
+	if( message && atomic_fetch_sub(&message->references, 1) == 1 ) {
+		free(message->data);
+		free(message);
+	}
+}
+
+static SSE_Message*
+SSE_Create(const char* event, unsigned int id, const char* json) {
+	size_t size = strlen(event) + strlen(json) + 48;
+	SSE_Message* message = calloc(1, sizeof(SSE_Message));
+	char* data = malloc(size);
+	if( !message || !data ) {
+		LOG_WARN("%s: Memory allocation error\n",__func__);
+		free(message);
+		free(data);
+		return 0;
+	}
+	atomic_init(&message->references, 1);
+	int length = snprintf(data, size, "event: %s\nid: %u\ndata: %s\n\n", event, id, json);
+	message->data = data;
+	message->length = length > 0 ? (size_t)length : 0;
+	return message;
+}
+
+//Called on a client thread, once per frame
+static void
+SSE_Format(SSE_Message* message) {
+	size_t size = 128 + message->count * (sizeof(SSE_labelNames[0]) + 96);
+	char* data = malloc(size);
+	if( !data )
+		return;
+	int length = snprintf(data, size, "event: detections\nid: %u\ndata: {\"sequence\":%u,\"timestamp\":%llu,\"detections\":[",
+		message->sequence, message->sequence, (unsigned long long)message->timestamp);
+	for( uint32_t i = 0; i < message->count && length > 0 && (size_t)length < size; i++ ) {
+		const Detection_t* detection = &message->detections[i];
+		length += snprintf(data + length, size - length, "%s{\"label\":\"%s\",\"c\":%u,\"x\":%u,\"y\":%u,\"w\":%u,\"h\":%u,\"zones\":%u}",
+			i ? "," : "", detection->label < SSE_labelCount ? SSE_labelNames[detection->label] : "Undefined",
+			detection->confidence, detection->x, detection->y, detection->w, detection->h, detection->zones);
+	}
+	if( length > 0 && (size_t)length < size )
+		length += snprintf(data + length, size - length, "]}\n\n");
+	if( length <= 0 || (size_t)length >= size ) {
+		free(data);
+		return;
+	}
+	message->length = (size_t)length;
+	message->data = data;
+}
+
+static void
+SSE_Labels() {
+	SSE_labelCount = 0;
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	for( cJSON* label = labels ? labels->child : 0; label && SSE_labelCount < SSE_MAX_LABELS; label = label->next ) {
+		char* name = SSE_labelNames[SSE_labelCount++];
+		snprintf(name, sizeof(SSE_labelNames[0]), "%s", cJSON_IsString(label) ? label->valuestring : "Undefined");
+		for( char* c = name; *c; c++ )
+			if( *c == '"' || *c == '\\' || (unsigned char)*c < 0x20 )
+				*c = '_';
+	}
+}
+
+static void
+SSE_Status() {
+	ACAP_STATUS_SetNumber("sse","clients", atomic_load(&SSE_activeClients));
+	ACAP_STATUS_SetNumber("sse","dropped", atomic_load(&SSE_dropped));
+}
+
+//Hand one reference of the message to every connected client
+static void
+SSE_Publish(SSE_Message* message) {
+	pthread_mutex_lock(&SSE_mutex);
+	for( int i = 0; i < SSE_MAX_CLIENTS; i++ ) {
+		SSE_Client* client = &SSE_clients[i];
+		if( !client->active || client->shutdown )
+			continue;
+		if( client->count == SSE_QUEUE_SIZE ) {
+			//Drop the oldest message to make room
+			SSE_Release(client->queue[client->head]);
+			client->head = (client->head + 1) % SSE_QUEUE_SIZE;
+			client->count--;
+			atomic_fetch_add(&SSE_dropped, 1);
+		}
+		atomic_fetch_add(&message->references, 1);
+		client->queue[(client->head + client->count) % SSE_QUEUE_SIZE] = message;
+		client->count++;
+		pthread_cond_signal(&client->cond);
+	}
+	pthread_mutex_unlock(&SSE_mutex);
+	SSE_Release(message);
+}
+
+static void*
+SSE_Client_Thread(void* data) {
+	SSE_Client* client = (SSE_Client*)data;
+	SSE_Message* batch[SSE_QUEUE_SIZE];
+	int failed = 0;
+
+	pthread_mutex_lock(&SSE_mutex);
+	while( !client->shutdown && !failed ) {
+		if( client->count == 0 ) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += SSE_KEEPALIVE_SECONDS;
+			pthread_cond_timedwait(&client->cond, &SSE_mutex, &deadline);
+			if( client->shutdown )
+				break;
+		}
+
+		unsigned int count = client->count;
+		for( unsigned int i = 0; i < count; i++ )
+			batch[i] = client->queue[(client->head + i) % SSE_QUEUE_SIZE];
+		client->head = (client->head + count) % SSE_QUEUE_SIZE;
+		client->count = 0;
+		pthread_mutex_unlock(&SSE_mutex);
+
+		if( count == 0 ) {
+			//Comment line keeps proxies from timing out and detects closed clients
+			failed = !ACAP_HTTP_Respond_String(client->response, ": keepalive\n\n");
+		}
+		for( unsigned int i = 0; i < count; i++ ) {
+			pthread_mutex_lock(&SSE_formatMutex);
+			if( !batch[i]->data )
+				SSE_Format(batch[i]);
+			pthread_mutex_unlock(&SSE_formatMutex);
+			if( !failed && batch[i]->data && batch[i]->length )
+				failed = !ACAP_HTTP_Respond_Data(client->response, batch[i]->length, batch[i]->data);
+			SSE_Release(batch[i]);
+		}
+		if( !failed && FCGX_FFlush(client->response->out) < 0 )
+			failed = 1;
+
+		pthread_mutex_lock(&SSE_mutex);
+	}
+
+	while( client->count ) {
+		SSE_Release(client->queue[client->head]);
+		client->head = (client->head + 1) % SSE_QUEUE_SIZE;
+		client->count--;
+	}
+	ACAP_HTTP_Response response = client->response;
+	client->response = 0;
+	client->active = 0;
+	pthread_cond_destroy(&client->cond);
+	atomic_fetch_sub(&SSE_activeClients, 1);
+	pthread_mutex_unlock(&SSE_mutex);
+
+	ACAP_HTTP_Release(response);
+	LOG_TRACE("%s: Client disconnected\n",__func__);
+	return NULL;
+}
+
+static void
+SSE_HTTP_Stream(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	const char* method = ACAP_HTTP_Get_Method(request);
+	if( !method || strcmp(method, "GET") != 0 ) {
+		ACAP_HTTP_Respond_Error(response, 405, "Method Not Allowed - Only GET supported");
+		return;
+	}
+
+	pthread_mutex_lock(&SSE_mutex);
+	SSE_Client* client = 0;
+	for( int i = 0; i < SSE_MAX_CLIENTS && !client; i++ )
+		if( !SSE_clients[i].active )
+			client = &SSE_clients[i];
+	pthread_mutex_unlock(&SSE_mutex);
+
+	if( !client ) {
+		ACAP_HTTP_Respond_Error(response, 503, "Too many stream clients");
+		return;
+	}
+	//The previous thread of the slot has marked it inactive and is about to return
+	if( client->joinable ) {
+		pthread_join(client->thread, NULL);
+		client->joinable = 0;
+	}
+
+	if( !ACAP_HTTP_Respond_String(response,
+			"Content-Type: text/event-stream\r\n"
+			"Cache-Control: no-cache\r\n"
+			"X-Accel-Buffering: no\r\n"
+			"\r\n"
+			"retry: 2000\n\n") ) {
+		return;
+	}
+	FCGX_FFlush(response->out);
+
+	ACAP_HTTP_Response detached = ACAP_HTTP_Detach(response);
+	if( !detached )
+		return;
+
+	pthread_mutex_lock(&SSE_mutex);
+	memset(client, 0, sizeof(SSE_Client));
+	client->response = detached;
+	pthread_cond_init(&client->cond, NULL);
+	client->active = 1;
+	if( pthread_create(&client->thread, NULL, SSE_Client_Thread, client) != 0 ) {
+		LOG_WARN("%s: Unable to start client thread: %s\n",__func__, strerror(errno));
+		client->active = 0;
+		pthread_cond_destroy(&client->cond);
+		pthread_mutex_unlock(&SSE_mutex);
+		ACAP_HTTP_Release(detached);
+		return;
+	}
+	client->joinable = 1;
+	atomic_fetch_add(&SSE_activeClients, 1);
+	pthread_mutex_unlock(&SSE_mutex);
+
+	SSE_Status();
+	LOG_TRACE("%s: Client connected\n",__func__);
+}
+
+void
+SSE_Frame(const Frame_t* frame) {
+	SSE_sequence = frame->sequence;
+	if( atomic_load(&SSE_activeClients) == 0 )
+		return;
+	if( SSE_labelCount < 0 )
+		SSE_Labels();
+
+	uint32_t count = frame->count < FRAME_MAX_DETECTIONS ? frame->count : FRAME_MAX_DETECTIONS;
+	SSE_Message* message = calloc(1, sizeof(SSE_Message) + count * sizeof(Detection_t));
+	if( !message ) {
+		LOG_WARN("%s: Memory allocation error\n",__func__);
+		return;
+	}
+	atomic_init(&message->references, 1);
+	message->sequence = frame->sequence;
+	message->timestamp = frame->timestamp;
+	message->count = count;
+	memcpy(message->detections, frame->detections, count * sizeof(Detection_t));
+	SSE_Publish(message);
+	SSE_Status();
+}
+
+void
+SSE_Event(const char* id, int state) {
+	if( !id || atomic_load(&SSE_activeClients) == 0 )
+		return;
+
+	cJSON* event = cJSON_CreateObject();
+	cJSON_AddStringToObject(event, "event", id);
+	cJSON_AddBoolToObject(event, "state", state);
+	cJSON_AddNumberToObject(event, "timestamp", ACAP_DEVICE_Timestamp());
+	char* json = cJSON_PrintUnformatted(event);
+	cJSON_Delete(event);
+	if( !json )
+		return;
+	SSE_Message* message = SSE_Create("state", SSE_sequence, json);
+	free(json);
+	if( message )
+		SSE_Publish(message);
+}
+
+int
+SSE_Init() {
+	ACAP_STATUS_Live("sse", NULL);
+	SSE_Status();
+	return ACAP_HTTP_Node("sse", SSE_HTTP_Stream);
+}
+
+void
+SSE_Cleanup() {
+	pthread_mutex_lock(&SSE_mutex);
+	for( int i = 0; i < SSE_MAX_CLIENTS; i++ ) {
+		if( SSE_clients[i].active ) {
+			SSE_clients[i].shutdown = 1;
+			pthread_cond_signal(&SSE_clients[i].cond);
+		}
+	}
+	pthread_mutex_unlock(&SSE_mutex);
+	for( int i = 0; i < SSE_MAX_CLIENTS; i++ ) {
+		if( SSE_clients[i].joinable ) {
+			pthread_join(SSE_clients[i].thread, NULL);
+			SSE_clients[i].joinable = 0;
+		}
+	}
+}
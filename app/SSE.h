@@ -0,0 +1,20 @@
+/*
+ * Server-Sent Events stream of detections and event state transitions.
+ * GET /local/detectx/sse keeps the connection open and pushes every
+ * processed frame as it is produced.
+ */
+#ifndef SSE_H
+#define SSE_H
+
+#include "cJSON.h"
+#include "Frame.h"
+
+#define SSE_MAX_CLIENTS		4
+#define SSE_QUEUE_SIZE		64	//Pending messages per client before the oldest are dropped
+
+int		SSE_Init();
+void	SSE_Frame(const Frame_t* frame);
+void	SSE_Event(const char* id, int state);
+void	SSE_Cleanup();
+
+#endif
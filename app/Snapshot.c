@@ -0,0 +1,354 @@
+/*
+ * JPEG of the last processed frame.
+ *
+ * Nothing is done per frame.  When the pre-event clip stream is running
+ * its ring already holds camera encoded JPEGs, so the frame closest in
+ * time to the latest detections is served as is, with the boxes in the
+ * X-Detections header for the client to draw.  Without that stream, or
+ * with ?annotate=1, the NV12 frame that produced the detections is copied
+ * on the main loop (row by row, VDO pads rows to the stream pitch), the
+ * boxes are drawn in the luma and chroma planes and the copy is handed to
+ * an encoder thread.  Requests for a frame being encoded are detached and
+ * answered by that thread, so inference never waits for the encoder.
+ * The JPEG is cached by frame sequence so all viewers of the same frame
+ * share one encode, and a new encode is started at most every
+ * SNAPSHOT_MIN_INTERVAL ms; requests in between get the cached image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "ACAP.h"
+#include "Video.h"
+#include "Clip.h"
+#include "Jpeg.h"
+#include "Snapshot.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define SNAPSHOT_LINE	2
+
+typedef struct {
+	atomic_int references;
+	uint32_t sequence;
+	size_t length;
+	uint8_t data[];
+} Snapshot_Image;
+
+static const Frame_t* Snapshot_frame = 0;
+
+static pthread_t Snapshot_thread;
+static pthread_mutex_t Snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Snapshot_cond = PTHREAD_COND_INITIALIZER;
+static int Snapshot_running = 0;
+static int Snapshot_shutdown = 0;
+
+//Owned by the encoder thread while Snapshot_busy is set
+static int Snapshot_busy = 0;
+static uint8_t* Snapshot_nv12 = 0;		//Packed NV12 copy with boxes
+static size_t Snapshot_nv12Size = 0;
+static unsigned int Snapshot_width = 0;
+static unsigned int Snapshot_height = 0;
+static uint32_t Snapshot_sequence = 0;
+
+static Snapshot_Image* Snapshot_cached = 0;
+static ACAP_HTTP_Response Snapshot_waiting[SNAPSHOT_MAX_WAITING];
+static int Snapshot_waitingCount = 0;
+static uint64_t Snapshot_encoded = 0;
+
+static atomic_uint Snapshot_encodes = 0;
+static atomic_uint Snapshot_served = 0;
+static unsigned int Snapshot_streamed = 0;
+
+//Y, U, V per label index
+static const uint8_t Snapshot_colors[][3] = {
+	{ 82, 90,240},	//Red
+	{145, 54, 34},	//Green
+	{ 41,240,110},	//Blue
+	{210, 16,146},	//Yellow
+	{170,166, 16},	//Cyan
+	{107,202,222}	//Magenta
+};
+
+static uint64_t
+Snapshot_Now() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static void
+Snapshot_Release(Snapshot_Image* image) {
+	if( image && atomic_fetch_sub(&image->references, 1) == 1 )
+		free(image);
+}
+
+static void
+Snapshot_Fill(uint8_t* image, unsigned int width, unsigned int height, unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2, const uint8_t* color) {
+	if( x2 > width ) x2 = width;
+	if( y2 > height ) y2 = height;
+	uint8_t* chroma = image + width * height;
+	for( unsigned int y = y1; y < y2; y++ )
+		memset(image + y * width + x1, color[0], x2 > x1 ? x2 - x1 : 0);
+	for( unsigned int y = y1 / 2; y < (y2 + 1) / 2; y++ ) {
+		for( unsigned int x = x1 / 2; x < (x2 + 1) / 2; x++ ) {
+			chroma[y * width + x * 2] = color[1];
+			chroma[y * width + x * 2 + 1] = color[2];
+		}
+	}
+}
+
+static void
+Snapshot_Box(uint8_t* image, unsigned int width, unsigned int height, const Detection_t* detection) {
+	unsigned int x1 = detection->x * width / 1000;
+	unsigned int y1 = detection->y * height / 1000;
+	unsigned int x2 = (detection->x + detection->w) * width / 1000;
+	unsigned int y2 = (detection->y + detection->h) * height / 1000;
+	if( x2 > width - 1 ) x2 = width - 1;
+	if( y2 > height - 1 ) y2 = height - 1;
+	if( x1 >= x2 || y1 >= y2 )
+		return;
+	const uint8_t* color = Snapshot_colors[detection->label % (sizeof(Snapshot_colors) / sizeof(Snapshot_colors[0]))];
+	Snapshot_Fill(image, width, height, x1, y1, x2 + 1, y1 + SNAPSHOT_LINE, color);
+	Snapshot_Fill(image, width, height, x1, y2 + 1 - SNAPSHOT_LINE, x2 + 1, y2 + 1, color);
+	Snapshot_Fill(image, width, height, x1, y1, x1 + SNAPSHOT_LINE, y2 + 1, color);
+	Snapshot_Fill(image, width, height, x2 + 1 - SNAPSHOT_LINE, y1, x2 + 1, y2 + 1, color);
+}
+
+//Copy the last frame and draw the boxes.  Main loop, with Snapshot_busy clear
+static int
+Snapshot_Prepare() {
+	unsigned int width = 0, height = 0, pitch = 0;
+	VdoBuffer* buffer = Video_Last_YUV(&width, &height, &pitch);
+	if( !buffer || !Snapshot_frame )
+		return 0;
+	const uint8_t* data = vdo_buffer_get_data(buffer);
+	if( !data || pitch < width )
+		return 0;
+	if( (size_t)pitch * height * 3 / 2 > vdo_buffer_get_capacity(buffer) ) {
+		LOG_WARN("%s: Frame %ux%u pitch %u exceeds the buffer\n",__func__, width, height, pitch);
+		return 0;
+	}
+
+	//The chroma plane starts after height padded rows, copy only the visible part
+	unsigned int evenWidth = width & ~1u;
+	unsigned int evenHeight = height & ~1u;
+	size_t size = (size_t)evenWidth * evenHeight * 3 / 2;
+	if( size != Snapshot_nv12Size ) {
+		free(Snapshot_nv12);
+		Snapshot_nv12 = malloc(size);
+		Snapshot_nv12Size = Snapshot_nv12 ? size : 0;
+		if( !Snapshot_nv12 ) {
+			LOG_WARN("%s: Memory allocation error\n",__func__);
+			return 0;
+		}
+	}
+	for( unsigned int y = 0; y < evenHeight; y++ )
+		memcpy(Snapshot_nv12 + (size_t)y * evenWidth, data + (size_t)y * pitch, evenWidth);
+	const uint8_t* chroma = data + (size_t)pitch * height;
+	uint8_t* packed = Snapshot_nv12 + (size_t)evenWidth * evenHeight;
+	for( unsigned int y = 0; y < evenHeight / 2; y++ )
+		memcpy(packed + (size_t)y * evenWidth, chroma + (size_t)y * pitch, evenWidth);
+
+	for( uint32_t i = 0; i < Snapshot_frame->count && i < FRAME_MAX_DETECTIONS; i++ )
+		Snapshot_Box(Snapshot_nv12, evenWidth, evenHeight, &Snapshot_frame->detections[i]);
+	Snapshot_width = evenWidth;
+	Snapshot_height = evenHeight;
+	Snapshot_sequence = Snapshot_frame->sequence;
+	return 1;
+}
+
+static void
+Snapshot_Respond(ACAP_HTTP_Response response, const Snapshot_Image* image) {
+	if( !image ) {
+		ACAP_HTTP_Respond_Error(response, 503, "No frame available");
+		return;
+	}
+	ACAP_HTTP_Respond_String(response,
+		"Content-Type: image/jpeg\r\n"
+		"Content-Length: %zu\r\n"
+		"Cache-Control: no-cache\r\n"
+		"X-Frame-Sequence: %u\r\n"
+		"\r\n", image->length, image->sequence);
+	ACAP_HTTP_Respond_Data(response, image->length, image->data);
+	atomic_fetch_add(&Snapshot_served, 1);
+}
+
+static void*
+Snapshot_Encoder_Thread(void* data) {
+	pthread_mutex_lock(&Snapshot_mutex);
+	while( !Snapshot_shutdown ) {
+		if( !Snapshot_busy ) {
+			pthread_cond_wait(&Snapshot_cond, &Snapshot_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&Snapshot_mutex);
+
+		uint8_t* jpeg = 0;
+		size_t length = 0;
+		Snapshot_Image* image = 0;
+		if( Jpeg_Encode_NV12(Snapshot_nv12, Snapshot_width, Snapshot_height, SNAPSHOT_QUALITY, &jpeg, &length) ) {
+			image = malloc(sizeof(Snapshot_Image) + length);
+			if( image ) {
+				atomic_init(&image->references, 1);
+				image->sequence = Snapshot_sequence;
+				image->length = length;
+				memcpy(image->data, jpeg, length);
+				atomic_fetch_add(&Snapshot_encodes, 1);
+			}
+			free(jpeg);
+		} else {
+			LOG_WARN("%s: Encoding failed\n",__func__);
+		}
+
+		pthread_mutex_lock(&Snapshot_mutex);
+		if( image ) {
+			Snapshot_Release(Snapshot_cached);
+			Snapshot_cached = image;
+		}
+		image = Snapshot_cached;
+		if( image )
+			atomic_fetch_add(&image->references, 1);
+		ACAP_HTTP_Response waiting[SNAPSHOT_MAX_WAITING];
+		int count = Snapshot_waitingCount;
+		memcpy(waiting, Snapshot_waiting, sizeof(waiting));
+		Snapshot_waitingCount = 0;
+		Snapshot_busy = 0;
+		pthread_mutex_unlock(&Snapshot_mutex);
+
+		for( int i = 0; i < count; i++ ) {
+			Snapshot_Respond(waiting[i], image);
+			ACAP_HTTP_Release(waiting[i]);
+		}
+		Snapshot_Release(image);
+		pthread_mutex_lock(&Snapshot_mutex);
+	}
+	pthread_mutex_unlock(&Snapshot_mutex);
+	return NULL;
+}
+
+//Camera encoded frame from the clip ring, the boxes go in a header
+static int
+Snapshot_Stream(const ACAP_HTTP_Response response) {
+	if( !Snapshot_frame || !Snapshot_frame->timestamp )
+		return 0;
+	Clip_Frame* clip = Clip_Nearest(Snapshot_frame->timestamp, SNAPSHOT_MAX_SKEW);
+	if( !clip )
+		return 0;
+	cJSON* boxes = cJSON_CreateArray();
+	for( uint32_t i = 0; i < Snapshot_frame->count && i < FRAME_MAX_DETECTIONS; i++ ) {
+		const Detection_t* detection = &Snapshot_frame->detections[i];
+		int box[] = { detection->label, detection->confidence, detection->x, detection->y, detection->w, detection->h };
+		cJSON_AddItemToArray(boxes, cJSON_CreateIntArray(box, 6));
+	}
+	char* json = cJSON_PrintUnformatted(boxes);
+	cJSON_Delete(boxes);
+	ACAP_HTTP_Respond_String(response,
+		"Content-Type: image/jpeg\r\n"
+		"Content-Length: %zu\r\n"
+		"Cache-Control: no-cache\r\n"
+		"X-Frame-Sequence: %u\r\n"
+		"X-Detections: %s\r\n"
+		"\r\n", clip->size, Snapshot_frame->sequence, json ? json : "[]");
+	ACAP_HTTP_Respond_Data(response, clip->size, clip->data);
+	free(json);
+	Clip_Release(clip);
+	Snapshot_streamed++;
+	return 1;
+}
+
+static void
+Snapshot_HTTP(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	const char* method = ACAP_HTTP_Get_Method(request);
+	if( !method || strcmp(method, "GET") != 0 ) {
+		ACAP_HTTP_Respond_Error(response, 405, "Method Not Allowed - Only GET supported");
+		return;
+	}
+	const char* annotate = ACAP_HTTP_Request_Param(request, "annotate");
+	int draw = annotate && strcmp(annotate, "0") != 0;
+	if( annotate )
+		free((void*)annotate);
+
+	if( !draw && Snapshot_Stream(response) ) {
+		ACAP_STATUS_SetNumber("snapshot","streamed",Snapshot_streamed);
+		return;
+	}
+	if( !Snapshot_running ) {
+		ACAP_HTTP_Respond_Error(response, 503, "Snapshot encoder not running");
+		return;
+	}
+
+	uint64_t now = Snapshot_Now();
+	pthread_mutex_lock(&Snapshot_mutex);
+	int stale = !Snapshot_cached || (Snapshot_frame && Snapshot_frame->sequence != Snapshot_cached->sequence);
+	if( stale && !Snapshot_busy && (!Snapshot_cached || now - Snapshot_encoded >= SNAPSHOT_MIN_INTERVAL) ) {
+		if( Snapshot_Prepare() ) {
+			Snapshot_encoded = now;
+			Snapshot_busy = 1;
+			pthread_cond_signal(&Snapshot_cond);
+		}
+	}
+	//Wait for the encode in progress unless a cached image will do
+	if( Snapshot_busy && (stale || !Snapshot_cached) && Snapshot_waitingCount < SNAPSHOT_MAX_WAITING ) {
+		ACAP_HTTP_Response detached = ACAP_HTTP_Detach(response);
+		if( detached ) {
+			Snapshot_waiting[Snapshot_waitingCount++] = detached;
+			pthread_mutex_unlock(&Snapshot_mutex);
+			return;
+		}
+	}
+	Snapshot_Image* image = Snapshot_cached;
+	if( image )
+		atomic_fetch_add(&image->references, 1);
+	pthread_mutex_unlock(&Snapshot_mutex);
+
+	Snapshot_Respond(response, image);
+	Snapshot_Release(image);
+	ACAP_STATUS_SetNumber("snapshot","encodes",atomic_load(&Snapshot_encodes));
+	ACAP_STATUS_SetNumber("snapshot","served",atomic_load(&Snapshot_served));
+}
+
+int
+Snapshot_Init(const Frame_t* frame) {
+	ACAP_STATUS_Live("snapshot", NULL);
+	Snapshot_frame = frame;
+	Snapshot_shutdown = 0;
+	if( pthread_create(&Snapshot_thread, NULL, Snapshot_Encoder_Thread, NULL) != 0 ) {
+		LOG_WARN("%s: Unable to start encoder thread: %s\n",__func__, strerror(errno));
+	} else {
+		Snapshot_running = 1;
+	}
+	return ACAP_HTTP_Node("snapshot", Snapshot_HTTP);
+}
+
+void
+Snapshot_Cleanup() {
+	if( Snapshot_running ) {
+		pthread_mutex_lock(&Snapshot_mutex);
+		Snapshot_shutdown = 1;
+		pthread_cond_signal(&Snapshot_cond);
+		pthread_mutex_unlock(&Snapshot_mutex);
+		pthread_join(Snapshot_thread, NULL);
+		Snapshot_running = 0;
+	}
+	for( int i = 0; i < Snapshot_waitingCount; i++ ) {
+		ACAP_HTTP_Respond_Error(Snapshot_waiting[i], 503, "Shutting down");
+		ACAP_HTTP_Release(Snapshot_waiting[i]);
+	}
+	Snapshot_waitingCount = 0;
+	Snapshot_busy = 0;
+	Snapshot_Release(Snapshot_cached);
+	Snapshot_cached = 0;
+	free(Snapshot_nv12);
+	Snapshot_nv12 = 0;
+	Snapshot_nv12Size = 0;
+}
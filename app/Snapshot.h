@@ -0,0 +1,18 @@
+/*
+ * JPEG of the last processed frame.
+ * GET /local/detectx/snapshot[?annotate=1]
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "Frame.h"
+
+#define SNAPSHOT_QUALITY		75
+#define SNAPSHOT_MIN_INTERVAL	500		//ms between encodes
+#define SNAPSHOT_MAX_SKEW		300		//ms between detections and a clip frame
+#define SNAPSHOT_MAX_WAITING	8		//Requests waiting for an encode
+
+int		Snapshot_Init(const Frame_t* frame);
+void	Snapshot_Cleanup();
+
+#endif
@@ -0,0 +1,481 @@
+/*
+ * Rolling detection statistics.
+ *
+ * Every frame updates the current bucket of three fixed rings (minute,
+ * hour, day) in O(labels).  A bucket is reused when its slot comes
+ * around again.  Touched buckets are marked dirty and written in place
+ * to localdata/stats.bin once a minute, so persisting costs a few
+ * hundred bytes instead of rewriting the rings.
+ *
+ * Violation time is accumulated while one of the configured events is
+ * high.  Compliance for an event is 1 - violation / presence of the
+ * presenceLabel (normally Person) in the same bucket.
+ *
+ * Per zone the bucket holds the presence and max concurrent count of the
+ * presenceLabel, and the time any event was high while it was present in
+ * the zone, so a violation is charged to every zone with people in it.
+ * Zones are identified by index; the zone counters are cleared when the
+ * zone names change.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "ACAP.h"
+#include "Zones.h"
+#include "Stats.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define STATS_FILE			"localdata/stats.bin"
+#define STATS_MAGIC			0x53545844	//"DXTS"
+#define STATS_VERSION		2
+#define STATS_PERSIST		60			//Seconds between writes
+#define STATS_MAX_GAP		1000		//Longest frame interval counted, ms
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t bucketSize;
+	uint32_t labels;
+	uint32_t events;
+	uint32_t sizes[3];
+	char eventIds[STATS_MAX_EVENTS][32];
+	uint32_t zones;
+	char zoneNames[STATS_MAX_ZONES][32];
+} Stats_Header;
+
+typedef struct {
+	const char* name;
+	unsigned int seconds;
+	unsigned int size;
+	Stats_Bucket* buckets;
+	uint8_t* dirty;
+	size_t fileOffset;
+} Stats_Ring;
+
+static Stats_Bucket Stats_minutes[STATS_MINUTES];
+static Stats_Bucket Stats_hours[STATS_HOURS];
+static Stats_Bucket Stats_days[STATS_DAYS];
+static uint8_t Stats_minutesDirty[STATS_MINUTES];
+static uint8_t Stats_hoursDirty[STATS_HOURS];
+static uint8_t Stats_daysDirty[STATS_DAYS];
+
+static Stats_Ring Stats_rings[3] = {
+	{"minute", 60, STATS_MINUTES, Stats_minutes, Stats_minutesDirty, 0},
+	{"hour", 3600, STATS_HOURS, Stats_hours, Stats_hoursDirty, 0},
+	{"day", 86400, STATS_DAYS, Stats_days, Stats_daysDirty, 0}
+};
+
+static Stats_Header Stats_header;
+static char Stats_presenceLabel[32] = "Person";
+static int Stats_presence = -1;		//Label index of presenceLabel
+static int Stats_eventState[STATS_MAX_EVENTS];
+static uint64_t Stats_lastFrame = 0;
+static int Stats_running = 0;
+static guint Stats_timer = 0;
+
+static int
+Stats_Event_Index(const char* id) {
+	for( unsigned int i = 0; i < Stats_header.events; i++ )
+		if( strncmp(Stats_header.eventIds[i], id, sizeof(Stats_header.eventIds[i])) == 0 )
+			return i;
+	return -1;
+}
+
+static Stats_Bucket*
+Stats_Current(Stats_Ring* ring, uint32_t now) {
+	uint32_t start = now - now % ring->seconds;
+	unsigned int index = (now / ring->seconds) % ring->size;
+	Stats_Bucket* bucket = &ring->buckets[index];
+	if( bucket->start != start ) {
+		memset(bucket, 0, sizeof(Stats_Bucket));
+		bucket->start = start;
+	}
+	ring->dirty[index] = 1;
+	return bucket;
+}
+
+static void
+Stats_Clear_Zones() {
+	for( int r = 0; r < 3; r++ ) {
+		Stats_Ring* ring = &Stats_rings[r];
+		for( unsigned int i = 0; i < ring->size; i++ ) {
+			Stats_Bucket* bucket = &ring->buckets[i];
+			memset(bucket->zonePresent, 0, sizeof(bucket->zonePresent));
+			memset(bucket->zoneMax, 0, sizeof(bucket->zoneMax));
+			memset(bucket->zoneViolation, 0, sizeof(bucket->zoneViolation));
+		}
+		memset(ring->dirty, 1, ring->size);
+	}
+}
+
+//Zone names as Zones has them, returns 1 when they differ from the header
+static int
+Stats_Zone_Names(Stats_Header* header) {
+	Stats_Header current;
+	memset(current.zoneNames, 0, sizeof(current.zoneNames));
+	current.zones = Zones_Count() < STATS_MAX_ZONES ? Zones_Count() : STATS_MAX_ZONES;
+	for( unsigned int z = 0; z < current.zones; z++ )
+		memcpy(current.zoneNames[z], Zones_Name(z), strnlen(Zones_Name(z), sizeof(current.zoneNames[z]) - 1));
+	int changed = current.zones != header->zones || memcmp(current.zoneNames, header->zoneNames, sizeof(current.zoneNames)) != 0;
+	header->zones = current.zones;
+	memcpy(header->zoneNames, current.zoneNames, sizeof(current.zoneNames));
+	return changed;
+}
+
+void
+Stats_Zones() {
+	if( Stats_running && Stats_Zone_Names(&Stats_header) ) {
+		LOG("Statistics zones changed, zone counters cleared\n");
+		Stats_Clear_Zones();
+	}
+}
+
+void
+Stats_Frame(const Frame_t* frame) {
+	if( !Stats_running || !frame )
+		return;
+
+	uint16_t counts[STATS_MAX_LABELS] = {0};
+	uint16_t zoneCounts[STATS_MAX_ZONES] = {0};
+	for( uint32_t i = 0; i < frame->count && i < FRAME_MAX_DETECTIONS; i++ ) {
+		const Detection_t* detection = &frame->detections[i];
+		if( detection->label < STATS_MAX_LABELS )
+			counts[detection->label]++;
+		if( detection->label == Stats_presence && detection->zones )
+			for( unsigned int z = 0; z < Stats_header.zones; z++ )
+				if( detection->zones & (1u << z) )
+					zoneCounts[z]++;
+	}
+	int violation = 0;
+	for( unsigned int event = 0; event < Stats_header.events; event++ )
+		violation |= Stats_eventState[event];
+
+	uint32_t elapsed = 0;
+	if( Stats_lastFrame && frame->timestamp > Stats_lastFrame )
+		elapsed = frame->timestamp - Stats_lastFrame;
+	if( elapsed > STATS_MAX_GAP )
+		elapsed = STATS_MAX_GAP;
+	Stats_lastFrame = frame->timestamp;
+
+	uint32_t now = frame->timestamp / 1000;
+	for( int r = 0; r < 3; r++ ) {
+		Stats_Bucket* bucket = Stats_Current(&Stats_rings[r], now);
+		bucket->frames++;
+		for( unsigned int label = 0; label < Stats_header.labels; label++ ) {
+			bucket->sum[label] += counts[label];
+			if( counts[label] > bucket->max[label] )
+				bucket->max[label] = counts[label];
+			if( counts[label] )
+				bucket->present[label] += elapsed;
+		}
+		for( unsigned int event = 0; event < Stats_header.events; event++ )
+			if( Stats_eventState[event] )
+				bucket->violation[event] += elapsed;
+		for( unsigned int zone = 0; zone < Stats_header.zones; zone++ ) {
+			if( !zoneCounts[zone] )
+				continue;
+			if( zoneCounts[zone] > bucket->zoneMax[zone] )
+				bucket->zoneMax[zone] = zoneCounts[zone];
+			bucket->zonePresent[zone] += elapsed;
+			if( violation )
+				bucket->zoneViolation[zone] += elapsed;
+		}
+	}
+}
+
+void
+Stats_Event(const char* id, int state) {
+	if( !Stats_running || !id )
+		return;
+	int index = Stats_Event_Index(id);
+	if( index >= 0 )
+		Stats_eventState[index] = state;
+}
+
+/*
+ * Persistence
+ */
+
+static void
+Stats_Layout() {
+	size_t offset = sizeof(Stats_Header);
+	for( int r = 0; r < 3; r++ ) {
+		Stats_rings[r].fileOffset = offset;
+		offset += Stats_rings[r].size * sizeof(Stats_Bucket);
+	}
+}
+
+static gboolean
+Stats_Persist(gpointer user_data) {
+	FILE* file = ACAP_FILE_Open(STATS_FILE, "r+b");
+	if( !file )
+		file = ACAP_FILE_Open(STATS_FILE, "w+b");
+	if( !file ) {
+		LOG_WARN("%s: Unable to open %s\n",__func__, STATS_FILE);
+		return G_SOURCE_CONTINUE;
+	}
+	int fd = fileno(file);
+	int failed = pwrite(fd, &Stats_header, sizeof(Stats_header), 0) != sizeof(Stats_header);
+	unsigned int written = 0;
+	for( int r = 0; r < 3 && !failed; r++ ) {
+		Stats_Ring* ring = &Stats_rings[r];
+		for( unsigned int i = 0; i < ring->size && !failed; i++ ) {
+			if( !ring->dirty[i] )
+				continue;
+			off_t offset = ring->fileOffset + i * sizeof(Stats_Bucket);
+			failed = pwrite(fd, &ring->buckets[i], sizeof(Stats_Bucket), offset) != sizeof(Stats_Bucket);
+			ring->dirty[i] = 0;
+			written++;
+		}
+	}
+	if( failed )
+		LOG_WARN("%s: Write failed: %s\n",__func__, strerror(errno));
+	if( written )
+		fdatasync(fd);
+	fclose(file);
+	LOG_TRACE("%s: %u buckets\n",__func__, written);
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+Stats_Load() {
+	FILE* file = ACAP_FILE_Open(STATS_FILE, "rb");
+	if( !file )
+		return;
+	Stats_Header stored;
+	int valid = fread(&stored, sizeof(stored), 1, file) == 1 &&
+		stored.magic == STATS_MAGIC && stored.version == STATS_VERSION &&
+		stored.bucketSize == sizeof(Stats_Bucket) && stored.labels == Stats_header.labels &&
+		memcmp(stored.sizes, Stats_header.sizes, sizeof(stored.sizes)) == 0 &&
+		memcmp(stored.eventIds, Stats_header.eventIds, sizeof(stored.eventIds)) == 0;
+	for( int r = 0; r < 3 && valid; r++ ) {
+		Stats_Ring* ring = &Stats_rings[r];
+		//A short read leaves the remaining buckets empty
+		if( fseek(file, ring->fileOffset, SEEK_SET) == 0 )
+			fread(ring->buckets, sizeof(Stats_Bucket), ring->size, file);
+	}
+	fclose(file);
+	if( !valid ) {
+		LOG("Statistics layout changed, starting over\n");
+		for( int r = 0; r < 3; r++ ) {
+			memset(Stats_rings[r].buckets, 0, Stats_rings[r].size * sizeof(Stats_Bucket));
+			memset(Stats_rings[r].dirty, 1, Stats_rings[r].size);
+		}
+	} else if( stored.zones != Stats_header.zones || memcmp(stored.zoneNames, Stats_header.zoneNames, sizeof(stored.zoneNames)) != 0 ) {
+		LOG("Statistics zones changed, zone counters cleared\n");
+		Stats_Clear_Zones();
+	}
+}
+
+static double
+Stats_Compliance(uint32_t violation, uint32_t present) {
+	double compliance = present ? 1.0 - (double)violation / present : 1.0;
+	return compliance < 0 ? 0 : compliance;
+}
+
+/*
+ * Query
+ */
+
+static void
+Stats_HTTP(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	if( !Stats_running ) {
+		ACAP_HTTP_Respond_Error(response, 503, "Statistics not enabled");
+		return;
+	}
+
+	Stats_Ring* ring = &Stats_rings[0];
+	uint64_t from = 0, to = UINT64_MAX;
+	int csv = 0;
+	const char* param;
+	if( (param = ACAP_HTTP_Request_Param(request, "resolution")) ) {
+		for( int r = 0; r < 3; r++ )
+			if( strcmp(param, Stats_rings[r].name) == 0 )
+				ring = &Stats_rings[r];
+		free((void*)param);
+	}
+	if( (param = ACAP_HTTP_Request_Param(request, "from")) ) {
+		from = strtoull(param, NULL, 10) / 1000;
+		free((void*)param);
+	}
+	if( (param = ACAP_HTTP_Request_Param(request, "to")) ) {
+		to = strtoull(param, NULL, 10) / 1000;
+		free((void*)param);
+	}
+	if( (param = ACAP_HTTP_Request_Param(request, "format")) ) {
+		csv = strcmp(param, "csv") == 0;
+		free((void*)param);
+	}
+
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	unsigned int labelCount = Stats_header.labels;
+	int presence = Stats_presence;
+
+	//Oldest bucket first
+	uint32_t now = (uint32_t)(ACAP_DEVICE_Timestamp() / 1000);
+	unsigned int newest = (now / ring->seconds) % ring->size;
+	const Stats_Bucket* buckets[STATS_DAYS > STATS_MINUTES ? STATS_DAYS : STATS_MINUTES];
+	unsigned int count = 0;
+	for( unsigned int i = 1; i <= ring->size; i++ ) {
+		const Stats_Bucket* bucket = &ring->buckets[(newest + i) % ring->size];
+		if( bucket->start && bucket->start + ring->seconds > from && bucket->start <= to && bucket->start <= now )
+			buckets[count++] = bucket;
+	}
+
+	if( csv ) {
+		ACAP_HTTP_Respond_String(response, "Content-Type: text/csv\r\nCache-Control: no-cache\r\n\r\nstart,frames");
+		for( unsigned int l = 0; l < labelCount; l++ ) {
+			cJSON* label = cJSON_GetArrayItem(labels, l);
+			const char* name = label && cJSON_IsString(label) ? label->valuestring : "Undefined";
+			ACAP_HTTP_Respond_String(response, ",%s_avg,%s_max,%s_seconds", name, name, name);
+		}
+		for( unsigned int e = 0; e < Stats_header.events; e++ )
+			ACAP_HTTP_Respond_String(response, ",%.32s_seconds,%.32s_compliance", Stats_header.eventIds[e], Stats_header.eventIds[e]);
+		for( unsigned int z = 0; z < Stats_header.zones; z++ ) {
+			const char* name = Stats_header.zoneNames[z];
+			ACAP_HTTP_Respond_String(response, ",%s_max,%s_seconds,%s_violation_seconds,%s_compliance", name, name, name, name);
+		}
+		ACAP_HTTP_Respond_String(response, "\n");
+		for( unsigned int b = 0; b < count; b++ ) {
+			const Stats_Bucket* bucket = buckets[b];
+			ACAP_HTTP_Respond_String(response, "%llu,%u", (unsigned long long)bucket->start * 1000, bucket->frames);
+			for( unsigned int l = 0; l < labelCount; l++ )
+				ACAP_HTTP_Respond_String(response, ",%.2f,%u,%.1f",
+					bucket->frames ? (double)bucket->sum[l] / bucket->frames : 0.0, bucket->max[l], bucket->present[l] / 1000.0);
+			for( unsigned int e = 0; e < Stats_header.events; e++ ) {
+				double compliance = Stats_Compliance(bucket->violation[e], presence >= 0 ? bucket->present[presence] : 0);
+				ACAP_HTTP_Respond_String(response, ",%.1f,%.3f", bucket->violation[e] / 1000.0, compliance);
+			}
+			for( unsigned int z = 0; z < Stats_header.zones; z++ )
+				ACAP_HTTP_Respond_String(response, ",%u,%.1f,%.1f,%.3f", bucket->zoneMax[z], bucket->zonePresent[z] / 1000.0,
+					bucket->zoneViolation[z] / 1000.0, Stats_Compliance(bucket->zoneViolation[z], bucket->zonePresent[z]));
+			ACAP_HTTP_Respond_String(response, "\n");
+		}
+		return;
+	}
+
+	cJSON* result = cJSON_CreateObject();
+	cJSON_AddStringToObject(result, "resolution", ring->name);
+	cJSON* list = cJSON_AddArrayToObject(result, "buckets");
+	for( unsigned int b = 0; b < count; b++ ) {
+		const Stats_Bucket* bucket = buckets[b];
+		cJSON* item = cJSON_CreateObject();
+		cJSON_AddNumberToObject(item, "start", (double)bucket->start * 1000);
+		cJSON_AddNumberToObject(item, "frames", bucket->frames);
+		cJSON* labelStats = cJSON_AddObjectToObject(item, "labels");
+		for( unsigned int l = 0; l < labelCount; l++ ) {
+			if( bucket->max[l] == 0 )
+				continue;
+			cJSON* label = cJSON_GetArrayItem(labels, l);
+			cJSON* stat = cJSON_AddObjectToObject(labelStats, label && cJSON_IsString(label) ? label->valuestring : "Undefined");
+			cJSON_AddNumberToObject(stat, "avg", bucket->frames ? (double)bucket->sum[l] / bucket->frames : 0);
+			cJSON_AddNumberToObject(stat, "max", bucket->max[l]);
+			cJSON_AddNumberToObject(stat, "seconds", bucket->present[l] / 1000.0);
+		}
+		cJSON* violations = cJSON_AddObjectToObject(item, "violations");
+		for( unsigned int e = 0; e < Stats_header.events; e++ ) {
+			char id[sizeof(Stats_header.eventIds[0]) + 1];
+			snprintf(id, sizeof(id), "%.32s", Stats_header.eventIds[e]);
+			cJSON* stat = cJSON_AddObjectToObject(violations, id);
+			cJSON_AddNumberToObject(stat, "seconds", bucket->violation[e] / 1000.0);
+			cJSON_AddNumberToObject(stat, "compliance", Stats_Compliance(bucket->violation[e], presence >= 0 ? bucket->present[presence] : 0));
+		}
+		cJSON* zones = cJSON_AddObjectToObject(item, "zones");
+		for( unsigned int z = 0; z < Stats_header.zones; z++ ) {
+			if( bucket->zoneMax[z] == 0 )
+				continue;
+			cJSON* stat = cJSON_AddObjectToObject(zones, Stats_header.zoneNames[z]);
+			cJSON_AddNumberToObject(stat, "max", bucket->zoneMax[z]);
+			cJSON_AddNumberToObject(stat, "seconds", bucket->zonePresent[z] / 1000.0);
+			cJSON_AddNumberToObject(stat, "violationSeconds", bucket->zoneViolation[z] / 1000.0);
+			cJSON_AddNumberToObject(stat, "compliance", Stats_Compliance(bucket->zoneViolation[z], bucket->zonePresent[z]));
+		}
+		cJSON_AddItemToArray(list, item);
+	}
+	ACAP_HTTP_Respond_JSON(response, result);
+	cJSON_Delete(result);
+}
+
+/*
+ * Setup
+ */
+
+int
+Stats_Init(cJSON* settings) {
+	static int registered = 0;
+	if( !registered ) {
+		ACAP_HTTP_Node("stats", Stats_HTTP);
+		registered = 1;
+	}
+
+	if( Stats_running ) {
+		Stats_Persist(NULL);
+		if( Stats_timer )
+			g_source_remove(Stats_timer);
+		Stats_timer = 0;
+		Stats_running = 0;
+	}
+	if( !settings || !cJSON_IsTrue(cJSON_GetObjectItem(settings,"enabled")) )
+		return 1;
+
+	memset(&Stats_header, 0, sizeof(Stats_header));
+	Stats_header.magic = STATS_MAGIC;
+	Stats_header.version = STATS_VERSION;
+	Stats_header.bucketSize = sizeof(Stats_Bucket);
+	Stats_header.labels = STATS_MAX_LABELS;
+	cJSON* model = ACAP_Get_Config("model");
+	int labels = model ? cJSON_GetArraySize(cJSON_GetObjectItem(model,"labels")) : 0;
+	if( labels > 0 && labels < STATS_MAX_LABELS )
+		Stats_header.labels = labels;
+	for( int r = 0; r < 3; r++ )
+		Stats_header.sizes[r] = Stats_rings[r].size;
+	cJSON* event = cJSON_GetObjectItem(settings,"events") ? cJSON_GetObjectItem(settings,"events")->child : 0;
+	while( event && Stats_header.events < STATS_MAX_EVENTS ) {
+		if( cJSON_IsString(event) )
+			strncpy(Stats_header.eventIds[Stats_header.events++], event->valuestring, sizeof(Stats_header.eventIds[0]));
+		event = event->next;
+	}
+	cJSON* presence = cJSON_GetObjectItem(settings,"presenceLabel");
+	if( presence && cJSON_IsString(presence) )
+		snprintf(Stats_presenceLabel, sizeof(Stats_presenceLabel), "%s", presence->valuestring);
+	Stats_presence = -1;
+	for( int i = 0; model && i < labels; i++ ) {
+		cJSON* label = cJSON_GetArrayItem(cJSON_GetObjectItem(model,"labels"), i);
+		if( label && cJSON_IsString(label) && strcmp(label->valuestring, Stats_presenceLabel) == 0 )
+			Stats_presence = i;
+	}
+	Stats_Zone_Names(&Stats_header);
+
+	Stats_Layout();
+	Stats_Load();
+	for( unsigned int e = 0; e < Stats_header.events; e++ ) {
+		char id[sizeof(Stats_header.eventIds[0]) + 1];
+		snprintf(id, sizeof(id), "%.32s", Stats_header.eventIds[e]);
+		Stats_eventState[e] = ACAP_STATUS_Bool("events", id);
+	}
+	Stats_lastFrame = 0;
+	Stats_running = 1;
+	Stats_timer = g_timeout_add_seconds(STATS_PERSIST, Stats_Persist, NULL);
+	return 1;
+}
+
+void
+Stats_Cleanup() {
+	if( Stats_running )
+		Stats_Persist(NULL);
+	if( Stats_timer )
+		g_source_remove(Stats_timer);
+	Stats_timer = 0;
+	Stats_running = 0;
+}
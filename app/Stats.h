@@ -0,0 +1,37 @@
+/*
+ * Rolling detection statistics in minute, hour and day resolution.
+ * GET /local/detectx/stats?resolution=minute|hour|day[&from=<ms>][&to=<ms>][&format=csv]
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "cJSON.h"
+#include "Frame.h"
+
+#define STATS_MAX_LABELS	32
+#define STATS_MAX_EVENTS	4
+#define STATS_MAX_ZONES		8		//The first zones in settings.json
+#define STATS_MINUTES		1440	//24 hours
+#define STATS_HOURS			336		//14 days
+#define STATS_DAYS			366
+
+typedef struct {
+	uint32_t start;							//EPOCH seconds, 0 for unused
+	uint32_t frames;
+	uint32_t sum[STATS_MAX_LABELS];			//Detections summed over frames
+	uint16_t max[STATS_MAX_LABELS];			//Max concurrent detections
+	uint32_t present[STATS_MAX_LABELS];		//ms with at least one detection
+	uint32_t violation[STATS_MAX_EVENTS];	//ms with the event high
+	uint32_t zonePresent[STATS_MAX_ZONES];	//ms with a presenceLabel detection in the zone
+	uint16_t zoneMax[STATS_MAX_ZONES];		//Max concurrent presenceLabel detections in the zone
+	uint32_t zoneViolation[STATS_MAX_ZONES];	//ms with an event high while present in the zone
+} Stats_Bucket;
+
+int		Stats_Init(cJSON* settings);
+void	Stats_Frame(const Frame_t* frame);
+void	Stats_Event(const char* id, int state);
+void	Stats_Zones();		//Call when the zones change
+void	Stats_Cleanup();
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ * Object tracking with tripwire and zone entry counting.
+ *
+ * Detections are matched to the tracks of the previous frames by IoU,
+ * same label only.  Tracks are binned by centre in a coarse grid so a
+ * detection is only compared with tracks in its own and neighbouring
+ * cells, keeping matching near-linear in the number of objects.
+ *
+ * A matched track moves its anchor point (bottom centre) from the last
+ * position to the new one.  Only that movement segment is tested
+ * against the tripwires, and zone membership is compared with the
+ * previous frame, so counting is incremental.  The "counter" event is
+ * fired with the counters as JSON only when a count changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "ACAP.h"
+#include "Zones.h"
+#include "Tracker.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define TRACKER_GRID		8		//Cells per axis for candidate search
+#define TRACKER_MAX_LABELS	8		//Labels per tripwire filter or requirement
+
+typedef struct {
+	int active;
+	uint32_t id;
+	uint16_t label;
+	int misses;
+	int matched;
+	Detection_t box;
+	int ax, ay;				//Anchor point
+	uint32_t zones;
+	int next;				//Next track in the same grid cell
+} Tracker_Track;
+
+typedef struct {
+	char name[32];
+	float x1, y1, x2, y2;
+	int labels[TRACKER_MAX_LABELS];
+	int labelCount;
+	int requires[TRACKER_MAX_LABELS];
+	int requireCount;
+	unsigned int forward;
+	unsigned int backward;
+	unsigned int violations;
+} Tracker_Tripwire;
+
+typedef struct {
+	unsigned int entries;
+	unsigned int exits;
+	unsigned int violations;
+} Tracker_ZoneCount;
+
+static Tracker_Track Tracker_tracks[TRACKER_MAX_TRACKS];
+static int Tracker_grid[TRACKER_GRID * TRACKER_GRID];
+static Tracker_Tripwire Tracker_tripwires[TRACKER_MAX_TRIPWIRES];
+static int Tracker_tripwireCount = 0;
+static Tracker_ZoneCount Tracker_zones[ZONES_MAX];
+static uint32_t Tracker_countZones = 0;
+static int Tracker_zoneLabels[TRACKER_MAX_LABELS];
+static int Tracker_zoneLabelCount = 0;
+static int Tracker_zoneRequires[TRACKER_MAX_LABELS];
+static int Tracker_zoneRequireCount = 0;
+static uint32_t Tracker_nextId = 1;
+static int Tracker_running = 0;
+static char* Tracker_config = 0;				//counting setting the tripwires were built from
+static char Tracker_zoneNames[ZONES_MAX][32];	//Zones that Tracker_zones and track masks refer to
+static int Tracker_zoneCount = 0;
+static ACAP_EVENTS_Handle* Tracker_counter = 0;
+
+static float
+Tracker_IoU(const Detection_t* a, const Detection_t* b) {
+	int x1 = a->x > b->x ? a->x : b->x;
+	int y1 = a->y > b->y ? a->y : b->y;
+	int x2 = a->x + a->w < b->x + b->w ? a->x + a->w : b->x + b->w;
+	int y2 = a->y + a->h < b->y + b->h ? a->y + a->h : b->y + b->h;
+	if( x2 <= x1 || y2 <= y1 )
+		return 0;
+	float intersection = (float)(x2 - x1) * (y2 - y1);
+	float area = (float)a->w * a->h + (float)b->w * b->h - intersection;
+	return area > 0 ? intersection / area : 0;
+}
+
+static int
+Tracker_Cell(int x, int y) {
+	int column = x * TRACKER_GRID / 1000;
+	int row = y * TRACKER_GRID / 1000;
+	if( column < 0 ) column = 0;
+	if( row < 0 ) row = 0;
+	if( column >= TRACKER_GRID ) column = TRACKER_GRID - 1;
+	if( row >= TRACKER_GRID ) row = TRACKER_GRID - 1;
+	return row * TRACKER_GRID + column;
+}
+
+static int
+Tracker_Has_Label(const int* labels, int count, int label) {
+	if( count == 0 )
+		return 1;
+	for( int i = 0; i < count; i++ )
+		if( labels[i] == label )
+			return 1;
+	return 0;
+}
+
+//A required label (e.g. Helmet) must overlap the upper third of the object
+static int
+Tracker_Compliant(const Frame_t* frame, const Detection_t* object, const int* requires, int count) {
+	if( count == 0 )
+		return 1;
+	Detection_t upper = *object;
+	upper.h = object->h / 3;
+	for( int r = 0; r < count; r++ ) {
+		int found = 0;
+		for( uint32_t i = 0; i < frame->count && i < FRAME_MAX_DETECTIONS && !found; i++ )
+			if( frame->detections[i].label == requires[r] && Tracker_IoU(&frame->detections[i], &upper) > 0 )
+				found = 1;
+		if( !found )
+			return 0;
+	}
+	return 1;
+}
+
+static float
+Tracker_Side(const Tracker_Tripwire* wire, float x, float y) {
+	return (wire->x2 - wire->x1) * (y - wire->y1) - (wire->y2 - wire->y1) * (x - wire->x1);
+}
+
+//Returns 1 forward, -1 backward, 0 no crossing
+static int
+Tracker_Crossing(const Tracker_Tripwire* wire, int px, int py, int cx, int cy) {
+	float before = Tracker_Side(wire, px, py);
+	float after = Tracker_Side(wire, cx, cy);
+	if( (before < 0) == (after < 0) || after == 0 )
+		return 0;
+	//The movement must also cross within the wire's extent
+	float dx = cx - px, dy = cy - py;
+	float start = dx * (wire->y1 - py) - dy * (wire->x1 - px);
+	float end = dx * (wire->y2 - py) - dy * (wire->x2 - px);
+	if( (start < 0) == (end < 0) && start != 0 && end != 0 )
+		return 0;
+	return after > 0 ? 1 : -1;
+}
+
+static void
+Tracker_Publish(int fire) {
+	cJSON* counters = cJSON_CreateObject();
+	cJSON* tripwires = cJSON_AddObjectToObject(counters, "tripwires");
+	for( int i = 0; i < Tracker_tripwireCount; i++ ) {
+		cJSON* wire = cJSON_AddObjectToObject(tripwires, Tracker_tripwires[i].name);
+		cJSON_AddNumberToObject(wire, "forward", Tracker_tripwires[i].forward);
+		cJSON_AddNumberToObject(wire, "backward", Tracker_tripwires[i].backward);
+		cJSON_AddNumberToObject(wire, "violations", Tracker_tripwires[i].violations);
+	}
+	cJSON* zones = cJSON_AddObjectToObject(counters, "zones");
+	for( int z = 0; z < Zones_Count(); z++ ) {
+		if( !(Tracker_countZones & (1u << z)) )
+			continue;
+		cJSON* zone = cJSON_AddObjectToObject(zones, Zones_Name(z));
+		cJSON_AddNumberToObject(zone, "entries", Tracker_zones[z].entries);
+		cJSON_AddNumberToObject(zone, "exits", Tracker_zones[z].exits);
+		cJSON_AddNumberToObject(zone, "violations", Tracker_zones[z].violations);
+	}
+	ACAP_STATUS_SetObject("tracker", "counters", counters);
+	if( !fire ) {
+		cJSON_Delete(counters);
+		return;
+	}
+
+	char* json = cJSON_PrintUnformatted(counters);
+	cJSON_Delete(counters);
+	if( !json )
+		return;
+	if( !Tracker_counter )
+		Tracker_counter = ACAP_EVENTS_Handle_Get("counter");
+	ACAP_EVENTS_Handle_Fire_String(Tracker_counter, "json", json);
+	free(json);
+}
+
+static int
+Tracker_Count(const Frame_t* frame, Tracker_Track* track, int px, int py, uint32_t previousZones) {
+	int changed = 0;
+	const Detection_t* box = &track->box;
+	for( int w = 0; w < Tracker_tripwireCount; w++ ) {
+		Tracker_Tripwire* wire = &Tracker_tripwires[w];
+		if( !Tracker_Has_Label(wire->labels, wire->labelCount, track->label) )
+			continue;
+		int direction = Tracker_Crossing(wire, px, py, track->ax, track->ay);
+		if( !direction )
+			continue;
+		if( direction > 0 )
+			wire->forward++;
+		else
+			wire->backward++;
+		if( !Tracker_Compliant(frame, box, wire->requires, wire->requireCount) )
+			wire->violations++;
+		changed = 1;
+	}
+
+	uint32_t entered = track->zones & ~previousZones & Tracker_countZones;
+	uint32_t exited = previousZones & ~track->zones & Tracker_countZones;
+	if( (entered || exited) && Tracker_Has_Label(Tracker_zoneLabels, Tracker_zoneLabelCount, track->label) ) {
+		int compliant = !entered || Tracker_Compliant(frame, box, Tracker_zoneRequires, Tracker_zoneRequireCount);
+		for( int z = 0; z < ZONES_MAX; z++ ) {
+			if( entered & (1u << z) ) {
+				Tracker_zones[z].entries++;
+				if( !compliant )
+					Tracker_zones[z].violations++;
+			}
+			if( exited & (1u << z) )
+				Tracker_zones[z].exits++;
+		}
+		changed = 1;
+	}
+	return changed;
+}
+
+void
+Tracker_Frame(const Frame_t* frame) {
+	if( !Tracker_running || !frame )
+		return;
+
+	//Bin the existing tracks by centre
+	for( int i = 0; i < TRACKER_GRID * TRACKER_GRID; i++ )
+		Tracker_grid[i] = -1;
+	for( int t = 0; t < TRACKER_MAX_TRACKS; t++ ) {
+		Tracker_Track* track = &Tracker_tracks[t];
+		track->matched = 0;
+		if( !track->active )
+			continue;
+		int cell = Tracker_Cell(track->box.x + track->box.w / 2, track->box.y + track->box.h / 2);
+		track->next = Tracker_grid[cell];
+		Tracker_grid[cell] = t;
+	}
+
+	int changed = 0;
+	for( uint32_t i = 0; i < frame->count && i < FRAME_MAX_DETECTIONS; i++ ) {
+		const Detection_t* detection = &frame->detections[i];
+		int cx = detection->x + detection->w / 2;
+		int cy = detection->y + detection->h / 2;
+		int column = Tracker_Cell(cx, cy) % TRACKER_GRID;
+		int row = Tracker_Cell(cx, cy) / TRACKER_GRID;
+
+		int best = -1;
+		float bestIoU = TRACKER_MIN_IOU;
+		for( int r = row - 1; r <= row + 1; r++ ) {
+			for( int c = column - 1; c <= column + 1; c++ ) {
+				if( r < 0 || c < 0 || r >= TRACKER_GRID || c >= TRACKER_GRID )
+					continue;
+				for( int t = Tracker_grid[r * TRACKER_GRID + c]; t >= 0; t = Tracker_tracks[t].next ) {
+					Tracker_Track* track = &Tracker_tracks[t];
+					if( track->matched || track->label != detection->label )
+						continue;
+					float iou = Tracker_IoU(&track->box, detection);
+					if( iou >= bestIoU ) {
+						bestIoU = iou;
+						best = t;
+					}
+				}
+			}
+		}
+
+		int ax = cx;
+		int ay = detection->y + detection->h;
+		if( best >= 0 ) {
+			Tracker_Track* track = &Tracker_tracks[best];
+			int px = track->ax, py = track->ay;
+			uint32_t previousZones = track->zones;
+			track->matched = 1;
+			track->misses = 0;
+			track->box = *detection;
+			track->ax = ax;
+			track->ay = ay;
+			track->zones = detection->zones;
+			changed |= Tracker_Count(frame, track, px, py, previousZones);
+			continue;
+		}
+
+		for( int t = 0; t < TRACKER_MAX_TRACKS; t++ ) {
+			Tracker_Track* track = &Tracker_tracks[t];
+			if( track->active )
+				continue;
+			track->active = 1;
+			track->matched = 1;
+			track->id = Tracker_nextId++;
+			track->label = detection->label;
+			track->misses = 0;
+			track->box = *detection;
+			track->ax = ax;
+			track->ay = ay;
+			//Objects appearing inside a zone have not been seen entering it
+			track->zones = detection->zones;
+			break;
+		}
+	}
+
+	int active = 0;
+	for( int t = 0; t < TRACKER_MAX_TRACKS; t++ ) {
+		Tracker_Track* track = &Tracker_tracks[t];
+		if( track->active && !track->matched && ++track->misses > TRACKER_MAX_MISSES )
+			track->active = 0;
+		active += track->active;
+	}
+	ACAP_STATUS_SetNumber("tracker", "tracks", active);
+
+	if( changed )
+		Tracker_Publish(1);
+}
+
+static int
+Tracker_Labels(cJSON* list, int* indexes) {
+	cJSON* model = ACAP_Get_Config("model");
+	cJSON* labels = model ? cJSON_GetObjectItem(model,"labels") : 0;
+	int count = 0;
+	cJSON* item = list && cJSON_IsArray(list) ? list->child : 0;
+	for( ; item && count < TRACKER_MAX_LABELS; item = item->next ) {
+		if( !cJSON_IsString(item) )
+			continue;
+		int found = -1;
+		for( int i = 0; labels && i < cJSON_GetArraySize(labels); i++ )
+			if( cJSON_IsString(cJSON_GetArrayItem(labels, i)) && strcmp(cJSON_GetArrayItem(labels, i)->valuestring, item->valuestring) == 0 )
+				found = i;
+		if( found < 0 ) {
+			LOG_WARN("%s: Unknown label %s\n",__func__, item->valuestring);
+			continue;
+		}
+		indexes[count++] = found;
+	}
+	return count;
+}
+
+static int
+Tracker_Zones_Changed() {
+	if( Zones_Count() != Tracker_zoneCount )
+		return 1;
+	for( int z = 0; z < Tracker_zoneCount; z++ )
+		if( strcmp(Zones_Name(z), Tracker_zoneNames[z]) != 0 )
+			return 1;
+	return 0;
+}
+
+/*
+ * Counters and tracks survive a rebuild.  Tripwire counters follow the
+ * tripwire name, zone counters and the zone bits of live tracks follow
+ * the zone name.
+ */
+int
+Tracker_Init(cJSON* settings) {
+	ACAP_STATUS_Live("tracker", "tracks");
+	char* config = settings ? cJSON_PrintUnformatted(settings) : 0;
+	if( Tracker_config && config && strcmp(config, Tracker_config) == 0 && !Tracker_Zones_Changed() ) {
+		free(config);
+		return Tracker_running;
+	}
+	free(Tracker_config);
+	Tracker_config = config;
+
+	Tracker_Tripwire previous[TRACKER_MAX_TRIPWIRES];
+	int previousCount = Tracker_tripwireCount;
+	memcpy(previous, Tracker_tripwires, sizeof(previous));
+	Tracker_ZoneCount previousZones[ZONES_MAX];
+	memcpy(previousZones, Tracker_zones, sizeof(previousZones));
+	if( !Tracker_running )
+		memset(Tracker_tracks, 0, sizeof(Tracker_tracks));	//Not updated while stopped
+
+	//Old zone index to new zone index
+	int zoneMap[ZONES_MAX];
+	for( int old = 0; old < ZONES_MAX; old++ ) {
+		zoneMap[old] = -1;
+		for( int z = 0; old < Tracker_zoneCount && z < Zones_Count() && zoneMap[old] < 0; z++ )
+			if( strcmp(Zones_Name(z), Tracker_zoneNames[old]) == 0 )
+				zoneMap[old] = z;
+	}
+	for( int t = 0; t < TRACKER_MAX_TRACKS; t++ ) {
+		uint32_t zones = 0;
+		for( int old = 0; old < Tracker_zoneCount; old++ )
+			if( (Tracker_tracks[t].zones & (1u << old)) && zoneMap[old] >= 0 )
+				zones |= 1u << zoneMap[old];
+		Tracker_tracks[t].zones = zones;
+	}
+	memset(Tracker_zones, 0, sizeof(Tracker_zones));
+	for( int old = 0; old < Tracker_zoneCount; old++ )
+		if( zoneMap[old] >= 0 )
+			Tracker_zones[zoneMap[old]] = previousZones[old];
+	Tracker_zoneCount = Zones_Count();
+	for( int z = 0; z < Tracker_zoneCount; z++ )
+		snprintf(Tracker_zoneNames[z], sizeof(Tracker_zoneNames[0]), "%s", Zones_Name(z));
+
+	memset(Tracker_tripwires, 0, sizeof(Tracker_tripwires));
+	Tracker_tripwireCount = 0;
+	Tracker_countZones = 0;
+	Tracker_running = 0;
+	if( !settings ) {
+		memset(Tracker_tracks, 0, sizeof(Tracker_tracks));
+		return 0;
+	}
+
+	cJSON* wire = cJSON_GetObjectItem(settings,"tripwires") ? cJSON_GetObjectItem(settings,"tripwires")->child : 0;
+	for( ; wire && Tracker_tripwireCount < TRACKER_MAX_TRIPWIRES; wire = wire->next ) {
+		cJSON* from = cJSON_GetObjectItem(wire,"from");
+		cJSON* to = cJSON_GetObjectItem(wire,"to");
+		cJSON* name = cJSON_GetObjectItem(wire,"name");
+		if( cJSON_GetArraySize(from) != 2 || cJSON_GetArraySize(to) != 2 ) {
+			LOG_WARN("%s: Tripwire needs from and to points\n",__func__);
+			continue;
+		}
+		Tracker_Tripwire* tripwire = &Tracker_tripwires[Tracker_tripwireCount++];
+		snprintf(tripwire->name, sizeof(tripwire->name), "%s", name && cJSON_IsString(name) ? name->valuestring : "Tripwire");
+		tripwire->x1 = cJSON_GetArrayItem(from, 0)->valuedouble;
+		tripwire->y1 = cJSON_GetArrayItem(from, 1)->valuedouble;
+		tripwire->x2 = cJSON_GetArrayItem(to, 0)->valuedouble;
+		tripwire->y2 = cJSON_GetArrayItem(to, 1)->valuedouble;
+		tripwire->labelCount = Tracker_Labels(cJSON_GetObjectItem(wire,"labels"), tripwire->labels);
+		tripwire->requireCount = Tracker_Labels(cJSON_GetObjectItem(wire,"requires"), tripwire->requires);
+		for( int i = 0; i < previousCount; i++ ) {
+			if( strcmp(previous[i].name, tripwire->name) != 0 )
+				continue;
+			tripwire->forward = previous[i].forward;
+			tripwire->backward = previous[i].backward;
+			tripwire->violations = previous[i].violations;
+			break;
+		}
+	}
+
+	cJSON* countZones = cJSON_GetObjectItem(settings,"countZones");
+	cJSON* zone = countZones && cJSON_IsArray(countZones) ? countZones->child : 0;
+	for( ; zone; zone = zone->next ) {
+		for( int z = 0; z < Zones_Count(); z++ )
+			if( cJSON_IsString(zone) && strcmp(Zones_Name(z), zone->valuestring) == 0 )
+				Tracker_countZones |= 1u << z;
+	}
+	Tracker_zoneLabelCount = Tracker_Labels(cJSON_GetObjectItem(settings,"countLabels"), Tracker_zoneLabels);
+	Tracker_zoneRequireCount = Tracker_Labels(cJSON_GetObjectItem(settings,"countRequires"), Tracker_zoneRequires);
+
+	Tracker_running = Tracker_tripwireCount > 0 || Tracker_countZones != 0;
+	Tracker_Publish(0);
+	return Tracker_running;
+}
+
+void
+Tracker_Cleanup() {
+	Tracker_running = 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Object tracking with tripwire and zone entry counting.
+ *
+ * settings.json "counting": {
+ *		"tripwires": [{"name":"Gate","from":[200,800],"to":[800,800],"labels":["Person"],"requires":["Helmet"]}],
+ *		"countZones": ["Scaffold"], "countLabels": ["Person"], "countRequires": ["Helmet"]
+ * }
+ * "forward" counts crossings with the "to" point on the left hand side,
+ * "backward" the opposite direction.  A crossing is also counted as a
+ * violation when a required label does not overlap the upper part of
+ * the object's box.  Zone entries and exits are counted the same way
+ * for the zones listed in "countZones".
+ */
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include "cJSON.h"
+#include "Frame.h"
+
+#define TRACKER_MAX_TRACKS		128
+#define TRACKER_MAX_TRIPWIRES	16
+#define TRACKER_MAX_MISSES		5		//Frames a track survives without a match
+#define TRACKER_MIN_IOU			0.3f
+
+int		Tracker_Init(cJSON* settings);
+void	Tracker_Frame(const Frame_t* frame);
+void	Tracker_Cleanup();
+
+#endif
@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <syslog.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include "ACAP.h"
 #include "Video.h"
 
 #define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
@@ -7,55 +11,429 @@
 //#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); }
 #define LOG_TRACE(fmt, args...)    {}
 
-ImgProvider_t* yuvProvider = NULL;
-VdoBuffer* yuvBuffer = NULL;
+#define VIDEO_WINDOW_MS		5000	//Frame rate measurement window
+#define VIDEO_HEADROOM		1.2		//Requested rate relative to the consumed rate
+#define VIDEO_HYSTERESIS	0.15	//Relative change needed before the stream is adjusted
+
+/*
+ * One YUV stream per inference channel.  Index 0 is the primary stream on
+ * VDO channel 1; additional view areas or sensors use the higher indexes.
+ *
+ * Adaptive frame rate.  Inference only takes the latest frame, so frames
+ * produced faster than they are consumed are wasted work for the ISP and
+ * the fetcher thread.  Every window the consumed rate of each stream is
+ * measured and the stream is asked for that rate plus some headroom.  The
+ * headroom lets the rate climb again when inference gets faster.
+ *
+ * Frame age.  "age" is capture to Video_Capture_Channel, "latency" capture
+ * to Video_Decided after the detections have been published.  Both use the
+ * VDO capture timestamp, CLOCK_MONOTONIC in microseconds.
+ */
+typedef struct {
+	unsigned int vdoChannel;
+	ImgProvider_t* provider;
+	VdoBuffer* buffer;
+	unsigned int width;
+	unsigned int height;
+	double framerate;				//Requested from VDO, 0 = sensor rate
+	double sensorRate;				//Delivered rate measured without a limit
+	int recreate;
+	gint64 retryTime;				//No new recreate attempt before this, monotonic ms
+	gint64 windowStart;
+	unsigned int windowDelivered;
+	unsigned int windowConsumed;
+	unsigned int adjustments;
+	unsigned int skipped;			//From streams that have been stopped
+	unsigned int lost;
+	guint64 captureTime;
+	guint64 ageSum, ageMax;
+	guint64 latencySum, latencyMax;
+	unsigned int ageCount, latencyCount;
+} Video_Channel_t;
+
+static Video_Channel_t Video_channels[VIDEO_MAX_CHANNELS];
+
+static int Video_adaptive = 1;
+static double Video_minFramerate = 2;
+static double Video_maxFramerate = 0;		//0 = sensor rate
+
+//Buffer pool and delivery order of the inference streams
+static unsigned int Video_buffers = NUM_VDO_BUFFERS;
+static unsigned int Video_appFrames = 2;
+static ImgDelivery_t Video_delivery = IMG_DELIVERY_LATEST;
+
+//The primary stream keeps its fields in the "video" status group, the others in "video"/"channel<n>"
+static void
+Video_Status(Video_Channel_t* video, const char* name, double value) {
+	if( video == &Video_channels[0] ) {
+		ACAP_STATUS_SetNumber("video", name, value);
+		return;
+	}
+	char key[32];
+	snprintf(key, sizeof(key), "channel%u", video->vdoChannel);
+	cJSON* status = ACAP_STATUS_Object("video", key);
+	cJSON* copy = status ? cJSON_Duplicate(status, 1) : cJSON_CreateObject();
+	cJSON_DeleteItemFromObject(copy, name);
+	cJSON_AddNumberToObject(copy, name, value);
+	ACAP_STATUS_SetObject("video", key, copy);
+	cJSON_Delete(copy);
+}
+
+//Measured every period, kept out of the status ETag
+static void
+Video_Metric(Video_Channel_t* video, const char* name, double value) {
+	char key[32];
+	snprintf(key, sizeof(key), "channel%u", video->vdoChannel);
+	ACAP_STATUS_Live("video", video == &Video_channels[0] ? name : key);
+	Video_Status(video, name, value);
+}
+
+static void
+Video_Window_Reset(Video_Channel_t* video) {
+	video->windowStart = g_get_monotonic_time() / 1000;
+	video->windowDelivered = video->provider ? atomic_load(&video->provider->deliveredCount) : 0;
+	video->windowConsumed = video->provider ? atomic_load(&video->provider->consumedCount) : 0;
+}
+
+static void
+Video_Set_Framerate(Video_Channel_t* video, double framerate) {
+	if( framerate == video->framerate )
+		return;
+	if( video->provider )
+		video->adjustments++;
+	//Going back to the sensor rate or a failed renegotiation needs a new stream
+	if( !video->provider || framerate <= 0 || !setFramerate(video->provider, framerate) )
+		video->recreate = video->provider != NULL;
+	video->framerate = framerate;
+	if( video->provider ) {
+		Video_Status(video, "framerate", video->framerate);
+		Video_Status(video, "adjustments", video->adjustments);
+	}
+	Video_Window_Reset(video);
+}
+
+static void
+Video_Measure(Video_Channel_t* video) {
+	gint64 now = g_get_monotonic_time() / 1000;
+	if( now - video->windowStart < VIDEO_WINDOW_MS )
+		return;
+
+	ImgProvider_t* provider = video->provider;
+	double seconds = (now - video->windowStart) / 1000.0;
+	unsigned int delivered = atomic_load(&provider->deliveredCount);
+	unsigned int consumed = atomic_load(&provider->consumedCount);
+	double deliveredRate = (delivered - video->windowDelivered) / seconds;
+	double consumedRate = (consumed - video->windowConsumed) / seconds;
+	Video_Window_Reset(video);
+	if( video->framerate <= 0 && deliveredRate > video->sensorRate )
+		video->sensorRate = deliveredRate;
+
+	Video_Metric(video, "delivered", round(deliveredRate * 10) / 10);
+	Video_Metric(video, "consumed", round(consumedRate * 10) / 10);
+	Video_Metric(video, "discarded", round((deliveredRate - consumedRate) * 10) / 10);
+	Video_Metric(video, "skipped", video->skipped + atomic_load(&provider->skippedCount));
+	Video_Metric(video, "lost", video->lost + atomic_load(&provider->lostCount));
+	Video_Metric(video, "ageMs", video->ageCount ? round(video->ageSum / 100.0 / video->ageCount) / 10 : 0);
+	Video_Metric(video, "ageMaxMs", round(video->ageMax / 100.0) / 10);
+	Video_Metric(video, "latencyMs", video->latencyCount ? round(video->latencySum / 100.0 / video->latencyCount) / 10 : 0);
+	Video_Metric(video, "latencyMaxMs", round(video->latencyMax / 100.0) / 10);
+	video->ageSum = video->ageMax = video->latencySum = video->latencyMax = 0;
+	video->ageCount = video->latencyCount = 0;
+
+	if( !Video_adaptive )
+		return;
+	double ceiling = Video_maxFramerate > 0 ? Video_maxFramerate : video->sensorRate;
+	if( ceiling <= 0 )
+		return;
+	double target = ceil(consumedRate * VIDEO_HEADROOM + 1);
+	if( target > ceiling )
+		target = ceiling;
+	if( target < Video_minFramerate )
+		target = Video_minFramerate;
+	double current = video->framerate > 0 ? video->framerate : ceiling;
+	if( fabs(target - current) < current * VIDEO_HYSTERESIS )
+		return;
+	LOG("Video channel %u frame rate %.1f -> %.1f fps (consumed %.1f fps)\n", video->vdoChannel, current, target, consumedRate);
+	Video_Set_Framerate(video, target);
+}
+
+/*
+ * settings.json "framerate": {"adaptive": true, "min": 2, "max": 0}
+ * "max" 0 means the sensor rate.  Without "adaptive" the streams run at "max".
+ */
+void
+Video_Framerate(cJSON* settings) {
+	cJSON* item;
+	Video_adaptive = !settings || !cJSON_IsFalse(cJSON_GetObjectItem(settings,"adaptive"));
+	if( (item = cJSON_GetObjectItem(settings,"min")) && cJSON_IsNumber(item) && item->valuedouble > 0 )
+		Video_minFramerate = item->valuedouble;
+	if( (item = cJSON_GetObjectItem(settings,"max")) && cJSON_IsNumber(item) && item->valuedouble >= 0 )
+		Video_maxFramerate = item->valuedouble;
+	ACAP_STATUS_SetBool("video","adaptive",Video_adaptive);
+
+	for( int i = 0; i < VIDEO_MAX_CHANNELS; i++ ) {
+		Video_Channel_t* video = &Video_channels[i];
+		double framerate = video->framerate;
+		if( !Video_adaptive || (Video_maxFramerate > 0 && (framerate <= 0 || framerate > Video_maxFramerate)) )
+			framerate = Video_maxFramerate;
+		if( framerate > 0 && framerate < Video_minFramerate )
+			framerate = Video_minFramerate;
+		Video_Set_Framerate(video, framerate);
+	}
+}
+
+/*
+ * settings.json "stream": {"buffers": 8, "appFrames": 2, "delivery": "latest"}
+ * "delivery" "latest" hands inference the newest frame, "fifo" the oldest
+ * of up to "appFrames" waiting frames.  Changes restart the streams.
+ */
+void
+Video_Stream(cJSON* settings) {
+	cJSON* item;
+	unsigned int buffers = NUM_VDO_BUFFERS;
+	unsigned int appFrames = 2;
+	ImgDelivery_t delivery = IMG_DELIVERY_LATEST;
+	if( (item = cJSON_GetObjectItem(settings,"buffers")) && cJSON_IsNumber(item) && item->valueint > 0 )
+		buffers = item->valueint > MAX_VDO_BUFFERS ? MAX_VDO_BUFFERS : item->valueint;
+	if( (item = cJSON_GetObjectItem(settings,"appFrames")) && cJSON_IsNumber(item) && item->valueint > 0 )
+		appFrames = item->valueint;
+	if( (item = cJSON_GetObjectItem(settings,"delivery")) && cJSON_IsString(item) && strcmp(item->valuestring,"fifo") == 0 )
+		delivery = IMG_DELIVERY_FIFO;
+	if( appFrames > MAX_VDO_BUFFERS - 2 )
+		appFrames = MAX_VDO_BUFFERS - 2;
+	if( buffers < appFrames + 2 ) {
+		LOG_WARN("%s: %u buffers is too few for %u app frames, using %u\n",__func__, buffers, appFrames, appFrames + 2);
+		buffers = appFrames + 2;
+	}
+
+	if( buffers == Video_buffers && appFrames == Video_appFrames && delivery == Video_delivery )
+		return;
+	Video_buffers = buffers;
+	Video_appFrames = appFrames;
+	Video_delivery = delivery;
+	for( int i = 0; i < VIDEO_MAX_CHANNELS; i++ )
+		if( Video_channels[i].provider )
+			Video_channels[i].recreate = 1;
+	ACAP_STATUS_SetNumber("video","buffers",Video_buffers);
+	ACAP_STATUS_SetNumber("video","appFrames",Video_appFrames);
+	ACAP_STATUS_SetString("video","delivery",Video_delivery == IMG_DELIVERY_FIFO ? "fifo" : "latest");
+}
+
 ImgProvider_t* rgbProvider = NULL;
 VdoBuffer* rgbBuffer = NULL;
 
-bool Video_Start_YUV(unsigned int width, unsigned int height) {
-    yuvProvider = createImgProvider(width, height, 2, VDO_FORMAT_YUV);
-    if (!yuvProvider) {
-        LOG_WARN("%s: Could not create image provider\n", __func__);
-		return false;
+//Create and start a stream with the current buffer settings and the channel's requested rate
+static ImgProvider_t*
+Video_Open(Video_Channel_t* video, unsigned int vdoChannel, unsigned int width, unsigned int height) {
+	ImgProviderConfig_t config = {
+		.channel = vdoChannel,
+		.width = width,
+		.height = height,
+		.vdoFormat = VDO_FORMAT_YUV,
+		.numAppFrames = Video_appFrames,
+		.numVdoBuffers = Video_buffers,
+		.delivery = Video_delivery,
+		.framerate = video->framerate
+	};
+    ImgProvider_t* provider = createImgProvider(&config);
+    if (!provider) {
+        LOG_WARN("%s: Could not create image provider for channel %u\n", __func__, vdoChannel);
+		return NULL;
 	}
-    if (!startFrameFetch(yuvProvider)) {
-        destroyImgProvider(yuvProvider);
+    if (!startFrameFetch(provider)) {
+        destroyImgProvider(provider);
         LOG_WARN("%s: Unable to start frame fetch\n", __func__);
-		return false;
+		return NULL;
     }
-	LOG_TRACE("%s: YUV Video %ux%u\n",__func__,width,height);
+	return provider;
+}
+
+//Release the channel's frame and stream, keeping the counters it collected
+static void
+Video_Close(Video_Channel_t* video) {
+	if( !video->provider )
+		return;
+	if( video->buffer )
+		returnFrame(video->provider, video->buffer);
+	video->buffer = NULL;
+	stopFrameFetch(video->provider);
+	video->skipped += atomic_load(&video->provider->skippedCount);
+	video->lost += atomic_load(&video->provider->lostCount);
+	destroyImgProvider(video->provider);
+	video->provider = NULL;
+}
+
+bool
+Video_Start_Channel(int index, unsigned int vdoChannel, unsigned int width, unsigned int height) {
+	if( index < 0 || index >= VIDEO_MAX_CHANNELS )
+		return false;
+	Video_Channel_t* video = &Video_channels[index];
+	if( video->provider )
+		Video_Stop_Channel(index);
+	if( video->vdoChannel != vdoChannel ) {
+		//Another sensor or view area, forget the rate history
+		memset(video, 0, sizeof(Video_Channel_t));
+		if( Video_maxFramerate > 0 )
+			video->framerate = Video_maxFramerate;
+	}
+	video->provider = Video_Open(video, vdoChannel, width, height);
+	if( !video->provider )
+		return false;
+	video->vdoChannel = vdoChannel;
+	video->width = width;
+	video->height = height;
+	Video_Window_Reset(video);
+	Video_Status(video, "framerate", video->framerate);
+	if( index == 0 ) {
+		ACAP_STATUS_SetNumber("video","buffers",video->provider->numVdoBuffers);
+		ACAP_STATUS_SetNumber("video","appFrames",video->provider->numAppFrames);
+		ACAP_STATUS_SetString("video","delivery",Video_delivery == IMG_DELIVERY_FIFO ? "fifo" : "latest");
+	}
+	LOG_TRACE("%s: YUV Video %ux%u on channel %u\n",__func__,width,height,vdoChannel);
 	return true;
 }
 
+void
+Video_Stop_Channel(int index) {
+	if( index < 0 || index >= VIDEO_MAX_CHANNELS )
+		return;
+	Video_Channel_t* video = &Video_channels[index];
+	Video_Close(video);
+	video->captureTime = 0;
+	video->recreate = 0;
+	video->retryTime = 0;
+	if( index > 0 ) {
+		char key[32];
+		snprintf(key, sizeof(key), "channel%u", video->vdoChannel);
+		ACAP_STATUS_SetNull("video", key);
+	}
+}
+
+bool Video_Start_YUV(unsigned int width, unsigned int height) {
+	return Video_Start_Channel(0, 1, width, height);
+}
+
 void
 Video_Stop_YUV() {
-	if( yuvProvider ) {
-		stopFrameFetch(yuvProvider);
-        destroyImgProvider(yuvProvider);
-    }
-	yuvProvider = NULL;
+	Video_Stop_Channel(0);
 }
 
 VdoBuffer*
-Video_Capture_YUV() {
-	if(!yuvProvider) {
+Video_Capture_Channel(int index) {
+	if( index < 0 || index >= VIDEO_MAX_CHANNELS )
+		return 0;
+	Video_Channel_t* video = &Video_channels[index];
+	if( !video->provider ) {
 		LOG_TRACE("-");
 		return 0;
 	}
-	if( yuvBuffer )
-		returnFrame(yuvProvider, yuvBuffer);	
-    yuvBuffer = getLastFrameBlocking(yuvProvider);
-    return yuvBuffer;
+	if( video->recreate && g_get_monotonic_time() / 1000 >= video->retryTime ) {
+		//The old stream keeps delivering until the new one has started
+		ImgProvider_t* provider = Video_Open(video, video->vdoChannel, video->width, video->height);
+		if( provider ) {
+			Video_Close(video);
+			video->provider = provider;
+			video->recreate = 0;
+			video->retryTime = 0;
+			Video_Window_Reset(video);
+		} else {
+			LOG_WARN("%s: Unable to restart channel %u at %.1f fps, keeping %.1f fps\n",__func__, video->vdoChannel, video->framerate, video->provider->framerate);
+			video->framerate = video->provider->framerate;
+			video->retryTime = g_get_monotonic_time() / 1000 + VIDEO_WINDOW_MS;
+			//Only retry for stream settings the running stream does not have, a rate change is retried by Video_Measure
+			video->recreate = video->provider->numVdoBuffers != Video_buffers ||
+			                  video->provider->numAppFrames != Video_appFrames ||
+			                  video->provider->delivery != Video_delivery;
+		}
+		Video_Status(video, "framerate", video->framerate);
+	}
+	if( video->buffer )
+		returnFrame(video->provider, video->buffer);	
+    video->buffer = getLastFrameBlocking(video->provider);
+
+	guint64 timestamp = 0;
+	video->captureTime = 0;
+	if( getFrameInfo(video->buffer, &timestamp, NULL) ) {
+		guint64 now = g_get_monotonic_time();
+		//Ignore timestamps from another clock base
+		if( timestamp <= now && now - timestamp < 10000000 ) {
+			video->captureTime = timestamp;
+			video->ageSum += now - timestamp;
+			video->ageCount++;
+			if( now - timestamp > video->ageMax )
+				video->ageMax = now - timestamp;
+		}
+	}
+	Video_Measure(video);
+    return video->buffer;
+}
+
+//VDO timestamps are monotonic us; converted through the current offset to wall-clock time
+uint64_t
+Video_Capture_Time(VdoBuffer* buffer) {
+	uint64_t timestamp = 0;
+	if( !getFrameInfo(buffer, &timestamp, NULL) || !timestamp )
+		return 0;
+	guint64 now = g_get_monotonic_time();
+	if( timestamp > now || now - timestamp >= 10000000 )
+		return 0;
+	return (uint64_t)(ACAP_DEVICE_Timestamp() - (now - timestamp) / 1000.0);
+}
+
+VdoBuffer*
+Video_Capture_YUV() {
+	return Video_Capture_Channel(0);
+}
+
+//Called when the detections of the latest frame captured on the channel have been published
+void
+Video_Decided(int index) {
+	if( index < 0 || index >= VIDEO_MAX_CHANNELS || !Video_channels[index].captureTime )
+		return;
+	Video_Channel_t* video = &Video_channels[index];
+	guint64 latency = g_get_monotonic_time() - video->captureTime;
+	video->latencySum += latency;
+	video->latencyCount++;
+	if( latency > video->latencyMax )
+		video->latencyMax = latency;
+	video->captureTime = 0;
+}
+
+//The frame returned by the latest Video_Capture_YUV.  Valid until the next capture
+VdoBuffer*
+Video_Last_YUV(unsigned int* width, unsigned int* height, unsigned int* pitch) {
+	Video_Channel_t* video = &Video_channels[0];
+	if( !video->provider || !video->buffer )
+		return 0;
+	//Geometry VDO delivers, not the requested size
+	if( width )
+		*width = video->provider->streamWidth;
+	if( height )
+		*height = video->provider->streamHeight;
+	if( pitch )
+		*pitch = video->provider->streamPitch;
+	return video->buffer;
 }
 
-bool Video_Start_RGB(unsigned int width, unsigned int height) {
-    rgbProvider = createImgProvider(width, height, 1, VDO_FORMAT_JPEG);
+bool Video_Start_RGB(unsigned int width, unsigned int height, double framerate) {
+	ImgProviderConfig_t config = {
+		.channel = 1,
+		.width = width,
+		.height = height,
+		.vdoFormat = VDO_FORMAT_JPEG,
+		.numAppFrames = 1,
+		.numVdoBuffers = NUM_VDO_BUFFERS,
+		.delivery = IMG_DELIVERY_LATEST,
+		.framerate = framerate
+	};
+    rgbProvider = createImgProvider(&config);
     if (!rgbProvider) {
         LOG_WARN("%s: Could not create image provider\n", __func__);
 		return false;
 	}
     if (!startFrameFetch(rgbProvider)) {
         destroyImgProvider(rgbProvider);
+		rgbProvider = NULL;
         LOG_WARN("%s: Unable to start frame fetch\n", __func__);
 		return false;
     }
@@ -66,6 +444,9 @@ bool Video_Start_RGB(unsigned int width, unsigned int height) {
 void
 Video_Stop_RGB() {
 	if( rgbProvider ) {
+		if( rgbBuffer )
+			returnFrame(rgbProvider, rgbBuffer);
+		rgbBuffer = NULL;
 		stopFrameFetch(rgbProvider);
         destroyImgProvider(rgbProvider);
     }
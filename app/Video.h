@@ -4,12 +4,23 @@
 #include "vdo-frame.h"
 #include "vdo-types.h"
 #include "imgprovider.h"
+#include "cJSON.h"
+
+#define VIDEO_MAX_CHANNELS	4	//Inference streams, index 0 is the primary stream
 
 bool Video_Start_YUV(unsigned int width, unsigned int height);
-bool Video_Start_RGB(unsigned int width, unsigned int height);
+bool Video_Start_RGB(unsigned int width, unsigned int height, double framerate);
 void Video_Stop_YUV();
 void Video_Stop_RGB();
 VdoBuffer* Video_Capture_YUV(); 
 VdoBuffer* Video_Capture_RGB(); 
+VdoBuffer* Video_Last_YUV(unsigned int* width, unsigned int* height, unsigned int* pitch);
+void Video_Framerate(cJSON* settings);
+void Video_Stream(cJSON* settings);
+bool Video_Start_Channel(int index, unsigned int vdoChannel, unsigned int width, unsigned int height);
+void Video_Stop_Channel(int index);
+VdoBuffer* Video_Capture_Channel(int index);
+uint64_t Video_Capture_Time(VdoBuffer* buffer);	//EPOCH ms the buffer was captured, 0 when unknown
+void Video_Decided(int index);
 
 #endif
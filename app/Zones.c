@@ -0,0 +1,172 @@
+/*
+ * Polygon zones.
+ *
+ * Whenever the zones setting changes every polygon is rasterized into a
+ * ZONES_GRID x ZONES_GRID grid of uint32 masks, bit n set for cells whose
+ * centre is inside zone n.  Per frame a detection only costs one lookup
+ * of its anchor point, independent of the number of zones and edges.
+ * The anchor is the bottom centre of the box (where a person stands)
+ * unless the setting zoneAnchor is "center".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <glib.h>
+
+#include "ACAP.h"
+#include "Zones.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define ZONES_MAX_POINTS	64
+
+static uint32_t Zones_grid[ZONES_GRID * ZONES_GRID];
+static char Zones_names[ZONES_MAX][32];
+static int Zones_count = 0;
+static int Zones_center = 0;
+static char* Zones_config = 0;		//zones and zoneAnchor the grid was built from
+
+//Even-odd rule for the point (px,py)
+static int
+Zones_Inside(const float* xs, const float* ys, int points, float px, float py) {
+	int inside = 0;
+	for( int i = 0, j = points - 1; i < points; j = i++ ) {
+		if( (ys[i] > py) != (ys[j] > py) &&
+			px < (xs[j] - xs[i]) * (py - ys[i]) / (ys[j] - ys[i]) + xs[i] )
+			inside = !inside;
+	}
+	return inside;
+}
+
+static void
+Zones_Rasterize(int zone, const float* xs, const float* ys, int points) {
+	float minX = 1000, minY = 1000, maxX = 0, maxY = 0;
+	for( int i = 0; i < points; i++ ) {
+		if( xs[i] < minX ) minX = xs[i];
+		if( xs[i] > maxX ) maxX = xs[i];
+		if( ys[i] < minY ) minY = ys[i];
+		if( ys[i] > maxY ) maxY = ys[i];
+	}
+	int column1 = minX * ZONES_GRID / 1000, column2 = maxX * ZONES_GRID / 1000;
+	int row1 = minY * ZONES_GRID / 1000, row2 = maxY * ZONES_GRID / 1000;
+	if( column1 < 0 ) column1 = 0;
+	if( row1 < 0 ) row1 = 0;
+	if( column2 >= ZONES_GRID ) column2 = ZONES_GRID - 1;
+	if( row2 >= ZONES_GRID ) row2 = ZONES_GRID - 1;
+
+	uint32_t bit = 1u << zone;
+	for( int row = row1; row <= row2; row++ ) {
+		float py = (row + 0.5f) * 1000.0f / ZONES_GRID;
+		for( int column = column1; column <= column2; column++ ) {
+			float px = (column + 0.5f) * 1000.0f / ZONES_GRID;
+			if( Zones_Inside(xs, ys, points, px, py) )
+				Zones_grid[row * ZONES_GRID + column] |= bit;
+		}
+	}
+}
+
+uint32_t
+Zones_Lookup(unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
+	if( Zones_count == 0 )
+		return 0;
+	unsigned int ax = x + w / 2;
+	unsigned int ay = Zones_center ? y + h / 2 : y + h;
+	unsigned int column = ax * ZONES_GRID / 1000;
+	unsigned int row = ay * ZONES_GRID / 1000;
+	if( column >= ZONES_GRID ) column = ZONES_GRID - 1;
+	if( row >= ZONES_GRID ) row = ZONES_GRID - 1;
+	return Zones_grid[row * ZONES_GRID + column];
+}
+
+int
+Zones_Count() {
+	return Zones_count;
+}
+
+const char*
+Zones_Name(int index) {
+	if( index < 0 || index >= Zones_count )
+		return 0;
+	return Zones_names[index];
+}
+
+cJSON*
+Zones_Names(uint32_t mask) {
+	cJSON* names = cJSON_CreateArray();
+	for( int i = 0; i < Zones_count && mask; i++, mask >>= 1 )
+		if( mask & 1 )
+			cJSON_AddItemToArray(names, cJSON_CreateString(Zones_names[i]));
+	return names;
+}
+
+static char*
+Zones_Config(cJSON* zones) {
+	cJSON* settings = ACAP_Get_Config("settings");
+	cJSON* anchor = settings ? cJSON_GetObjectItem(settings,"zoneAnchor") : 0;
+	char* polygons = zones ? cJSON_PrintUnformatted(zones) : 0;
+	char* config = g_strdup_printf("%s|%s", polygons ? polygons : "", cJSON_IsString(anchor) ? anchor->valuestring : "");
+	free(polygons);
+	return config;
+}
+
+int
+Zones_Changed(cJSON* zones) {
+	char* config = Zones_Config(zones);
+	int changed = !Zones_config || strcmp(config, Zones_config) != 0;
+	g_free(config);
+	return changed;
+}
+
+int
+Zones_Init(cJSON* zones) {
+	memset(Zones_grid, 0, sizeof(Zones_grid));
+	Zones_count = 0;
+	g_free(Zones_config);
+	Zones_config = Zones_Config(zones);
+
+	cJSON* settings = ACAP_Get_Config("settings");
+	cJSON* anchor = settings ? cJSON_GetObjectItem(settings,"zoneAnchor") : 0;
+	Zones_center = anchor && cJSON_IsString(anchor) && strcmp(anchor->valuestring, "center") == 0;
+
+	cJSON* zone = zones && cJSON_IsArray(zones) ? zones->child : 0;
+	while( zone ) {
+		if( Zones_count >= ZONES_MAX ) {
+			LOG_WARN("%s: Only %d zones supported\n",__func__, ZONES_MAX);
+			break;
+		}
+		cJSON* name = cJSON_GetObjectItem(zone,"name");
+		cJSON* points = cJSON_GetObjectItem(zone,"points");
+		float xs[ZONES_MAX_POINTS], ys[ZONES_MAX_POINTS];
+		int count = 0;
+		cJSON* point = points && cJSON_IsArray(points) ? points->child : 0;
+		while( point && count < ZONES_MAX_POINTS ) {
+			if( cJSON_GetArraySize(point) == 2 ) {
+				xs[count] = cJSON_GetArrayItem(point, 0)->valuedouble;
+				ys[count] = cJSON_GetArrayItem(point, 1)->valuedouble;
+				count++;
+			}
+			point = point->next;
+		}
+		if( count < 3 ) {
+			LOG_WARN("%s: Zone %d needs at least 3 points\n",__func__, Zones_count);
+			zone = zone->next;
+			continue;
+		}
+		snprintf(Zones_names[Zones_count], sizeof(Zones_names[0]), "%s",
+			name && cJSON_IsString(name) ? name->valuestring : "Zone");
+		Zones_Rasterize(Zones_count, xs, ys, count);
+		Zones_count++;
+		zone = zone->next;
+	}
+
+	cJSON* names = Zones_Names(Zones_count ? (uint32_t)((1ull << Zones_count) - 1) : 0);
+	ACAP_STATUS_SetObject("zones","names",names);
+	cJSON_Delete(names);
+	LOG_TRACE("%s: %d zones\n",__func__, Zones_count);
+	return Zones_count;
+}
@@ -0,0 +1,28 @@
+/*
+ * Polygon zones.
+ * Up to ZONES_MAX polygons in the 0-1000 coordinate space are rasterized
+ * into a grid of zone bitmasks so a detection's zones are found with a
+ * single lookup.
+ *
+ * settings.json "zones": [
+ *		{"name":"Gate","points":[[100,100],[400,120],[380,600],[90,580]]},
+ *		...
+ * ]
+ */
+#ifndef ZONES_H
+#define ZONES_H
+
+#include <stdint.h>
+#include "cJSON.h"
+
+#define ZONES_MAX		32
+#define ZONES_GRID		200		//Cells per axis, 5 units per cell
+
+int			Zones_Init(cJSON* zones);
+int			Zones_Changed(cJSON* zones);	//zones or zoneAnchor differ from the compiled grid
+uint32_t	Zones_Lookup(unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+int			Zones_Count();
+const char*	Zones_Name(int index);
+cJSON*		Zones_Names(uint32_t mask);
+
+#endif
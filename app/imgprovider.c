@@ -26,6 +26,7 @@
 #include <syslog.h>
 #include <vdo-channel.h>
 
+#include "vdo-frame.h"
 #include "vdo-map.h"
 
 #define VDO_CHANNEL (1)
@@ -77,7 +78,7 @@ static void releaseVdoBuffers(ImgProvider_t* provider);
  * frame.
  * 2. The fresh frame is put at the end of the deliveredFrame queue. If the
  *    client want to fetch a frame the item at the end of deliveredFrame
- *    list is returned.
+ *    list is returned, or the item at the head with IMG_DELIVERY_FIFO.
  * 3. If there are any frames in the processedFrames list one of these are
  *    enqueued back to VDO to keep the flow of buffers.
  * 4. If the processedFrames list is empty we instead check if there are
@@ -91,8 +92,7 @@ static void releaseVdoBuffers(ImgProvider_t* provider);
  */
 static void* threadEntry(void* data);
 
-ImgProvider_t*
-createImgProvider(unsigned int w, unsigned int h, unsigned int numFrames, VdoFormat format) {
+ImgProvider_t* createImgProvider(const ImgProviderConfig_t* config) {
     bool mtxInitialized  = false;
     bool condInitialized = false;
 
@@ -102,8 +102,21 @@ createImgProvider(unsigned int w, unsigned int h, unsigned int numFrames, VdoFor
         goto errorExit;
     }
 
-    provider->vdoFormat    = format;
-    provider->numAppFrames = numFrames;
+    provider->vdoFormat     = config->vdoFormat;
+    provider->channel       = config->channel ? config->channel : VDO_CHANNEL;
+    provider->numAppFrames  = config->numAppFrames ? config->numAppFrames : 1;
+    provider->numVdoBuffers = config->numVdoBuffers ? config->numVdoBuffers : NUM_VDO_BUFFERS;
+    provider->delivery      = config->delivery;
+    provider->framerate     = config->framerate;
+    if (provider->numAppFrames > MAX_VDO_BUFFERS - 2) {
+        provider->numAppFrames = MAX_VDO_BUFFERS - 2;
+    }
+    if (provider->numVdoBuffers < provider->numAppFrames + 2) {
+        provider->numVdoBuffers = provider->numAppFrames + 2;
+    }
+    if (provider->numVdoBuffers > MAX_VDO_BUFFERS) {
+        provider->numVdoBuffers = MAX_VDO_BUFFERS;
+    }
 
     if (pthread_mutex_init(&provider->frameMutex, NULL)) {
         syslog(LOG_ERR, "%s: Unable to initialize mutex: %s", __func__, strerror(errno));
@@ -132,7 +145,7 @@ createImgProvider(unsigned int w, unsigned int h, unsigned int numFrames, VdoFor
         goto errorExit;
     }
 
-    if (!createStream(provider, w, h)) {
+    if (!createStream(provider, config->width, config->height)) {
         syslog(LOG_ERR, "%s: Could not create VDO stream!", __func__);
         goto errorExit;
     }
@@ -182,7 +195,7 @@ bool allocateVdoBuffers(ImgProvider_t* provider, VdoStream* vdoStream) {
     assert(provider);
     assert(vdoStream);
 
-    for (size_t i = 0; i < NUM_VDO_BUFFERS; i++) {
+    for (size_t i = 0; i < provider->numVdoBuffers; i++) {
         provider->vdoBuffers[i] = vdo_stream_buffer_alloc(vdoStream, NULL, &error);
         if (provider->vdoBuffers[i] == NULL) {
             syslog(LOG_ERR,
@@ -305,10 +318,13 @@ bool createStream(ImgProvider_t* provider, unsigned int w, unsigned int h) {
         goto end;
     }
 
-    vdo_map_set_uint32(vdoMap, "channel", VDO_CHANNEL);
+    vdo_map_set_uint32(vdoMap, "channel", provider->channel);
     vdo_map_set_uint32(vdoMap, "format", provider->vdoFormat);
     vdo_map_set_uint32(vdoMap, "width", w);
     vdo_map_set_uint32(vdoMap, "height", h);
+    if (provider->framerate > 0) {
+        vdo_map_set_double(vdoMap, "framerate", provider->framerate);
+    }
     // We will use buffer_alloc() and buffer_unref() calls.
     vdo_map_set_uint32(vdoMap, "buffer.strategy", VDO_BUFFER_STRATEGY_EXPLICIT);
 
@@ -340,6 +356,26 @@ bool createStream(ImgProvider_t* provider, unsigned int w, unsigned int h) {
 
     provider->vdoStream = vdoStream;
 
+    // The stream may have been scaled or padded to a supported format.
+    provider->streamWidth  = w;
+    provider->streamHeight = h;
+    provider->streamPitch  = w;
+    VdoMap* info = vdo_stream_get_info(vdoStream, &error);
+    if (info) {
+        provider->streamWidth  = vdo_map_get_uint32(info, "width", w);
+        provider->streamHeight = vdo_map_get_uint32(info, "height", h);
+        provider->streamPitch  = vdo_map_get_uint32(info, "pitch", provider->streamWidth);
+        g_object_unref(info);
+    } else {
+        syslog(LOG_WARNING,
+               "%s: No stream info, assuming %ux%u: %s",
+               __func__,
+               w,
+               h,
+               (error != NULL) ? error->message : "N/A");
+        g_clear_error(&error);
+    }
+
     ret = true;
 
     goto end;
@@ -360,7 +396,7 @@ static void releaseVdoBuffers(ImgProvider_t* provider) {
         return;
     }
 
-    for (size_t i = 0; i < NUM_VDO_BUFFERS; i++) {
+    for (size_t i = 0; i < provider->numVdoBuffers; i++) {
         if (provider->vdoBuffers[i] != NULL) {
             vdo_stream_buffer_unref(provider->vdoStream, &provider->vdoBuffers[i], NULL);
         }
@@ -378,7 +414,12 @@ VdoBuffer* getLastFrameBlocking(ImgProvider_t* provider) {
         }
     }
 
-    returnBuf = g_queue_pop_tail(provider->deliveredFrames);
+    if (provider->delivery == IMG_DELIVERY_FIFO) {
+        returnBuf = g_queue_pop_head(provider->deliveredFrames);
+    } else {
+        returnBuf = g_queue_pop_tail(provider->deliveredFrames);
+    }
+    atomic_fetch_add(&provider->consumedCount, 1);
 
 errorExit:
     pthread_mutex_unlock(&provider->frameMutex);
@@ -386,6 +427,22 @@ errorExit:
     return returnBuf;
 }
 
+bool getFrameInfo(VdoBuffer* buffer, uint64_t* timestamp, unsigned int* sequence) {
+    VdoFrame* frame = buffer ? vdo_buffer_get_frame(buffer) : NULL;
+
+    if (!frame) {
+        return false;
+    }
+    if (timestamp) {
+        *timestamp = vdo_frame_get_timestamp(frame);
+    }
+    if (sequence) {
+        *sequence = vdo_frame_get_sequence_nbr(frame);
+    }
+
+    return true;
+}
+
 void returnFrame(ImgProvider_t* provider, VdoBuffer* buffer) {
     pthread_mutex_lock(&provider->frameMutex);
 
@@ -411,9 +468,18 @@ static void* threadEntry(void* data) {
             g_clear_error(&error);
             continue;
         }
+        unsigned int sequence = 0;
+        if (getFrameInfo(newBuffer, NULL, &sequence)) {
+            if (provider->lastSequence && sequence > provider->lastSequence + 1) {
+                atomic_fetch_add(&provider->lostCount, sequence - provider->lastSequence - 1);
+            }
+            provider->lastSequence = sequence;
+        }
+
         pthread_mutex_lock(&provider->frameMutex);
 
         g_queue_push_tail(provider->deliveredFrames, newBuffer);
+        atomic_fetch_add(&provider->deliveredCount, 1);
 
         VdoBuffer* oldBuffer = NULL;
 
@@ -427,6 +493,7 @@ static void* threadEntry(void* data) {
             // VDO if we have collected more buffers than numAppFrames.
             if (g_queue_get_length(provider->deliveredFrames) > provider->numAppFrames) {
                 oldBuffer = g_queue_pop_head(provider->deliveredFrames);
+                atomic_fetch_add(&provider->skippedCount, 1);
             }
         }
 
@@ -447,6 +514,26 @@ static void* threadEntry(void* data) {
 	return NULL;
 }
 
+bool setFramerate(ImgProvider_t* provider, double framerate) {
+    GError* error = NULL;
+
+    if (!provider->vdoStream || framerate <= 0) {
+        return false;
+    }
+    if (!vdo_stream_set_framerate(provider->vdoStream, framerate, &error)) {
+        syslog(LOG_WARNING,
+               "%s: Failed changing framerate to %.1f: %s",
+               __func__,
+               framerate,
+               (error != NULL) ? error->message : "N/A");
+        g_clear_error(&error);
+        return false;
+    }
+    provider->framerate = framerate;
+
+    return true;
+}
+
 bool startFrameFetch(ImgProvider_t* provider) {
     if (pthread_create(&provider->fetcherThread, NULL, threadEntry, provider)) {
         syslog(LOG_ERR,
@@ -23,11 +23,40 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "vdo-stream.h"
 #include "vdo-types.h"
 
 #define NUM_VDO_BUFFERS (8)
+#define MAX_VDO_BUFFERS (32)
+
+/**
+ * brief Order in which delivered frames are handed to the client.
+ *
+ * IMG_DELIVERY_LATEST returns the newest frame and older frames are
+ * recycled unseen. IMG_DELIVERY_FIFO returns frames oldest first and
+ * only drops the oldest when more than numAppFrames are waiting.
+ */
+typedef enum { IMG_DELIVERY_LATEST, IMG_DELIVERY_FIFO } ImgDelivery_t;
+
+/**
+ * brief Stream and buffer settings for createImgProvider().
+ */
+typedef struct ImgProviderConfig {
+    /// VDO channel (sensor or view area), 0 for the default channel.
+    unsigned int channel;
+    unsigned int width;
+    unsigned int height;
+    VdoFormat vdoFormat;
+    /// Frames delivered by VDO kept for the client.
+    unsigned int numAppFrames;
+    /// Buffers allocated on the stream, at most MAX_VDO_BUFFERS.
+    unsigned int numVdoBuffers;
+    ImgDelivery_t delivery;
+    /// Requested frames per second, 0 for the sensor rate.
+    double framerate;
+} ImgProviderConfig_t;
 
 /**
  * brief A type representing a provider of frames from VDO.
@@ -39,16 +68,36 @@
 typedef struct ImgProvider {
     /// Stream configuration parameters.
     VdoFormat vdoFormat;
+    unsigned int channel;
+    /// Geometry of the stream VDO created, may differ from the request.
+    unsigned int streamWidth;
+    unsigned int streamHeight;
+    /// Bytes per row of the luma plane, the chroma plane follows after
+    /// streamHeight rows.
+    unsigned int streamPitch;
 
     /// Vdo stream and buffers handling.
     VdoStream* vdoStream;
-    VdoBuffer* vdoBuffers[NUM_VDO_BUFFERS];
+    VdoBuffer* vdoBuffers[MAX_VDO_BUFFERS];
+    unsigned int numVdoBuffers;
 
     /// Keeping track of frames' statuses.
     GQueue* deliveredFrames;
     GQueue* processedFrames;
     /// Number of frames to keep in the deliveredFrames queue.
     unsigned int numAppFrames;
+    ImgDelivery_t delivery;
+
+    /// Requested stream framerate, 0 for the full sensor rate.
+    double framerate;
+    /// Frames delivered by VDO and frames handed to the client.
+    atomic_uint deliveredCount;
+    atomic_uint consumedCount;
+    /// Frames recycled without reaching the client.
+    atomic_uint skippedCount;
+    /// Frames VDO never delivered, from gaps in the frame sequence numbers.
+    atomic_uint lostCount;
+    unsigned int lastSequence;
 
     /// To support fetching frames asynchonously with VDO.
     pthread_mutex_t frameMutex;
@@ -82,14 +131,26 @@ bool chooseStreamResolution(unsigned int reqWidth,
  * find resolution of the created stream. These numbers might not match the
  * requested resolution depending on platform properties.
  *
- * param w Requested output image width.
- * param h Requested ouput image height.
- * param numFrames Number of fetched frames to keep.
- * param vdoFormat Image format to be output by stream.
+ * numVdoBuffers is raised to numAppFrames + 2 when lower, so VDO always
+ * has buffers to fill while the client holds its frames.
+ *
+ * param config Stream size, format, buffer counts and delivery order.
  * return Pointer to new ImgProvider, or NULL if failed.
  */
-ImgProvider_t*
-createImgProvider(unsigned int w, unsigned int h, unsigned int numFrames, VdoFormat vdoFormat);
+ImgProvider_t* createImgProvider(const ImgProviderConfig_t* config);
+
+/**
+ * brief Change the framerate of a running stream.
+ *
+ * VDO renegotiates the rate without restarting the stream. If the
+ * platform does not support that the stream must be recreated with
+ * the new rate.
+ *
+ * param provider Pointer to ImgProvider whose stream to change.
+ * param framerate Requested frames per second.
+ * return False if VDO did not accept the new rate, otherwise true.
+ */
+bool setFramerate(ImgProvider_t* provider, double framerate);
 
 /**
  * brief Release VDO buffers and deallocate provider.
@@ -122,6 +183,16 @@ bool stopFrameFetch(ImgProvider_t* provider);
  */
 VdoBuffer* getLastFrameBlocking(ImgProvider_t* provider);
 
+/**
+ * brief Capture time and sequence number of a frame.
+ *
+ * param buffer Frame returned by getLastFrameBlocking().
+ * param timestamp Capture time in microseconds, CLOCK_MONOTONIC.
+ * param sequence VDO frame sequence number.
+ * return False if the buffer carries no frame information.
+ */
+bool getFrameInfo(VdoBuffer* buffer, uint64_t* timestamp, unsigned int* sequence);
+
 /**
  * brief Release reference to an image buffer.
  *
@@ -18,6 +18,20 @@
 #include "Video.h"
 #include "cJSON.h"
 #include "Output.h"
+#include "SSE.h"
+#include "Frame.h"
+#include "Feed.h"
+#include "SHM.h"
+#include "Clip.h"
+#include "Snapshot.h"
+#include "History.h"
+#include "Stats.h"
+#include "Heatmap.h"
+#include "Zones.h"
+#include "Tracker.h"
+#include "Rules.h"
+#include "MQTT.h"
+#include "Channels.h"
 
 #define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args);}
 #define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args);}
@@ -35,6 +49,7 @@ GTimer *cleanupTransitionTimer = 0;
 void
 ConfigUpdate( const char *service, cJSON* data) {
 	LOG_TRACE("%s: %s\n",__func__,service);
+	int zones = 0;
 	cJSON* setting = data->child;
 	while(setting) {
 		LOG_TRACE("%s: Processing %s\n",__func__,setting->string);
@@ -47,22 +62,97 @@ ConfigUpdate( const char *service, cJSON* data) {
 		if( strcmp( "aoi", setting->string ) == 0 ) {
 			LOG("Updated area of intrest\n");
 		}
+		if( strcmp( "zones", setting->string ) == 0 || strcmp( "zoneAnchor", setting->string ) == 0 )
+			zones = 1;
 		if( strcmp( "ignore", setting->string ) == 0 ) {
 			LOG("Update labels to be processed\n");
 		}
 		if( strcmp( "confidence", setting->string ) == 0 ) {
 			LOG("Updated confidence threshold to %d\n", setting->valueint);
 		}
+		if( strcmp( "feed", setting->string ) == 0 ) {
+			Feed_Init( setting );
+		}
+		if( strcmp( "shm", setting->string ) == 0 ) {
+			SHM_Init( setting );
+		}
+		if( strcmp( "clips", setting->string ) == 0 ) {
+			Clip_Init( setting );
+		}
+		if( strcmp( "history", setting->string ) == 0 ) {
+			History_Init( setting );
+		}
+		if( strcmp( "stats", setting->string ) == 0 ) {
+			Stats_Init( setting );
+		}
+		if( strcmp( "heatmap", setting->string ) == 0 ) {
+			Heatmap_Init( setting );
+		}
+		if( strcmp( "counting", setting->string ) == 0 ) {
+			Tracker_Init( setting );
+		}
+		if( strcmp( "rules", setting->string ) == 0 ) {
+			Rules_Init( setting );
+		}
+		if( strcmp( "framerate", setting->string ) == 0 ) {
+			Video_Framerate( setting );
+		}
+		if( strcmp( "stream", setting->string ) == 0 ) {
+			Video_Stream( setting );
+		}
+		if( strcmp( "channels", setting->string ) == 0 && model ) {
+			if( Channels_Init( setting ) ) {
+				Output_Channels();
+				Rules_Init( cJSON_GetObjectItem(settings,"rules") );
+			}
+		}
 		setting = setting->next;
 	}
+	//Everything resolving zone indexes follows the compiled zones
+	if( zones && settings && Zones_Changed( cJSON_GetObjectItem(settings,"zones") ) ) {
+		LOG("Updated %d zones\n", Zones_Init( cJSON_GetObjectItem(settings,"zones") ));
+		Tracker_Init( cJSON_GetObjectItem(settings,"counting") );
+		Rules_Init( cJSON_GetObjectItem(settings,"rules") );
+		Stats_Zones();
+	}
 	LOG_TRACE("%s: Exit\n",__func__);
 }
 
 
+/*
+ * Startup timeline in status "startup", ms since the application started.
+ * "uptime" is the system uptime at start, so uptime + firstEvent is the
+ * time from camera boot to the first event.
+ */
+static gint64 startupTime = 0;
+static int startupInference = 0;
+static int startupEvent = 0;
+
+static void
+Startup_Phase( const char* phase ) {
+	ACAP_STATUS_SetNumber("startup", phase, (int)((g_get_monotonic_time() - startupTime) / 1000));
+}
+
+void
+EventState( const char *id, int state ) {
+	if( state && !startupEvent ) {
+		startupEvent = 1;
+		Startup_Phase("firstEvent");
+	}
+	SSE_Event( id, state );
+	MQTT_Event( id, state );
+	Clip_Event( id, state );
+	History_Event( id, state );
+	Stats_Event( id, state );
+	Heatmap_Event( id, state );
+}
+
 VdoMap *capture_VDO_map = NULL;
 
 int inferenceCounter = 0;
 unsigned int inferenceAverage = 0;
+Frame_t frame = {0};
+Frame_t channelFrame = {0};		//Detections of the additional channels
 
 gboolean
 ImageProcess(gpointer data) {
@@ -72,8 +162,13 @@ ImageProcess(gpointer data) {
 	if( !settings || !model )
 		return G_SOURCE_REMOVE;
 
-	VdoBuffer* buffer = Video_Capture_YUV();	
+	int channel = Channels_Next();
+	VdoBuffer* buffer = Video_Capture_Channel( channel );
 
+	if( !buffer && channel > 0 ) {
+		LOG_WARN("Image capture failed on channel %s\n", Channels_Name(channel));
+		return G_SOURCE_CONTINUE;
+	}
 	if( !buffer ) {
 		ACAP_STATUS_SetString("model","status","Error. Check log");
 		ACAP_STATUS_SetBool("model","state", 0);
@@ -84,6 +179,8 @@ ImageProcess(gpointer data) {
     gettimeofday(&startTs, NULL);
 	cJSON* detections = Model_Inference(buffer);
     gettimeofday(&endTs, NULL);
+	if( !detections )
+		return ACAP_STATUS_Bool("model","state") ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
 
 	unsigned int inferenceTime = (unsigned int)(((endTs.tv_sec - startTs.tv_sec) * 1000) + ((endTs.tv_usec - startTs.tv_usec) / 1000));
 	inferenceCounter++;
@@ -98,7 +195,7 @@ ImageProcess(gpointer data) {
 
 	//Apply Transform detection data and apply user filters
 	cJSON* processedDetections = cJSON_CreateArray();
-	cJSON* aoi = cJSON_GetObjectItem(settings,"aoi");
+	cJSON* aoi = Channels_Setting(channel,"aoi");
 	if(!aoi) {
 		ACAP_STATUS_SetString("model","status","Error. Check log");
 		ACAP_STATUS_SetBool("model","state", 0);
@@ -110,7 +207,7 @@ ImageProcess(gpointer data) {
 	unsigned int x2 = cJSON_GetObjectItem(aoi,"x2")?cJSON_GetObjectItem(aoi,"x2")->valueint:900;
 	unsigned int y2 = cJSON_GetObjectItem(aoi,"y2")?cJSON_GetObjectItem(aoi,"y2")->valueint:900;
 
-	cJSON* size = cJSON_GetObjectItem(settings,"size");
+	cJSON* size = Channels_Setting(channel,"size");
 	if(!size) {
 		ACAP_STATUS_SetString("model","status","Error. Check log");
 		ACAP_STATUS_SetBool("model","state", 0);
@@ -120,16 +217,28 @@ ImageProcess(gpointer data) {
 	unsigned int minWidth = cJSON_GetObjectItem(size,"x2")->valueint - cJSON_GetObjectItem(size,"x1")->valueint;
 	unsigned int minHeight = cJSON_GetObjectItem(size,"y2")->valueint - cJSON_GetObjectItem(size,"y1")->valueint;
 
-	int confidenceThreshold = cJSON_GetObjectItem(settings,"confidence")?cJSON_GetObjectItem(settings,"confidence")->valueint:0.5;
+	int confidenceThreshold = Channels_Setting(channel,"confidence")?Channels_Setting(channel,"confidence")->valueint:0.5;
+	cJSON* ignore = Channels_Setting(channel,"ignore");
+
+	//Rules run on every channel; zones, counting and the other frame consumers follow the primary channel
+	Frame_t* current = channel == 0 ? &frame : &channelFrame;
+	current->sequence++;
+	current->timestamp = Video_Capture_Time( buffer );
+	if( !current->timestamp )
+		current->timestamp = (uint64_t)timestamp;
+	current->count = 0;
 		
 	cJSON* detection = detections->child;
 	while(detection) {
 		cJSON* property = detection->child;
+		unsigned x = 0;
+		unsigned y = 0;
 		unsigned cx = 0;
 		unsigned cy = 0;
 		unsigned width = 0;
 		unsigned height = 0;
 		unsigned c = 0;
+		unsigned labelId = 0;
 		label = "Undefined";
 		while(property) {
 			if( strcmp("c",property->string) == 0 ) {
@@ -140,11 +249,13 @@ ImageProcess(gpointer data) {
 			if( strcmp("x",property->string) == 0 ) {
 				property->valueint = property->valuedouble * 1000;
 				property->valuedouble = property->valueint;
+				x = property->valueint;
 				cx += property->valueint;
 			}
 			if( strcmp("y",property->string) == 0 ) {
 				property->valueint = property->valuedouble * 1000;
 				property->valuedouble = property->valueint;
+				y = property->valueint;
 				cy += property->valueint;
 			}
 			if( strcmp("w",property->string) == 0 ) {
@@ -162,6 +273,9 @@ ImageProcess(gpointer data) {
 			if( strcmp("label",property->string) == 0 ) {
 				label = property->valuestring;
 			}
+			if( strcmp("id",property->string) == 0 ) {
+				labelId = property->valueint;
+			}
 			property = property->next;
 		}
 		
@@ -172,7 +286,6 @@ ImageProcess(gpointer data) {
 			insert = 1;
 		if( width < minWidth || height < minHeight )
 			insert = 0;
-		cJSON* ignore = cJSON_GetObjectItem(settings,"ignore");
 		if( insert && ignore && ignore->type == cJSON_Array && cJSON_GetArraySize(ignore) > 0 ) {
 			cJSON* ignoreLabel = ignore->child;
 			while( ignoreLabel && insert ) {
@@ -184,13 +297,48 @@ ImageProcess(gpointer data) {
 		//Add custom filter here.  Set "insert = 0" if you want to exclude the detection
 
 		if( insert ) {
+			//Zones are drawn in the primary view
+			uint32_t zones = channel == 0 ? Zones_Lookup( x, y, width, height ) : 0;
 			cJSON_AddNumberToObject( detection, "timestamp", timestamp );
+			if( channel == 0 && Zones_Count() )
+				cJSON_AddItemToObject( detection, "zones", Zones_Names( zones ) );
 			cJSON_AddItemToArray(processedDetections, cJSON_Duplicate(detection,1));
+			if( current->count < FRAME_MAX_DETECTIONS ) {
+				Detection_t* compact = &current->detections[current->count++];
+				compact->label = labelId;
+				compact->confidence = c;
+				compact->x = x;
+				compact->y = y;
+				compact->w = width;
+				compact->h = height;
+				compact->zones = zones;
+			}
 		}
 		detection = detection->next;
 	}
 	
-	Output( processedDetections );
+	if( channel == 0 ) {
+		SHM_Publish( &frame );
+		Output( processedDetections );
+		SSE_Frame( &frame );
+		MQTT_Publish( &frame );
+		Rules_Frame( 0, &frame );
+		Feed_Publish( &frame );
+		History_Frame( &frame );
+		Stats_Frame( &frame );
+		Heatmap_Frame( &frame );
+		Tracker_Frame( &frame );
+	} else {
+		Output_Channel( channel, processedDetections );
+		Rules_Frame( channel, &channelFrame );
+	}
+	Channels_Done( channel, cJSON_GetArraySize(processedDetections) );
+	Video_Decided( channel );
+	if( !startupInference ) {
+		startupInference = 1;
+		Startup_Phase("firstInference");
+		LOG("First inference %d ms after start\n", (int)((g_get_monotonic_time() - startupTime) / 1000));
+	}
 
 	cJSON_Delete(processedDetections);
 
@@ -205,6 +353,16 @@ void HTTP_ENDPOINT_eventsTransition(const ACAP_HTTP_Response response,const ACAP
 
 static GMainLoop *main_loop = NULL;
 
+static void
+ModelReady( int ok ) {
+	if( !ok ) {
+		LOG_WARN("Model setup failed\n");
+		return;
+	}
+	Startup_Phase("model");
+	g_idle_add(ImageProcess, NULL);
+}
+
 static gboolean
 signal_handler(gpointer user_data) {
     LOG("Received SIGTERM, initiating shutdown\n");
@@ -219,10 +377,24 @@ int main(void) {
 	setbuf(stdout, NULL);
 	unsigned int videoWidth = 800;
 	unsigned int videoHeight = 600;
+	double uptime = 0;
+
+	startupTime = g_get_monotonic_time();
+	FILE* file = fopen("/proc/uptime", "r");
+	if( file ) {
+		if( fscanf(file, "%lf", &uptime) != 1 )
+			uptime = 0;
+		fclose(file);
+	}
 
 	openlog(APP_PACKAGE, LOG_PID|LOG_CONS, LOG_USER);
 
 	ACAP( APP_PACKAGE, ConfigUpdate );
+	ACAP_STATUS_SetNumber("startup", "uptime", (int)(uptime * 1000));
+	//Per-frame values, kept out of the status ETag
+	ACAP_STATUS_Live("model", "averageTime");
+	ACAP_STATUS_Live("labels", "detections");
+	Startup_Phase("acap");
 
 	settings = ACAP_Get_Config("settings");
 	if(!settings) {
@@ -234,24 +406,44 @@ int main(void) {
 
 	eventLabelCounter = cJSON_CreateObject();
 
-	model = Model_Setup();
+	SSE_Init();
+	Zones_Init( cJSON_GetObjectItem(settings,"zones") );
+	Snapshot_Init( &frame );
+	Feed_Init( cJSON_GetObjectItem(settings,"feed") );
+	SHM_Init( cJSON_GetObjectItem(settings,"shm") );
+	History_Init( cJSON_GetObjectItem(settings,"history") );
+	ACAP_EVENTS_SetStateCallback( EventState );
+
+	//The model loads on its own thread while the video stream starts
+	model = Model_Setup( ModelReady );
 
 	videoWidth = cJSON_GetObjectItem(model,"videoWidth")?cJSON_GetObjectItem(model,"videoWidth")->valueint:800;
 	videoHeight = cJSON_GetObjectItem(model,"videoHeight")?cJSON_GetObjectItem(model,"videoHeight")->valueint:600;
 
 	if( model ) {
 		ACAP_Set_Config("model", model );
+		Video_Framerate( cJSON_GetObjectItem(settings,"framerate") );
+		Video_Stream( cJSON_GetObjectItem(settings,"stream") );
 		if( Video_Start_YUV( videoWidth, videoHeight ) ) {
 			LOG("Video %ux%u started\n",videoWidth,videoHeight);
 		} else {
 			LOG_WARN("Video stream for image capture failed\n");
 		}
-		g_idle_add(ImageProcess, NULL);
+		Startup_Phase("video");
 	} else {
 		LOG_WARN("Model setup failed\n");
 	}
 	ACAP_Set_Config("model",model);
+	if( model )
+		Channels_Init( cJSON_GetObjectItem(settings,"channels") );
 	Output_reset();
+	Rules_Init( cJSON_GetObjectItem(settings,"rules") );
+	Stats_Init( cJSON_GetObjectItem(settings,"stats") );
+	Heatmap_Init( cJSON_GetObjectItem(settings,"heatmap") );
+	Tracker_Init( cJSON_GetObjectItem(settings,"counting") );
+	Clip_Init( cJSON_GetObjectItem(settings,"clips") );
+	MQTT_Init();
+	Startup_Phase("services");
 	g_idle_add(ACAP_Process, NULL);
 	main_loop = g_main_loop_new(NULL, FALSE);
     GSource *signal_source = g_unix_signal_source_new(SIGTERM);
@@ -264,6 +456,18 @@ int main(void) {
 
 	g_main_loop_run(main_loop);
 	LOG("Terminating and cleaning up %s\n",APP_PACKAGE);
+	Channels_Cleanup();
+	SSE_Cleanup();
+	MQTT_Cleanup();
+	Feed_Cleanup();
+	SHM_Cleanup();
+	Clip_Cleanup();
+	Snapshot_Cleanup();
+	History_Cleanup();
+	Stats_Cleanup();
+	Heatmap_Cleanup();
+	Tracker_Cleanup();
+	Rules_Cleanup();
 	ACAP_Cleanup();
     closelog();	
     return 0;